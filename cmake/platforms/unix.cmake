@@ -39,6 +39,7 @@ check_symbol_exists(elf_aux_info "sys/auxv.h" HAVE_ELF_AUX_INFO)
 check_symbol_exists(sysctlbyname "sys/types.h;sys/sysctl.h" HAVE_SYSCTLBYNAME)
 check_symbol_exists(CLOCK_MONOTONIC "time.h" HAVE_CLOCK_MONOTONIC)
 check_symbol_exists(clock_gettime "time.h" HAVE_CLOCK_GETTIME)
+check_symbol_exists(splice "fcntl.h" HAVE_SPLICE)
 
 check_c_source_compiles("
 #define _GNU_SOURCE
@@ -117,6 +118,14 @@ add_optional_system_lib(m pow)
 add_optional_system_lib(rt clock_gettime)
 add_optional_system_lib(xnet socket)
 
+# Threads are used by the worker pool in unix/utils/workerpool.c, which
+# is part of the utils library and hence linked into everything.
+set(THREADS_PREFER_PTHREAD_FLAG ON)
+find_package(Threads)
+if(Threads_FOUND)
+  link_libraries(Threads::Threads)
+endif()
+
 set(extra_dirs charset)
 
 if(PUTTY_GSSAPI STREQUAL DYNAMIC)
@@ -85,6 +85,25 @@ CONF_OPTION(tcp_keepalives,
     DEFAULT_BOOL(false),
     SAVE_KEYWORD("TCPKeepalives"),
 )
+/*
+ * Kernel socket buffer tuning for outgoing connections, in bytes.
+ * Zero means leave the OS default alone.
+ */
+CONF_OPTION(tcp_notsent_lowat,
+    VALUE_TYPE(INT),
+    DEFAULT_INT(0),
+    SAVE_KEYWORD("TCPNotSentLowat"),
+)
+CONF_OPTION(tcp_sndbuf,
+    VALUE_TYPE(INT),
+    DEFAULT_INT(0),
+    SAVE_KEYWORD("TCPSendBuffer"),
+)
+CONF_OPTION(tcp_rcvbuf,
+    VALUE_TYPE(INT),
+    DEFAULT_INT(0),
+    SAVE_KEYWORD("TCPRecvBuffer"),
+)
 CONF_OPTION(loghost, /* logical host being contacted, for host key check */
     VALUE_TYPE(STR),
     DEFAULT_STR(""),
@@ -179,6 +198,11 @@ CONF_OPTION(compression,
     DEFAULT_BOOL(false),
     SAVE_KEYWORD("Compression"),
 )
+CONF_OPTION(compression_level,
+    VALUE_TYPE(INT),
+    DEFAULT_INT(6), /* SSH_COMPRESSION_DEFAULT_LEVEL */
+    SAVE_KEYWORD("CompressionLevel"),
+)
 CONF_OPTION(ssh_kexlist,
     SUBKEY_TYPE(INT), /* indices in preference order: 0,...,KEX_MAX-1
                        * (lower is more preferred) */
@@ -290,6 +314,17 @@ CONF_OPTION(ssh_connection_sharing_downstream,
     DEFAULT_BOOL(true),
     SAVE_KEYWORD("ConnectionSharingDownstream"),
 )
+CONF_OPTION(ssh_connection_sharing_persist,
+    /*
+     * Number of seconds a sharing upstream with no session of its own
+     * stays connected after its last downstream goes away. If this is
+     * nonzero, the Unix command-line tools start such an upstream in
+     * the background, rather than becoming the upstream themselves.
+     */
+    VALUE_TYPE(INT),
+    DEFAULT_INT(0),
+    SAVE_KEYWORD("ConnectionSharingPersist"),
+)
 CONF_OPTION(ssh_manual_hostkeys,
     /*
      * Manually configured host keys to accept regardless of the state
@@ -404,6 +439,15 @@ CONF_OPTION(ssh_nc_port, /* port to connect to in `nc' mode */
     DEFAULT_INT(0),
     NOT_SAVED,
 )
+CONF_OPTION(ssh_report_timing, /* print connection setup times */
+    /*
+     * Only set by Plink's '-timing' command-line option; never loaded
+     * or saved.
+     */
+    VALUE_TYPE(BOOL),
+    DEFAULT_BOOL(false),
+    NOT_SAVED,
+)
 
 /* Telnet options */
 CONF_OPTION(termtype,
@@ -1230,6 +1274,12 @@ CONF_OPTION(sshbug_rsa_sha2_cert_userauth,
     SAVE_KEYWORD("BugRSASHA2CertUserauth"),
     STORAGE_ENUM(auto_off_on),
 )
+CONF_OPTION(sshbug_pipelined_setup,
+    VALUE_TYPE(INT),
+    DEFAULT_INT(AUTO),
+    SAVE_KEYWORD("BugPipelinedSetup"),
+    STORAGE_ENUM(auto_off_on),
+)
 CONF_OPTION(sshbug_hmac2,
     VALUE_TYPE(INT),
     DEFAULT_INT(AUTO),
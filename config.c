@@ -2490,6 +2490,16 @@ void setup_config_box(struct controlbox *b, bool midsession,
                           'p', HELPCTX(connection_tcpkeepalive),
                           conf_checkbox_handler,
                           I(CONF_tcp_keepalives));
+            ctrl_editbox(s, "Max unsent data in kernel (TCP_NOTSENT_LOWAT)",
+                         NO_SHORTCUT, 20, HELPCTX(connection_tcpbuffers),
+                         conf_editbox_handler,
+                         I(CONF_tcp_notsent_lowat), ED_INT);
+            ctrl_editbox(s, "Socket send buffer size (SO_SNDBUF)",
+                         NO_SHORTCUT, 20, HELPCTX(connection_tcpbuffers),
+                         conf_editbox_handler, I(CONF_tcp_sndbuf), ED_INT);
+            ctrl_editbox(s, "Socket receive buffer size (SO_RCVBUF)",
+                         NO_SHORTCUT, 20, HELPCTX(connection_tcpbuffers),
+                         conf_editbox_handler, I(CONF_tcp_rcvbuf), ED_INT);
 #ifndef NO_IPV6
             s = ctrl_getset(b, "Connection", "ipversion",
                             "Internet protocol version");
@@ -2701,6 +2711,10 @@ void setup_config_box(struct controlbox *b, bool midsession,
                           HELPCTX(ssh_compress),
                           conf_checkbox_handler,
                           I(CONF_compression));
+            ctrl_editbox(s, "Compression level (0-9)", NO_SHORTCUT, 20,
+                         HELPCTX(ssh_compress),
+                         conf_editbox_handler,
+                         I(CONF_compression_level), ED_INT);
         }
 
         if (!midsession) {
@@ -2721,6 +2735,10 @@ void setup_config_box(struct controlbox *b, bool midsession,
                           HELPCTX(ssh_share),
                           conf_checkbox_handler,
                           I(CONF_ssh_connection_sharing_downstream));
+            ctrl_editbox(s, "Seconds to keep a background upstream", NO_SHORTCUT,
+                         20, HELPCTX(ssh_share),
+                         conf_editbox_handler,
+                         I(CONF_ssh_connection_sharing_persist), ED_INT);
         }
 
         if (!midsession) {
@@ -3215,6 +3233,9 @@ void setup_config_box(struct controlbox *b, bool midsession,
             ctrl_droplist(s, "Chokes on SSH-1 RSA authentication", 'r', 20,
                           HELPCTX(ssh_bugs_rsa1),
                           sshbug_handler, I(CONF_sshbug_rsa1));
+            ctrl_droplist(s, "Chokes on pipelined connection setup", 'u', 20,
+                          HELPCTX(ssh_bugs_pipelined_setup),
+                          sshbug_handler, I(CONF_sshbug_pipelined_setup));
         }
     }
 
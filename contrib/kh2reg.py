@@ -7,6 +7,8 @@
 #       Creates a Windows .REG file (double-click to install).
 #     kh2reg.py --unix    known_hosts1 2 3 4 ... > sshhostkeys
 #       Creates data suitable for storing in ~/.putty/sshhostkeys (Unix).
+#       To import keys into an existing file, append to it instead:
+#       later entries override earlier ones for the same host.
 # Line endings are someone else's problem as is traditional.
 # Should run under either Python 2 or 3.
 
@@ -8,75 +8,153 @@
 
 #include <stddef.h>
 #include <string.h>
+#include "putty.h"
 #include "ssh.h"
 #include "blowfish.h"
 
-static BlowfishContext *bcrypt_setup(const unsigned char *key, int keybytes,
-                                     const unsigned char *salt, int saltbytes)
+/*
+ * The output of openssh_bcrypt is made of several independent chains
+ * of bcrypt computations, one per 32 bytes of output. We run them in
+ * pairs where we can, using the interleaved two-way Blowfish key
+ * schedule routine, which is considerably faster than doing them one
+ * after another because Blowfish is limited by the latency of its
+ * S-box lookups rather than by throughput.
+ */
+#define BCRYPT_MAX_LANES 2
+
+static void bcrypt_expandkey(BlowfishContext **ctxs, int nlanes,
+                             const unsigned char *const *keys, int keybytes,
+                             const unsigned char *const *salts, int saltbytes)
+{
+    if (nlanes == 2) {
+        blowfish_expandkey_x2(ctxs, (const void *const *)keys, keybytes,
+                              (const void *const *)salts, saltbytes);
+    } else {
+        blowfish_expandkey(ctxs[0], keys[0], keybytes,
+                           salts ? salts[0] : NULL, saltbytes);
+    }
+}
+
+static void bcrypt_setup(BlowfishContext **ctxs, int nlanes,
+                         const unsigned char *key, int keybytes,
+                         const unsigned char *const *salts, int saltbytes)
 {
+    const unsigned char *keys[BCRYPT_MAX_LANES];
     int i;
-    BlowfishContext *ctx;
 
-    ctx = blowfish_make_context();
-    blowfish_initkey(ctx);
-    blowfish_expandkey(ctx, key, keybytes, salt, saltbytes);
+    for (i = 0; i < nlanes; i++) {
+        blowfish_initkey(ctxs[i]);
+        keys[i] = key;
+    }
+    bcrypt_expandkey(ctxs, nlanes, keys, keybytes, salts, saltbytes);
 
     /* Original bcrypt replaces this fixed loop count with the
      * variable cost. OpenSSH instead iterates the whole thing more
      * than once if it wants extra rounds. */
     for (i = 0; i < 64; i++) {
-        blowfish_expandkey(ctx, salt, saltbytes, NULL, 0);
-        blowfish_expandkey(ctx, key, keybytes, NULL, 0);
+        bcrypt_expandkey(ctxs, nlanes, salts, saltbytes, NULL, 0);
+        bcrypt_expandkey(ctxs, nlanes, keys, keybytes, NULL, 0);
     }
-
-    return ctx;
 }
 
-static void bcrypt_hash(const unsigned char *key, int keybytes,
-                        const unsigned char *salt, int saltbytes,
-                        unsigned char output[32])
+static void bcrypt_hash(BlowfishContext **ctxs, int nlanes,
+                        const unsigned char *key, int keybytes,
+                        const unsigned char *const *salts, int saltbytes,
+                        unsigned char (*outputs)[32])
 {
-    BlowfishContext *ctx;
-    int i;
-
-    ctx = bcrypt_setup(key, keybytes, salt, saltbytes);
-    /* This was quite a nice starting string until it ran into
-     * little-endian Blowfish :-/ */
-    memcpy(output, "cyxOmorhcitawolBhsiftawSanyDetim", 32);
-    for (i = 0; i < 64; i++) {
-        blowfish_lsb_encrypt_ecb(output, 32, ctx);
+    int i, lane;
+
+    bcrypt_setup(ctxs, nlanes, key, keybytes, salts, saltbytes);
+    for (lane = 0; lane < nlanes; lane++) {
+        /* This was quite a nice starting string until it ran into
+         * little-endian Blowfish :-/ */
+        memcpy(outputs[lane], "cyxOmorhcitawolBhsiftawSanyDetim", 32);
+        for (i = 0; i < 64; i++) {
+            blowfish_lsb_encrypt_ecb(outputs[lane], 32, ctxs[lane]);
+        }
     }
-    blowfish_free_context(ctx);
 }
 
-static void bcrypt_genblock(int counter,
+static void bcrypt_genblock(BlowfishContext **ctxs, int nlanes,
+                            const int *counters,
                             const unsigned char hashed_passphrase[64],
-                            const unsigned char *salt, int saltbytes,
-                            unsigned char output[32])
+                            const unsigned char *const *salts, int saltbytes,
+                            unsigned char (*outputs)[32])
 {
-    unsigned char hashed_salt[64];
+    unsigned char hashed_salts[BCRYPT_MAX_LANES][64];
+    const unsigned char *hashed_salt_ptrs[BCRYPT_MAX_LANES];
 
     /* Hash the input salt with the counter value optionally suffixed
      * to get our real 32-byte salt */
-    ssh_hash *h = ssh_hash_new(&ssh_sha512);
-    put_data(h, salt, saltbytes);
-    if (counter)
-        put_uint32(h, counter);
-    ssh_hash_final(h, hashed_salt);
+    for (int lane = 0; lane < nlanes; lane++) {
+        ssh_hash *h = ssh_hash_new(&ssh_sha512);
+        put_data(h, salts[lane], saltbytes);
+        if (counters[lane])
+            put_uint32(h, counters[lane]);
+        ssh_hash_final(h, hashed_salts[lane]);
+        hashed_salt_ptrs[lane] = hashed_salts[lane];
+    }
 
-    bcrypt_hash(hashed_passphrase, 64, hashed_salt, 64, output);
+    bcrypt_hash(ctxs, nlanes, hashed_passphrase, 64,
+                hashed_salt_ptrs, 64, outputs);
 
-    smemclr(&hashed_salt, sizeof(hashed_salt));
+    smemclr(&hashed_salts, sizeof(hashed_salts));
+}
+
+/*
+ * Each group of up to BCRYPT_MAX_LANES residues (see openssh_bcrypt
+ * below) is independent of all the others, so if there's more than
+ * one group, they're computed in parallel on the worker thread pool.
+ * This is the state for one of them.
+ */
+typedef struct bcrypt_group {
+    const unsigned char *hashed_passphrase;
+    ptrlen salt;
+    int rounds, residue, nlanes;
+    BlowfishContext *ctxs[BCRYPT_MAX_LANES];
+    unsigned char blocks[BCRYPT_MAX_LANES][32];
+    unsigned char outblocks[BCRYPT_MAX_LANES][32];
+} bcrypt_group;
+
+static void bcrypt_group_run(void *vctx)
+{
+    bcrypt_group *g = (bcrypt_group *)vctx;
+    const unsigned char *thissalts[BCRYPT_MAX_LANES];
+    int counters[BCRYPT_MAX_LANES];
+    int thissaltbytes;
+    int lane, i, round;
+
+    enable_dit(); /* in case this is running in a worker thread */
+
+    /* Our output block of data for each residue is the XOR of all
+     * blocks generated by bcrypt in the following loop */
+    memset(g->outblocks, 0, sizeof(g->outblocks));
+
+    for (lane = 0; lane < g->nlanes; lane++)
+        thissalts[lane] = g->salt.ptr;
+    thissaltbytes = g->salt.len;
+    for (round = 0; round < g->rounds; round++) {
+        for (lane = 0; lane < g->nlanes; lane++)
+            counters[lane] = (round == 0 ? g->residue+lane+1 : 0);
+        bcrypt_genblock(g->ctxs, g->nlanes, counters, g->hashed_passphrase,
+                        thissalts, thissaltbytes, g->blocks);
+        /* Each subsequent bcrypt call reuses the previous one's
+         * output as its salt */
+        for (lane = 0; lane < g->nlanes; lane++)
+            thissalts[lane] = g->blocks[lane];
+        thissaltbytes = 32;
+
+        for (lane = 0; lane < g->nlanes; lane++)
+            for (i = 0; i < 32; i++)
+                g->outblocks[lane][i] ^= g->blocks[lane][i];
+    }
 }
 
 void openssh_bcrypt(ptrlen passphrase, ptrlen salt,
                     int rounds, unsigned char *out, int outbytes)
 {
     unsigned char hashed_passphrase[64];
-    unsigned char block[32], outblock[32];
-    const unsigned char *thissalt;
-    int thissaltbytes;
-    int modulus, residue, i, j, round;
+    int modulus, residue, ngroups, lane, i, j, k;
 
     /* Hash the passphrase to get the bcrypt key material */
     hash_simple(&ssh_sha512, passphrase, hashed_passphrase);
@@ -90,29 +168,42 @@ void openssh_bcrypt(ptrlen passphrase, ptrlen salt,
      * bcrypt_genblock, so we must pick a modulus large enough that at
      * most 32 bytes are used in the pass. */
     modulus = (outbytes + 31) / 32;
+    ngroups = (modulus + BCRYPT_MAX_LANES - 1) / BCRYPT_MAX_LANES;
+
+    bcrypt_group *groups = snewn(ngroups, bcrypt_group);
+    void **groupctxs = snewn(ngroups, void *);
+    for (k = 0, residue = 0; k < ngroups; k++, residue += BCRYPT_MAX_LANES) {
+        bcrypt_group *g = &groups[k];
+        g->hashed_passphrase = hashed_passphrase;
+        g->salt = salt;
+        g->rounds = rounds;
+        g->residue = residue;
+        g->nlanes = modulus - residue;
+        if (g->nlanes > BCRYPT_MAX_LANES)
+            g->nlanes = BCRYPT_MAX_LANES;
+
+        /* Every bcrypt_hash call completely reinitialises the
+         * Blowfish key schedule, so each group can use the same ones
+         * for all of them */
+        for (lane = 0; lane < g->nlanes; lane++)
+            g->ctxs[lane] = blowfish_make_context();
+        groupctxs[k] = g;
+    }
 
-    for (residue = 0; residue < modulus; residue++) {
-        /* Our output block of data is the XOR of all blocks generated
-         * by bcrypt in the following loop */
-        memset(outblock, 0, sizeof(outblock));
-
-        thissalt = salt.ptr;
-        thissaltbytes = salt.len;
-        for (round = 0; round < rounds; round++) {
-            bcrypt_genblock(round == 0 ? residue+1 : 0,
-                            hashed_passphrase,
-                            thissalt, thissaltbytes, block);
-            /* Each subsequent bcrypt call reuses the previous one's
-             * output as its salt */
-            thissalt = block;
-            thissaltbytes = 32;
+    run_in_parallel(bcrypt_group_run, groupctxs, ngroups);
 
-            for (i = 0; i < 32; i++)
-                outblock[i] ^= block[i];
+    for (k = 0; k < ngroups; k++) {
+        bcrypt_group *g = &groups[k];
+        for (lane = 0; lane < g->nlanes; lane++) {
+            for (i = g->residue+lane, j = 0; i < outbytes;
+                 i += modulus, j++)
+                out[i] = g->outblocks[lane][j];
+            blowfish_free_context(g->ctxs[lane]);
         }
-
-        for (i = residue, j = 0; i < outbytes; i += modulus, j++)
-            out[i] = outblock[j];
     }
+
+    smemclr(groups, ngroups * sizeof(*groups));
+    sfree(groups);
+    sfree(groupctxs);
     smemclr(&hashed_passphrase, sizeof(hashed_passphrase));
 }
@@ -266,6 +266,55 @@ static void blowfish_encrypt(uint32_t xL, uint32_t xR, uint32_t *output,
     output[1] = xL;
 }
 
+/*
+ * Two independent Blowfish encryptions under different keys, with
+ * their rounds interleaved. Each round of Blowfish depends on the
+ * S-box lookups of the previous one, so a single encryption spends
+ * most of its time waiting for memory loads; doing two at once lets
+ * the CPU overlap them. Used by bcrypt, which needs a lot of
+ * encryptions in parallel chains.
+ */
+#define F_X2(S0, S1, S2, S3, x) \
+    ( ( (S0[(x>>24)&0xFF] + S1[(x>>16)&0xFF]) ^ S2[(x>>8)&0xFF] ) + S3[x&0xFF] )
+#define ROUND_X2(n) (                                          \
+        aL ^= aP[n], bL ^= bP[n], ta = aL, tb = bL,            \
+        aL = F_X2(aS0, aS1, aS2, aS3, aL) ^ aR,                \
+        bL = F_X2(bS0, bS1, bS2, bS3, bL) ^ bR,                \
+        aR = ta, bR = tb)
+
+static void blowfish_encrypt_x2(uint32_t *a, uint32_t *b,
+                                BlowfishContext *actx, BlowfishContext *bctx)
+{
+    uint32_t *aS0 = actx->S0, *bS0 = bctx->S0;
+    uint32_t *aS1 = actx->S1, *bS1 = bctx->S1;
+    uint32_t *aS2 = actx->S2, *bS2 = bctx->S2;
+    uint32_t *aS3 = actx->S3, *bS3 = bctx->S3;
+    uint32_t *aP = actx->P, *bP = bctx->P;
+    uint32_t aL = a[0], aR = a[1], bL = b[0], bR = b[1], ta, tb;
+
+    ROUND_X2(0);
+    ROUND_X2(1);
+    ROUND_X2(2);
+    ROUND_X2(3);
+    ROUND_X2(4);
+    ROUND_X2(5);
+    ROUND_X2(6);
+    ROUND_X2(7);
+    ROUND_X2(8);
+    ROUND_X2(9);
+    ROUND_X2(10);
+    ROUND_X2(11);
+    ROUND_X2(12);
+    ROUND_X2(13);
+    ROUND_X2(14);
+    ROUND_X2(15);
+
+    a[0] = aR ^ aP[17];
+    a[1] = aL ^ aP[16];
+    b[0] = bR ^ bP[17];
+    b[1] = bL ^ bP[16];
+}
+
 static void blowfish_decrypt(uint32_t xL, uint32_t xR, uint32_t *output,
                              BlowfishContext *ctx)
 {
@@ -471,28 +520,44 @@ void blowfish_initkey(BlowfishContext *ctx)
     }
 }
 
+/*
+ * Fill one of the key schedule arrays with successive encryptions of
+ * a running block, XORing salt data into the block before each one.
+ * The salt is treated as a cyclic stream, and *saltpos tracks our
+ * position in it between calls.
+ */
+static void blowfish_expand_array(BlowfishContext *ctx, uint32_t *array,
+                                  int len, uint32_t str[2],
+                                  const unsigned char *salt, int saltbytes,
+                                  int *saltpos)
+{
+    int i, j, pos = *saltpos;
+
+    for (i = 0; i < len; i += 2) {
+        if (salt) {
+            for (j = 0; j < 8; j++) {
+                str[j/4] ^= ((uint32_t)salt[pos]) << (24-8*(j%4));
+                if (++pos == saltbytes)
+                    pos = 0;
+            }
+        }
+        blowfish_encrypt(str[0], str[1], str, ctx);
+        array[i] = str[0];
+        array[i + 1] = str[1];
+    }
+
+    *saltpos = pos;
+}
+
 void blowfish_expandkey(BlowfishContext *ctx,
                         const void *vkey, short keybytes,
                         const void *vsalt, short saltbytes)
 {
     const unsigned char *key = (const unsigned char *)vkey;
     const unsigned char *salt = (const unsigned char *)vsalt;
-    uint32_t *S0 = ctx->S0;
-    uint32_t *S1 = ctx->S1;
-    uint32_t *S2 = ctx->S2;
-    uint32_t *S3 = ctx->S3;
     uint32_t *P = ctx->P;
     uint32_t str[2];
-    int i, j;
-    int saltpos;
-    unsigned char dummysalt[1];
-
-    saltpos = 0;
-    if (!salt) {
-        saltbytes = 1;
-        salt = dummysalt;
-        dummysalt[0] = 0;
-    }
+    int i, saltpos;
 
     for (i = 0; i < 18; i++) {
         P[i] ^=
@@ -504,44 +569,76 @@ void blowfish_expandkey(BlowfishContext *ctx,
         P[i] ^= ((uint32_t) (unsigned char) (key[(i * 4 + 3) % keybytes]));
     }
 
+    /* A null salt behaves like a salt of all zeroes, i.e. as if we
+     * didn't XOR anything in at all, so blowfish_expand_array can
+     * skip that step completely. */
+    if (!saltbytes)
+        salt = NULL;
+
     str[0] = str[1] = 0;
+    saltpos = 0;
 
-    for (i = 0; i < 18; i += 2) {
-        for (j = 0; j < 8; j++)
-            str[j/4] ^= ((uint32_t)salt[saltpos++ % saltbytes]) << (24-8*(j%4));
+    blowfish_expand_array(ctx, P, 18, str, salt, saltbytes, &saltpos);
+    blowfish_expand_array(ctx, ctx->S0, 256, str, salt, saltbytes, &saltpos);
+    blowfish_expand_array(ctx, ctx->S1, 256, str, salt, saltbytes, &saltpos);
+    blowfish_expand_array(ctx, ctx->S2, 256, str, salt, saltbytes, &saltpos);
+    blowfish_expand_array(ctx, ctx->S3, 256, str, salt, saltbytes, &saltpos);
+}
 
-        blowfish_encrypt(str[0], str[1], str, ctx);
-        P[i] = str[0];
-        P[i + 1] = str[1];
+/*
+ * Equivalent to calling blowfish_expandkey on two contexts, with
+ * keys and salts of the same lengths, but faster (see
+ * blowfish_encrypt_x2). If salts is NULL, neither has a salt.
+ */
+void blowfish_expandkey_x2(BlowfishContext *ctxs[2],
+                           const void *const keys[2], short keybytes,
+                           const void *const salts[2], short saltbytes)
+{
+    uint32_t str[2][2];
+    const unsigned char *salt[2];
+    uint32_t *arrays[2][5];
+    static const int lens[5] = { 18, 256, 256, 256, 256 };
+    int i, j, k, lane, saltpos;
+
+    for (lane = 0; lane < 2; lane++) {
+        BlowfishContext *ctx = ctxs[lane];
+        const unsigned char *key = (const unsigned char *)keys[lane];
+
+        for (i = 0; i < 18; i++) {
+            ctx->P[i] ^= ((uint32_t)key[(i * 4 + 0) % keybytes]) << 24;
+            ctx->P[i] ^= ((uint32_t)key[(i * 4 + 1) % keybytes]) << 16;
+            ctx->P[i] ^= ((uint32_t)key[(i * 4 + 2) % keybytes]) << 8;
+            ctx->P[i] ^= ((uint32_t)key[(i * 4 + 3) % keybytes]);
+        }
+
+        salt[lane] = (salts && saltbytes ?
+                      (const unsigned char *)salts[lane] : NULL);
+        str[lane][0] = str[lane][1] = 0;
+
+        arrays[lane][0] = ctx->P;
+        arrays[lane][1] = ctx->S0;
+        arrays[lane][2] = ctx->S1;
+        arrays[lane][3] = ctx->S2;
+        arrays[lane][4] = ctx->S3;
     }
 
-    for (i = 0; i < 256; i += 2) {
-        for (j = 0; j < 8; j++)
-            str[j/4] ^= ((uint32_t)salt[saltpos++ % saltbytes]) << (24-8*(j%4));
-        blowfish_encrypt(str[0], str[1], str, ctx);
-        S0[i] = str[0];
-        S0[i + 1] = str[1];
-    }
-    for (i = 0; i < 256; i += 2) {
-        for (j = 0; j < 8; j++)
-            str[j/4] ^= ((uint32_t)salt[saltpos++ % saltbytes]) << (24-8*(j%4));
-        blowfish_encrypt(str[0], str[1], str, ctx);
-        S1[i] = str[0];
-        S1[i + 1] = str[1];
-    }
-    for (i = 0; i < 256; i += 2) {
-        for (j = 0; j < 8; j++)
-            str[j/4] ^= ((uint32_t)salt[saltpos++ % saltbytes]) << (24-8*(j%4));
-        blowfish_encrypt(str[0], str[1], str, ctx);
-        S2[i] = str[0];
-        S2[i + 1] = str[1];
-    }
-    for (i = 0; i < 256; i += 2) {
-        for (j = 0; j < 8; j++)
-            str[j/4] ^= ((uint32_t)salt[saltpos++ % saltbytes]) << (24-8*(j%4));
-        blowfish_encrypt(str[0], str[1], str, ctx);
-        S3[i] = str[0];
-        S3[i + 1] = str[1];
+    saltpos = 0;
+    for (k = 0; k < 5; k++) {
+        for (i = 0; i < lens[k]; i += 2) {
+            if (salt[0]) {
+                for (j = 0; j < 8; j++) {
+                    str[0][j/4] ^= ((uint32_t)salt[0][saltpos]) << (24-8*(j%4));
+                    str[1][j/4] ^= ((uint32_t)salt[1][saltpos]) << (24-8*(j%4));
+                    if (++saltpos == saltbytes)
+                        saltpos = 0;
+                }
+            }
+            blowfish_encrypt_x2(str[0], str[1], ctxs[0], ctxs[1]);
+            for (lane = 0; lane < 2; lane++) {
+                arrays[lane][k][i] = str[lane][0];
+                arrays[lane][k][i + 1] = str[lane][1];
+            }
+        }
     }
 }
 
@@ -563,6 +660,7 @@ BlowfishContext *blowfish_make_context(void)
 
 void blowfish_free_context(BlowfishContext *ctx)
 {
+    smemclr(ctx, sizeof(*ctx));
     sfree(ctx);
 }
 
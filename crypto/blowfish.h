@@ -11,4 +11,7 @@ void blowfish_initkey(BlowfishContext *ctx);
 void blowfish_expandkey(BlowfishContext *ctx,
                         const void *key, short keybytes,
                         const void *salt, short saltbytes);
+void blowfish_expandkey_x2(BlowfishContext *ctxs[2],
+                           const void *const keys[2], short keybytes,
+                           const void *const salts[2], short saltbytes);
 void blowfish_lsb_encrypt_ecb(void *blk, int len, BlowfishContext *ctx);
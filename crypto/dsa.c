@@ -404,4 +404,5 @@ const ssh_keyalg ssh_dsa = {
     .variable_size = nullkey_variable_size_yes,
     .ssh_id = "ssh-dss",
     .cache_id = "dss",
+    .thread_safe_sign = true,
 };
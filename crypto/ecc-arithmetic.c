@@ -8,6 +8,43 @@
 #include "mpint.h"
 #include "ecc.h"
 
+/* ----------------------------------------------------------------------
+ * Shared machinery for fixed-base multiplication tables.
+ *
+ * A table for a base point B stores j * 2^(w*i) * B, for every window
+ * position i and every nonzero w-bit digit j. To multiply B by n, we
+ * split n into w-bit digits, look up one table entry per window, and
+ * add them all together, with no doublings needed at all.
+ *
+ * To keep the lookups constant-time, each one reads every entry for
+ * its window and uses a masked select to keep the right one, so that
+ * neither the memory access pattern nor the sequence of arithmetic
+ * operations depends on the digit.
+ */
+
+#define BASE_TABLE_WINDOW_BITS 4
+#define BASE_TABLE_WINDOW_ENTRIES ((1 << BASE_TABLE_WINDOW_BITS) - 1)
+
+static inline size_t base_table_nwindows(size_t bits)
+{
+    return (bits + BASE_TABLE_WINDOW_BITS - 1) / BASE_TABLE_WINDOW_BITS;
+}
+
+static inline unsigned base_table_digit(mp_int *n, size_t window)
+{
+    unsigned digit = 0;
+    for (size_t b = 0; b < BASE_TABLE_WINDOW_BITS; b++)
+        digit |= mp_get_bit(n, window * BASE_TABLE_WINDOW_BITS + b) << b;
+    return digit;
+}
+
+/* Return 1 if x == y, and 0 otherwise, without branching. Only
+ * needs to work for values smaller than 2^BASE_TABLE_WINDOW_BITS. */
+static inline unsigned base_table_digit_eq(unsigned x, unsigned y)
+{
+    return (unsigned)((x ^ y) - 1) >> (sizeof(unsigned) * 8 - 1);
+}
+
 /* ----------------------------------------------------------------------
  * Weierstrass curves.
  */
@@ -394,9 +431,17 @@ WeierstrassPoint *ecc_weierstrass_add_general(
     ecc_weierstrass_add_prologue(
         P, Q, &Px, &Py, &Qx, &denom, &lambda_n, &lambda_d);
 
-    /* Slope if P == Q */
+    /*
+     * Slope if P == Q. This has to be computed from the version of P
+     * that the prologue put over the common denominator, because
+     * that's the representation the epilogue will be working with.
+     * (Px,Py,denom) is a valid Jacobian representation of P in its
+     * own right, so we can pass it straight to tangent_slope.
+     */
+    WeierstrassPoint Pcommon = { .X = Px, .Y = Py, .Z = denom, .wc = wc };
     mp_int *lambda_n_tangent, *lambda_d_tangent;
-    ecc_weierstrass_tangent_slope(P, &lambda_n_tangent, &lambda_d_tangent);
+    ecc_weierstrass_tangent_slope(
+        &Pcommon, &lambda_n_tangent, &lambda_d_tangent);
 
     /* Select between those slopes depending on whether P == Q */
     unsigned same_x_coord = mp_eq_integer(lambda_d, 0);
@@ -472,6 +517,94 @@ WeierstrassPoint *ecc_weierstrass_multiply(WeierstrassPoint *B, mp_int *n)
     return k_B;
 }
 
+struct WeierstrassBaseTable {
+    WeierstrassCurve *wc;
+    size_t nwindows;
+
+    /* entries[i * BASE_TABLE_WINDOW_ENTRIES + (j-1)] is the point
+     * j * 2^(BASE_TABLE_WINDOW_BITS * i) * B. */
+    WeierstrassPoint **entries;
+};
+
+WeierstrassBaseTable *ecc_weierstrass_base_table_new(
+    WeierstrassPoint *B, size_t bits)
+{
+    WeierstrassBaseTable *tbl = snew(WeierstrassBaseTable);
+    tbl->wc = B->wc;
+    tbl->nwindows = base_table_nwindows(bits);
+    tbl->entries = snewn(tbl->nwindows * BASE_TABLE_WINDOW_ENTRIES,
+                         WeierstrassPoint *);
+
+    /*
+     * Building the table only involves public data, so there's no
+     * need for it to be constant-time. But we use add_general
+     * throughout anyway, because the first addition in each window
+     * is a doubling, and in principle any of the entries might turn
+     * out to be the identity.
+     */
+    WeierstrassPoint **entry = tbl->entries;
+    WeierstrassPoint *base = ecc_weierstrass_point_copy(B);
+    for (size_t i = 0; i < tbl->nwindows; i++) {
+        entry[0] = ecc_weierstrass_point_copy(base);
+        for (size_t j = 1; j < BASE_TABLE_WINDOW_ENTRIES; j++)
+            entry[j] = ecc_weierstrass_add_general(entry[j-1], base);
+
+        /* The base point for the next window is one more multiple of
+         * this window's base than its largest entry. */
+        WeierstrassPoint *next = ecc_weierstrass_add_general(
+            entry[BASE_TABLE_WINDOW_ENTRIES-1], base);
+        ecc_weierstrass_point_free(base);
+        base = next;
+        entry += BASE_TABLE_WINDOW_ENTRIES;
+    }
+    ecc_weierstrass_point_free(base);
+
+    return tbl;
+}
+
+void ecc_weierstrass_base_table_free(WeierstrassBaseTable *tbl)
+{
+    for (size_t i = 0; i < tbl->nwindows * BASE_TABLE_WINDOW_ENTRIES; i++)
+        ecc_weierstrass_point_free(tbl->entries[i]);
+    sfree(tbl->entries);
+    sfree(tbl);
+}
+
+WeierstrassPoint *ecc_weierstrass_base_multiply(
+    WeierstrassBaseTable *tbl, mp_int *n)
+{
+    WeierstrassCurve *wc = tbl->wc;
+    assert(mp_get_nbits(n) <= tbl->nwindows * BASE_TABLE_WINDOW_BITS);
+
+    WeierstrassPoint *acc = ecc_weierstrass_point_new_identity(wc);
+    WeierstrassPoint *sel = ecc_weierstrass_point_new_identity(wc);
+
+    for (size_t i = 0; i < tbl->nwindows; i++) {
+        WeierstrassPoint **entry =
+            tbl->entries + i * BASE_TABLE_WINDOW_ENTRIES;
+        unsigned digit = base_table_digit(n, i);
+
+        /* Start from the identity, which is the right answer if this
+         * digit is zero, and overwrite it with whichever table entry
+         * matches otherwise. */
+        mp_clear(sel->X);
+        mp_clear(sel->Y);
+        mp_clear(sel->Z);
+        for (size_t j = 1; j <= BASE_TABLE_WINDOW_ENTRIES; j++)
+            ecc_weierstrass_cond_overwrite(
+                sel, entry[j-1], base_table_digit_eq(digit, j));
+
+        /* add_general copes with either input being the identity, and
+         * with the (unlikely) case of the two inputs coinciding. */
+        WeierstrassPoint *sum = ecc_weierstrass_add_general(acc, sel);
+        ecc_weierstrass_point_free(acc);
+        acc = sum;
+    }
+
+    ecc_weierstrass_point_free(sel);
+    return acc;
+}
+
 unsigned ecc_weierstrass_is_identity(WeierstrassPoint *wp)
 {
     return mp_eq_integer(wp->Z, 0);
@@ -1133,6 +1266,90 @@ EdwardsPoint *ecc_edwards_multiply(EdwardsPoint *B, mp_int *n)
     return k_B;
 }
 
+static EdwardsPoint *ecc_edwards_point_new_identity(EdwardsCurve *ec)
+{
+    EdwardsPoint *ep = ecc_edwards_point_new_empty(ec);
+    size_t bits = mp_max_bits(ec->p);
+    ep->X = mp_new(bits);
+    ep->Y = mp_copy(monty_identity(ec->mc));
+    ep->Z = mp_copy(monty_identity(ec->mc));
+    ep->T = mp_new(bits);
+    return ep;
+}
+
+struct EdwardsBaseTable {
+    EdwardsCurve *ec;
+    size_t nwindows;
+
+    /* entries[i * BASE_TABLE_WINDOW_ENTRIES + (j-1)] is the point
+     * j * 2^(BASE_TABLE_WINDOW_BITS * i) * B. */
+    EdwardsPoint **entries;
+};
+
+EdwardsBaseTable *ecc_edwards_base_table_new(EdwardsPoint *B, size_t bits)
+{
+    EdwardsBaseTable *tbl = snew(EdwardsBaseTable);
+    tbl->ec = B->ec;
+    tbl->nwindows = base_table_nwindows(bits);
+    tbl->entries = snewn(tbl->nwindows * BASE_TABLE_WINDOW_ENTRIES,
+                         EdwardsPoint *);
+
+    /* Edwards addition is unified, so this is simpler than the
+     * Weierstrass version: no special cases to worry about. */
+    EdwardsPoint **entry = tbl->entries;
+    EdwardsPoint *base = ecc_edwards_point_copy(B);
+    for (size_t i = 0; i < tbl->nwindows; i++) {
+        entry[0] = ecc_edwards_point_copy(base);
+        for (size_t j = 1; j < BASE_TABLE_WINDOW_ENTRIES; j++)
+            entry[j] = ecc_edwards_add(entry[j-1], base);
+
+        EdwardsPoint *next = ecc_edwards_add(
+            entry[BASE_TABLE_WINDOW_ENTRIES-1], base);
+        ecc_edwards_point_free(base);
+        base = next;
+        entry += BASE_TABLE_WINDOW_ENTRIES;
+    }
+    ecc_edwards_point_free(base);
+
+    return tbl;
+}
+
+void ecc_edwards_base_table_free(EdwardsBaseTable *tbl)
+{
+    for (size_t i = 0; i < tbl->nwindows * BASE_TABLE_WINDOW_ENTRIES; i++)
+        ecc_edwards_point_free(tbl->entries[i]);
+    sfree(tbl->entries);
+    sfree(tbl);
+}
+
+EdwardsPoint *ecc_edwards_base_multiply(EdwardsBaseTable *tbl, mp_int *n)
+{
+    EdwardsCurve *ec = tbl->ec;
+    assert(mp_get_nbits(n) <= tbl->nwindows * BASE_TABLE_WINDOW_BITS);
+
+    EdwardsPoint *identity = ecc_edwards_point_new_identity(ec);
+    EdwardsPoint *acc = ecc_edwards_point_copy(identity);
+    EdwardsPoint *sel = ecc_edwards_point_copy(identity);
+
+    for (size_t i = 0; i < tbl->nwindows; i++) {
+        EdwardsPoint **entry = tbl->entries + i * BASE_TABLE_WINDOW_ENTRIES;
+        unsigned digit = base_table_digit(n, i);
+
+        ecc_edwards_point_copy_into(sel, identity);
+        for (size_t j = 1; j <= BASE_TABLE_WINDOW_ENTRIES; j++)
+            ecc_edwards_cond_overwrite(
+                sel, entry[j-1], base_table_digit_eq(digit, j));
+
+        EdwardsPoint *sum = ecc_edwards_add(acc, sel);
+        ecc_edwards_point_free(acc);
+        acc = sum;
+    }
+
+    ecc_edwards_point_free(identity);
+    ecc_edwards_point_free(sel);
+    return acc;
+}
+
 /*
  * Helper routine to determine whether two values each given as a pair
  * of projective coordinates represent the same affine value.
@@ -306,6 +306,56 @@ static struct ec_curve *ec_ed448(void)
     return &curve;
 }
 
+/* ----------------------------------------------------------------------
+ * Multiplying the generator of a curve.
+ *
+ * Almost every operation we do - making a signature, generating an
+ * ephemeral key exchange key, or deriving a public key from a private
+ * one - involves multiplying the curve's generator by something. So
+ * it's worth keeping a table of precomputed multiples of G, which
+ * makes those multiplications several times faster.
+ *
+ * Building the table costs about as much as a couple of ordinary
+ * multiplications, so it isn't worth it in a process that only ever
+ * does one (such as a single SSH session verifying one host key
+ * signature). So we do the first multiplication the ordinary way, and
+ * only build the table once the same curve's generator is needed a
+ * second time; after that it lasts for the life of the process, just
+ * like the curve structure itself.
+ */
+
+static WeierstrassPoint *ec_wcurve_multiply_G(
+    struct ec_curve *curve, mp_int *n)
+{
+    assert(curve->type == EC_WEIERSTRASS);
+    struct ec_wcurve *w = &curve->w;
+
+    if (!w->G_table) {
+        if (w->G_multiplies++ == 0)
+            return ecc_weierstrass_multiply(w->G, n);
+        w->G_table = ecc_weierstrass_base_table_new(w->G, curve->fieldBits);
+    }
+
+    return ecc_weierstrass_base_multiply(w->G_table, n);
+}
+
+static EdwardsPoint *ec_ecurve_multiply_G(struct ec_curve *curve, mp_int *n)
+{
+    assert(curve->type == EC_EDWARDS);
+    struct ec_ecurve *e = &curve->e;
+
+    if (!e->G_table) {
+        if (e->G_multiplies++ == 0)
+            return ecc_edwards_multiply(e->G, n);
+        /* EdDSA verification can pass us an s value taking up the
+         * full byte length of an encoded field element, which may
+         * have more bits than the field itself */
+        e->G_table = ecc_edwards_base_table_new(e->G, curve->fieldBytes * 8);
+    }
+
+    return ecc_edwards_base_multiply(e->G_table, n);
+}
+
 /* ----------------------------------------------------------------------
  * Public point from private
  */
@@ -334,8 +384,7 @@ WeierstrassPoint *ecdsa_public(mp_int *private_key, const ssh_keyalg *alg)
     assert(curve->type == EC_WEIERSTRASS);
 
     mp_int *priv_reduced = mp_mod(private_key, curve->p);
-    WeierstrassPoint *toret = ecc_weierstrass_multiply(
-        curve->w.G, priv_reduced);
+    WeierstrassPoint *toret = ec_wcurve_multiply_G(curve, priv_reduced);
     mp_free(priv_reduced);
     return toret;
 }
@@ -382,7 +431,7 @@ EdwardsPoint *eddsa_public(mp_int *private_key, const ssh_keyalg *alg)
     mp_int *exponent = eddsa_exponent_from_hash(
         make_ptrlen(hash, extra->hash->hlen), curve);
 
-    EdwardsPoint *toret = ecc_edwards_multiply(curve->e.G, exponent);
+    EdwardsPoint *toret = ec_ecurve_multiply_G(curve, exponent);
     mp_free(exponent);
 
     return toret;
@@ -1021,7 +1070,7 @@ static bool ecdsa_verify(ssh_key *key, ptrlen sig, ptrlen data)
     mp_free(z);
     mp_int *u2 = mp_modmul(r, w, ek->curve->w.G_order);
     mp_free(w);
-    WeierstrassPoint *u1G = ecc_weierstrass_multiply(ek->curve->w.G, u1);
+    WeierstrassPoint *u1G = ec_wcurve_multiply_G(extra->curve(), u1);
     mp_free(u1);
     WeierstrassPoint *u2P = ecc_weierstrass_multiply(ek->publicKey, u2);
     mp_free(u2);
@@ -1095,7 +1144,7 @@ static bool eddsa_verify(ssh_key *key, ptrlen sig, ptrlen data)
     mp_int *H = eddsa_signing_exponent_from_data(ek, extra, rstr, data);
 
     /* Verify that s*G == r + H*publicKey */
-    EdwardsPoint *lhs = ecc_edwards_multiply(ek->curve->e.G, s);
+    EdwardsPoint *lhs = ec_ecurve_multiply_G(extra->curve(), s);
     mp_free(s);
     EdwardsPoint *hpk = ecc_edwards_multiply(ek->publicKey, H);
     mp_free(H);
@@ -1124,7 +1173,7 @@ static void ecdsa_sign(ssh_key *key, ptrlen data,
     mp_int *k = rfc6979(
         extra->hash, ek->curve->w.G_order, ek->privateKey, data);
 
-    WeierstrassPoint *kG = ecc_weierstrass_multiply(ek->curve->w.G, k);
+    WeierstrassPoint *kG = ec_wcurve_multiply_G(extra->curve(), k);
     mp_int *x;
     ecc_weierstrass_get_affine(kG, &x, NULL);
     ecc_weierstrass_point_free(kG);
@@ -1206,7 +1255,7 @@ static void eddsa_sign(ssh_key *key, ptrlen data,
         make_ptrlen(hash, extra->hash->hlen));
     mp_int *log_r = mp_mod(log_r_unreduced, ek->curve->e.G_order);
     mp_free(log_r_unreduced);
-    EdwardsPoint *r = ecc_edwards_multiply(ek->curve->e.G, log_r);
+    EdwardsPoint *r = ec_ecurve_multiply_G(extra->curve(), log_r);
 
     /*
      * Encode r now, because we'll need its encoding for the next
@@ -1445,7 +1494,7 @@ static ecdh_key *ssh_ecdhkex_w_new(const ssh_kex *kex, bool is_server)
     dhw->private = mp_random_in_range(one, dhw->curve->w.G_order);
     mp_free(one);
 
-    dhw->w_public = ecc_weierstrass_multiply(dhw->curve->w.G, dhw->private);
+    dhw->w_public = ec_wcurve_multiply_G(extra->curve(), dhw->private);
 
     return &dhw->ek;
 }
@@ -96,6 +96,24 @@ WeierstrassPoint *ecc_weierstrass_double(WeierstrassPoint *);
  */
 WeierstrassPoint *ecc_weierstrass_multiply(WeierstrassPoint *, mp_int *);
 
+/*
+ * Precomputed tables for multiplying a fixed base point (typically a
+ * curve's generator) by many different integers.
+ *
+ * base_table_new builds a table of small multiples of B at every
+ * window position up to 'bits' bits. It costs about as much as a few
+ * calls to ecc_weierstrass_multiply, but afterwards,
+ * base_multiply(table, n) computes nB for any n < 2^bits several
+ * times faster, and still in time independent of n. Unlike
+ * ecc_weierstrass_multiply, it copes fine with n=0 or with n being a
+ * multiple of the order of B.
+ */
+WeierstrassBaseTable *ecc_weierstrass_base_table_new(
+    WeierstrassPoint *B, size_t bits);
+void ecc_weierstrass_base_table_free(WeierstrassBaseTable *table);
+WeierstrassPoint *ecc_weierstrass_base_multiply(
+    WeierstrassBaseTable *table, mp_int *n);
+
 /*
  * Query functions to get the value of a point back out. is_identity
  * tells you whether the point is the identity; if it isn't, then
@@ -233,6 +251,14 @@ void ecc_edwards_point_free(EdwardsPoint *point);
 EdwardsPoint *ecc_edwards_add(EdwardsPoint *, EdwardsPoint *);
 EdwardsPoint *ecc_edwards_multiply(EdwardsPoint *, mp_int *);
 
+/*
+ * Precomputed tables for fixed-base multiplication, exactly as for
+ * Weierstrass curves above.
+ */
+EdwardsBaseTable *ecc_edwards_base_table_new(EdwardsPoint *B, size_t bits);
+void ecc_edwards_base_table_free(EdwardsBaseTable *table);
+EdwardsPoint *ecc_edwards_base_multiply(EdwardsBaseTable *table, mp_int *n);
+
 /*
  * Query functions: compare two points for equality, and return the
  * affine coordinates of a point.
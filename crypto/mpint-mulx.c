@@ -0,0 +1,135 @@
+/*
+ * Inner multiplication loop for mpint.c using the x86 BMI2 and ADX
+ * instruction set extensions (MULX, ADCX and ADOX).
+ *
+ * MULX is a flag-preserving multiply, and ADCX and ADOX are
+ * add-with-carry instructions that use two different flags (CF and
+ * OF) as their carry. So a row of a schoolbook multiplication can run
+ * two independent carry chains side by side - one adding the low half
+ * of each partial product to the high half of the previous one, the
+ * other accumulating the result into the output - without having to
+ * save and restore the flags between them.
+ *
+ * Like everything else in mpint.c, the code below runs in time
+ * depending only on the lengths of its inputs.
+ */
+
+#include "ssh.h"
+#include "mpint_i.h"
+
+#include <immintrin.h>
+
+#if defined(__clang__) || defined(__GNUC__)
+#include <cpuid.h>
+#define GET_CPU_ID_7(out) \
+    __cpuid_count(7, 0, (out)[0], (out)[1], (out)[2], (out)[3])
+#define GET_CPU_ID_MAX(out) __cpuid(0, (out)[0], (out)[1], (out)[2], (out)[3])
+#else
+#define GET_CPU_ID_7(out) __cpuidex(out, 7, 0)
+#define GET_CPU_ID_MAX(out) __cpuid(out, 0)
+#endif
+
+#if BIGNUM_INT_BITS == 64
+
+bool mp_mulx_available(void)
+{
+    /*
+     * BMI2 and ADX are reported in EBX of CPUID leaf 7, at bits 8 and
+     * 19 respectively. Check first that leaf 7 exists at all.
+     */
+    unsigned int CPUInfo[4];
+    GET_CPU_ID_MAX(CPUInfo);
+    if (CPUInfo[0] < 7)
+        return false;
+    GET_CPU_ID_7(CPUInfo);
+    return (CPUInfo[1] & (1 << 8)) && (CPUInfo[1] & (1 << 19));
+}
+
+/*
+ * Add adata times the n words of b into the n words of r. Return the
+ * top word of the partial product, and the carry out of the
+ * accumulation in *carry.
+ *
+ * gcc and clang don't generate ADCX and ADOX from the intrinsics in
+ * the way you'd hope: they materialise each carry flag in a register
+ * between operations, which is slower than just using MUL and ADC. So
+ * with those compilers we write the loop in inline assembler, using
+ * only LEA and JRCXZ for the loop control, because they leave both
+ * carry flags alone.
+ */
+static inline BignumInt mul_row(
+    BignumInt *r, const BignumInt *b, size_t n, BignumInt adata,
+    unsigned char *carry)
+{
+#if defined(__clang__) || defined(__GNUC__)
+    BignumInt prevhi, lo, hi;
+    unsigned char cacc;
+    __asm__ volatile(
+        "xorl %k[prevhi], %k[prevhi]\n\t"   /* clears CF and OF too */
+        "1:\n\t"
+        "jrcxz 2f\n\t"
+        "mulx (%[b]), %[lo], %[hi]\n\t"
+        "adcx %[prevhi], %[lo]\n\t"
+        "adox (%[r]), %[lo]\n\t"
+        "movq %[lo], (%[r])\n\t"
+        "movq %[hi], %[prevhi]\n\t"
+        "leaq 8(%[b]), %[b]\n\t"
+        "leaq 8(%[r]), %[r]\n\t"
+        "leaq -1(%[n]), %[n]\n\t"
+        "jmp 1b\n\t"
+        "2:\n\t"
+        "movl $0, %k[lo]\n\t"
+        "adcx %[lo], %[prevhi]\n\t"
+        "seto %[cacc]\n\t"
+        : [r] "+r" (r), [b] "+r" (b), [n] "+c" (n),
+          [prevhi] "=&r" (prevhi), [lo] "=&r" (lo), [hi] "=&r" (hi),
+          [cacc] "=qm" (cacc)
+        : "d" (adata)
+        : "cc", "memory");
+    *carry = cacc;
+    return prevhi;
+#else
+    unsigned long long prevhi = 0, word, lo, hi;
+    unsigned char cprod = 0, cacc = 0;
+
+    for (size_t j = 0; j < n; j++) {
+        lo = _mulx_u64(adata, b[j], &hi);
+        cprod = _addcarryx_u64(cprod, lo, prevhi, &word);
+        cacc = _addcarryx_u64(cacc, r[j], word, &word);
+        r[j] = word;
+        prevhi = hi;
+    }
+
+    *carry = cacc;
+    return prevhi + cprod;
+#endif
+}
+
+/*
+ * Add a*b into r, discarding anything that goes off the top of r.
+ * Semantically identical to mp_mul_add_simple in mpint.c.
+ */
+void mp_mul_add_simple_mulx(BignumInt *r, size_t rw, const BignumInt *a,
+                            size_t aw, const BignumInt *b, size_t bw)
+{
+    for (size_t i = 0; i < aw && i < rw; i++) {
+        BignumInt *rp = r + i;
+        size_t rowlen = rw - i, n = bw < rowlen ? bw : rowlen;
+        unsigned char cacc;
+
+        /*
+         * The top word of the partial product a[i]*b (including the
+         * product chain's final carry, which can't overflow it) and
+         * the accumulation carry then ripple up through the rest of
+         * r.
+         */
+        BignumInt top = mul_row(rp, b, n, a[i], &cacc);
+        BignumCarry carry = cacc;
+        for (size_t j = n; j < rowlen; j++) {
+            BignumADC(rp[j], carry, rp[j], top, carry);
+            top = 0;
+        }
+    }
+}
+
+#endif /* BIGNUM_INT_BITS == 64 */
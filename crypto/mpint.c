@@ -950,8 +950,27 @@ mp_int *mp_sub(mp_int *x, mp_int *y)
  * Internal routine: multiply and accumulate in the trivial O(N^2)
  * way. Sets r <- r + a*b.
  */
+#if HAVE_MULX_ADX && BIGNUM_INT_BITS == 64
+static bool mp_use_mulx(void)
+{
+    static bool checked, available;
+    if (!checked) {
+        available = mp_mulx_available();
+        checked = true;
+    }
+    return available;
+}
+#endif
+
 static void mp_mul_add_simple(mp_int *r, mp_int *a, mp_int *b)
 {
+#if HAVE_MULX_ADX && BIGNUM_INT_BITS == 64
+    if (mp_use_mulx()) {
+        mp_mul_add_simple_mulx(r->w, r->nw, a->w, a->nw, b->w, b->nw);
+        return;
+    }
+#endif
+
     BignumInt *aend = a->w + a->nw, *bend = b->w + b->nw, *rend = r->w + r->nw;
 
     for (BignumInt *ap = a->w, *rp = r->w;
@@ -1377,6 +1396,66 @@ mp_int *mp_invert_mod_2to(mp_int *x, size_t p)
     return r;
 }
 
+/*
+ * Special-purpose reduction for primes of the form 2^k - c with c
+ * small, such as 2^255-19 and 2^521-1. Since 2^k is congruent to c,
+ * we can replace the part of x above bit k with c times itself, and
+ * add it to the part below. monty_choose_reduction only selects this
+ * method when k is large enough, and c small enough, that two such
+ * folds always get x below 2m, after which a single trial subtraction
+ * finishes the job.
+ */
+static mp_int monty_reduce_pseudo_mersenne(MontyContext *mc, mp_int *x,
+                                           mp_int scratch)
+{
+    mp_int t = mp_alloc_from_scratch(&scratch, mc->pw);
+    mp_int hi = mp_alloc_from_scratch(&scratch, mc->pw);
+    mp_copy_into(&t, x);
+
+    for (size_t fold = 0; fold < 2; fold++) {
+        mp_rshift_fixed_into(&hi, &t, mc->pm_bits);
+        mp_reduce_mod_2to(&t, mc->pm_bits);
+        mp_mul_integer_into(&hi, &hi, mc->pm_c);
+        mp_add_into(&t, &t, &hi);
+    }
+
+    mp_cond_sub_into(&t, &t, mc->m, mp_cmp_hs(&t, mc->m));
+    return mp_make_alias(&t, 0, mc->rw);
+}
+
+/*
+ * Decide whether a new MontyContext's modulus is one we have a
+ * special reduction method for. This depends only on the shape of
+ * the modulus, which for the secret moduli we deal with (RSA primes)
+ * is never special.
+ */
+static void monty_choose_reduction(MontyContext *mc)
+{
+    mc->reduction = MONTY_REDUCE_GENERIC;
+    mc->pm_bits = 0;
+    mc->pm_c = 0;
+
+    /*
+     * For a pseudo-Mersenne modulus 2^k - c, the input to a reduction
+     * is less than 2^{2 rbits}, so after one fold it's less than 2^k
+     * + c 2^{2 rbits - k}, and after a second, less than 2^k + c +
+     * c^2 2^{2(rbits - k)}. We need that to be less than 2m, and
+     * since rbits - k < BIGNUM_INT_BITS and c < 2^16, it's enough
+     * that k >= 2*BIGNUM_INT_BITS + 34.
+     */
+    size_t k = mp_get_nbits(mc->m);
+    mp_int *c = mp_make_sized(mc->rw + 1);
+    mp_set_bit(c, k, 1);
+    mp_sub_into(c, c, mc->m);
+    if (k >= 2*BIGNUM_INT_BITS + 34 && mc->rbits - k < BIGNUM_INT_BITS &&
+        mp_get_nbits(c) <= 16) {
+        mc->reduction = MONTY_REDUCE_PSEUDO_MERSENNE;
+        mc->pm_bits = k;
+        mc->pm_c = mp_get_integer(c);
+    }
+    mp_free(c);
+}
+
 static size_t monty_scratch_size(MontyContext *mc)
 {
     return 3*mc->rw + mc->pw + mp_mul_scratchspace(mc->pw, mc->rw, mc->rw);
@@ -1395,10 +1474,18 @@ MontyContext *monty_new(mp_int *modulus)
     mc->minus_minv_mod_r = mp_invert_mod_2to(mc->m, mc->rbits);
     mp_neg_into(mc->minus_minv_mod_r, mc->minus_minv_mod_r);
 
-    mp_int *r = mp_make_sized(mc->rw + 1);
-    r->w[mc->rw] = 1;
-    mc->powers_of_r_mod_m[0] = mp_mod(r, mc->m);
-    mp_free(r);
+    monty_choose_reduction(mc);
+
+    if (mc->reduction == MONTY_REDUCE_GENERIC) {
+        mp_int *r = mp_make_sized(mc->rw + 1);
+        r->w[mc->rw] = 1;
+        mc->powers_of_r_mod_m[0] = mp_mod(r, mc->m);
+        mp_free(r);
+    } else {
+        /* r = 1, as described in mpint_i.h */
+        mc->powers_of_r_mod_m[0] = mp_make_sized(mc->rw);
+        mc->powers_of_r_mod_m[0]->w[0] = 1;
+    }
 
     for (size_t j = 1; j < lenof(mc->powers_of_r_mod_m); j++)
         mc->powers_of_r_mod_m[j] = mp_modmul(
@@ -1425,6 +1512,13 @@ void monty_free(MontyContext *mc)
  */
 static mp_int monty_reduce_internal(MontyContext *mc, mp_int *x, mp_int scratch)
 {
+    switch (mc->reduction) {
+      case MONTY_REDUCE_PSEUDO_MERSENNE:
+        return monty_reduce_pseudo_mersenne(mc, x, scratch);
+      default:
+        break;
+    }
+
     /*
      * The trick with Montgomery reduction is that on the one hand we
      * want to reduce the size of the input by a factor of about r,
@@ -1476,9 +1570,11 @@ void monty_mul_into(MontyContext *mc, mp_int *r, mp_int *x, mp_int *y)
     assert(x->nw <= mc->rw);
     assert(y->nw <= mc->rw);
 
+    /* Do the multiplication in our preallocated scratch space,
+     * rather than letting mp_mul_into allocate its own. */
     mp_int scratch = *mc->scratch;
     mp_int tmp = mp_alloc_from_scratch(&scratch, 2*mc->rw);
-    mp_mul_into(&tmp, x, y);
+    mp_mul_internal(&tmp, x, y, scratch);
     mp_int reduced = monty_reduce_internal(mc, &tmp, scratch);
     mp_copy_into(r, &reduced);
     mp_clear(mc->scratch);
@@ -274,6 +274,11 @@ struct mp_int {
     BignumInt *w;
 };
 
+typedef enum MontyReduction {
+    MONTY_REDUCE_GENERIC,          /* ordinary Montgomery reduction */
+    MONTY_REDUCE_PSEUDO_MERSENNE,  /* m = 2^k - c, for small c */
+} MontyReduction;
+
 struct MontyContext {
     /*
      * The actual modulus.
@@ -313,6 +318,21 @@ struct MontyContext {
      */
     mp_int *powers_of_r_mod_m[3];
 
+    /*
+     * Some moduli have a special form which makes it faster to
+     * reduce mod m directly than to do a Montgomery reduction. For
+     * those, 'reduction' is set to something other than
+     * MONTY_REDUCE_GENERIC, and we take r to be 1 instead of a power
+     * of 2. So the 'Montgomery representation' of a number is just
+     * the number itself, and monty_reduce_internal is an ordinary
+     * reduction mod m. (rbits and rw are still used for sizing.)
+     */
+    MontyReduction reduction;
+
+    /* For MONTY_REDUCE_PSEUDO_MERSENNE: m = 2^pm_bits - pm_c. */
+    size_t pm_bits;
+    uint16_t pm_c;
+
     /*
      * Persistent scratch space from which monty_* functions can
      * allocate storage for intermediate values.
@@ -322,3 +342,10 @@ struct MontyContext {
 
 /* Functions shared between mpint.c and mpunsafe.c */
 mp_int *mp_make_sized(size_t nw);
+
+/* Optional x86 BMI2/ADX version of the inner multiplication loop, in
+ * mpint-mulx.c. Only built when HAVE_MULX_ADX, and only usable if
+ * mp_mulx_available() says the CPU supports it. */
+bool mp_mulx_available(void);
+void mp_mul_add_simple_mulx(BignumInt *r, size_t rw, const BignumInt *a,
+                            size_t aw, const BignumInt *b, size_t bw);
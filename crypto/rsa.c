@@ -929,7 +929,8 @@ static const struct ssh2_rsa_extra
     .pubkey_bits = rsa2_pubkey_bits,            \
     .alg_desc = rsa2_alg_desc,                  \
     .variable_size = nullkey_variable_size_yes, \
-    .cache_id = "rsa2"
+    .cache_id = "rsa2",                         \
+    .thread_safe_sign = true
 
 const ssh_keyalg ssh_rsa = {
     COMMON_KEYALG_FIELDS,
@@ -0,0 +1,32 @@
+/*
+ * Setup needed before signing with a thread_safe_sign key on a
+ * thread other than the main one.
+ */
+
+#include "ssh.h"
+#include "mpint.h"
+
+void prepare_thread_safe_sign(void)
+{
+    static bool done = false;
+    if (done)
+        return;
+
+    /*
+     * The hash selector vtables and the bignum multiplication code
+     * decide between hardware and software implementations the first
+     * time they're used, and cache the answer in static storage. Make
+     * sure that happens here, in the main thread, before any worker
+     * thread can race to do it.
+     */
+    static const ssh_hashalg *const algs[] = {
+        &ssh_sha1, &ssh_sha256, &ssh_sha384, &ssh_sha512,
+    };
+    for (size_t i = 0; i < lenof(algs); i++)
+        ssh_hash_free(ssh_hash_new(algs[i]));
+    mp_int *x = mp_from_integer(1);
+    mp_free(mp_mul(x, x));
+    mp_free(x);
+
+    done = true;
+}
@@ -103,6 +103,7 @@ typedef struct handle_sink handle_sink;
 typedef struct IdempotentCallback IdempotentCallback;
 
 typedef struct SockAddr SockAddr;
+typedef struct NameLookup NameLookup;
 
 typedef struct Socket Socket;
 typedef struct Plug Plug;
@@ -145,10 +146,12 @@ typedef struct MontyContext MontyContext;
 
 typedef struct WeierstrassCurve WeierstrassCurve;
 typedef struct WeierstrassPoint WeierstrassPoint;
+typedef struct WeierstrassBaseTable WeierstrassBaseTable;
 typedef struct MontgomeryCurve MontgomeryCurve;
 typedef struct MontgomeryPoint MontgomeryPoint;
 typedef struct EdwardsCurve EdwardsCurve;
 typedef struct EdwardsPoint EdwardsPoint;
+typedef struct EdwardsBaseTable EdwardsBaseTable;
 
 typedef struct SshServerConfig SshServerConfig;
 typedef struct SftpServer SftpServer;
@@ -159,6 +162,7 @@ typedef struct SshChannel SshChannel;
 typedef struct mainchan mainchan;
 
 typedef struct CertExprBuilder CertExprBuilder;
+typedef struct CertExpr CertExpr;
 
 typedef struct ssh_sharing_state ssh_sharing_state;
 typedef struct ssh_sharing_connstate ssh_sharing_connstate;
@@ -555,6 +555,12 @@ bool cert_expr_valid(const char *expression,
                      char **error_msg, ptrlen *error_loc);
 bool cert_expr_match_str(const char *expression,
                          const char *hostname, unsigned port);
+/* The same, parsing an expression once to match it many times. Returns
+ * NULL from cert_expr_parse if the expression isn't valid. */
+CertExpr *cert_expr_parse(const char *expression);
+CertExpr *cert_expr_dup(CertExpr *ce);   /* another reference to it */
+void cert_expr_free(CertExpr *ce);
+bool cert_expr_match(CertExpr *ce, const char *hostname, unsigned port);
 /* Build a certificate expression out of hostname wildcards. Required
  * to handle legacy configuration from early in development, when
  * multiple wildcards were stored separately in config, implicitly
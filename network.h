@@ -76,7 +76,9 @@ struct PlugVtable {
      *    connection. `addr' gives the address we connected to, if
      *    available. (But sometimes, in cases of complicated proxy
      *    setups, it might not be available, so receivers of this log
-     *    event should be prepared to deal with addr==NULL.)
+     *    event should be prepared to deal with addr==NULL.) error_msg
+     *    may optionally give extra detail to append to the log
+     *    message, such as how long the connection took, or be NULL.
      *
      *  - PLUGLOG_PROXY_MSG means that error_msg contains a line of
      *    logging information from whatever the connection is being
@@ -210,6 +212,22 @@ void sk_cleanup(void);                 /* called just before program exit */
 
 SockAddr *sk_namelookup(const char *host, char **canonicalname, int address_family);
 SockAddr *sk_nonamelookup(const char *host);
+/*
+ * Version of sk_namelookup that doesn't make the caller wait for the
+ * resolver. 'callback' is called later, from the toplevel callback
+ * queue, with what sk_namelookup would have returned; it takes
+ * ownership of both the SockAddr and the canonical name. After
+ * sk_namelookup_cancel, the callback won't be called at all.
+ * Platforms which can't do lookups in the background do the lookup
+ * on the spot, but still deliver the result via the callback.
+ */
+typedef void (*namelookup_callback_fn_t)(
+    void *ctx, SockAddr *addr, char *canonicalname);
+NameLookup *sk_namelookup_async(const char *host, int address_family,
+                                namelookup_callback_fn_t callback, void *ctx);
+void sk_namelookup_cancel(NameLookup *nl);
+/* Turn off (or back on) any cache the platform keeps of lookup results */
+void sk_set_namelookup_cache(bool enabled);
 void sk_getaddr(SockAddr *addr, char *buf, int buflen);
 bool sk_addr_needs_port(SockAddr *addr);
 bool sk_hostname_is_local(const char *name);
@@ -225,10 +243,28 @@ void sk_addr_free(SockAddr *addr);
  * implementation. */
 SockAddr *sk_addr_dup(SockAddr *addr);
 
+/*
+ * Optional tuning of the kernel's buffering on a connect()-type
+ * socket. A zero in any field means leave the OS default alone.
+ *
+ * notsent_lowat (TCP_NOTSENT_LOWAT, where the OS has it) limits how
+ * much data the kernel will accept beyond what's already been
+ * transmitted, so that a bulk transfer backs up in our own buffers,
+ * where it can be throttled and queued behind interactive data,
+ * rather than in the kernel's, where it can't.
+ */
+typedef struct SockBufferSizes {
+    int sndbuf, rcvbuf, notsent_lowat;
+} SockBufferSizes;
+
 /* NB, control of 'addr' is passed via sk_new, which takes responsibility
  * for freeing it, as for new_connection() */
 Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
                bool nodelay, bool keepalive, Plug *p);
+/* sk_new with optional buffer tuning ('bufsizes' may be NULL) */
+Socket *sk_new_tuned(SockAddr *addr, int port, bool privport, bool oobinline,
+                     bool nodelay, bool keepalive,
+                     const SockBufferSizes *bufsizes, Plug *p);
 
 Socket *sk_newlistener(const char *srcaddr, int port, Plug *plug,
                        bool local_host_only, int address_family);
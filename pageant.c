@@ -52,6 +52,10 @@ struct PageantKeyRequestNode {
 struct PageantClientInfo {
     PageantClient *pc; /* goes to NULL when client is unregistered */
     PageantClientRequestNode head;
+    /* Set for clients that run our coroutines directly instead of
+     * returning to the event loop, so we mustn't make them wait for
+     * a background thread */
+    bool synchronous;
 };
 
 struct PageantAsyncOp {
@@ -181,10 +185,50 @@ struct PageantPublicKey {
     strbuf *base_pub;            /* the true owner of sort.priv.base_pub */
     strbuf *full_pub;            /* the true owner of sort.full_pub */
     char *comment;
+    PageantPrivateKey *priv;     /* the entry in privkeytree we go with */
+    char *fingerprint;           /* cached by pubkey_fingerprint() */
 };
 static tree234 *pubkeytree;
 
+/*
+ * Second index of the same public keys, sorted by just SSH version
+ * and full_pub. This lets us look up a key named in a request without
+ * first working out its base_pub, which for a certified key means
+ * decoding the whole certificate.
+ */
+static int pubkey_blob_cmpfn(void *av, void *bv)
+{
+    PageantPublicKeySort *a = (PageantPublicKeySort *)av;
+    PageantPublicKeySort *b = (PageantPublicKeySort *)bv;
+
+    if (a->priv.ssh_version != b->priv.ssh_version)
+        return a->priv.ssh_version < b->priv.ssh_version ? -1 : +1;
+    else
+        return ptrlen_strcmp(a->full_pub, b->full_pub);
+}
+static tree234 *pubkeyblobtree;
+
+/*
+ * Cached serialisations of the key lists we send in reply to
+ * identities requests, indexed by KEYLIST_*. keylist_changed() throws
+ * them away whenever a key is added or removed, or gains or loses
+ * its cleartext or encrypted form (which the extended list reports).
+ */
+enum { KEYLIST_SSH1, KEYLIST_SSH2, KEYLIST_EXTENDED, KEYLIST_NTYPES };
+static strbuf *keylist_cache[KEYLIST_NTYPES];
+
+static void keylist_changed(void)
+{
+    for (size_t i = 0; i < KEYLIST_NTYPES; i++) {
+        if (keylist_cache[i]) {
+            strbuf_free(keylist_cache[i]);
+            keylist_cache[i] = NULL;
+        }
+    }
+}
+
 typedef struct PageantSignOp PageantSignOp;
+typedef struct PageantSignJob PageantSignJob;
 struct PageantSignOp {
     PageantPrivateKey *priv;
     strbuf *data_to_sign;
@@ -192,10 +236,43 @@ struct PageantSignOp {
     int crLine;
     unsigned char failure_type;
 
+    PageantSignJob *job;       /* non-NULL while a worker thread signs */
+    strbuf *signature;
+    unsigned long sign_start;
+
     PageantKeyRequestNode pkr;
     PageantAsyncOp pao;
 };
 
+/*
+ * A signature being generated in a background thread. The job owns
+ * everything the worker thread looks at, so that the PageantSignOp
+ * can go away in the meantime (if its client disconnects), and so can
+ * the PageantPrivateKey (if the key is deleted or re-encrypted).
+ *
+ * In the latter case the ssh_key itself must outlive the PageantPrivateKey,
+ * so pageant_free_skey() marks it as orphaned in every job using it,
+ * and the last of those jobs to finish frees it.
+ */
+struct PageantSignJob {
+    ssh_key *key;
+    strbuf *data_to_sign, *signature;
+    unsigned flags;
+    bool key_orphaned;
+    PageantSignOp *so;         /* NULL if the request was abandoned */
+    PageantSignJob *prev, *next;       /* list of all jobs in progress */
+};
+static PageantSignJob sign_jobs = { .prev = &sign_jobs, .next = &sign_jobs };
+
+/*
+ * Recent signing latencies, in ticks, for the statistics we log
+ * every SIGN_LATENCY_REPORT_INTERVAL signatures.
+ */
+#define SIGN_LATENCY_SAMPLES 1024
+#define SIGN_LATENCY_REPORT_INTERVAL 100
+static unsigned long sign_latencies[SIGN_LATENCY_SAMPLES];
+static size_t sign_latency_count;
+
 /* Master lock that indicates whether a GUI request is currently in
  * progress */
 static bool gui_request_in_progress = false;
@@ -207,6 +284,20 @@ static void failure(PageantClient *pc, PageantClientRequestId *reqid,
 static void fail_requests_for_key(PageantPrivateKey *priv, const char *reason);
 static PageantPublicKey *pageant_nth_pubkey(int ssh_version, int i);
 
+static void pageant_free_skey(ssh_key *skey)
+{
+    bool busy = false;
+    for (PageantSignJob *job = sign_jobs.next; job != &sign_jobs;
+         job = job->next) {
+        if (job->key == skey) {
+            job->key_orphaned = true;
+            busy = true;
+        }
+    }
+    if (!busy)
+        ssh_key_free(skey);
+}
+
 static void pk_priv_free(PageantPrivateKey *priv)
 {
     if (priv->base_pub)
@@ -216,7 +307,7 @@ static void pk_priv_free(PageantPrivateKey *priv)
         sfree(priv->rkey);
     }
     if (priv->sort.ssh_version == 2 && priv->skey) {
-        ssh_key_free(priv->skey);
+        pageant_free_skey(priv->skey);
     }
     if (priv->encrypted_key_file)
         strbuf_free(priv->encrypted_key_file);
@@ -232,9 +323,19 @@ static void pk_pub_free(PageantPublicKey *pub)
     if (pub->full_pub)
         strbuf_free(pub->full_pub);
     sfree(pub->comment);
+    sfree(pub->fingerprint);
     sfree(pub);
 }
 
+static const char *pubkey_fingerprint(PageantPublicKey *pub)
+{
+    assert(pub->sort.priv.ssh_version == 2);
+    if (!pub->fingerprint)
+        pub->fingerprint = ssh2_double_fingerprint_blob(
+            pub->sort.full_pub, SSH_FPTYPE_DEFAULT);
+    return pub->fingerprint;
+}
+
 static strbuf *makeblob1(RSAKey *rkey)
 {
     strbuf *blob = strbuf_new();
@@ -259,9 +360,8 @@ static strbuf *makeblob2base(ssh_key *key)
 
 static PageantPrivateKey *pub_to_priv(PageantPublicKey *pub)
 {
-    PageantPrivateKey *priv = find234(privkeytree, &pub->sort.priv, NULL);
-    assert(priv && "Public and private trees out of sync!");
-    return priv;
+    assert(pub->priv && "Public and private trees out of sync!");
+    return pub->priv;
 }
 
 static PageantPublicKey *findpubkey1(RSAKey *reqkey)
@@ -315,11 +415,7 @@ static PageantPublicKey *findpubkey2(ptrlen full_pub)
     PageantPublicKeySort sort;
     sort.priv.ssh_version = 2;
     sort.full_pub = full_pub;
-    strbuf *base_pub = make_base_pub_2(&sort);
-    PageantPublicKey *toret = find234(pubkeytree, &sort, NULL);
-    if (base_pub)
-        strbuf_free(base_pub);
-    return toret;
+    return find234(pubkeyblobtree, &sort, NULL);
 }
 
 static int find_first_pubkey_for_version(int ssh_version)
@@ -353,6 +449,8 @@ static bool pageant_add_key_common(PageantPublicKey *pub,
 {
     int ssh_version = priv->sort.ssh_version;
 
+    keylist_changed();
+
     priv->sort.base_pub = ptrlen_from_strbuf(priv->base_pub);
 
     pub->base_pub = strbuf_dup(priv->sort.base_pub);
@@ -367,6 +465,7 @@ static bool pageant_add_key_common(PageantPublicKey *pub,
      * of it with what's already there.
      */
     PageantPrivateKey *priv_in_tree = add234(privkeytree, priv);
+    pub->priv = priv_in_tree;
     if (priv_in_tree == priv) {
         /* The key wasn't in the tree at all, and we've just added it. */
     } else {
@@ -398,6 +497,9 @@ static bool pageant_add_key_common(PageantPublicKey *pub,
     PageantPublicKey *pub_in_tree = add234(pubkeytree, pub);
     if (pub_in_tree == pub) {
         /* Successfully added a new key. */
+        PageantPublicKey *added = add234(pubkeyblobtree, pub);
+        assert(added == pub);
+        (void)added;
         return true;
     } else {
         /* This public key was already there. */
@@ -481,6 +583,9 @@ static void remove_pubkey_cleanup(PageantPublicKey *pub)
      * public key sharing a private half, and if so, remove the
      * corresponding private entry too. */
 
+    keylist_changed();
+    del234(pubkeyblobtree, pub);
+
     PageantPublicKeySort pubsearch;
     pubsearch.priv = pub->sort.priv;
     pubsearch.full_pub = PTRLEN_LITERAL("");
@@ -524,7 +629,7 @@ static void remove_all_keys(int ssh_version)
     }
 }
 
-static void list_keys(BinarySink *bs, int ssh_version, bool extended)
+static void make_keylist(BinarySink *bs, int ssh_version, bool extended)
 {
     int i;
     PageantPublicKey *pub;
@@ -569,6 +674,18 @@ static void list_keys(BinarySink *bs, int ssh_version, bool extended)
     }
 }
 
+static void list_keys(BinarySink *bs, int ssh_version, bool extended)
+{
+    strbuf **cache = &keylist_cache[
+        extended ? KEYLIST_EXTENDED : ssh_version == 1 ? KEYLIST_SSH1 :
+        KEYLIST_SSH2];
+    if (!*cache) {
+        *cache = strbuf_new();
+        make_keylist(BinarySink_UPCAST(*cache), ssh_version, extended);
+    }
+    put_datapl(bs, ptrlen_from_strbuf(*cache));
+}
+
 void pageant_make_keylist1(BinarySink *bs) { list_keys(bs, 1, false); }
 void pageant_make_keylist2(BinarySink *bs) { list_keys(bs, 2, false); }
 void pageant_make_keylist_extended(BinarySink *bs) { list_keys(bs, 2, true); }
@@ -578,6 +695,7 @@ void pageant_register_client(PageantClient *pc)
     pc->info = snew(PageantClientInfo);
     pc->info->pc = pc;
     pc->info->head.prev = pc->info->head.next = &pc->info->head;
+    pc->info->synchronous = false;
 }
 
 void pageant_unregister_client(PageantClient *pc)
@@ -595,6 +713,27 @@ void pageant_unregister_client(PageantClient *pc)
     sfree(pc->info);
 }
 
+/*
+ * Log the fingerprint of an SSH-2 key named in a request, using the
+ * cached one if it's a key we know about.
+ */
+static void log_requested_key(PageantClient *pc, PageantClientRequestId *reqid,
+                              const char *what, ptrlen blob,
+                              PageantPublicKey *pub)
+{
+    if (pc->suppress_logging)
+        return;
+    if (pub) {
+        pageant_client_log(pc, reqid, "%s: %s", what,
+                           pubkey_fingerprint(pub));
+    } else {
+        char *fingerprint = ssh2_double_fingerprint_blob(
+            blob, SSH_FPTYPE_DEFAULT);
+        pageant_client_log(pc, reqid, "%s: %s", what, fingerprint);
+        sfree(fingerprint);
+    }
+}
+
 static PRINTF_LIKE(5, 6) void failure(
     PageantClient *pc, PageantClientRequestId *reqid, strbuf *sb,
     unsigned char type, const char *fmt, ...)
@@ -649,10 +788,113 @@ static void signop_free(PageantAsyncOp *pao)
 {
     PageantSignOp *so = container_of(pao, PageantSignOp, pao);
     signop_unlink(so);
-    strbuf_free(so->data_to_sign);
+    if (so->job)
+        so->job->so = NULL;    /* the job will clean up after itself */
+    if (so->data_to_sign)
+        strbuf_free(so->data_to_sign);
+    if (so->signature)
+        strbuf_free(so->signature);
     sfree(so);
 }
 
+static void signjob_work(void *vctx)
+{
+    PageantSignJob *job = (PageantSignJob *)vctx;
+    ssh_key_sign(job->key, ptrlen_from_strbuf(job->data_to_sign),
+                 job->flags, BinarySink_UPCAST(job->signature));
+}
+
+static void signjob_done(void *vctx)
+{
+    PageantSignJob *job = (PageantSignJob *)vctx;
+
+    job->prev->next = job->next;
+    job->next->prev = job->prev;
+
+    if (job->key_orphaned) {
+        bool busy = false;
+        for (PageantSignJob *other = sign_jobs.next; other != &sign_jobs;
+             other = other->next)
+            if (other->key == job->key)
+                busy = true;
+        if (!busy)
+            ssh_key_free(job->key);
+    }
+
+    PageantSignOp *so = job->so;
+    if (so) {
+        so->job = NULL;
+        so->signature = job->signature;
+        so->data_to_sign = job->data_to_sign;
+        sfree(job);
+        pageant_async_op_coroutine(&so->pao);
+    } else {
+        strbuf_free(job->signature);
+        strbuf_free(job->data_to_sign);
+        sfree(job);
+    }
+}
+
+static void signop_start_job(PageantSignOp *so)
+{
+    prepare_thread_safe_sign();
+
+    PageantSignJob *job = snew(PageantSignJob);
+    job->key = so->priv->skey;
+    job->data_to_sign = so->data_to_sign;
+    so->data_to_sign = NULL;
+    job->signature = strbuf_new();
+    job->flags = so->flags;
+    job->key_orphaned = false;
+    job->so = so;
+    so->job = job;
+
+    job->prev = sign_jobs.prev;
+    job->next = &sign_jobs;
+    job->prev->next = job->next->prev = job;
+
+    run_in_background(signjob_work, signjob_done, job);
+}
+
+static int ulong_cmp(const void *av, const void *bv)
+{
+    unsigned long a = *(const unsigned long *)av;
+    unsigned long b = *(const unsigned long *)bv;
+    return a < b ? -1 : a > b ? +1 : 0;
+}
+
+static unsigned long percentile_ms(const unsigned long *sorted, size_t n,
+                                   unsigned percent)
+{
+    return sorted[(n - 1) * percent / 100] * 1000 / TICKSPERSEC;
+}
+
+static void sign_latency_record(PageantSignOp *so, unsigned long ticks)
+{
+    PageantClient *pc = so->pao.info->pc;
+
+    sign_latencies[sign_latency_count++ % SIGN_LATENCY_SAMPLES] = ticks;
+    pageant_client_log(pc, so->pao.reqid, "signed in %lums",
+                       ticks * 1000 / TICKSPERSEC);
+
+    if (sign_latency_count % SIGN_LATENCY_REPORT_INTERVAL ||
+        pc->suppress_logging)
+        return;
+
+    size_t n = (sign_latency_count < SIGN_LATENCY_SAMPLES ?
+                sign_latency_count : SIGN_LATENCY_SAMPLES);
+    unsigned long *sorted = snewn(n, unsigned long);
+    memcpy(sorted, sign_latencies, n * sizeof(*sorted));
+    qsort(sorted, n, sizeof(*sorted), ulong_cmp);
+    pageant_client_log(pc, so->pao.reqid, "sign latency over last %zu "
+                       "requests: p50 %lums, p90 %lums, p99 %lums, "
+                       "max %lums", n, percentile_ms(sorted, n, 50),
+                       percentile_ms(sorted, n, 90),
+                       percentile_ms(sorted, n, 99),
+                       percentile_ms(sorted, n, 100));
+    sfree(sorted);
+}
+
 static bool request_passphrase(PageantClient *pc, PageantPrivateKey *priv)
 {
     if (!priv->decryption_prompt_active) {
@@ -678,6 +920,10 @@ static void signop_coroutine(PageantAsyncOp *pao)
 
     crBegin(so->crLine);
 
+    /* We were linked to the key while waiting to be called for the
+     * first time, in case it was deleted in the meantime */
+    signop_unlink(so);
+
     while (!so->priv->skey && gui_request_in_progress) {
         signop_link_to_pending_gui_request(so);
         crReturnV;
@@ -722,13 +968,28 @@ static void signop_coroutine(PageantAsyncOp *pao)
         goto respond;
     }
 
-    strbuf *signature = strbuf_new();
-    ssh_key_sign(so->priv->skey, ptrlen_from_strbuf(so->data_to_sign),
-                 so->flags, BinarySink_UPCAST(signature));
+    so->sign_start = GETTICKCOUNT();
+    if (so->pao.info->synchronous ||
+        !ssh_key_alg(ssh_key_base_key(so->priv->skey))->thread_safe_sign) {
+        so->signature = strbuf_new();
+        ssh_key_sign(so->priv->skey, ptrlen_from_strbuf(so->data_to_sign),
+                     so->flags, BinarySink_UPCAST(so->signature));
+    } else {
+        /* Hand off to a worker thread, so that a slow key (in
+         * practice, a big RSA one) doesn't hold up everybody else.
+         * signjob_done() will resume us. */
+        signop_start_job(so);
+        while (so->job)
+            crReturnV;
+    }
+    sign_latency_record(so, GETTICKCOUNT() - so->sign_start);
 
     response = strbuf_new();
     put_byte(response, SSH2_AGENT_SIGN_RESPONSE);
-    put_stringsb(response, signature);
+    put_stringsb(response, so->signature);
+    so->signature = NULL;
+    pageant_client_log(so->pao.info->pc, so->pao.reqid,
+                       "reply: SSH2_AGENT_SIGN_RESPONSE");
 
   respond:
     pageant_client_got_response(so->pao.info->pc, so->pao.reqid,
@@ -829,6 +1090,7 @@ void pageant_passphrase_request_success(PageantClientDialogId *dlgid,
             priv->skey = skey->key;
             sfree(skey->comment);
             sfree(skey);
+            keylist_changed();
             keylist_update();
         }
     }
@@ -911,8 +1173,9 @@ static bool reencrypt_key(PageantPublicKey *pub)
      * regardless, so that 'please ensure this key isn't stored
      * decrypted' is idempotent. */
     if (priv->skey) {
-        ssh_key_free(priv->skey);
+        pageant_free_skey(priv->skey);
         priv->skey = NULL;
+        keylist_changed();
     }
 
     return true;
@@ -981,13 +1244,9 @@ static PageantAsyncOp *pageant_make_op(
         if (!pc->suppress_logging) {
             int i;
             PageantPublicKey *pub;
-            for (i = 0; NULL != (pub = pageant_nth_pubkey(2, i)); i++) {
-                char *fingerprint = ssh2_double_fingerprint_blob(
-                    pub->sort.full_pub, SSH_FPTYPE_DEFAULT);
+            for (i = 0; NULL != (pub = pageant_nth_pubkey(2, i)); i++)
                 pageant_client_log(pc, reqid, "returned key: %s %s",
-                                   fingerprint, pub->comment);
-                sfree(fingerprint);
-            }
+                                   pubkey_fingerprint(pub), pub->comment);
         }
         break;
       }
@@ -1093,13 +1352,9 @@ static PageantAsyncOp *pageant_make_op(
         if (!get_err(msg))
             have_flags = true;
 
-        if (!pc->suppress_logging) {
-            char *fingerprint = ssh2_double_fingerprint_blob(
-                keyblob, SSH_FPTYPE_DEFAULT);
-            pageant_client_log(pc, reqid, "requested key: %s", fingerprint);
-            sfree(fingerprint);
-        }
-        if ((pub = findpubkey2(keyblob)) == NULL) {
+        pub = findpubkey2(keyblob);
+        log_requested_key(pc, reqid, "requested key", keyblob, pub);
+        if (!pub) {
             fail("key not found");
             goto responded;
         }
@@ -1122,9 +1377,12 @@ static PageantAsyncOp *pageant_make_op(
         so->priv = pub_to_priv(pub);
         so->pkr.prev = so->pkr.next = NULL;
         so->data_to_sign = strbuf_dup(sigdata);
+        so->job = NULL;
+        so->signature = NULL;
         so->flags = flags;
         so->failure_type = failure_type;
         so->crLine = 0;
+        signop_link_to_key(so);
         return &so->pao;
         break;
       }
@@ -1301,14 +1559,8 @@ static PageantAsyncOp *pageant_make_op(
             goto responded;
         }
 
-        if (!pc->suppress_logging) {
-            char *fingerprint = ssh2_double_fingerprint_blob(
-                blob, SSH_FPTYPE_DEFAULT);
-            pageant_client_log(pc, reqid, "unwanted key: %s", fingerprint);
-            sfree(fingerprint);
-        }
-
         pub = findpubkey2(blob);
+        log_requested_key(pc, reqid, "unwanted key", blob, pub);
         if (!pub) {
             fail("key not found");
             goto responded;
@@ -1485,15 +1737,8 @@ static PageantAsyncOp *pageant_make_op(
                 goto responded;
             }
 
-            if (!pc->suppress_logging) {
-                char *fingerprint = ssh2_double_fingerprint_blob(
-                    blob, SSH_FPTYPE_DEFAULT);
-                pageant_client_log(pc, reqid, "key to re-encrypt: %s",
-                                   fingerprint);
-                sfree(fingerprint);
-            }
-
             PageantPublicKey *pub = findpubkey2(blob);
+            log_requested_key(pc, reqid, "key to re-encrypt", blob, pub);
             if (!pub) {
                 fail("key not found");
                 goto responded;
@@ -1570,14 +1815,10 @@ static PageantAsyncOp *pageant_make_op(
             if (!pc->suppress_logging) {
                 int i;
                 PageantPublicKey *pub;
-                for (i = 0; NULL != (pub = pageant_nth_pubkey(2, i)); i++) {
-                    char *fingerprint = ssh2_double_fingerprint_blob(
-                        ptrlen_from_strbuf(pub->full_pub),
-                        SSH_FPTYPE_DEFAULT);
+                for (i = 0; NULL != (pub = pageant_nth_pubkey(2, i)); i++)
                     pageant_client_log(pc, reqid, "returned key: %s %s",
-                                       fingerprint, pub->comment);
-                    sfree(fingerprint);
-                }
+                                       pubkey_fingerprint(pub),
+                                       pub->comment);
             }
             break;
           }
@@ -1618,6 +1859,7 @@ void pageant_init(void)
 {
     pageant_local = true;
     pubkeytree = newtree234(pubkey_cmpfn);
+    pubkeyblobtree = newtree234(pubkey_blob_cmpfn);
     privkeytree = newtree234(privkey_cmpfn);
 }
 
@@ -2042,6 +2284,7 @@ static unsigned pageant_client_op_query(PageantClientOp *pco)
         pic.response = pco->buf;
         pic.got_response = false;
         pageant_register_client(&pic.pc);
+        pic.pc.info->synchronous = true;
 
         assert(pco->buf->len > 4);
         PageantAsyncOp *pao = pageant_make_op(
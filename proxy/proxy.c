@@ -228,10 +228,10 @@ static void proxy_negotiate(ProxySocket *ps)
     if (ps->pn->reconnect) {
         sk_close(ps->sub_socket);
         SockAddr *proxy_addr = sk_addr_dup(ps->proxy_addr);
-        ps->sub_socket = sk_new(proxy_addr, ps->proxy_port,
-                                ps->proxy_privport, ps->proxy_oobinline,
-                                ps->proxy_nodelay, ps->proxy_keepalive,
-                                &ps->plugimpl);
+        ps->sub_socket = sk_new_tuned(proxy_addr, ps->proxy_port,
+                                      ps->proxy_privport, ps->proxy_oobinline,
+                                      ps->proxy_nodelay, ps->proxy_keepalive,
+                                      &ps->proxy_bufsizes, &ps->plugimpl);
         ps->pn->reconnect = false;
         /* If the negotiator has asked us to reconnect, they are
          * expecting that on the next call their input queue will
@@ -412,7 +412,12 @@ SockAddr *name_lookup(const char *host, int port, char **canonicalname,
             logevent_and_free(
                 logctx, dns_log_msg(host, addressfamily, reason));
 
-        return sk_namelookup(host, canonicalname, addressfamily);
+        unsigned long start = GETTICKCOUNT();
+        SockAddr *addr = sk_namelookup(host, canonicalname, addressfamily);
+        if (logctx)
+            logeventf(logctx, "Host lookup of \"%s\" took %lu ms", host,
+                      (GETTICKCOUNT() - start) * 1000 / TICKSPERSEC);
+        return addr;
     }
 }
 
@@ -505,12 +510,22 @@ void proxy_spr_abort(ProxyNegotiator *pn, SeatPromptResult spr)
     }
 }
 
+static void buffer_sizes_from_conf(SockBufferSizes *bufsizes, Conf *conf)
+{
+    bufsizes->sndbuf = conf_get_int(conf, CONF_tcp_sndbuf);
+    bufsizes->rcvbuf = conf_get_int(conf, CONF_tcp_rcvbuf);
+    bufsizes->notsent_lowat = conf_get_int(conf, CONF_tcp_notsent_lowat);
+}
+
 Socket *new_connection(SockAddr *addr, const char *hostname,
                        int port, bool privport,
                        bool oobinline, bool nodelay, bool keepalive,
                        Plug *plug, Conf *conf, Interactor *itr)
 {
     int type = conf_get_int(conf, CONF_proxy_type);
+    SockBufferSizes bufsizes;
+
+    buffer_sizes_from_conf(&bufsizes, conf);
 
     if (type != PROXY_NONE &&
         proxy_for_destination(addr, hostname, port, conf)) {
@@ -640,10 +655,11 @@ Socket *new_connection(SockAddr *addr, const char *hostname,
         ps->proxy_oobinline = oobinline;
         ps->proxy_nodelay = nodelay;
         ps->proxy_keepalive = keepalive;
-        ps->sub_socket = sk_new(proxy_addr, ps->proxy_port,
-                                ps->proxy_privport, ps->proxy_oobinline,
-                                ps->proxy_nodelay, ps->proxy_keepalive,
-                                &ps->plugimpl);
+        ps->proxy_bufsizes = bufsizes;
+        ps->sub_socket = sk_new_tuned(proxy_addr, ps->proxy_port,
+                                      ps->proxy_privport, ps->proxy_oobinline,
+                                      ps->proxy_nodelay, ps->proxy_keepalive,
+                                      &ps->proxy_bufsizes, &ps->plugimpl);
         if (sk_socket_error(ps->sub_socket) != NULL)
             return &ps->sock;
 
@@ -655,7 +671,8 @@ Socket *new_connection(SockAddr *addr, const char *hostname,
     }
 
     /* no proxy, so just return the direct socket */
-    return sk_new(addr, port, privport, oobinline, nodelay, keepalive, plug);
+    return sk_new_tuned(addr, port, privport, oobinline, nodelay, keepalive,
+                        &bufsizes, plug);
 }
 
 Socket *new_listener(const char *srcaddr, int port, Plug *plug,
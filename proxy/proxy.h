@@ -26,6 +26,7 @@ struct ProxySocket {
     SockAddr *proxy_addr;
     int proxy_port;
     bool proxy_privport, proxy_oobinline, proxy_nodelay, proxy_keepalive;
+    SockBufferSizes proxy_bufsizes;
 
     bufchain pending_output_data;
     bufchain pending_oob_output_data;
@@ -469,7 +469,8 @@ static void do_cmd(char *host, char *user, char *cmd)
 
     logctx = log_init(console_cli_logpolicy, conf);
 
-    platform_psftp_pre_conn_setup(console_cli_logpolicy);
+    if (!platform_psftp_pre_conn_setup(console_cli_logpolicy, conf))
+        bump("ssh_init: unable to start shared connection");
 
     err = backend_init(backend_vt_from_proto(
                            conf_get_int(conf, CONF_protocol)),
@@ -2742,7 +2742,10 @@ static int psftp_connect(char *userhost, char *user, int portnumber)
 
     psftp_logctx = log_init(console_cli_logpolicy, conf);
 
-    platform_psftp_pre_conn_setup(console_cli_logpolicy);
+    if (!platform_psftp_pre_conn_setup(console_cli_logpolicy, conf)) {
+        fprintf(stderr, "ssh_init: unable to start shared connection\n");
+        return 1;
+    }
 
     err = backend_init(backend_vt_from_proto(
                            conf_get_int(conf, CONF_protocol)),
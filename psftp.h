@@ -47,9 +47,10 @@ char *ssh_sftp_get_cmdline(const char *prompt, bool backend_required);
 
 /*
  * Platform-specific function called when we're about to make a
- * network connection.
+ * network connection. Returns false if the connection should not go
+ * ahead after all, having already reported why.
  */
-void platform_psftp_pre_conn_setup(LogPolicy *lp);
+bool platform_psftp_pre_conn_setup(LogPolicy *lp, Conf *conf);
 
 /*
  * The main program in psftp.c. Called from main() in the platform-
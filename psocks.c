@@ -5,6 +5,7 @@
 
 #include <string.h>
 #include <errno.h>
+#include <ctype.h>
 
 #include "putty.h"
 #include "storage.h"
@@ -22,7 +23,18 @@
  *    sk_namelookup, to allow forwarding via some other proxy type
  */
 
+/*
+ * Buffer accounting. Each connection may buffer up to BUFLIMIT bytes
+ * in each direction before we stop reading from the other end; but
+ * all connections together share a global budget, so that when
+ * there are a lot of them each one's allowance shrinks to its fair
+ * share of that budget, down to a floor of MIN_ALLOWANCE. Once every
+ * admitted connection would be down to the floor, further new
+ * connections are queued until some old ones go away.
+ */
 #define BUFLIMIT 16384
+#define MIN_ALLOWANCE 2048
+#define DEFAULT_BUDGET (64 << 20)
 
 #define LOGBITS(X)                              \
     X(CONNSTATUS)                               \
@@ -51,6 +63,14 @@ struct psocks_state {
     RecordDestination rec_dest;
     char *rec_cmd;
     bool got_subcmd;
+    bool no_splice;
+
+    size_t buffer_budget, total_buffered;
+    size_t nactive;
+    unsigned conn_rate;                /* per second; 0 means unlimited */
+    unsigned long rate_tat;            /* rate limiter's next free slot */
+    bool rate_timer_pending;
+    psocks_connection *pending_head, *pending_tail;
 
     ConnectionLayer cl;
 };
@@ -61,11 +81,19 @@ struct psocks_connection {
     char *host, *realhost;
     int port;
     SockAddr *addr;
+    NameLookup *lookup;                /* while the name lookup runs */
+    unsigned long lookup_start;
     Socket *socket;
     bool connecting, eof_pfmgr_to_socket, eof_socket_to_pfmgr;
     uint64_t index;
     PsocksDataSink *rec_sink;
 
+    /* amount of data buffered for sending in each direction: UP is
+     * conn->socket's output, DN is the SOCKS client socket's */
+    size_t bufsize[2];
+    bool pending, admitted;
+    psocks_connection *pending_next;
+
     Plug plug;
     SshChannel sc;
 };
@@ -153,6 +181,104 @@ static void psocks_conn_log_data(psocks_connection *conn, PsocksDirection dir,
 
 static void psocks_connection_establish(void *vctx);
 
+static size_t psocks_allowance(psocks_state *ps)
+{
+    size_t allowance = ps->buffer_budget / 2 / (ps->nactive ? ps->nactive : 1);
+    if (allowance > BUFLIMIT)
+        allowance = BUFLIMIT;
+    if (allowance < MIN_ALLOWANCE)
+        allowance = MIN_ALLOWANCE;
+    return allowance;
+}
+
+static void psocks_set_bufsize(psocks_connection *conn, PsocksDirection dir,
+                               size_t bufsize)
+{
+    conn->ps->total_buffered -= conn->bufsize[dir];
+    conn->bufsize[dir] = bufsize;
+    conn->ps->total_buffered += conn->bufsize[dir];
+}
+
+/*
+ * Stop or restart reading data that would be sent in direction
+ * 'dir', according to how much is already buffered that way.
+ */
+static void psocks_throttle(psocks_connection *conn, PsocksDirection dir)
+{
+    psocks_state *ps = conn->ps;
+    size_t bufsize = conn->bufsize[dir];
+
+    /*
+     * If we're over the global budget, then any connection with data
+     * still buffered waits for it to drain. It will hear about that
+     * via a sent notification, so it can't get stuck.
+     */
+    bool frozen = bufsize > psocks_allowance(ps) ||
+        (bufsize > 0 && ps->total_buffered > ps->buffer_budget);
+
+    if (dir == UP) {
+        if (!conn->connecting)
+            chan_set_input_wanted(conn->chan, !frozen);
+    } else {
+        if (conn->socket)
+            sk_set_frozen(conn->socket, frozen);
+    }
+}
+
+static void psocks_admit(psocks_state *ps);
+
+static void psocks_rate_timer(void *vctx, unsigned long now)
+{
+    psocks_state *ps = (psocks_state *)vctx;
+    ps->rate_timer_pending = false;
+    psocks_admit(ps);
+}
+
+/*
+ * Start establishing as many queued connections as the connection
+ * limit and the rate limit permit.
+ */
+static void psocks_admit(psocks_state *ps)
+{
+    while (ps->pending_head) {
+        if (ps->nactive >= ps->buffer_budget / (2 * MIN_ALLOWANCE))
+            return;            /* wait for psocks_conn_free to call us again */
+
+        if (ps->conn_rate) {
+            /*
+             * Rate limit: rate_tat advances by one interval per
+             * connection admitted, and may run up to a second ahead
+             * of the current time, permitting bursts of one second's
+             * worth of connections.
+             */
+            unsigned long now = GETTICKCOUNT();
+            unsigned long interval = TICKSPERSEC / ps->conn_rate;
+            if (interval == 0)
+                interval = 1;
+            if ((long)(ps->rate_tat - now) < 0)
+                ps->rate_tat = now;
+            long wait = (long)(ps->rate_tat - now) - TICKSPERSEC;
+            if (wait > 0) {
+                if (!ps->rate_timer_pending) {
+                    ps->rate_timer_pending = true;
+                    schedule_timer(wait, psocks_rate_timer, ps);
+                }
+                return;
+            }
+            ps->rate_tat += interval;
+        }
+
+        psocks_connection *conn = ps->pending_head;
+        ps->pending_head = conn->pending_next;
+        if (!ps->pending_head)
+            ps->pending_tail = NULL;
+        conn->pending = false;
+        conn->admitted = true;
+        ps->nactive++;
+        queue_toplevel_callback(psocks_connection_establish, conn);
+    }
+}
+
 static SshChannel *psocks_lportfwd_open(
     ConnectionLayer *cl, const char *hostname, int port,
     const char *description, const SocketEndpointInfo *pi, Channel *chan)
@@ -227,17 +353,42 @@ static SshChannel *psocks_lportfwd_open(
       default:
         break;
     }
-    queue_toplevel_callback(psocks_connection_establish, conn);
+
+    conn->pending = true;
+    if (ps->pending_tail)
+        ps->pending_tail->pending_next = conn;
+    else
+        ps->pending_head = conn;
+    ps->pending_tail = conn;
+    psocks_admit(ps);
+
     return &conn->sc;
 }
 
 static void psocks_conn_free(psocks_connection *conn)
 {
-    if (conn->ps->log_flags & LOG_CONNSTATUS)
+    psocks_state *ps = conn->ps;
+
+    if (ps->log_flags & LOG_CONNSTATUS)
         psocks_conn_log(conn, "closed");
 
+    if (conn->pending) {
+        psocks_connection **prev = &ps->pending_head, *prevconn = NULL;
+        while (*prev != conn) {
+            prevconn = *prev;
+            prev = &prevconn->pending_next;
+        }
+        *prev = conn->pending_next;
+        if (ps->pending_tail == conn)
+            ps->pending_tail = prevconn;
+    }
+    psocks_set_bufsize(conn, UP, 0);
+    psocks_set_bufsize(conn, DN, 0);
+
     sfree(conn->host);
     sfree(conn->realhost);
+    if (conn->lookup)
+        sk_namelookup_cancel(conn->lookup);
     if (conn->socket)
         sk_close(conn->socket);
     if (conn->chan)
@@ -245,17 +396,25 @@ static void psocks_conn_free(psocks_connection *conn)
     if (conn->rec_sink)
         pds_free(conn->rec_sink);
     delete_callbacks_for_context(conn);
+    if (conn->admitted) {
+        ps->nactive--;
+        psocks_admit(ps);
+    }
     sfree(conn);
 }
 
-static void psocks_connection_establish(void *vctx)
+static void psocks_connection_looked_up(void *vctx, SockAddr *addr,
+                                        char *canonicalname)
 {
     psocks_connection *conn = (psocks_connection *)vctx;
 
-    /*
-     * Look up destination host name.
-     */
-    conn->addr = sk_namelookup(conn->host, &conn->realhost, ADDRTYPE_UNSPEC);
+    conn->lookup = NULL;
+    conn->addr = addr;
+    conn->realhost = canonicalname;
+    if (conn->ps->log_flags & LOG_CONNSTATUS)
+        psocks_conn_log(conn, "name lookup took %lu ms",
+                        (GETTICKCOUNT() - conn->lookup_start) * 1000 /
+                        TICKSPERSEC);
 
     const char *err = sk_addr_error(conn->addr);
     if (err) {
@@ -263,6 +422,7 @@ static void psocks_connection_establish(void *vctx)
         chan_open_failed(conn->chan, msg);
         sfree(msg);
 
+        sk_addr_free(conn->addr);
         psocks_conn_free(conn);
         return;
     }
@@ -275,6 +435,19 @@ static void psocks_connection_establish(void *vctx)
                           &conn->plug);
 }
 
+static void psocks_connection_establish(void *vctx)
+{
+    psocks_connection *conn = (psocks_connection *)vctx;
+
+    /*
+     * Look up destination host name, without holding up all the
+     * other connections while the resolver thinks about it.
+     */
+    conn->lookup_start = GETTICKCOUNT();
+    conn->lookup = sk_namelookup_async(
+        conn->host, ADDRTYPE_UNSPEC, psocks_connection_looked_up, conn);
+}
+
 static size_t psocks_sc_write(SshChannel *sc, bool is_stderr,
                               const void *data, size_t len)
 {
@@ -283,7 +456,9 @@ static size_t psocks_sc_write(SshChannel *sc, bool is_stderr,
 
     psocks_conn_log_data(conn, UP, data, len);
 
-    return sk_write(conn->socket, data, len);
+    psocks_set_bufsize(conn, UP, sk_write(conn->socket, data, len));
+    psocks_throttle(conn, UP);
+    return conn->bufsize[UP];
 }
 
 static void psocks_check_close(void *vctx)
@@ -310,15 +485,23 @@ static void psocks_sc_write_eof(SshChannel *sc)
 static void psocks_sc_initiate_close(SshChannel *sc, const char *err)
 {
     psocks_connection *conn = container_of(sc, psocks_connection, sc);
-    sk_close(conn->socket);
-    conn->socket = NULL;
+    if (conn->socket) {
+        sk_close(conn->socket);
+        conn->socket = NULL;
+    }
+
+    /* Nothing more can happen in either direction, so let
+     * psocks_check_close clean up the whole connection. */
+    conn->eof_pfmgr_to_socket = true;
+    conn->eof_socket_to_pfmgr = true;
+    queue_toplevel_callback(psocks_check_close, conn);
 }
 
 static void psocks_sc_unthrottle(SshChannel *sc, size_t bufsize)
 {
     psocks_connection *conn = container_of(sc, psocks_connection, sc);
-    if (bufsize < BUFLIMIT)
-	sk_set_frozen(conn->socket, false);
+    psocks_set_bufsize(conn, DN, bufsize);
+    psocks_throttle(conn, DN);
 }
 
 static void psocks_plug_log(Plug *plug, Socket *s, PlugLogType type,
@@ -348,6 +531,16 @@ static void psocks_plug_log(Plug *plug, Socket *s, PlugLogType type,
         if (conn->connecting) {
             chan_open_confirmation(conn->chan);
             conn->connecting = false;
+
+            /*
+             * If we're not going to look at the data, let the
+             * platform relay it directly between the two sockets,
+             * if it can.
+             */
+            if (conn->ps->platform->splice && !conn->ps->no_splice &&
+                !(conn->ps->log_flags & LOG_DIALOGUE) && !conn->rec_sink)
+                conn->ps->platform->splice(
+                    portfwd_raw_socket(conn->chan), conn->socket);
         }
         break;
       case PLUGLOG_PROXY_MSG:
@@ -382,8 +575,8 @@ static void psocks_plug_receive(Plug *plug, int urgent,
                                 const char *data, size_t len)
 {
     psocks_connection *conn = container_of(plug, psocks_connection, plug);
-    size_t bufsize = chan_send(conn->chan, false, data, len);
-    sk_set_frozen(conn->socket, bufsize > BUFLIMIT);
+    psocks_set_bufsize(conn, DN, chan_send(conn->chan, false, data, len));
+    psocks_throttle(conn, DN);
 
     psocks_conn_log_data(conn, DN, data, len);
 }
@@ -391,7 +584,8 @@ static void psocks_plug_receive(Plug *plug, int urgent,
 static void psocks_plug_sent(Plug *plug, size_t bufsize)
 {
     psocks_connection *conn = container_of(plug, psocks_connection, plug);
-    sk_set_frozen(conn->socket, bufsize > BUFLIMIT);
+    psocks_set_bufsize(conn, UP, bufsize);
+    psocks_throttle(conn, UP);
 }
 
 psocks_state *psocks_new(const PsocksPlatform *platform)
@@ -409,17 +603,39 @@ psocks_state *psocks_new(const PsocksPlatform *platform)
     ps->log_flags = LOG_CONNSTATUS;
     ps->rec_dest = REC_NONE;
     ps->platform = platform;
+    ps->buffer_budget = DEFAULT_BUDGET;
 
     return ps;
 }
 
 void psocks_free(psocks_state *ps)
 {
+    expire_timer_context(ps);
     portfwdmgr_free(ps->portfwdmgr);
     sfree(ps->rec_cmd);
     sfree(ps);
 }
 
+/*
+ * Parse a byte count, optionally suffixed with k, M or G.
+ */
+static bool psocks_parse_size(const char *p, size_t *out)
+{
+    char *end;
+    unsigned long long val = strtoull(p, &end, 10);
+    if (end == p)
+        return false;
+    switch (*end) {
+      case 'k': case 'K': val <<= 10; end++; break;
+      case 'm': case 'M': val <<= 20; end++; break;
+      case 'g': case 'G': val <<= 30; end++; break;
+    }
+    if (*end || val > SIZE_MAX)
+        return false;
+    *out = val;
+    return true;
+}
+
 void psocks_cmdline(psocks_state *ps, CmdlineArgList *arglist)
 {
     bool doing_opts = true;
@@ -453,6 +669,40 @@ void psocks_cmdline(psocks_state *ps, CmdlineArgList *arglist)
 		    exit(1);
 		}
 		ps->rec_dest = REC_PIPE;
+            } else if (!strcmp(p, "--no-splice")) {
+                ps->no_splice = true;
+            } else if (!strcmp(p, "--no-dns-cache")) {
+                sk_set_namelookup_cache(false);
+            } else if (!strcmp(p, "--budget")) {
+                if (!arglist->args[arglistpos]) {
+		    fprintf(stderr, "psocks: expected an argument to "
+                            "'--budget'\n");
+		    exit(1);
+                }
+                const char *val = cmdline_arg_to_str(
+                    arglist->args[arglistpos++]);
+                if (!psocks_parse_size(val, &ps->buffer_budget) ||
+                    ps->buffer_budget < 2 * MIN_ALLOWANCE) {
+		    fprintf(stderr, "psocks: invalid buffer budget '%s' "
+                            "(minimum %d)\n", val, 2 * MIN_ALLOWANCE);
+		    exit(1);
+                }
+            } else if (!strcmp(p, "--rate")) {
+                if (!arglist->args[arglistpos]) {
+		    fprintf(stderr, "psocks: expected an argument to "
+                            "'--rate'\n");
+		    exit(1);
+                }
+                const char *val = cmdline_arg_to_str(
+                    arglist->args[arglistpos++]);
+                char *end;
+                unsigned long rate = strtoul(val, &end, 10);
+                if (!isdigit((unsigned char)*val) || *end ||
+                    rate > UINT_MAX) {
+		    fprintf(stderr, "psocks: invalid rate '%s'\n", val);
+		    exit(1);
+                }
+                ps->conn_rate = rate;
 	    } else if (!strcmp(p, "--exec")) {
                 if (!ps->platform->start_subcommand) {
 		    fprintf(stderr, "psocks: running a subcommand is not "
@@ -472,7 +722,8 @@ void psocks_cmdline(psocks_state *ps, CmdlineArgList *arglist)
                 printf("usage: psocks [ -d ] [ -f");
                 if (ps->platform->open_pipes)
                     printf(" | -p pipe-cmd");
-                printf(" ] [ -g ] port-number");
+                printf(" ] [ -g ] [ --budget size ] [ --rate n ]"
+                       " [ --no-dns-cache ] port-number");
                 printf("\n");
                 printf("where: -d           log all connection contents to"
                        " standard output\n");
@@ -483,6 +734,15 @@ void psocks_cmdline(psocks_state *ps, CmdlineArgList *arglist)
                            " to 'pipe-cmd [in|out] N'\n");
                 printf("       -g           accept connections from anywhere,"
                        " not just localhost\n");
+                printf("       --budget size  total data to buffer for all"
+                       " connections (default 64M)\n");
+                printf("       --rate n     start at most n new connections"
+                       " per second\n");
+                printf("       --no-dns-cache  look up every destination"
+                       " afresh\n");
+                if (ps->platform->splice)
+                    printf("       --no-splice  always relay data through"
+                           " user space\n");
                 if (ps->platform->start_subcommand)
                     printf("       --exec subcmd [args...]   run command, and "
                            "terminate when it exits\n");
@@ -516,6 +776,7 @@ void psocks_start(psocks_state *ps)
     conf_set_str_str(conf, CONF_portfwd, key, "D");
     sfree(key);
 
+    ps->rate_tat = GETTICKCOUNT();
     portfwdmgr_config(ps->portfwdmgr, conf);
 
     if (ps->got_subcmd)
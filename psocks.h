@@ -21,6 +21,7 @@ struct PsocksPlatform {
         const char *index_arg, char **err);
     void (*found_subcommand)(CmdlineArg *arg);
     void (*start_subcommand)(void);
+    bool (*splice)(Socket *s1, Socket *s2);
 };
 
 psocks_state *psocks_new(const PsocksPlatform *);
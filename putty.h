@@ -2728,6 +2728,43 @@ typedef void (*toplevel_callback_notify_fn_t)(void *ctx);
 void request_callback_notifications(toplevel_callback_notify_fn_t notify,
                                     void *ctx);
 
+/*
+ * Facility for running CPU-heavy (or otherwise slow, like a name
+ * lookup) jobs in background threads, so that they don't hold up the
+ * event loop.
+ *
+ * 'work' is called in some other thread, and must not touch anything
+ * except the context it's passed: no sockets, timers, callbacks or
+ * other shared state. Once it has returned, 'done' is called with
+ * the same context from the main event loop, like a toplevel
+ * callback. 'done' is always called, so a caller that loses interest
+ * in the result in the meantime must record that in the context.
+ *
+ * Where threads aren't available, this calls 'work' immediately and
+ * schedules 'done' as an ordinary toplevel callback.
+ */
+void run_in_background(toplevel_callback_fn_t work,
+                       toplevel_callback_fn_t done, void *ctx);
+
+/*
+ * Facility for splitting one CPU-heavy job into independent pieces,
+ * and doing them at once on the same pool of threads. Calls
+ * work(ctxs[i]) for each i < n, some of them in other threads and
+ * some in the calling thread, and returns when all of them have
+ * finished. The same restrictions on 'work' apply as above. Unlike
+ * run_in_background, this doesn't need an event loop, so it's
+ * available in every program; without threads it just does the
+ * pieces in turn.
+ */
+void run_in_parallel(toplevel_callback_fn_t work, void **ctxs, size_t n);
+
+/*
+ * The thread pool underlying both of the above, provided by each
+ * platform's utils. Runs work(ctx) on some pool thread, or returns
+ * false if no thread could be started to do it.
+ */
+bool worker_pool_submit(toplevel_callback_fn_t work, void *ctx);
+
 /*
  * Facility provided by the platform to spawn a parallel subprocess
  * and present its stdio via a Socket.
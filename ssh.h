@@ -164,6 +164,8 @@ int ssh2_censor_packet(
 
 PktOut *ssh_new_packet(void);
 void ssh_free_pktout(PktOut *pkt);
+/* Make room for 'len' more bytes in a PktOut without writing them */
+void ssh_pkt_reserve(PktOut *pkt, size_t len);
 
 Socket *ssh_connection_sharing_init(
     const char *host, int port, Conf *conf, LogContext *logctx,
@@ -398,13 +400,43 @@ bool portfwdmgr_unlisten(PortFwdManager *mgr, const char *host, int port);
 Channel *portfwd_raw_new(ConnectionLayer *cl, Plug **plug, bool start_ready);
 void portfwd_raw_free(Channel *pfchan);
 void portfwd_raw_setup(Channel *pfchan, Socket *s, SshChannel *sc);
+Socket *portfwd_raw_socket(Channel *pfchan);
 
 Socket *platform_make_agent_socket(Plug *plug, const char *dirprefix,
                                    char **error, char **name);
 
 LogContext *ssh_get_logctx(Ssh *ssh);
 
+/*
+ * Phases of setting up an SSH connection, in the order they happen.
+ * Each layer calls ssh_setup_phase_done() when it finishes one, and
+ * ssh.c reports how long each took once the session is running.
+ *
+ * 'connect' is the connection to the proxy, if there is one, and
+ * 'proxy' is the proxy negotiation after that. 'kex' ends when we
+ * have the server's host key, and 'newkeys' when the first key
+ * exchange is complete.
+ */
+#define SSH_SETUP_PHASES(X)                     \
+    X(LOOKUP, "lookup")                         \
+    X(CONNECT, "connect")                       \
+    X(PROXY, "proxy")                           \
+    X(VERSION, "version")                       \
+    X(KEX, "kex")                               \
+    X(HOSTKEY, "hostkey")                       \
+    X(NEWKEYS, "newkeys")                       \
+    X(AUTH, "auth")                             \
+    X(CHANNEL, "channel")                       \
+    /* end of list */
+#define SSH_SETUP_PHASE_ENUM_DEF(id, name) SSH_PHASE_##id,
+typedef enum SshSetupPhase {
+    SSH_SETUP_PHASES(SSH_SETUP_PHASE_ENUM_DEF)
+    SSH_SETUP_PHASE_COUNT
+} SshSetupPhase;
+#undef SSH_SETUP_PHASE_ENUM_DEF
+
 /* Communications back to ssh.c from connection layers */
+void ssh_setup_phase_done(Ssh *ssh, SshSetupPhase phase);
 void ssh_throttle_conn(Ssh *ssh, int adjust);
 void ssh_got_exitcode(Ssh *ssh, int status);
 void ssh_ldisc_update(Ssh *ssh);
@@ -473,6 +505,10 @@ struct ec_wcurve
     WeierstrassCurve *wc;
     WeierstrassPoint *G;
     mp_int *G_order;
+
+    /* Precomputed multiples of G, built on demand by ecc-ssh.c */
+    WeierstrassBaseTable *G_table;
+    unsigned G_multiplies;
 };
 
 /* Montgomery form curve */
@@ -490,6 +526,10 @@ struct ec_ecurve
     EdwardsPoint *G;
     mp_int *G_order;
     unsigned log2_cofactor;
+
+    /* Precomputed multiples of G, built on demand by ecc-ssh.c */
+    EdwardsBaseTable *G_table;
+    unsigned G_multiplies;
 };
 
 typedef enum EllipticCurveType {
@@ -901,8 +941,16 @@ struct ssh_keyalg {
     const void *extra;     /* private to the public key methods */
     bool is_certificate;   /* is this a certified key type? */
     const ssh_keyalg *base_alg; /* if so, for what underlying key alg? */
+    /* Can several threads sign with keys of this type at once? Not if
+     * signing touches shared state, as the elliptic-curve algorithms
+     * do with their per-curve tables and scratch space. */
+    bool thread_safe_sign;
 };
 
+/* Must be called from the main thread before the first time a key
+ * with thread_safe_sign is used to sign in any other thread. */
+void prepare_thread_safe_sign(void);
+
 static inline ssh_key *ssh_key_new_pub(const ssh_keyalg *self, ptrlen pub)
 { return self->new_pub(self, pub); }
 static inline ssh_key *ssh_key_new_priv(
@@ -1090,7 +1138,7 @@ struct ssh_compression_alg {
     /* For zlib@openssh.com: if non-NULL, this name will be considered once
      * userauth has completed successfully. */
     const char *delayed_name;
-    ssh_compressor *(*compress_new)(void);
+    ssh_compressor *(*compress_new)(int level);
     void (*compress_free)(ssh_compressor *);
     void (*compress)(ssh_compressor *, const unsigned char *block, int len,
                      unsigned char **outblock, int *outlen,
@@ -1102,9 +1150,11 @@ struct ssh_compression_alg {
     const char *text_name;
 };
 
+/* Compression levels are on zlib's scale of 0 (none) to 9 (slowest) */
+#define SSH_COMPRESSION_DEFAULT_LEVEL 6
 static inline ssh_compressor *ssh_compressor_new(
-    const ssh_compression_alg *alg)
-{ return alg->compress_new(); }
+    const ssh_compression_alg *alg, int level)
+{ return alg->compress_new(level); }
 static inline ssh_decompressor *ssh_decompressor_new(
     const ssh_compression_alg *alg)
 { return alg->decompress_new(); }
@@ -1966,6 +2016,7 @@ void old_keyfile_warning(void);
     X(BUG_SSH2_OLDGEX)                          \
     X(BUG_REQUIRES_FILTERED_KEXINIT)            \
     X(BUG_RSA_SHA2_CERT_USERAUTH)               \
+    X(BUG_CHOKES_ON_PIPELINED_SETUP)            \
     /* end of list */
 #define TMP_DECLARE_LOG2_ENUM(thing) log2_##thing,
 enum { SSH_IMPL_BUG_LIST(TMP_DECLARE_LOG2_ENUM) };
@@ -11,28 +11,87 @@
 #include "pageant.h"
 #include "channel.h"
 
-typedef struct agentf {
+/*
+ * Maximum number of queries we'll have outstanding to the real agent
+ * at once on a single forwarding channel. Requests after that stay in
+ * the input buffer until an earlier one has been answered.
+ */
+#define AGENTF_MAX_QUERIES 16
+
+typedef struct agentf agentf;
+typedef struct agentf_query agentf_query;
+
+/*
+ * One request passed on to the real agent. These are kept on a queue
+ * in the order the requests arrived, because the agent protocol has
+ * no request ids, so the replies have to be sent back in that order
+ * even if the agent answers them out of order (e.g. because it opened
+ * a separate connection for each one, or signs in multiple threads).
+ */
+struct agentf_query {
+    agentf *af;
+    agent_pending_query *pending;
+    bool answered;
+    void *reply;
+    int replylen;
+    agentf_query *next;
+};
+
+struct agentf {
     SshChannel *c;
     bufchain inbuffer;
-    agent_pending_query *pending;
+    agentf_query *qhead, *qtail;
+    size_t nqueries;
     bool input_wanted;
     bool rcvd_eof;
+    bool rejected;                /* we've stopped accepting input */
+    bool sent_eof;
 
     Channel chan;
-} agentf;
+};
 
-static void agentf_got_response(agentf *af, void *reply, int replylen)
+static agentf_query *agentf_new_query(agentf *af)
 {
-    af->pending = NULL;
+    agentf_query *q = snew(agentf_query);
+    q->af = af;
+    q->pending = NULL;
+    q->answered = false;
+    q->reply = NULL;
+    q->replylen = 0;
+    q->next = NULL;
+
+    if (af->qtail)
+        af->qtail->next = q;
+    else
+        af->qhead = q;
+    af->qtail = q;
+    af->nqueries++;
+    return q;
+}
 
-    if (!reply) {
-        /* The real agent didn't send any kind of reply at all for
-         * some reason, so fake an SSH_AGENT_FAILURE. */
-        reply = "\0\0\0\1\5";
-        replylen = 5;
+static void agentf_send_replies(agentf *af)
+{
+    /*
+     * Send back every reply at the head of the queue that we now have
+     * an answer for, stopping at the first one that's still waiting.
+     */
+    while (af->qhead && af->qhead->answered) {
+        agentf_query *q = af->qhead;
+        af->qhead = q->next;
+        if (!af->qhead)
+            af->qtail = NULL;
+        af->nqueries--;
+
+        if (q->reply) {
+            sshfwd_write(af->c, q->reply, q->replylen);
+            sfree(q->reply);
+        } else {
+            /* The real agent didn't send any kind of reply at all for
+             * some reason, so fake an SSH_AGENT_FAILURE. */
+            sshfwd_write(af->c, "\0\0\0\1\5", 5);
+        }
+        sfree(q);
     }
-
-    sshfwd_write(af->c, reply, replylen);
 }
 
 static void agentf_callback(void *vctx, void *reply, int replylen);
@@ -42,15 +101,6 @@ static void agentf_try_forward(agentf *af)
     size_t datalen, length;
     strbuf *message;
     unsigned char msglen[4];
-    void *reply;
-    int replylen;
-
-    /*
-     * Don't try to parallelise agent requests. Wait for each one to
-     * return before attempting the next.
-     */
-    if (af->pending)
-        return;
 
     /*
      * If the outgoing side of the channel connection is currently
@@ -60,10 +110,15 @@ static void agentf_try_forward(agentf *af)
      * remote client, and encouraging it to read our responses before
      * sending too many more requests.
      */
-    if (!af->input_wanted)
-        return;
+    while (af->input_wanted && !af->rejected) {
+        if (af->nqueries >= AGENTF_MAX_QUERIES) {
+            /* Make room in the queue if we can, by sending replies
+             * the agent gave us synchronously */
+            agentf_send_replies(af);
+            if (af->nqueries >= AGENTF_MAX_QUERIES)
+                break;
+        }
 
-    while (1) {
         /*
          * Try to extract a complete message from the input buffer.
          */
@@ -81,11 +136,13 @@ static void agentf_try_forward(agentf *af)
              * of the incoming message, and also close the connection
              * for good measure (which avoids us having to faff about
              * with carefully ignoring just the right number of bytes
-             * from the overlong message).
+             * from the overlong message). The rejection goes on the
+             * end of the queue, after the replies to any requests
+             * still outstanding.
              */
-            agentf_got_response(af, NULL, 0);
-            sshfwd_write_eof(af->c);
-            return;
+            agentf_new_query(af)->answered = true;
+            af->rejected = true;
+            break;
         }
 
         if (length > datalen - 4)
@@ -96,49 +153,51 @@ static void agentf_try_forward(agentf *af)
         message = strbuf_new_for_agent_query();
         bufchain_fetch_consume(
             &af->inbuffer, strbuf_append(message, length), length);
-        af->pending = agent_query(
-            message, &reply, &replylen, agentf_callback, af);
+        agentf_query *q = agentf_new_query(af);
+        q->pending = agent_query(
+            message, &q->reply, &q->replylen, agentf_callback, q);
         strbuf_free(message);
 
-        if (af->pending)
-            return;   /* agent_query promised to reply in due course */
-
         /*
-         * If the agent gave us an answer immediately, pass it
-         * straight on and go round this loop again.
+         * If the agent gave us an answer immediately, mark it as
+         * ready to send. Otherwise agent_query has promised to reply
+         * in due course, and we go on to the next message without
+         * waiting.
          */
-        agentf_got_response(af, reply, replylen);
-        sfree(reply);
+        if (!q->pending)
+            q->answered = true;
     }
 
+    agentf_send_replies(af);
+
     /*
-     * If we get here (i.e. we left the above while loop via 'break'
-     * rather than 'return'), that means we've determined that the
-     * input buffer for the agent forwarding connection doesn't
-     * contain a complete request.
-     *
-     * So if there's potentially more data to come, we can return now,
-     * and wait for the remote client to send it. But if the remote
-     * has sent EOF, it would be a mistake to do that, because we'd be
-     * waiting a long time. So this is the moment to check for EOF,
-     * and respond appropriately.
+     * Once every reply has been sent, check whether there's any more
+     * to come. If we've rejected the input, or the remote has sent
+     * EOF and the input buffer doesn't contain another complete
+     * request, then there isn't, and we should send EOF in turn.
      */
-    if (af->rcvd_eof)
+    if (!af->qhead && !af->sent_eof &&
+        (af->rejected || (af->rcvd_eof && af->input_wanted))) {
         sshfwd_write_eof(af->c);
+        af->sent_eof = true;
+    }
 }
 
 static void agentf_callback(void *vctx, void *reply, int replylen)
 {
-    agentf *af = (agentf *)vctx;
+    agentf_query *q = (agentf_query *)vctx;
 
-    agentf_got_response(af, reply, replylen);
-    sfree(reply);
+    q->pending = NULL;
+    q->answered = true;
+    q->reply = reply;
+    q->replylen = replylen;
 
     /*
-     * Now try to extract and send further messages from the channel's
-     * input-side buffer.
+     * Send this reply if it's next in line (and any that were waiting
+     * behind it), and then try to extract and send further messages
+     * from the channel's input-side buffer.
      */
-    agentf_try_forward(af);
+    agentf_try_forward(q->af);
 }
 
 static void agentf_free(Channel *chan);
@@ -179,8 +238,11 @@ Channel *agentf_new(SshChannel *c)
     af->chan.vt = &agentf_channelvt;
     af->chan.initial_fixed_window_size = 0;
     af->rcvd_eof = false;
+    af->rejected = false;
+    af->sent_eof = false;
     bufchain_init(&af->inbuffer);
-    af->pending = NULL;
+    af->qhead = af->qtail = NULL;
+    af->nqueries = 0;
     af->input_wanted = true;
     return &af->chan;
 }
@@ -190,8 +252,14 @@ static void agentf_free(Channel *chan)
     assert(chan->vt == &agentf_channelvt);
     agentf *af = container_of(chan, agentf, chan);
 
-    if (af->pending)
-        agent_cancel_query(af->pending);
+    while (af->qhead) {
+        agentf_query *q = af->qhead;
+        af->qhead = q->next;
+        if (q->pending)
+            agent_cancel_query(q->pending);
+        sfree(q->reply);
+        sfree(q);
+    }
     bufchain_clear(&af->inbuffer);
     sfree(af);
 }
@@ -206,13 +274,14 @@ static size_t agentf_send(Channel *chan, bool is_stderr,
 
     /*
      * We exert back-pressure on an agent forwarding client if and
-     * only if we're waiting for the response to an asynchronous agent
-     * request. This prevents the client running out of window while
-     * receiving the _first_ message, but means that if any message
-     * takes time to process, the client will be discouraged from
-     * sending an endless stream of further ones after it.
+     * only if we already have as many requests outstanding to the
+     * real agent as we're prepared to. This prevents the client
+     * running out of window while receiving a message, but means
+     * that if the agent is slow to answer, the client will be
+     * discouraged from sending an endless stream of further ones.
      */
-    return (af->pending ? bufchain_size(&af->inbuffer) : 0);
+    return (af->nqueries >= AGENTF_MAX_QUERIES ?
+            bufchain_size(&af->inbuffer) : 0);
 }
 
 static void agentf_send_eof(Channel *chan)
@@ -97,10 +97,16 @@ bool ssh2_bpp_check_unimplemented(BinaryPacketProtocol *bpp, PktIn *pktin);
  * The limit is sticky: once 'running' has flipped to false,
  * 'remaining' is no longer decremented, so it shouldn't dangerously
  * wrap round.
+ *
+ * Separately, 'total' counts everything ever passed to dts_consume(),
+ * whether or not there's a limit, and is never reset. It's only there
+ * to tell whether any data has gone past since it was last looked at,
+ * so it's allowed to wrap round, and should only be compared for
+ * equality.
  */
 struct DataTransferStatsDirection {
     bool running, expired;
-    unsigned long remaining;
+    unsigned long remaining, total;
 };
 struct DataTransferStats {
     struct DataTransferStatsDirection in, out;
@@ -108,6 +114,7 @@ struct DataTransferStats {
 static inline void dts_consume(struct DataTransferStatsDirection *s,
                                unsigned long size_consumed)
 {
+    s->total += size_consumed;
     if (s->running) {
         if (s->remaining <= size_consumed) {
             s->running = false;
@@ -139,7 +146,7 @@ void ssh2_bpp_new_outgoing_crypto(
     const ssh_cipheralg *cipher, const void *ckey, const void *iv,
     const ssh2_macalg *mac, bool etm_mode, const void *mac_key,
     const ssh_compression_alg *compression, bool delayed_compression,
-    bool reset_sequence_number);
+    int compression_level, bool reset_sequence_number);
 void ssh2_bpp_new_incoming_crypto(
     BinaryPacketProtocol *bpp,
     const ssh_cipheralg *cipher, const void *ckey, const void *iv,
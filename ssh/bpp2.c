@@ -15,6 +15,7 @@ struct ssh2_bpp_direction {
     ssh2_mac *mac;
     bool etm_mode;
     const ssh_compression_alg *pending_compression;
+    int compression_level;
 };
 
 struct ssh2_bpp_state {
@@ -107,7 +108,7 @@ void ssh2_bpp_new_outgoing_crypto(
     const ssh_cipheralg *cipher, const void *ckey, const void *iv,
     const ssh2_macalg *mac, bool etm_mode, const void *mac_key,
     const ssh_compression_alg *compression, bool delayed_compression,
-    bool reset_sequence_number)
+    int compression_level, bool reset_sequence_number)
 {
     struct ssh2_bpp_state *s;
     assert(bpp->vt == &ssh2_bpp_vtable);
@@ -154,6 +155,8 @@ void ssh2_bpp_new_outgoing_crypto(
     if (reset_sequence_number)
         s->out.sequence = 0;
 
+    s->out.compression_level = compression_level;
+
     if (delayed_compression && !s->seen_userauth_success) {
         s->out.pending_compression = compression;
         s->out_comp = NULL;
@@ -166,7 +169,7 @@ void ssh2_bpp_new_outgoing_crypto(
         /* 'compression' is always non-NULL, because no compression is
          * indicated by ssh_comp_none. But this setup call may return a
          * null out_comp. */
-        s->out_comp = ssh_compressor_new(compression);
+        s->out_comp = ssh_compressor_new(compression, compression_level);
 
         if (s->out_comp)
             bpp_logevent("Initialised %s compression",
@@ -264,7 +267,8 @@ static void ssh2_bpp_enable_pending_compression(struct ssh2_bpp_state *s)
         s->in.pending_compression = NULL;
     }
     if (s->out.pending_compression) {
-        s->out_comp = ssh_compressor_new(s->out.pending_compression);
+        s->out_comp = ssh_compressor_new(s->out.pending_compression,
+                                         s->out.compression_level);
         bpp_logevent("Initialised delayed %s compression",
                      ssh_compressor_alg(s->out_comp)->text_name);
         s->out.pending_compression = NULL;
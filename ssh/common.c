@@ -265,6 +265,11 @@ static void ssh_pkt_adddata(PktOut *pkt, const void *data, int len)
     pkt->qnode.formal_size = pkt->length;
 }
 
+void ssh_pkt_reserve(PktOut *pkt, size_t len)
+{
+    sgrowarrayn_nm(pkt->data, pkt->maxlen, pkt->length, len);
+}
+
 static void ssh_pkt_BinarySink_write(BinarySink *bs,
                                      const void *data, size_t len)
 {
@@ -310,6 +310,7 @@ SshChannel *ssh2_session_open(ConnectionLayer *cl, Channel *chan)
     c->connlayer = s;
     ssh2_channel_init(c);
     c->halfopen = true;
+    c->interactive = true;
     c->chan = chan;
 
     ppl_logevent("Opening main session channel");
@@ -29,8 +29,10 @@ static ChanopenResult chan_open_session(
     PacketProtocolLayer *ppl = &s->ppl; /* for ppl_logevent */
 
     ppl_logevent("Opened session channel");
-    CHANOPEN_RETURN_SUCCESS(sesschan_new(sc, s->ppl.logctx,
-                                         s->sftpserver_vt, s->ssc));
+    /* The server's end of the user's session, so its output gets the
+     * same priority as the client's main channel gives its input */
+    CHANOPEN_RETURN_INTERACTIVE(sesschan_new(sc, s->ppl.logctx,
+                                             s->sftpserver_vt, s->ssc));
 }
 
 static ChanopenResult chan_open_direct_tcpip(
@@ -3,6 +3,7 @@
  */
 
 #include <assert.h>
+#include <limits.h>
 
 #include "putty.h"
 #include "ssh.h"
@@ -159,6 +160,9 @@ static void ssh2_channel_check_close(struct ssh2_channel *c);
 static void ssh2_channel_try_eof(struct ssh2_channel *c);
 static void ssh2_set_window(struct ssh2_channel *c, int newwin);
 static size_t ssh2_try_send(struct ssh2_channel *c);
+static void ssh2_sched_add(struct ssh2_channel *c);
+static void ssh2_sched_remove(struct ssh2_channel *c);
+static void ssh2_connection_sched(void *vctx);
 static void ssh2_try_send_and_unthrottle(struct ssh2_channel *c);
 static void ssh2_channel_check_throttle(struct ssh2_channel *c);
 static void ssh2_channel_close_local(struct ssh2_channel *c,
@@ -221,6 +225,7 @@ struct outstanding_channel_request {
 
 static void ssh2_channel_free(struct ssh2_channel *c)
 {
+    ssh2_sched_remove(c);
     bufchain_clear(&c->outbuffer);
     bufchain_clear(&c->errbuffer);
     while (c->chanreq_head) {
@@ -260,10 +265,28 @@ PacketProtocolLayer *ssh2_connection_new(
      */
     s->persistent = conf_get_bool(s->conf, CONF_ssh_no_shell);
 
+    /*
+     * But if we have no port forwardings either, then our only
+     * purpose is to be a connection-sharing upstream, and if the
+     * user has asked for that to persist for a limited time, we
+     * close once we've been unused for that long.
+     */
+    if (s->persistent &&
+        conf_get_bool(s->conf, CONF_ssh_connection_sharing) &&
+        !conf_get_str_nthstrkey(s->conf, CONF_portfwd, 0)) {
+        int secs = conf_get_int(s->conf, CONF_ssh_connection_sharing_persist);
+        if (secs > INT_MAX / TICKSPERSEC)
+            secs = INT_MAX / TICKSPERSEC;
+        if (secs > 0)
+            s->persist_ticks = secs * TICKSPERSEC;
+    }
+
     s->connshare = connshare;
     s->peer_verstring = dupstr(peer_verstring);
 
     s->channels = newtree234(ssh2_channelcmp);
+    s->ic_sched.fn = ssh2_connection_sched;
+    s->ic_sched.ctx = s;
 
     s->x11authtree = newtree234(x11_authcmp);
 
@@ -318,6 +341,7 @@ static void ssh2_connection_free(PacketProtocolLayer *ppl)
         free_prompts(s->antispoof_prompt);
 
     delete_callbacks_for_context(s);
+    expire_timer_context(s);
 
     sfree(s);
 }
@@ -425,6 +449,8 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
             } else {
                 c->chan = chanopen_result.u.success.channel;
                 ssh2_channel_init(c);
+                if (chanopen_result.u.success.interactive)
+                    c->interactive = true;
                 c->remwindow = winsize;
                 c->remmaxpkt = pktsize;
                 if (c->remmaxpkt > s->ppl.bpp->vt->packet_size_limit)
@@ -1021,6 +1047,16 @@ static void ssh2_connection_process_queue(PacketProtocolLayer *ppl)
         s->ssh_is_simple, &s->mainchan_sc);
     s->started = true;
 
+    if (!s->mainchan) {
+        /*
+         * With no main channel, the session is as ready as it's
+         * going to get. Start the idle timer, if we have one, in case
+         * no downstream ever turns up.
+         */
+        seat_notify_session_started(s->ppl.seat);
+        ssh2_check_termination(s);
+    }
+
     /*
      * Transfer data!
      */
@@ -1106,41 +1142,73 @@ static void ssh2_channel_try_eof(struct ssh2_channel *c)
     ssh2_channel_check_close(c);
 }
 
+/*
+ * Send up to 'limit' bytes of a channel's buffered outgoing data, as
+ * far as its window permits. Returns the number of bytes sent.
+ */
+static size_t ssh2_channel_send_data(struct ssh2_channel *c, size_t limit)
+{
+    struct ssh2_connection_state *s = c->connlayer;
+    PktOut *pktout;
+    size_t sent = 0;
+
+    if (c->remwindow > 0 && limit > 0 &&
+        (bufchain_size(&c->outbuffer) > 0 ||
+         bufchain_size(&c->errbuffer) > 0)) {
+        unsigned long now = GETTICKCOUNT(), wait = now - c->queued_since;
+        c->sendwait_count++;
+        c->sendwait_total += wait;
+        if (c->sendwait_max < wait)
+            c->sendwait_max = wait;
+        /* Anything left over is counted as waiting from now on */
+        c->queued_since = now;
+    }
+
+    while (c->remwindow > 0 && sent < limit &&
+           (bufchain_size(&c->outbuffer) > 0 ||
+            bufchain_size(&c->errbuffer) > 0)) {
+        bufchain *buf = (bufchain_size(&c->errbuffer) > 0 ?
+                         &c->errbuffer : &c->outbuffer);
+
+        ptrlen data = bufchain_prefix(buf);
+        if (data.len > c->remwindow)
+            data.len = c->remwindow;
+        if (data.len > c->remmaxpkt)
+            data.len = c->remmaxpkt;
+        if (data.len > limit - sent)
+            data.len = limit - sent;
+        if (buf == &c->errbuffer) {
+            pktout = ssh_bpp_new_pktout(
+                s->ppl.bpp, SSH2_MSG_CHANNEL_EXTENDED_DATA);
+            put_uint32(pktout, c->remoteid);
+            put_uint32(pktout, SSH2_EXTENDED_DATA_STDERR);
+        } else {
+            pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_CHANNEL_DATA);
+            put_uint32(pktout, c->remoteid);
+        }
+        put_stringpl(pktout, data);
+        pq_push(s->ppl.out_pq, pktout);
+        bufchain_consume(buf, data.len);
+        c->remwindow -= data.len;
+        sent += data.len;
+    }
+
+    return sent;
+}
+
 /*
  * Attempt to send data on an SSH-2 channel.
  */
 static size_t ssh2_try_send(struct ssh2_channel *c)
 {
     struct ssh2_connection_state *s = c->connlayer;
-    PktOut *pktout;
     size_t bufsize;
 
     if (!c->halfopen) {
-        while (c->remwindow > 0 &&
-               (bufchain_size(&c->outbuffer) > 0 ||
-                bufchain_size(&c->errbuffer) > 0)) {
-            bufchain *buf = (bufchain_size(&c->errbuffer) > 0 ?
-                             &c->errbuffer : &c->outbuffer);
-
-            ptrlen data = bufchain_prefix(buf);
-            if (data.len > c->remwindow)
-                data.len = c->remwindow;
-            if (data.len > c->remmaxpkt)
-                data.len = c->remmaxpkt;
-            if (buf == &c->errbuffer) {
-                pktout = ssh_bpp_new_pktout(
-                    s->ppl.bpp, SSH2_MSG_CHANNEL_EXTENDED_DATA);
-                put_uint32(pktout, c->remoteid);
-                put_uint32(pktout, SSH2_EXTENDED_DATA_STDERR);
-            } else {
-                pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_CHANNEL_DATA);
-                put_uint32(pktout, c->remoteid);
-            }
-            put_stringpl(pktout, data);
-            pq_push(s->ppl.out_pq, pktout);
-            bufchain_consume(buf, data.len);
-            c->remwindow -= data.len;
-        }
+        if (c->interactive)
+            ssh2_channel_send_data(c, SIZE_MAX);
+        else if (c->remwindow > 0)
+            ssh2_sched_add(c);
     }
 
     /*
@@ -1149,6 +1217,18 @@ static size_t ssh2_try_send(struct ssh2_channel *c)
      */
     bufsize = bufchain_size(&c->outbuffer) + bufchain_size(&c->errbuffer);
 
+    /*
+     * If a non-interactive channel has built up a lot of data waiting
+     * for its turn, ask whatever is feeding it to stop for the moment.
+     * ssh2_connection_sched will unthrottle it again (via
+     * ssh2_try_send_and_unthrottle) once the buffer is empty.
+     */
+    if (!c->interactive && bufsize > SSH_MAX_BACKLOG &&
+        !c->throttled_by_backlog) {
+        c->throttled_by_backlog = true;
+        ssh2_channel_check_throttle(c);
+    }
+
     /*
      * And if there's no data pending but we need to send an EOF, send
      * it.
@@ -1160,6 +1240,98 @@ static size_t ssh2_try_send(struct ssh2_channel *c)
     return bufsize;
 }
 
+/*
+ * Outgoing data on non-interactive channels is sent by a round-robin
+ * scheduler, running as a toplevel callback. Each time it runs, it
+ * gives each waiting channel one quantum's worth of data, and then
+ * lets the event loop go round (so that the transport layer and the
+ * network can get on with sending it, and any interactive data that
+ * turns up in the meantime goes out ahead of the next round) before
+ * doing another. It stops altogether while the SSH socket is backed
+ * up, and ssh2_throttle_all_channels starts it again.
+ *
+ * This is deficit round robin in principle, but since channel data
+ * can be split into packets at any byte boundary, no channel ever
+ * has unused allowance to carry over to the next round, so there's
+ * no need to store a deficit counter.
+ */
+#define SSH2_SCHED_QUANTUM 0x8000
+
+static void ssh2_sched_add(struct ssh2_channel *c)
+{
+    struct ssh2_connection_state *s = c->connlayer;
+
+    if (c->scheduled ||
+        (bufchain_size(&c->outbuffer) == 0 &&
+         bufchain_size(&c->errbuffer) == 0))
+        return;
+
+    c->scheduled = true;
+    c->sched_next = NULL;
+    if (s->sched_tail)
+        s->sched_tail->sched_next = c;
+    else
+        s->sched_head = c;
+    s->sched_tail = c;
+
+    if (!s->all_channels_throttled)
+        queue_idempotent_callback(&s->ic_sched);
+}
+
+static void ssh2_sched_remove(struct ssh2_channel *c)
+{
+    struct ssh2_connection_state *s = c->connlayer;
+    struct ssh2_channel **pp, *prev = NULL;
+
+    if (!c->scheduled)
+        return;
+
+    for (pp = &s->sched_head; *pp != c; pp = &(*pp)->sched_next)
+        prev = *pp;
+    *pp = c->sched_next;
+    if (s->sched_tail == c)
+        s->sched_tail = prev;
+    c->scheduled = false;
+}
+
+static void ssh2_connection_sched(void *vctx)
+{
+    struct ssh2_connection_state *s = (struct ssh2_connection_state *)vctx;
+    struct ssh2_channel *c;
+    size_t nturns = 0;
+
+    if (s->all_channels_throttled)
+        return;
+
+    /*
+     * Give everything currently on the list one turn. We count the
+     * turns rather than watching for the current tail to come round,
+     * because a channel's turn can close and free other channels,
+     * including that one.
+     */
+    for (c = s->sched_head; c; c = c->sched_next)
+        nturns++;
+
+    while (nturns-- > 0 && (c = s->sched_head) != NULL) {
+        ssh2_sched_remove(c);
+
+        ssh2_channel_send_data(c, SSH2_SCHED_QUANTUM);
+
+        if (bufchain_size(&c->outbuffer) == 0 &&
+            bufchain_size(&c->errbuffer) == 0) {
+            /* This may send EOF, and even free the channel */
+            ssh2_try_send_and_unthrottle(c);
+        } else if (c->remwindow > 0) {
+            ssh2_sched_add(c);
+        }
+        /* Otherwise, wait for WINDOW_ADJUST to call ssh2_try_send */
+    }
+
+    if (s->sched_head)
+        queue_idempotent_callback(&s->ic_sched);
+    ssh_sendbuffer_changed(s->ppl.ssh);
+}
+
 static void ssh2_try_send_and_unthrottle(struct ssh2_channel *c)
 {
     int bufsize;
@@ -1209,6 +1381,16 @@ static void ssh2_channel_close_local(struct ssh2_channel *c,
 
     sfree(msg);
 
+    if (c->sendwait_max > 0) {
+        ppl_logevent("Outgoing data on %s channel %u waited up to %lu ms "
+                     "to be sent (mean %lu ms)",
+                     c->interactive ? "interactive" : "bulk", c->localid,
+                     c->sendwait_max * 1000 / TICKSPERSEC,
+                     c->sendwait_total * 1000 / TICKSPERSEC /
+                     c->sendwait_count);
+        c->sendwait_max = 0;
+    }
+
     chan_free(c->chan);
     c->chan = zombiechan_new();
 }
@@ -1238,6 +1420,23 @@ static void ssh2_channel_destroy(struct ssh2_channel *c)
     queue_toplevel_callback(ssh2_check_termination_callback, s);
 }
 
+static bool ssh2_connection_idle(struct ssh2_connection_state *s)
+{
+    return (count234(s->channels) == 0 &&
+            !(s->connshare && share_ndownstreams(s->connshare) > 0));
+}
+
+static void ssh2_persist_timeout(void *ctx, unsigned long now)
+{
+    struct ssh2_connection_state *s = (struct ssh2_connection_state *)ctx;
+
+    if (now != s->persist_timer || !ssh2_connection_idle(s))
+        return;                /* superseded, or in use again */
+
+    ssh_user_close(s->ppl.ssh, "Shared connection unused for %d seconds",
+                   s->persist_ticks / TICKSPERSEC);
+}
+
 static void ssh2_check_termination(struct ssh2_connection_state *s)
 {
     /*
@@ -1246,8 +1445,14 @@ static void ssh2_check_termination(struct ssh2_connection_state *s)
      * policy is that we terminate when none of either is left.
      */
 
-    if (s->persistent)
-        return;     /* persistent mode: never proactively terminate */
+    if (s->persistent) {
+        /* persistent mode: never proactively terminate, except via
+         * the idle timeout if there is one */
+        if (s->persist_ticks && s->started && ssh2_connection_idle(s))
+            s->persist_timer = schedule_timer(
+                s->persist_ticks, ssh2_persist_timeout, s);
+        return;
+    }
 
     if (!s->started) {
         /* At startup, we don't have any channels open because we
@@ -1258,8 +1463,7 @@ static void ssh2_check_termination(struct ssh2_connection_state *s)
         return;
     }
 
-    if (count234(s->channels) == 0 &&
-        !(s->connshare && share_ndownstreams(s->connshare) > 0)) {
+    if (ssh2_connection_idle(s)) {
         /*
          * We used to send SSH_MSG_DISCONNECT here, because I'd
          * believed that _every_ conforming SSH-2 connection had to
@@ -1286,6 +1490,10 @@ void ssh2_channel_init(struct ssh2_channel *c)
     c->pending_eof = false;
     c->throttling_conn = false;
     c->throttled_by_backlog = false;
+    c->interactive = s->ssh_is_simple; /* only one channel anyway */
+    c->scheduled = false;
+    c->sched_next = NULL;
+    c->sendwait_count = c->sendwait_total = c->sendwait_max = 0;
     c->sharectx = NULL;
     c->locwindow = c->locmaxwin = c->remlocwin =
         s->ssh_is_simple ? OUR_V2_BIGWIN : OUR_V2_WINSIZE;
@@ -1407,6 +1615,9 @@ static size_t ssh2channel_write(
 {
     struct ssh2_channel *c = container_of(sc, struct ssh2_channel, sc);
     assert(!(c->closes & CLOSES_SENT_EOF));
+    if (bufchain_size(&c->outbuffer) == 0 &&
+        bufchain_size(&c->errbuffer) == 0)
+        c->queued_since = GETTICKCOUNT();
     bufchain_add(is_stderr ? &c->errbuffer : &c->outbuffer, buf, len);
     return ssh2_try_send(c);
 }
@@ -1574,6 +1785,9 @@ static void ssh2_send_packet_from_downstream(
     PktOut *pkt = ssh_bpp_new_pktout(s->ppl.bpp, type);
     pkt->downstream_id = id;
     pkt->additional_log_text = additional_log_text;
+    /* Allow for the BPP's padding and MAC as well, so that bulk data
+     * isn't copied again when the packet is finalised */
+    ssh_pkt_reserve(pkt, datalen + 512);
     put_data(pkt, data, datalen);
     pq_push(s->ppl.out_pq, pkt);
 }
@@ -1676,6 +1890,9 @@ static void ssh2_throttle_all_channels(ConnectionLayer *cl, bool throttled)
     for (i = 0; NULL != (c = index234(s->channels, i)); i++)
         if (!c->sharectx)
             ssh2_channel_check_throttle(c);
+
+    if (!throttled && s->sched_head)
+        queue_idempotent_callback(&s->ic_sched);
 }
 
 static bool ssh2_ldisc_option(ConnectionLayer *cl, int option)
@@ -22,11 +22,25 @@ struct ssh2_connection_state {
     bool persistent;
     bool started;
 
+    /*
+     * A persistent connection that exists only to be a sharing
+     * upstream closes once it has been idle for persist_ticks.
+     */
+    int persist_ticks;
+    unsigned long persist_timer;
+
     Conf *conf;
 
     tree234 *channels;                 /* indexed by local id */
     bool all_channels_throttled;
 
+    /*
+     * Non-interactive channels with outgoing data waiting for
+     * ssh2_connection_sched to send it, in round-robin order.
+     */
+    struct ssh2_channel *sched_head, *sched_tail;
+    IdempotentCallback ic_sched;
+
     bool X11_fwd_enabled;
     tree234 *x11authtree;
 
@@ -101,6 +115,25 @@ struct ssh2_channel {
 
     bufchain outbuffer, errbuffer;
     unsigned remwindow, remmaxpkt;
+
+    /*
+     * An interactive channel (a session channel, at either end of
+     * the connection) sends its outgoing data as soon as it has
+     * window to do it. Any other channel goes on the connection
+     * layer's round-robin list, and is sent a limited amount at a
+     * time, so that a bulk transfer can't put a lot of data in the
+     * lower layers' queues ahead of the user's keystrokes.
+     */
+    bool interactive;
+    bool scheduled;                    /* if on the round-robin list */
+    struct ssh2_channel *sched_next;
+
+    /*
+     * Statistics on how long outgoing data waited in outbuffer or
+     * errbuffer before we could send it, in ticks.
+     */
+    unsigned long queued_since;
+    unsigned long sendwait_count, sendwait_total, sendwait_max;
     /* locwindow is signed so we can cope with excess data. */
     int locwindow, locmaxwin;
     /*
@@ -147,6 +180,7 @@ typedef struct ChanopenResult {
         } failure;
         struct {
             Channel *channel;
+            bool interactive;          /* send data ahead of bulk channels */
         } success;
         struct {
             ssh_sharing_connstate *share_ctx;
@@ -213,6 +247,16 @@ void ssh2channel_send_terminal_size_change(SshChannel *c, int w, int h);
         ChanopenResult toret;                           \
         toret.outcome = CHANOPEN_RESULT_SUCCESS;        \
         toret.u.success.channel = chan;                 \
+        toret.u.success.interactive = false;            \
+        return toret;                                   \
+    } while (0)
+
+#define CHANOPEN_RETURN_INTERACTIVE(chan) do            \
+    {                                                   \
+        ChanopenResult toret;                           \
+        toret.outcome = CHANOPEN_RESULT_SUCCESS;        \
+        toret.u.success.channel = chan;                 \
+        toret.u.success.interactive = true;             \
         return toret;                                   \
     } while (0)
 
@@ -45,6 +45,8 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
         if (s->nbits > s->kex_alg->hash->hlen * 8)
             s->nbits = s->kex_alg->hash->hlen * 8;
 
+        s->e = NULL;
+
         /*
          * If we're doing Diffie-Hellman group exchange, start by
          * requesting a group.
@@ -103,7 +105,16 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
                          ssh_hash_alg(s->exhash)->text_name);
         } else {
             s->ppl.bpp->pls->kctx = SSH2_PKTCTX_DHGROUP;
-            s->dh_ctx = dh_setup_group(s->kex_alg);
+            if (s->spare_dh_ctx && s->spare_kex_alg == s->kex_alg) {
+                /* Use the key we generated in advance (see
+                 * ssh2_transport_idle_timer) */
+                s->dh_ctx = s->spare_dh_ctx;
+                s->e = s->spare_dh_e;
+                s->spare_dh_ctx = NULL;
+                s->spare_dh_e = NULL;
+            } else {
+                s->dh_ctx = dh_setup_group(s->kex_alg);
+            }
             s->kex_init_value = SSH2_MSG_KEXDH_INIT;
             s->kex_reply_value = SSH2_MSG_KEXDH_REPLY;
 
@@ -118,7 +129,8 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
          * Now generate and send e for Diffie-Hellman.
          */
         seat_set_busy_status(s->ppl.seat, BUSY_CPU);
-        s->e = dh_create_e(s->dh_ctx);
+        if (!s->e)
+            s->e = dh_create_e(s->dh_ctx);
         pktout = ssh_bpp_new_pktout(s->ppl.bpp, s->kex_init_value);
         put_mp_ssh2(pktout, s->e);
         pq_push(s->ppl.out_pq, pktout);
@@ -192,16 +204,28 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
 
         s->ppl.bpp->pls->kctx = s->kex_alg->ecdh_vt->packet_naming_ctx;
 
-        s->ecdh_key = ecdh_key_new(s->kex_alg, false);
+        if (s->guess_ecdh_key) {
+            /* We already sent our KEX_ECDH_INIT as a guess along
+             * with our KEXINIT, and the server has accepted it */
+            s->ecdh_key = s->guess_ecdh_key;
+            s->guess_ecdh_key = NULL;
+        } else {
+            if (s->spare_ecdh_key && s->spare_kex_alg == s->kex_alg) {
+                s->ecdh_key = s->spare_ecdh_key;
+                s->spare_ecdh_key = NULL;
+            } else {
+                s->ecdh_key = ecdh_key_new(s->kex_alg, false);
+            }
 
-        pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_KEX_ECDH_INIT);
-        {
-            strbuf *pubpoint = strbuf_new();
-            ecdh_key_getpublic(s->ecdh_key, BinarySink_UPCAST(pubpoint));
-            put_stringsb(pktout, pubpoint);
-        }
+            pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_KEX_ECDH_INIT);
+            {
+                strbuf *pubpoint = strbuf_new();
+                ecdh_key_getpublic(s->ecdh_key, BinarySink_UPCAST(pubpoint));
+                put_stringsb(pktout, pubpoint);
+            }
 
-        pq_push(s->ppl.out_pq, pktout);
+            pq_push(s->ppl.out_pq, pktout);
+        }
 
         crMaybeWaitUntilV((pktin = ssh2_transport_pop(s)) != NULL);
         if (pktin->type != SSH2_MSG_KEX_ECDH_REPLY) {
@@ -893,6 +917,8 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
                 }
             }
 
+            ssh_setup_phase_done(s->ppl.ssh, SSH_PHASE_KEX);
+
             ssh2_userkey uk = { .key = s->hkey, .comment = NULL };
             char **fingerprints = ssh2_all_fingerprints(s->hkey);
 
@@ -1004,6 +1030,7 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
             }
 
           host_key_ok:
+            ssh_setup_phase_done(s->ppl.ssh, SSH_PHASE_HOSTKEY);
 
             /*
              * Save this host key, to check against the one presented in
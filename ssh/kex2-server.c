@@ -25,15 +25,68 @@ void ssh2_transport_provide_hostkeys(PacketProtocolLayer *ppl,
     s->nhostkeys = nhostkeys;
 }
 
-static strbuf *finalise_and_sign_exhash(struct ssh2_transport_state *s)
+/*
+ * Signing the exchange hash can be the slowest part of the whole key
+ * exchange, with a big RSA host key. So if the key type allows it, we
+ * do it on a worker thread, leaving the event loop free to get on
+ * with other connections in the meantime. Either way, the signature
+ * ends up in s->exhash_signature, and the kex coroutine waits for it
+ * to appear.
+ */
+static void exhash_sign_work(void *vctx)
 {
-    strbuf *sb;
+    ssh2_exhash_sign_job *job = (ssh2_exhash_sign_job *)vctx;
+    ssh_key_sign(job->key, ptrlen_from_strbuf(job->data), job->flags,
+                 BinarySink_UPCAST(job->signature));
+}
+
+static void exhash_sign_done(void *vctx)
+{
+    ssh2_exhash_sign_job *job = (ssh2_exhash_sign_job *)vctx;
+    struct ssh2_transport_state *s = job->s;
+
+    strbuf_free(job->data);
+    if (s) {
+        s->exhash_sign_job = NULL;
+        s->exhash_signature = job->signature;
+        queue_idempotent_callback(&s->ppl.ic_process_queue);
+    } else {
+        strbuf_free(job->signature);
+    }
+    sfree(job);
+}
+
+static void finalise_and_sign_exhash(struct ssh2_transport_state *s)
+{
+    ptrlen exhash;
+
     ssh2transport_finalise_exhash(s);
-    sb = strbuf_new();
-    ssh_key_sign(
-        s->hkey, make_ptrlen(s->exchange_hash, s->kex_alg->hash->hlen),
-        s->hkflags, BinarySink_UPCAST(sb));
-    return sb;
+    exhash = make_ptrlen(s->exchange_hash, s->kex_alg->hash->hlen);
+
+    if (!ssh_key_alg(ssh_key_base_key(s->hkey))->thread_safe_sign) {
+        s->exhash_signature = strbuf_new();
+        ssh_key_sign(s->hkey, exhash, s->hkflags,
+                     BinarySink_UPCAST(s->exhash_signature));
+        return;
+    }
+
+    prepare_thread_safe_sign();
+
+    ssh2_exhash_sign_job *job = snew(ssh2_exhash_sign_job);
+    job->s = s;
+    job->key = s->hkey;
+    job->flags = s->hkflags;
+    job->data = strbuf_dup(exhash);
+    job->signature = strbuf_new();
+    s->exhash_sign_job = job;
+    run_in_background(exhash_sign_work, exhash_sign_done, job);
+}
+
+static void put_exhash_signature(struct ssh2_transport_state *s,
+                                 PktOut *pktout)
+{
+    put_stringsb(pktout, s->exhash_signature);
+    s->exhash_signature = NULL;
 }
 
 void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
@@ -177,10 +230,13 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
         put_mp_ssh2(s->exhash, s->f);
         put_mp_ssh2(s->exhash, s->e);
 
+        finalise_and_sign_exhash(s);
+        crMaybeWaitUntilV(s->exhash_signature);
+
         pktout = ssh_bpp_new_pktout(s->ppl.bpp, s->kex_reply_value);
         put_stringpl(pktout, s->hostkeydata);
         put_mp_ssh2(pktout, s->e);
-        put_stringsb(pktout, finalise_and_sign_exhash(s));
+        put_exhash_signature(s, pktout);
         pq_push(s->ppl.out_pq, pktout);
 
         dh_cleanup(s->dh_ctx);
@@ -229,15 +285,23 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
             }
         }
 
+        {
+            strbuf *pubpoint = strbuf_new();
+            ecdh_key_getpublic(s->ecdh_key, BinarySink_UPCAST(pubpoint));
+            put_stringsb(s->exhash, pubpoint);
+        }
+
+        finalise_and_sign_exhash(s);
+        crMaybeWaitUntilV(s->exhash_signature);
+
         pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_KEX_ECDH_REPLY);
         put_stringpl(pktout, s->hostkeydata);
         {
             strbuf *pubpoint = strbuf_new();
             ecdh_key_getpublic(s->ecdh_key, BinarySink_UPCAST(pubpoint));
-            put_string(s->exhash, pubpoint->u, pubpoint->len);
             put_stringsb(pktout, pubpoint);
         }
-        put_stringsb(pktout, finalise_and_sign_exhash(s));
+        put_exhash_signature(s, pktout);
         pq_push(s->ppl.out_pq, pktout);
 
         ecdh_key_free(s->ecdh_key);
@@ -328,8 +392,11 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
         s->rsa_kex_key = NULL;
         s->rsa_kex_key_needs_freeing = false;
 
+        finalise_and_sign_exhash(s);
+        crMaybeWaitUntilV(s->exhash_signature);
+
         pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_KEXRSA_DONE);
-        put_stringsb(pktout, finalise_and_sign_exhash(s));
+        put_exhash_signature(s, pktout);
         pq_push(s->ppl.out_pq, pktout);
     }
 
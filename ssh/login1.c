@@ -234,6 +234,8 @@ static void ssh1_login_process_queue(PacketProtocolLayer *ppl)
 
     s->rsabuf = snewn(s->len, unsigned char);
 
+    ssh_setup_phase_done(s->ppl.ssh, SSH_PHASE_KEX);
+
     /*
      * Verify the host key.
      */
@@ -261,6 +263,7 @@ static void ssh1_login_process_queue(PacketProtocolLayer *ppl)
         ssh_spr_close(s->ppl.ssh, s->spr, "host key verification");
         return;
     }
+    ssh_setup_phase_done(s->ppl.ssh, SSH_PHASE_HOSTKEY);
 
     for (i = 0; i < 32; i++) {
         s->rsabuf[i] = s->session_key[i];
@@ -1089,6 +1092,7 @@ static void ssh1_login_process_queue(PacketProtocolLayer *ppl)
     }
 
     ppl_logevent("Authentication successful");
+    ssh_setup_phase_done(s->ppl.ssh, SSH_PHASE_AUTH);
 
     if (conf_get_bool(s->conf, CONF_compression)) {
         ppl_logevent("Requesting compression");
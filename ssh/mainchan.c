@@ -324,6 +324,7 @@ static void mainchan_request_response(Channel *chan, bool success)
 static void mainchan_ready(mainchan *mc)
 {
     mc->ready = true;
+    ssh_setup_phase_done(mc->ppl->ssh, SSH_PHASE_CHANNEL);
 
     ssh_set_wants_user_input(mc->cl, true);
     ssh_got_user_input(mc->cl); /* in case any is already queued */
@@ -501,6 +501,14 @@ void portfwd_raw_setup(Channel *pfchan, Socket *s, SshChannel *sc)
     pf->c = sc;
 }
 
+Socket *portfwd_raw_socket(Channel *pfchan)
+{
+    struct PortForwarding *pf;
+    assert(pfchan->vt == &PortForwarding_channelvt);
+    pf = container_of(pfchan, struct PortForwarding, chan);
+    return pf->s;
+}
+
 /*
  * called when someone connects to the local port
  */
@@ -682,6 +690,7 @@ static void pfd_open_failure(Channel *chan, const char *errtext)
 
 struct PortFwdRecord {
     enum { DESTROY, KEEP, CREATE } status;
+    int refcount;          /* how many CONF_portfwd entries describe this */
     int type;
     unsigned sport, dport;
     char *saddr, *daddr;
@@ -738,6 +747,7 @@ struct PortFwdManager {
     ConnectionLayer *cl;
     Conf *conf;
     tree234 *forwardings;
+    bool rescan;       /* a forwarding has gone that Conf still wants */
 };
 
 PortFwdManager *portfwdmgr_new(ConnectionLayer *cl)
@@ -747,6 +757,7 @@ PortFwdManager *portfwdmgr_new(ConnectionLayer *cl)
     mgr->cl = cl;
     mgr->conf = NULL;
     mgr->forwardings = newtree234(pfr_cmp);
+    mgr->rescan = false;
 
     return mgr;
 }
@@ -754,8 +765,11 @@ PortFwdManager *portfwdmgr_new(ConnectionLayer *cl)
 void portfwdmgr_close(PortFwdManager *mgr, PortFwdRecord *pfr)
 {
     PortFwdRecord *realpfr = del234(mgr->forwardings, pfr);
-    if (realpfr == pfr)
+    if (realpfr == pfr) {
+        if (pfr->refcount > 0)
+            mgr->rescan = true;
         pfr_free(pfr);
+    }
 }
 
 void portfwdmgr_close_all(PortFwdManager *mgr)
@@ -775,16 +789,346 @@ void portfwdmgr_free(PortFwdManager *mgr)
     sfree(mgr);
 }
 
+/*
+ * Decode one CONF_portfwd entry into a freshly allocated
+ * PortFwdRecord, not yet in any tree. Returns NULL if the entry
+ * doesn't describe a usable forwarding, logging why if 'report' is
+ * set.
+ */
+static PortFwdRecord *pfr_decode(PortFwdManager *mgr, const char *key,
+                                 const char *val, bool report)
+{
+    PortFwdRecord *pfr;
+    const char *kp, *kp2, *vp, *vp2;
+    char address_family, type;
+    int sport, dport, sserv, dserv;
+    const char *sports, *dports;
+    char *saddr, *host;
+
+    kp = key;
+
+    address_family = 'A';
+    type = 'L';
+    if (*kp == 'A' || *kp == '4' || *kp == '6')
+        address_family = *kp++;
+    if (*kp == 'L' || *kp == 'R')
+        type = *kp++;
+
+    if ((kp2 = host_strchr(kp, ':')) != NULL) {
+        /*
+         * There's a colon in the middle of the source port
+         * string, which means that the part before it is
+         * actually a source address.
+         */
+        char *saddr_tmp = dupprintf("%.*s", (int)(kp2 - kp), kp);
+        saddr = host_strduptrim(saddr_tmp);
+        sfree(saddr_tmp);
+        sports = kp2+1;
+    } else {
+        saddr = NULL;
+        sports = kp;
+    }
+    sport = atoi(sports);
+    sserv = 0;
+    if (sport == 0) {
+        sserv = 1;
+        sport = net_service_lookup(sports);
+        if (!sport && report) {
+            logeventf(mgr->cl->logctx, "Service lookup failed for source"
+                      " port \"%s\"", sports);
+        }
+    }
+
+    if (type == 'L' && !strcmp(val, "D")) {
+        /* dynamic forwarding */
+        host = NULL;
+        dports = NULL;
+        dport = -1;
+        dserv = 0;
+        type = 'D';
+    } else {
+        /* ordinary forwarding */
+        vp = val;
+        vp2 = vp + host_strcspn(vp, ":");
+        host = dupprintf("%.*s", (int)(vp2 - vp), vp);
+        if (*vp2)
+            vp2++;
+        dports = vp2;
+        dport = atoi(dports);
+        dserv = 0;
+        if (dport == 0) {
+            dserv = 1;
+            dport = net_service_lookup(dports);
+            if (!dport && report) {
+                logeventf(mgr->cl->logctx,
+                          "Service lookup failed for destination"
+                          " port \"%s\"", dports);
+            }
+        }
+    }
+
+    if (!sport || !dport) {
+        sfree(saddr);
+        sfree(host);
+        return NULL;
+    }
+
+    /* Set up a description of the source port. */
+    pfr = snew(PortFwdRecord);
+    pfr->status = CREATE;
+    pfr->refcount = 0;
+    pfr->type = type;
+    pfr->saddr = saddr;
+    pfr->sserv = sserv ? dupstr(sports) : NULL;
+    pfr->sport = sport;
+    pfr->daddr = host;
+    pfr->dserv = dserv ? dupstr(dports) : NULL;
+    pfr->dport = dport;
+    pfr->local = NULL;
+    pfr->remote = NULL;
+    pfr->addressfamily = (address_family == '4' ? ADDRTYPE_IPV4 :
+                          address_family == '6' ? ADDRTYPE_IPV6 :
+                          ADDRTYPE_UNSPEC);
+    return pfr;
+}
+
+/*
+ * Shut down a forwarding, and remove it from the manager's tree.
+ */
+static void pfr_cancel(PortFwdManager *mgr, PortFwdRecord *pfr)
+{
+    char *message;
+
+    message = dupprintf("%s port forwarding from %s%s%d",
+                        pfr->type == 'L' ? "local" :
+                        pfr->type == 'R' ? "remote" : "dynamic",
+                        pfr->saddr ? pfr->saddr : "",
+                        pfr->saddr ? ":" : "",
+                        pfr->sport);
+
+    if (pfr->type != 'D') {
+        char *msg2 = dupprintf("%s to %s:%d", message,
+                               pfr->daddr, pfr->dport);
+        sfree(message);
+        message = msg2;
+    }
+
+    logeventf(mgr->cl->logctx, "Cancelling %s", message);
+    sfree(message);
+
+    /* pfr->remote or pfr->local may be NULL if setting up a
+     * forwarding failed. */
+    if (pfr->remote) {
+        /*
+         * Cancel the port forwarding at the server
+         * end.
+         *
+         * Actually closing the listening port on the server
+         * side may fail - because in SSH-1 there's no message
+         * in the protocol to request it!
+         *
+         * Instead, we simply remove the record of the
+         * forwarding from our local end, so that any
+         * connections the server tries to make on it are
+         * rejected.
+         */
+        ssh_rportfwd_remove(mgr->cl, pfr->remote);
+        pfr->remote = NULL;
+    } else if (pfr->local) {
+        pfl_terminate(pfr->local);
+        pfr->local = NULL;
+    }
+
+    del234(mgr->forwardings, pfr);
+    pfr_free(pfr);
+}
+
+/*
+ * Start up a forwarding that's just been added to the manager's tree.
+ */
+static void pfr_start(PortFwdManager *mgr, PortFwdRecord *pfr, Conf *conf)
+{
+    char *sportdesc, *dportdesc;
+    sportdesc = dupprintf("%s%s%s%s%d%s",
+                          pfr->saddr ? pfr->saddr : "",
+                          pfr->saddr ? ":" : "",
+                          pfr->sserv ? pfr->sserv : "",
+                          pfr->sserv ? "(" : "",
+                          pfr->sport,
+                          pfr->sserv ? ")" : "");
+    if (pfr->type == 'D') {
+        dportdesc = NULL;
+    } else {
+        dportdesc = dupprintf("%s:%s%s%d%s",
+                              pfr->daddr,
+                              pfr->dserv ? pfr->dserv : "",
+                              pfr->dserv ? "(" : "",
+                              pfr->dport,
+                              pfr->dserv ? ")" : "");
+    }
+
+    pfr->status = KEEP;
+
+    if (pfr->type == 'L') {
+        char *err = pfl_listen(pfr->daddr, pfr->dport,
+                               pfr->saddr, pfr->sport,
+                               mgr->cl, conf, &pfr->local,
+                               pfr->addressfamily);
+
+        logeventf(mgr->cl->logctx,
+                  "Local %sport %s forwarding to %s%s%s",
+                  pfr->addressfamily == ADDRTYPE_IPV4 ? "IPv4 " :
+                  pfr->addressfamily == ADDRTYPE_IPV6 ? "IPv6 " : "",
+                  sportdesc, dportdesc,
+                  err ? " failed: " : "", err ? err : "");
+        if (err)
+            sfree(err);
+    } else if (pfr->type == 'D') {
+        char *err = pfl_listen(NULL, -1, pfr->saddr, pfr->sport,
+                               mgr->cl, conf, &pfr->local,
+                               pfr->addressfamily);
+
+        logeventf(mgr->cl->logctx,
+                  "Local %sport %s SOCKS dynamic forwarding%s%s",
+                  pfr->addressfamily == ADDRTYPE_IPV4 ? "IPv4 " :
+                  pfr->addressfamily == ADDRTYPE_IPV6 ? "IPv6 " : "",
+                  sportdesc,
+                  err ? " failed: " : "", err ? err : "");
+
+        if (err)
+            sfree(err);
+    } else {
+        const char *shost;
+
+        if (pfr->saddr) {
+            shost = pfr->saddr;
+        } else if (conf_get_bool(conf, CONF_rport_acceptall)) {
+            shost = "";
+        } else {
+            shost = "localhost";
+        }
+
+        pfr->remote = ssh_rportfwd_alloc(
+            mgr->cl, shost, pfr->sport, pfr->daddr, pfr->dport,
+            pfr->addressfamily, sportdesc, pfr, NULL);
+
+        if (!pfr->remote) {
+            logeventf(mgr->cl->logctx,
+                      "Duplicate remote port forwarding to %s:%d",
+                      pfr->daddr, pfr->dport);
+            del234(mgr->forwardings, pfr);
+            pfr_free(pfr);
+        } else {
+            logeventf(mgr->cl->logctx, "Requesting remote port %s"
+                      " forward to %s", sportdesc, dportdesc);
+        }
+    }
+    sfree(sportdesc);
+    sfree(dportdesc);
+}
+
+/*
+ * Apply one CONF_portfwd entry that has appeared in the
+ * configuration since we last looked.
+ */
+static void portfwdmgr_add_entry(PortFwdManager *mgr, Conf *conf,
+                                 const char *key, const char *val)
+{
+    PortFwdRecord *pfr = pfr_decode(mgr, key, val, true);
+    if (!pfr)
+        return;
+
+    PortFwdRecord *existing = add234(mgr->forwardings, pfr);
+    if (existing != pfr) {
+        /*
+         * Another entry in the configuration describes the same
+         * forwarding, which we'll silently ignore, apart from
+         * counting it so that we don't cancel the forwarding until
+         * both have gone.
+         */
+        existing->refcount++;
+        pfr_free(pfr);
+    } else {
+        pfr->refcount = 1;
+        pfr_start(mgr, pfr, conf);
+    }
+}
+
+/*
+ * Undo one CONF_portfwd entry that has vanished from the
+ * configuration.
+ */
+static void portfwdmgr_remove_entry(PortFwdManager *mgr,
+                                    const char *key, const char *val)
+{
+    PortFwdRecord *pfr = pfr_decode(mgr, key, val, false);
+    if (!pfr)
+        return;
+
+    /* The forwarding may already have gone, if the server refused it */
+    PortFwdRecord *existing = find234(mgr->forwardings, pfr, NULL);
+    pfr_free(pfr);
+    if (existing && existing->refcount > 0 && --existing->refcount == 0)
+        pfr_cancel(mgr, existing);
+}
+
 void portfwdmgr_config(PortFwdManager *mgr, Conf *conf)
 {
     PortFwdRecord *pfr;
+    Conf *oldconf = mgr->conf;
     int i;
-    char *key, *val;
+    char *key, *val, *oldval;
 
-    if (mgr->conf)
-        conf_free(mgr->conf);
     mgr->conf = conf_copy(conf);
 
+    if (oldconf && !mgr->rescan) {
+        /*
+         * Usually, we only need to look at the entries that have
+         * changed since last time, which we can find by walking the
+         * two Confs in step (they're both sorted by key), without
+         * decoding anything. Cancel the old ones before starting the
+         * new ones, in case a new one wants to reuse a port.
+         */
+        char **changed = NULL;
+        size_t nchanged = 0, changedsize = 0;
+        char *oldkey, *newkey, *newval;
+
+        oldval = conf_get_str_strs(oldconf, CONF_portfwd, NULL, &oldkey);
+        newval = conf_get_str_strs(mgr->conf, CONF_portfwd, NULL, &newkey);
+        while (oldval || newval) {
+            int cmp = !newval ? -1 : !oldval ? +1 : strcmp(oldkey, newkey);
+            bool same = cmp == 0 && !strcmp(oldval, newval);
+            if (cmp <= 0 && !same)
+                portfwdmgr_remove_entry(mgr, oldkey, oldval);
+            if (cmp >= 0 && !same) {
+                sgrowarray(changed, changedsize, nchanged + 1);
+                changed[nchanged++] = newkey;
+                changed[nchanged++] = newval;
+            }
+            if (cmp <= 0)
+                oldval = conf_get_str_strs(oldconf, CONF_portfwd,
+                                           oldkey, &oldkey);
+            if (cmp >= 0)
+                newval = conf_get_str_strs(mgr->conf, CONF_portfwd,
+                                           newkey, &newkey);
+        }
+        for (size_t j = 0; j < nchanged; j += 2)
+            portfwdmgr_add_entry(mgr, conf, changed[j], changed[j+1]);
+
+        sfree(changed);
+        conf_free(oldconf);
+        return;
+    }
+
+    /*
+     * Otherwise, this is the first time, or else a forwarding has
+     * been closed behind our back and we want to give it another
+     * try. So we go through the whole configuration.
+     */
+    if (oldconf)
+        conf_free(oldconf);
+    mgr->rescan = false;
+
     /*
      * Go through the existing port forwardings and tag them
      * with status==DESTROY. Any that we want to keep will be
@@ -792,117 +1136,37 @@ void portfwdmgr_config(PortFwdManager *mgr, Conf *conf)
      * configuration and find out which bits are the same as
      * they were before.
      */
-    for (i = 0; (pfr = index234(mgr->forwardings, i)) != NULL; i++)
+    for (i = 0; (pfr = index234(mgr->forwardings, i)) != NULL; i++) {
         pfr->status = DESTROY;
+        pfr->refcount = 0;
+    }
 
     for (val = conf_get_str_strs(conf, CONF_portfwd, NULL, &key);
          val != NULL;
          val = conf_get_str_strs(conf, CONF_portfwd, key, &key)) {
-        char *kp, *kp2, *vp, *vp2;
-        char address_family, type;
-        int sport, dport, sserv, dserv;
-        char *sports, *dports, *saddr, *host;
-
-        kp = key;
-
-        address_family = 'A';
-        type = 'L';
-        if (*kp == 'A' || *kp == '4' || *kp == '6')
-            address_family = *kp++;
-        if (*kp == 'L' || *kp == 'R')
-            type = *kp++;
-
-        if ((kp2 = host_strchr(kp, ':')) != NULL) {
-            /*
-             * There's a colon in the middle of the source port
-             * string, which means that the part before it is
-             * actually a source address.
-             */
-            char *saddr_tmp = dupprintf("%.*s", (int)(kp2 - kp), kp);
-            saddr = host_strduptrim(saddr_tmp);
-            sfree(saddr_tmp);
-            sports = kp2+1;
-        } else {
-            saddr = NULL;
-            sports = kp;
-        }
-        sport = atoi(sports);
-        sserv = 0;
-        if (sport == 0) {
-            sserv = 1;
-            sport = net_service_lookup(sports);
-            if (!sport) {
-                logeventf(mgr->cl->logctx, "Service lookup failed for source"
-                          " port \"%s\"", sports);
-            }
-        }
-
-        if (type == 'L' && !strcmp(val, "D")) {
-            /* dynamic forwarding */
-            host = NULL;
-            dports = NULL;
-            dport = -1;
-            dserv = 0;
-            type = 'D';
-        } else {
-            /* ordinary forwarding */
-            vp = val;
-            vp2 = vp + host_strcspn(vp, ":");
-            host = dupprintf("%.*s", (int)(vp2 - vp), vp);
-            if (*vp2)
-                vp2++;
-            dports = vp2;
-            dport = atoi(dports);
-            dserv = 0;
-            if (dport == 0) {
-                dserv = 1;
-                dport = net_service_lookup(dports);
-                if (!dport) {
-                    logeventf(mgr->cl->logctx,
-                              "Service lookup failed for destination"
-                              " port \"%s\"", dports);
-                }
-            }
-        }
+        pfr = pfr_decode(mgr, key, val, true);
+        if (!pfr)
+            continue;
 
-        if (sport && dport) {
-            /* Set up a description of the source port. */
-            pfr = snew(PortFwdRecord);
-            pfr->type = type;
-            pfr->saddr = saddr;
-            pfr->sserv = sserv ? dupstr(sports) : NULL;
-            pfr->sport = sport;
-            pfr->daddr = host;
-            pfr->dserv = dserv ? dupstr(dports) : NULL;
-            pfr->dport = dport;
-            pfr->local = NULL;
-            pfr->remote = NULL;
-            pfr->addressfamily = (address_family == '4' ? ADDRTYPE_IPV4 :
-                                  address_family == '6' ? ADDRTYPE_IPV6 :
-                                  ADDRTYPE_UNSPEC);
-
-            PortFwdRecord *existing = add234(mgr->forwardings, pfr);
-            if (existing != pfr) {
-                if (existing->status == DESTROY) {
-                    /*
-                     * We already have a port forwarding up and running
-                     * with precisely these parameters. Hence, no need
-                     * to do anything; simply re-tag the existing one
-                     * as KEEP.
-                     */
-                    existing->status = KEEP;
-                }
+        PortFwdRecord *existing = add234(mgr->forwardings, pfr);
+        if (existing != pfr) {
+            if (existing->status == DESTROY) {
                 /*
-                 * Anything else indicates that there was a duplicate
-                 * in our input, which we'll silently ignore.
+                 * We already have a port forwarding up and running
+                 * with precisely these parameters. Hence, no need
+                 * to do anything; simply re-tag the existing one
+                 * as KEEP.
                  */
-                pfr_free(pfr);
-            } else {
-                pfr->status = CREATE;
+                existing->status = KEEP;
             }
+            /*
+             * Anything else indicates that there was a duplicate
+             * in our input, which we'll silently ignore.
+             */
+            existing->refcount++;
+            pfr_free(pfr);
         } else {
-            sfree(saddr);
-            sfree(host);
+            pfr->refcount = 1;
         }
     }
 
@@ -912,133 +1176,21 @@ void portfwdmgr_config(PortFwdManager *mgr, Conf *conf)
      */
     for (i = 0; (pfr = index234(mgr->forwardings, i)) != NULL; i++) {
         if (pfr->status == DESTROY) {
-            char *message;
-
-            message = dupprintf("%s port forwarding from %s%s%d",
-                                pfr->type == 'L' ? "local" :
-                                pfr->type == 'R' ? "remote" : "dynamic",
-                                pfr->saddr ? pfr->saddr : "",
-                                pfr->saddr ? ":" : "",
-                                pfr->sport);
-
-            if (pfr->type != 'D') {
-                char *msg2 = dupprintf("%s to %s:%d", message,
-                                       pfr->daddr, pfr->dport);
-                sfree(message);
-                message = msg2;
-            }
-
-            logeventf(mgr->cl->logctx, "Cancelling %s", message);
-            sfree(message);
-
-            /* pfr->remote or pfr->local may be NULL if setting up a
-             * forwarding failed. */
-            if (pfr->remote) {
-                /*
-                 * Cancel the port forwarding at the server
-                 * end.
-                 *
-                 * Actually closing the listening port on the server
-                 * side may fail - because in SSH-1 there's no message
-                 * in the protocol to request it!
-                 *
-                 * Instead, we simply remove the record of the
-                 * forwarding from our local end, so that any
-                 * connections the server tries to make on it are
-                 * rejected.
-                 */
-                ssh_rportfwd_remove(mgr->cl, pfr->remote);
-                pfr->remote = NULL;
-            } else if (pfr->local) {
-                pfl_terminate(pfr->local);
-                pfr->local = NULL;
-            }
-
-            delpos234(mgr->forwardings, i);
-            pfr_free(pfr);
+            pfr_cancel(mgr, pfr);
             i--;                       /* so we don't skip one in the list */
         }
     }
 
     /*
      * And finally, set up any new port forwardings (status==CREATE).
+     * pfr_start may remove a record from the tree if it fails.
      */
     for (i = 0; (pfr = index234(mgr->forwardings, i)) != NULL; i++) {
         if (pfr->status == CREATE) {
-            char *sportdesc, *dportdesc;
-            sportdesc = dupprintf("%s%s%s%s%d%s",
-                                  pfr->saddr ? pfr->saddr : "",
-                                  pfr->saddr ? ":" : "",
-                                  pfr->sserv ? pfr->sserv : "",
-                                  pfr->sserv ? "(" : "",
-                                  pfr->sport,
-                                  pfr->sserv ? ")" : "");
-            if (pfr->type == 'D') {
-                dportdesc = NULL;
-            } else {
-                dportdesc = dupprintf("%s:%s%s%d%s",
-                                      pfr->daddr,
-                                      pfr->dserv ? pfr->dserv : "",
-                                      pfr->dserv ? "(" : "",
-                                      pfr->dport,
-                                      pfr->dserv ? ")" : "");
-            }
-
-            if (pfr->type == 'L') {
-                char *err = pfl_listen(pfr->daddr, pfr->dport,
-                                       pfr->saddr, pfr->sport,
-                                       mgr->cl, conf, &pfr->local,
-                                       pfr->addressfamily);
-
-                logeventf(mgr->cl->logctx,
-                          "Local %sport %s forwarding to %s%s%s",
-                          pfr->addressfamily == ADDRTYPE_IPV4 ? "IPv4 " :
-                          pfr->addressfamily == ADDRTYPE_IPV6 ? "IPv6 " : "",
-                          sportdesc, dportdesc,
-                          err ? " failed: " : "", err ? err : "");
-                if (err)
-                    sfree(err);
-            } else if (pfr->type == 'D') {
-                char *err = pfl_listen(NULL, -1, pfr->saddr, pfr->sport,
-                                       mgr->cl, conf, &pfr->local,
-                                       pfr->addressfamily);
-
-                logeventf(mgr->cl->logctx,
-                          "Local %sport %s SOCKS dynamic forwarding%s%s",
-                          pfr->addressfamily == ADDRTYPE_IPV4 ? "IPv4 " :
-                          pfr->addressfamily == ADDRTYPE_IPV6 ? "IPv6 " : "",
-                          sportdesc,
-                          err ? " failed: " : "", err ? err : "");
-
-                if (err)
-                    sfree(err);
-            } else {
-                const char *shost;
-
-                if (pfr->saddr) {
-                    shost = pfr->saddr;
-                } else if (conf_get_bool(conf, CONF_rport_acceptall)) {
-                    shost = "";
-                } else {
-                    shost = "localhost";
-                }
-
-                pfr->remote = ssh_rportfwd_alloc(
-                    mgr->cl, shost, pfr->sport, pfr->daddr, pfr->dport,
-                    pfr->addressfamily, sportdesc, pfr, NULL);
-
-                if (!pfr->remote) {
-                    logeventf(mgr->cl->logctx,
-                              "Duplicate remote port forwarding to %s:%d",
-                              pfr->daddr, pfr->dport);
-                    pfr_free(pfr);
-                } else {
-                    logeventf(mgr->cl->logctx, "Requesting remote port %s"
-                              " forward to %s", sportdesc, dportdesc);
-                }
-            }
-            sfree(sportdesc);
-            sfree(dportdesc);
+            int before = count234(mgr->forwardings);
+            pfr_start(mgr, pfr, conf);
+            if (count234(mgr->forwardings) < before)
+                i--;                   /* so we don't skip one in the list */
         }
     }
 }
@@ -1049,6 +1201,8 @@ bool portfwdmgr_listen(PortFwdManager *mgr, const char *host, int port,
     PortFwdRecord *pfr;
 
     pfr = snew(PortFwdRecord);
+    pfr->status = KEEP;
+    pfr->refcount = 0;
     pfr->type = 'L';
     pfr->saddr = host ? dupstr(host) : NULL;
     pfr->daddr = keyhost ? dupstr(keyhost) : NULL;
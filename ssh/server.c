@@ -85,6 +85,7 @@ Channel *agentf_new(SshChannel *c) { return NULL; }
 bool agent_exists(void) { return false; }
 void ssh_got_exitcode(Ssh *ssh, int exitcode) {}
 void ssh_check_frozen(Ssh *ssh) {}
+void ssh_setup_phase_done(Ssh *ssh, SshSetupPhase phase) {}
 
 mainchan *mainchan_new(
     PacketProtocolLayer *ppl, ConnectionLayer *cl, Conf *conf,
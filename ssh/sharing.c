@@ -167,6 +167,8 @@ struct ssh_sharing_connstate {
     unsigned char recvbuf[0x4010];
     size_t recvlen;
 
+    strbuf *outbuf;                    /* for assembling outgoing packets */
+
     /*
      * Assorted state we have to remember about this downstream, so
      * that we can clean it up appropriately when the downstream goes
@@ -507,6 +509,7 @@ static void share_connstate_free(struct ssh_sharing_connstate *cs)
     if (cs->sock)
         sk_close(cs->sock);
 
+    strbuf_free(cs->outbuf);
     sfree(cs);
 }
 
@@ -730,15 +733,53 @@ static PRINTF_LIKE(2, 3) void log_general(struct ssh_sharing_state *sharestate,
     sfree(buf);
 }
 
+/*
+ * Send a packet to a downstream, with the given header (if any)
+ * followed by the given body as its payload. The packet is assembled
+ * in a buffer kept for the purpose, so that channel data costs a
+ * single copy on its way from the server's packet to the socket.
+ */
+static void share_write_packet(struct ssh_sharing_connstate *cs, int type,
+                               const void *hdr, size_t hdrlen,
+                               const void *body, size_t bodylen)
+{
+    unsigned char *p;
+
+    strbuf_clear(cs->outbuf);
+    p = strbuf_append(cs->outbuf, 5 + hdrlen + bodylen);
+    PUT_32BIT_MSB_FIRST(p, 1 + hdrlen + bodylen);
+    p[4] = type;
+    if (hdrlen)
+        memcpy(p + 5, hdr, hdrlen);
+    if (bodylen)
+        memcpy(p + 5 + hdrlen, body, bodylen);
+    sk_write(cs->sock, cs->outbuf->s, cs->outbuf->len);
+}
+
+/*
+ * Send a packet to a downstream. If 'chan' is not NULL, the packet is
+ * a channel message, and its recipient channel id is replaced with
+ * the downstream's id for the channel on the way through.
+ */
 static void send_packet_to_downstream(struct ssh_sharing_connstate *cs,
                                       int type, const void *pkt, int pktlen,
                                       struct share_channel *chan)
 {
-    strbuf *packet;
+    unsigned char hdr[8];
 
     if (!cs->sock) /* throw away all packets destined for a dead downstream */
         return;
 
+    if (!chan || pktlen < 4) {
+        /*
+         * Just do the obvious thing.
+         */
+        share_write_packet(cs, type, NULL, 0, pkt, pktlen);
+        return;
+    }
+
+    PUT_32BIT_MSB_FIRST(hdr, chan->downstream_id);
+
     if (type == SSH2_MSG_CHANNEL_DATA) {
         /*
          * Special case which we take care of at a low level, so as to
@@ -756,40 +797,24 @@ static void send_packet_to_downstream(struct ssh_sharing_connstate *cs,
          * send them as separate CHANNEL_DATA packets.
          */
         BinarySource src[1];
-        unsigned channel;
         ptrlen data;
 
         BinarySource_BARE_INIT(src, pkt, pktlen);
-        channel = get_uint32(src);
+        get_uint32(src);
         data = get_string(src);
 
         do {
             int this_len = (data.len > chan->downstream_maxpkt ?
                             chan->downstream_maxpkt : data.len);
 
-            packet = strbuf_new_nm();
-            put_uint32(packet, 0);     /* placeholder for length field */
-            put_byte(packet, type);
-            put_uint32(packet, channel);
-            put_uint32(packet, this_len);
-            put_data(packet, data.ptr, this_len);
+            PUT_32BIT_MSB_FIRST(hdr + 4, this_len);
+            share_write_packet(cs, type, hdr, 8, data.ptr, this_len);
             data.ptr = (const char *)data.ptr + this_len;
             data.len -= this_len;
-            PUT_32BIT_MSB_FIRST(packet->s, packet->len-4);
-            sk_write(cs->sock, packet->s, packet->len);
-            strbuf_free(packet);
         } while (data.len > 0);
     } else {
-        /*
-         * Just do the obvious thing.
-         */
-        packet = strbuf_new_nm();
-        put_uint32(packet, 0);     /* placeholder for length field */
-        put_byte(packet, type);
-        put_data(packet, pkt, pktlen);
-        PUT_32BIT_MSB_FIRST(packet->s, packet->len-4);
-        sk_write(cs->sock, packet->s, packet->len);
-        strbuf_free(packet);
+        share_write_packet(cs, type, hdr, 4,
+                           (const unsigned char *)pkt + 4, pktlen - 4);
     }
 }
 
@@ -1162,7 +1187,6 @@ void share_got_pkt_from_server(ssh_sharing_connstate *cs, int type,
 {
     const unsigned char *pkt = (const unsigned char *)vpkt;
     struct share_globreq *globreq;
-    size_t id_pos;
     unsigned upstream_id, server_id;
     struct share_channel *chan;
     struct share_xchannel *xc;
@@ -1226,17 +1250,14 @@ void share_got_pkt_from_server(ssh_sharing_connstate *cs, int type,
          * first uint32 field in the packet. Substitute the downstream
          * channel id for our one and pass the packet downstream.
          */
-        id_pos = src->pos;
         upstream_id = get_uint32(src);
         if ((chan = share_find_channel_by_upstream(cs, upstream_id)) != NULL) {
             /*
              * The normal case: this id refers to an open channel.
+             * send_packet_to_downstream will substitute the
+             * downstream's id for the channel as it sends the packet.
              */
-            unsigned char *rewritten = snewn(pktlen, unsigned char);
-            memcpy(rewritten, pkt, pktlen);
-            PUT_32BIT_MSB_FIRST(rewritten + id_pos, chan->downstream_id);
-            send_packet_to_downstream(cs, type, rewritten, pktlen, chan);
-            sfree(rewritten);
+            send_packet_to_downstream(cs, type, pkt, pktlen, chan);
 
             /*
              * Update the channel state, for messages that need it.
@@ -1748,6 +1769,24 @@ static void share_got_pkt_from_downstream(struct ssh_sharing_connstate *cs,
         (c) = (unsigned char)*data++;                           \
     } while (0)
 
+/*
+ * And one which copies as much as it can of a run of bytes into
+ * 'buf', advancing 'pos' towards 'limit'.
+ */
+#define crGetData(buf, pos, limit) do                           \
+    {                                                           \
+        while (len == 0) {                                      \
+            *crLine = __LINE__; return; case __LINE__:;         \
+        }                                                       \
+        size_t n_ = (limit) - (pos);                            \
+        if (n_ > len)                                           \
+            n_ = len;                                           \
+        memcpy((buf) + (pos), data, n_);                        \
+        (pos) += n_;                                            \
+        data += n_;                                             \
+        len -= n_;                                              \
+    } while (0)
+
 static void share_receive(Plug *plug, int urgent, const char *data, size_t len)
 {
     ssh_sharing_connstate *cs = container_of(
@@ -1798,6 +1837,26 @@ static void share_receive(Plug *plug, int urgent, const char *data, size_t len)
      * Loop round reading packets.
      */
     while (1) {
+        /*
+         * Channel data and window adjustments go upstream unchanged,
+         * so if we already have a whole one of those in our input,
+         * pass it on from there rather than copying it into recvbuf
+         * first.
+         */
+        while (len >= 5) {
+            size_t pktlen = GET_32BIT_MSB_FIRST(data) + (size_t)4;
+            int type = (unsigned char)data[4];
+            if (pktlen < 5 || pktlen > len || pktlen > sizeof(cs->recvbuf) ||
+                (type != SSH2_MSG_CHANNEL_DATA &&
+                 type != SSH2_MSG_CHANNEL_EXTENDED_DATA &&
+                 type != SSH2_MSG_CHANNEL_WINDOW_ADJUST))
+                break;
+            ssh_send_packet_from_downstream(cs->parent->cl, cs->id, type,
+                                            data + 5, pktlen - 5, NULL);
+            data += pktlen;
+            len -= pktlen;
+        }
+
         cs->recvlen = 0;
         while (cs->recvlen < 4) {
             crGetChar(c);
@@ -1812,10 +1871,8 @@ static void share_receive(Plug *plug, int urgent, const char *data, size_t len)
             sfree(buf);
             return;
         }
-        while (cs->recvlen < cs->curr_packetlen) {
-            crGetChar(c);
-            cs->recvbuf[cs->recvlen++] = c;
-        }
+        while (cs->recvlen < cs->curr_packetlen)
+            crGetData(cs->recvbuf, cs->recvlen, cs->curr_packetlen);
 
         share_got_pkt_from_downstream(cs, cs->recvbuf[4],
                                       cs->recvbuf + 5, cs->recvlen - 5);
@@ -1935,6 +1992,8 @@ static int share_listen_accepting(Plug *plug,
 
     sk_set_frozen(cs->sock, false);
 
+    cs->outbuf = strbuf_new_nm();
+
     add234(cs->parent->connections, cs);
 
     cs->sent_verstring = false;
@@ -2073,7 +2132,16 @@ Socket *ssh_connection_sharing_init(
 
     if (!conf_get_bool(conf, CONF_ssh_connection_sharing))
         return NULL;                   /* do not share anything */
-    can_upstream = share_can_be_upstream &&
+    /*
+     * Tools that don't normally act as upstreams (because they exit
+     * as soon as their own job is done) can still run a persistent
+     * upstream with no session of its own, which exists only to be
+     * shared.
+     */
+    can_upstream = (share_can_be_upstream ||
+                    (conf_get_bool(conf, CONF_ssh_no_shell) &&
+                     conf_get_int(conf,
+                                  CONF_ssh_connection_sharing_persist) > 0)) &&
         conf_get_bool(conf, CONF_ssh_connection_sharing_upstream);
     can_downstream = share_can_be_downstream &&
         conf_get_bool(conf, CONF_ssh_connection_sharing_downstream);
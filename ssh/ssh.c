@@ -138,6 +138,15 @@ struct Ssh {
     char *deferred_abort_message;
 
     bool need_random_unref;
+
+    /*
+     * GETTICKCOUNT() values at the start of connection setup and at
+     * the end of each setup phase, for the timing report.
+     */
+    unsigned long setup_start;
+    unsigned long setup_phase_end[SSH_SETUP_PHASE_COUNT];
+    bool setup_phase_seen[SSH_SETUP_PHASE_COUNT];
+    bool setup_timing_reported;
 };
 
 
@@ -182,6 +191,7 @@ static void ssh_got_ssh_version(struct ssh_version_receiver *rcv,
     PacketProtocolLayer *connection_layer;
 
     ssh->session_started = true;
+    ssh_setup_phase_done(ssh, SSH_PHASE_VERSION);
 
     /*
      * We don't support choosing a major protocol version dynamically,
@@ -600,12 +610,79 @@ void ssh_sw_abort_deferred(Ssh *ssh, const char *fmt, ...)
     }
 }
 
+static const char *const ssh_setup_phase_names[] = {
+#define SSH_SETUP_PHASE_NAME(id, name) name,
+    SSH_SETUP_PHASES(SSH_SETUP_PHASE_NAME)
+#undef SSH_SETUP_PHASE_NAME
+};
+
+static void ssh_report_setup_timing(Ssh *ssh)
+{
+    strbuf *sb = strbuf_new();
+    unsigned long prev = ssh->setup_start;
+
+    for (size_t i = 0; i < SSH_SETUP_PHASE_COUNT; i++) {
+        if (ssh->setup_phase_seen[i]) {
+            unsigned long end = ssh->setup_phase_end[i];
+            put_fmt(sb, " %s=%lu", ssh_setup_phase_names[i],
+                    (end - prev) * 1000 / TICKSPERSEC);
+            prev = end;
+        } else {
+            put_fmt(sb, " %s=-", ssh_setup_phase_names[i]);
+        }
+    }
+    put_fmt(sb, " total=%lu", (prev - ssh->setup_start) * 1000 / TICKSPERSEC);
+
+    logeventf(ssh->logctx, "Connection setup times (ms):%s", sb->s);
+
+    if (conf_get_bool(ssh->conf, CONF_ssh_report_timing)) {
+        /* One line, in a fixed format, for scripts to parse */
+        char *msg = dupprintf("ssh-setup-timing:%s\r\n", sb->s);
+        seat_stderr_pl(ssh->seat, ptrlen_from_asciz(msg));
+        sfree(msg);
+    }
+
+    strbuf_free(sb);
+}
+
+void ssh_setup_phase_done(Ssh *ssh, SshSetupPhase phase)
+{
+    assert(phase < SSH_SETUP_PHASE_COUNT);
+
+    /* Later occurrences, e.g. repeat key exchanges, don't count */
+    if (ssh->setup_phase_seen[phase] || ssh->setup_timing_reported)
+        return;
+
+    ssh->setup_phase_seen[phase] = true;
+    ssh->setup_phase_end[phase] = GETTICKCOUNT();
+
+    /*
+     * The session is up once the main channel is ready, or once we've
+     * authenticated if there won't be a main channel at all.
+     */
+    if (phase == SSH_PHASE_CHANNEL ||
+        (phase == SSH_PHASE_AUTH &&
+         conf_get_bool(ssh->conf, CONF_ssh_no_shell))) {
+        ssh->setup_timing_reported = true;
+        ssh_report_setup_timing(ssh);
+    }
+}
+
 static void ssh_socket_log(Plug *plug, Socket *s, PlugLogType type,
                            SockAddr *addr, int port,
                            const char *error_msg, int error_code)
 {
     Ssh *ssh = container_of(plug, Ssh, plug);
 
+    /*
+     * If we're going through a proxy, we hear about two successful
+     * connections: first the one to the proxy itself, and then the
+     * proxied one to the server once negotiation has finished.
+     */
+    if (type == PLUGLOG_CONNECT_SUCCESS && !ssh->attempting_connshare)
+        ssh_setup_phase_done(ssh, ssh->setup_phase_seen[SSH_PHASE_CONNECT] ?
+                             SSH_PHASE_PROXY : SSH_PHASE_CONNECT);
+
     /*
      * While we're attempting connection sharing, don't loudly log
      * everything that happens. Real TCP connections need to be logged
@@ -830,6 +907,7 @@ static char *connect_to_host(
         addressfamily = conf_get_int(ssh->conf, CONF_addressfamily);
         addr = name_lookup(host, port, realhost, ssh->conf, addressfamily,
                            ssh->logctx, "SSH connection");
+        ssh_setup_phase_done(ssh, SSH_PHASE_LOOKUP);
         if ((err = sk_addr_error(addr)) != NULL) {
             sk_addr_free(addr);
             return dupstr(err);
@@ -981,6 +1059,7 @@ static char *ssh_init(const BackendVtable *vt, Seat *seat,
     ssh->bare_connection = (vt->protocol == PROT_SSHCONN);
 
     ssh->seat = seat;
+    ssh->setup_start = GETTICKCOUNT();
     ssh->cl_dummy.vt = &dummy_connlayer_vtable;
     ssh->cl_dummy.logctx = ssh->logctx = logctx;
 
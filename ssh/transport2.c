@@ -39,7 +39,7 @@ const static ptrlen kex_strict_s =
  * attack */
 static const char terrapin_weakness[1];
 
-static ssh_compressor *ssh_comp_none_init(void)
+static ssh_compressor *ssh_comp_none_init(int level)
 {
     return NULL;
 }
@@ -115,6 +115,11 @@ static void ssh2_transport_gss_update(struct ssh2_transport_state *s,
 
 static bool ssh2_transport_timer_update(struct ssh2_transport_state *s,
                                         unsigned long rekey_time);
+static void ssh2_transport_free_spare_kex(struct ssh2_transport_state *s);
+static bool ssh2_transport_want_spare_kex(struct ssh2_transport_state *s);
+static bool ssh2_transport_near_data_limit(struct ssh2_transport_state *s);
+static void ssh2_transport_schedule_idle_check(
+    struct ssh2_transport_state *s);
 static SeatPromptResult ssh2_transport_confirm_weak_crypto_primitive(
     struct ssh2_transport_state *s, const char *type, const char *name,
     const void *alg, WeakCryptoReason wcr);
@@ -257,8 +262,15 @@ static void ssh2_transport_free(PacketProtocolLayer *ppl)
     }
     if (s->ecdh_key)
         ecdh_key_free(s->ecdh_key);
+    if (s->guess_ecdh_key)
+        ecdh_key_free(s->guess_ecdh_key);
+    ssh2_transport_free_spare_kex(s);
     if (s->exhash)
         ssh_hash_free(s->exhash);
+    if (s->exhash_sign_job)
+        s->exhash_sign_job->s = NULL;  /* it will free itself */
+    if (s->exhash_signature)
+        strbuf_free(s->exhash_signature);
     strbuf_free(s->outgoing_kexinit);
     strbuf_free(s->incoming_kexinit);
     ssh_transient_hostkey_cache_free(s->thc);
@@ -514,7 +526,7 @@ static bool ssh2_transport_filter_queue(struct ssh2_transport_state *s)
             /* ... except that we shouldn't tolerate higher-layer
              * packets coming from the server before we've seen
              * the first NEWKEYS. */
-            if (!s->higher_layer_ok) {
+            if (!s->higher_layer_ok || s->service_accept_pending) {
                 ssh_proto_error(s->ppl.ssh, "Received premature higher-"
                                 "layer packet, type %d (%s)", pktin->type,
                                 ssh2_pkt_type(s->ppl.bpp->pls->kctx,
@@ -765,9 +777,8 @@ static void ssh2_write_kexinit_lists(
                     if (!hca)
                         continue;
 
-                    if (hca->ca_public_key &&
-                        cert_expr_match_str(hca->validity_expression,
-                                            hk_host, hk_port)) {
+                    if (hca->ca_public_key && hca->validity &&
+                        cert_expr_match(hca->validity, hk_host, hk_port)) {
                         accept_certs = true;
                         add234(host_cas, hca);
                     } else {
@@ -1083,17 +1094,6 @@ static ScanKexinitsResult ssh2_scan_kexinits(
          * not to be fatal. */
         selected[i] = NULL;
 
-        /*
-         * However, even if a failure to agree on any algorithm at all
-         * is not completely fatal (e.g. because it's the MAC
-         * negotiation for a cipher that comes with a built-in MAC),
-         * it still invalidates the guessed key exchange packet. (RFC
-         * 4253 section 7, not contradicted by OpenSSH's
-         * PROTOCOL.chacha20poly1305 or as far as I can see by their
-         * code.)
-         */
-        guess_correct = false;
-
         continue;
 
       found_match:
@@ -1125,8 +1125,17 @@ static ScanKexinitsResult ssh2_scan_kexinits(
          * If the kex or host key algorithm is not the first one in
          * both sides' lists, that means the guessed key exchange
          * packet (if any) is officially wrong.
+         *
+         * RFC 4253 section 7 also says the guess is wrong if any of
+         * the other algorithm lists fail to agree. But we don't
+         * enforce that, because OpenSSH and Dropbear don't: they only
+         * compare the first kex and host key algorithms. (The only
+         * case where it matters is a non-fatal failure to agree on a
+         * MAC, because the cipher has one built in.) Whichever side
+         * sent the guess, both sides must come to the same decision
+         * about it.
          */
-        if ((i == KEXLIST_KEX || i == KEXLIST_HOSTKEY) && !(cfirst || sfirst))
+        if ((i == KEXLIST_KEX || i == KEXLIST_HOSTKEY) && !(cfirst && sfirst))
             guess_correct = false;
     }
 
@@ -1417,6 +1426,54 @@ void ssh2transport_finalise_exhash(struct ssh2_transport_state *s)
 #endif
 }
 
+/*
+ * Decide whether to send a guessed key exchange packet along with
+ * our KEXINIT, and if so, return the kex method we're guessing.
+ *
+ * We only do this in the client, for the first key exchange (which
+ * is the one holding up session startup), and only if our preferred
+ * kex method is a single-message elliptic-curve or hybrid one, so
+ * that the guess is just our half of the exchange and costs nothing
+ * but a key generation if it's wrong.
+ */
+static const ssh_kex *ssh2_choose_kex_guess(struct ssh2_transport_state *s)
+{
+    if (s->ssc || s->got_session_id)
+        return NULL;
+    if (s->ppl.remote_bugs & BUG_REQUIRES_FILTERED_KEXINIT)
+        return NULL;
+    if (s->ppl.remote_bugs & BUG_CHOKES_ON_PIPELINED_SETUP)
+        return NULL;
+
+    struct kexinit_algorithm_list *kexlist = &s->kexlists[KEXLIST_KEX];
+    if (!kexlist->nalgs)
+        return NULL;
+    const struct kexinit_algorithm *first = &kexlist->algs[0];
+    if (first->u.kex.warn || first->u.kex.kex->main_type != KEXTYPE_ECDH)
+        return NULL;
+    return first->u.kex.kex;
+}
+
+static void ssh2_send_kex_guess(struct ssh2_transport_state *s)
+{
+    PacketProtocolLayer *ppl = &s->ppl; /* for ppl_logevent */
+    const ssh_kex *kex = s->guess_kex_alg;
+    PktOut *pktout;
+
+    ppl_logevent("Sending guessed key exchange packet for %s", kex->name);
+
+    s->ppl.bpp->pls->kctx = kex->ecdh_vt->packet_naming_ctx;
+    s->guess_ecdh_key = ecdh_key_new(kex, false);
+
+    pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_KEX_ECDH_INIT);
+    {
+        strbuf *pubpoint = strbuf_new();
+        ecdh_key_getpublic(s->guess_ecdh_key, BinarySink_UPCAST(pubpoint));
+        put_stringsb(pktout, pubpoint);
+    }
+    pq_push(s->ppl.out_pq, pktout);
+}
+
 static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
 {
     struct ssh2_transport_state *s =
@@ -1507,8 +1564,12 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
         s->hostkeys, s->nhostkeys,
         !s->got_session_id, s->can_gssapi_keyex,
         s->gss_kex_used && !s->need_gss_transient_hostkey);
-    /* First KEX packet does _not_ follow, because we're not that brave. */
-    put_bool(s->outgoing_kexinit, false);
+    /*
+     * Decide whether to follow our KEXINIT with a guessed first key
+     * exchange packet.
+     */
+    s->guess_kex_alg = ssh2_choose_kex_guess(s);
+    put_bool(s->outgoing_kexinit, s->guess_kex_alg != NULL);
     put_uint32(s->outgoing_kexinit, 0);             /* reserved */
 
     /*
@@ -1539,12 +1600,17 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
         put_data(pktout, s->outgoing_kexinit->u + 1,
                  s->outgoing_kexinit->len - 1); /* omit type byte */
         pq_push(s->ppl.out_pq, pktout);
+
+        if (s->guess_kex_alg)
+            ssh2_send_kex_guess(s);
     }
 
     /*
-     * Flag that KEX is in progress.
+     * Flag that KEX is in progress. From here until we've sent our
+     * NEWKEYS, packets from the higher layer stay on pq_out_higher.
      */
     s->kex_in_progress = true;
+    s->out_stall_start = GETTICKCOUNT();
 
     /*
      * Wait for the other side's KEXINIT, and save it.
@@ -1579,13 +1645,14 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
      */
     {
         struct server_hostkeys hks = { NULL, 0, 0 };
+        bool ignore_cs_guess, ignore_sc_guess;
 
         ScanKexinitsResult skr = ssh2_scan_kexinits(
                 ptrlen_from_strbuf(s->client_kexinit),
                 ptrlen_from_strbuf(s->server_kexinit), s->ssc != NULL,
                 s->kexlists, &s->kex_alg, &s->hostkey_alg, s->cstrans,
                 s->sctrans, &s->warn_kex, &s->warn_hk, &s->warn_cscipher,
-                &s->warn_sccipher, NULL, &s->ignorepkt, &hks,
+                &s->warn_sccipher, &ignore_cs_guess, &ignore_sc_guess, &hks,
                 &s->hkflags, &s->can_send_ext_info, !s->got_session_id,
                 &s->strict_kex);
 
@@ -1595,6 +1662,21 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
             return; /* we just called a fatal error function */
         }
 
+        /*
+         * We must discard the other side's guessed kex packet if it
+         * was wrong. And if our own guess was wrong, the other side
+         * will discard it, so we must forget it too and do the kex
+         * from scratch.
+         */
+        s->ignorepkt = s->ssc ? ignore_cs_guess : ignore_sc_guess;
+        if (s->guess_ecdh_key && (s->ssc ? ignore_sc_guess : ignore_cs_guess)) {
+            ppl_logevent("Server did not accept our guessed key exchange "
+                         "packet");
+            ecdh_key_free(s->guess_ecdh_key);
+            s->guess_ecdh_key = NULL;
+        }
+        assert(!s->guess_ecdh_key || s->kex_alg == s->guess_kex_alg);
+
         /*
          * If we've just turned on strict kex mode, say so, and
          * retrospectively fault any pre-KEXINIT extraneous packets.
@@ -1842,6 +1924,7 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
             s->out.cipher, cipher_key->u, cipher_iv->u,
             s->out.mac, s->out.etm_mode, mac_key->u,
             s->out.comp, s->out.comp_delayed,
+            conf_get_int(s->conf, CONF_compression_level),
             s->strict_kex);
         s->enabled_outgoing_crypto = true;
 
@@ -1891,13 +1974,26 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
      * our queued higher-layer packets. Transfer the whole of the next
      * layer's outgoing queue on to our own.
      */
+    if (s->higher_layer_ok) {
+        /* In a rekey, log how long the higher layer was held up */
+        ppl_logevent("Outgoing data held for %lu ms during key exchange",
+                     (unsigned long)(GETTICKCOUNT() - s->out_stall_start) *
+                     1000 / TICKSPERSEC);
+    }
     pq_concatenate(s->ppl.out_pq, s->ppl.out_pq, &s->pq_out_higher);
     ssh_sendbuffer_changed(s->ppl.ssh);
 
     /*
-     * Expect SSH2_MSG_NEWKEYS from server.
+     * Expect SSH2_MSG_NEWKEYS from server. While we wait, keep
+     * passing on anything more the higher layer sends, since our
+     * outgoing keys are already in place and there's no reason to
+     * make it wait a round trip for the other side's NEWKEYS.
      */
-    crMaybeWaitUntilV((pktin = ssh2_transport_pop(s)) != NULL);
+    while ((pktin = ssh2_transport_pop(s)) == NULL) {
+        crReturnV;
+        pq_concatenate(s->ppl.out_pq, s->ppl.out_pq, &s->pq_out_higher);
+        ssh_sendbuffer_changed(s->ppl.ssh);
+    }
     if (pktin->type != SSH2_MSG_NEWKEYS) {
         ssh_proto_error(s->ppl.ssh, "Received unexpected packet when "
                         "expecting SSH_MSG_NEWKEYS, type %d (%s)",
@@ -1944,6 +2040,8 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
         strbuf_free(mac_key);
     }
 
+    ssh_setup_phase_done(s->ppl.ssh, SSH_PHASE_NEWKEYS);
+
     /*
      * Free shared secret.
      */
@@ -1973,6 +2071,10 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
     s->kex_in_progress = false;
     s->last_rekey = GETTICKCOUNT();
     (void) ssh2_transport_timer_update(s, 0);
+    if (s->spare_kex_alg != s->kex_alg)
+        ssh2_transport_free_spare_kex(s); /* not going to be any use */
+    if (ssh2_transport_want_spare_kex(s))
+        ssh2_transport_schedule_idle_check(s);
 
     /*
      * Now we're encrypting. Get the next-layer protocol started if it
@@ -1988,11 +2090,22 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
             pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_SERVICE_REQUEST);
             put_stringz(pktout, s->higher_layer->vt->name);
             pq_push(s->ppl.out_pq, pktout);
-            crMaybeWaitUntilV((pktin = ssh2_transport_pop(s)) != NULL);
-            if (pktin->type != SSH2_MSG_SERVICE_ACCEPT) {
-                ssh_sw_abort(s->ppl.ssh, "Server refused request to start "
-                             "'%s' protocol", s->higher_layer->vt->name);
-                return;
+
+            if (!(s->ppl.remote_bugs & BUG_CHOKES_ON_PIPELINED_SETUP)) {
+                /*
+                 * Don't wait for the SERVICE_ACCEPT: let the higher
+                 * layer start sending straight away, and check for
+                 * the accept when it arrives, in the loop below.
+                 */
+                s->service_accept_pending = true;
+            } else {
+                crMaybeWaitUntilV((pktin = ssh2_transport_pop(s)) != NULL);
+                if (pktin->type != SSH2_MSG_SERVICE_ACCEPT) {
+                    ssh_sw_abort(s->ppl.ssh, "Server refused request to "
+                                 "start '%s' protocol",
+                                 s->higher_layer->vt->name);
+                    return;
+                }
             }
         } else {
             ptrlen service_name;
@@ -2024,6 +2137,9 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
 
         s->higher_layer_ok = true;
         queue_idempotent_callback(&s->higher_layer->ic_process_queue);
+        /* If the client didn't wait for our SERVICE_ACCEPT, there may
+         * already be higher-layer packets waiting to be passed on */
+        queue_idempotent_callback(&s->ppl.ic_process_queue);
     }
 
     s->rekey_class = RK_NONE;
@@ -2038,7 +2154,19 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
          * s->rekey_class. This call to ssh2_transport_pop also has
          * the side effect of transferring incoming packets _to_ the
          * higher layer (via filter_queue). */
-        if ((pktin = ssh2_transport_pop(s)) != NULL) {
+        if ((pktin = ssh2_transport_pop(s)) != NULL &&
+            s->service_accept_pending) {
+            if (pktin->type != SSH2_MSG_SERVICE_ACCEPT) {
+                ssh_sw_abort(s->ppl.ssh, "Server refused request to start "
+                             "'%s' protocol", s->higher_layer->vt->name);
+                return;
+            }
+            s->service_accept_pending = false;
+            /* Release any higher-layer packets queued behind it */
+            queue_idempotent_callback(&s->ppl.ic_process_queue);
+            continue;
+        }
+        if (pktin) {
             if (pktin->type != SSH2_MSG_KEXINIT) {
                 ssh_proto_error(s->ppl.ssh, "Received unexpected transport-"
                                 "layer packet outside a key exchange, "
@@ -2083,6 +2211,10 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
             } else if (s->stats->out.expired) {
                 s->rekey_reason = "too much data sent";
                 s->rekey_class = RK_NORMAL;
+            } else if (ssh2_transport_near_data_limit(s)) {
+                /* Not yet, but look out for a quiet moment to do it
+                 * before the limit is reached. */
+                ssh2_transport_schedule_idle_check(s);
             }
         }
 
@@ -2165,6 +2297,133 @@ static void ssh2_transport_timer(void *ctx, unsigned long now)
     (void) ssh2_transport_timer_update(s, 0);
 }
 
+/*
+ * How long the connection has to have been quiet before we do
+ * anything in ssh2_transport_idle_timer, and how often to look again
+ * if it's busy.
+ */
+#define KEX_IDLE_CHECK_DELAY (10 * TICKSPERSEC)
+
+static void ssh2_transport_free_spare_kex(struct ssh2_transport_state *s)
+{
+    if (s->spare_ecdh_key) {
+        ecdh_key_free(s->spare_ecdh_key);
+        s->spare_ecdh_key = NULL;
+    }
+    if (s->spare_dh_ctx) {
+        dh_cleanup(s->spare_dh_ctx);
+        s->spare_dh_ctx = NULL;
+        s->spare_dh_e = NULL;
+    }
+    s->spare_kex_alg = NULL;
+}
+
+/*
+ * Decide whether it's worth generating our half of the next key
+ * exchange in advance. That's only possible if the method we've just
+ * used is one where we can (on the assumption that a rekey will end
+ * up choosing the same one again): so only in the client, where the
+ * ephemeral key doesn't depend on anything the other side sends
+ * first, and not for DH group exchange, where the server chooses the
+ * group.
+ */
+static bool ssh2_transport_want_spare_kex(struct ssh2_transport_state *s)
+{
+    const ssh_kex *kex = s->kex_alg;
+
+    if (s->ssc || !kex)
+        return false;
+    if (s->spare_kex_alg == kex && (s->spare_ecdh_key || s->spare_dh_ctx))
+        return false;                  /* we already have one */
+    return (kex->main_type == KEXTYPE_ECDH ||
+            (kex->main_type == KEXTYPE_DH && !dh_is_gex(kex)));
+}
+
+/*
+ * Decide whether we've used up enough of the data limit on the
+ * current keys that we'd rather rekey now, while nothing is waiting
+ * to be sent, than wait for the limit to run out and risk having the
+ * rekey hold up a bulk transfer.
+ */
+static bool ssh2_transport_near_data_limit(struct ssh2_transport_state *s)
+{
+    unsigned long threshold = s->max_data_size / 4;
+
+    if (!s->max_data_size)
+        return false;
+    return ((s->stats->in.running && s->stats->in.remaining < threshold) ||
+            (s->stats->out.running && s->stats->out.remaining < threshold));
+}
+
+static void ssh2_transport_idle_timer(void *ctx, unsigned long now)
+{
+    struct ssh2_transport_state *s = (struct ssh2_transport_state *)ctx;
+    PacketProtocolLayer *ppl = &s->ppl; /* for ppl_logevent */
+
+    if (!s->idle_check_pending || now != s->idle_check_time)
+        return;
+
+    /* If a kex has started, it will reschedule us when it finishes */
+    if (s->kex_in_progress) {
+        s->idle_check_pending = false;
+        return;
+    }
+
+    /*
+     * If any data has gone through the connection since we last
+     * looked, it's not a good moment to spend CPU on this. Try again
+     * later.
+     */
+    if (s->stats->in.total != s->idle_in_total ||
+        s->stats->out.total != s->idle_out_total) {
+        s->idle_in_total = s->stats->in.total;
+        s->idle_out_total = s->stats->out.total;
+        s->idle_check_time = schedule_timer(
+            KEX_IDLE_CHECK_DELAY, ssh2_transport_idle_timer, s);
+        return;
+    }
+
+    s->idle_check_pending = false;
+
+    if (ssh2_transport_want_spare_kex(s)) {
+        const ssh_kex *kex = s->kex_alg;
+
+        ssh2_transport_free_spare_kex(s);
+        if (kex->main_type == KEXTYPE_ECDH) {
+            s->spare_ecdh_key = ecdh_key_new(kex, false);
+        } else {
+            s->spare_dh_ctx = dh_setup_group(kex);
+            s->spare_dh_e = dh_create_e(s->spare_dh_ctx);
+        }
+        s->spare_kex_alg = kex;
+        ppl_logevent("Generated key exchange material in advance for next "
+                     "rekey");
+    }
+
+    if (ssh2_transport_near_data_limit(s) && s->rekey_class == RK_NONE) {
+        s->rekey_reason = "approaching data limit while idle";
+        s->rekey_class = RK_NORMAL;
+        queue_idempotent_callback(&s->ppl.ic_process_queue);
+    }
+}
+
+/*
+ * Arrange for ssh2_transport_idle_timer to run the next time the
+ * connection has been quiet for a while, if it isn't already due to.
+ */
+static void ssh2_transport_schedule_idle_check(
+    struct ssh2_transport_state *s)
+{
+    if (s->idle_check_pending)
+        return;
+
+    s->idle_in_total = s->stats->in.total;
+    s->idle_out_total = s->stats->out.total;
+    s->idle_check_time = schedule_timer(
+        KEX_IDLE_CHECK_DELAY, ssh2_transport_idle_timer, s);
+    s->idle_check_pending = true;
+}
+
 /*
  * The rekey_time is zero except when re-configuring.
  *
@@ -18,6 +18,18 @@
 #define DH_MIN_SIZE 1024
 #define DH_MAX_SIZE 8192
 
+/*
+ * A server-side signature of the exchange hash, being made on a
+ * worker thread. If the transport layer is freed before it finishes,
+ * 's' is set to NULL, and the job cleans up after itself.
+ */
+typedef struct ssh2_exhash_sign_job {
+    struct ssh2_transport_state *s;
+    ssh_key *key;
+    unsigned flags;
+    strbuf *data, *signature;
+} ssh2_exhash_sign_job;
+
 struct kexinit_algorithm {
     ptrlen name;
     union {
@@ -156,7 +168,7 @@ struct ssh2_transport_state {
     bool kex_in_progress, kexinit_delayed;
     unsigned long next_rekey, last_rekey;
     const char *deferred_rekey_reason;
-    bool higher_layer_ok;
+    bool higher_layer_ok, service_accept_pending;
 
     /*
      * Fully qualified host name, which we need if doing GSSAPI.
@@ -200,6 +212,33 @@ struct ssh2_transport_state {
     RSAKey *rsa_kex_key;             /* for RSA kex */
     bool rsa_kex_key_needs_freeing;
     ecdh_key *ecdh_key;                     /* for ECDH kex */
+    /* Key from a KEX_ECDH_INIT we sent speculatively with our
+     * KEXINIT, and the kex method it was for */
+    ecdh_key *guess_ecdh_key;
+    const ssh_kex *guess_kex_alg;
+    /*
+     * Ephemeral key material for the next key exchange, generated in
+     * advance while the connection is quiet, so that a rekey in the
+     * middle of a busy session has less to do.
+     */
+    const ssh_kex *spare_kex_alg;
+    ecdh_key *spare_ecdh_key;
+    dh_ctx *spare_dh_ctx;
+    mp_int *spare_dh_e;                /* owned by spare_dh_ctx */
+    /*
+     * Timer that waits for the connection to go quiet, to generate
+     * the above, or to start a rekey early if we're close to the
+     * data limit.
+     */
+    bool idle_check_pending;
+    unsigned long idle_check_time;
+    unsigned long idle_in_total, idle_out_total;
+    /*
+     * Time at which we last stopped passing on outgoing higher-layer
+     * packets for a key exchange, for the stall time we log when we
+     * start again.
+     */
+    unsigned long out_stall_start;
     unsigned char exchange_hash[MAX_HASH_LEN];
     bool can_gssapi_keyex;
     bool need_gss_transient_hostkey;
@@ -247,6 +286,8 @@ struct ssh2_transport_state {
 
     ssh_key *const *hostkeys;
     int nhostkeys;
+    ssh2_exhash_sign_job *exhash_sign_job;
+    strbuf *exhash_signature;
 
     PacketProtocolLayer ppl;
 };
@@ -2051,6 +2051,7 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
      * doing an immediate rekey, if it has any reason to want to.
      */
     ssh2_transport_notify_auth_done(s->transport_layer);
+    ssh_setup_phase_done(s->ppl.ssh, SSH_PHASE_AUTH);
 
     /*
      * Finally, hand over to our successor layer, and return
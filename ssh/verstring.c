@@ -634,6 +634,23 @@ static void ssh_detect_bugs(struct ssh_verstring_state *s)
         bpp_logevent("We believe remote version has SSH-2 "
                      "RSA/SHA-2/certificate userauth bug");
     }
+
+    if (conf_get_int(s->conf, CONF_sshbug_pipelined_setup) == FORCE_ON ||
+        (conf_get_int(s->conf, CONF_sshbug_pipelined_setup) == AUTO &&
+         !wc_match("OpenSSH_*", imp) &&
+         !wc_match("dropbear*", imp) &&
+         !wc_match("Uppity*", imp))) {
+        /*
+         * Sending a guessed kex packet after our KEXINIT, or the
+         * first userauth request before SERVICE_ACCEPT, is allowed
+         * by the protocol, but easy for a server to get wrong
+         * without anyone noticing. So we assume every server has
+         * trouble with it, except the ones we've checked.
+         */
+        s->remote_bugs |= BUG_CHOKES_ON_PIPELINED_SETUP;
+        bpp_logevent("We believe remote version may not handle "
+                     "pipelined SSH-2 connection setup");
+    }
 }
 
 const char *ssh_verstring_get_remote(BinaryPacketProtocol *bpp)
@@ -39,306 +39,314 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
 
 #include "defs.h"
 #include "ssh.h"
 
 /* ----------------------------------------------------------------------
- * Basic LZ77 code. This bit is designed modularly, so it could be
- * ripped out and used in a different LZ77 compressor. Go to it,
- * and good luck :-)
- */
-
-struct LZ77InternalContext;
-struct LZ77Context {
-    struct LZ77InternalContext *ictx;
-    void *userdata;
-    void (*literal) (struct LZ77Context *ctx, unsigned char c);
-    void (*match) (struct LZ77Context *ctx, int distance, int len);
-};
-
-/*
- * Initialise the private fields of an LZ77Context. It's up to the
- * user to initialise the public fields.
- */
-static int lz77_init(struct LZ77Context *ctx);
-
-/*
- * Supply data to be compressed. Will update the private fields of
- * the LZ77Context, and will call literal() and match() to output.
- * If `compress' is false, it will never emit a match, but will
- * instead call literal() for everything.
+ * LZ77 matching.
+ *
+ * This is a hash-chain matcher in the same general style as zlib's
+ * own. The most recent data is kept in a flat buffer of twice the
+ * window size; 'head' maps a hash of three bytes to the most recent
+ * position at which they occurred, and 'prev' links each position to
+ * the previous one with the same hash. Positions are absolute offsets
+ * in the whole data stream (counting from 1, so that 0 can mean
+ * `none'), which means that sliding the buffer along never requires
+ * the tables to be rewritten: an entry more than a window's length
+ * behind the current position is simply out of range, and ignored.
+ *
+ * Each SSH packet has to be compressed and flushed completely before
+ * we see the next, so matches never extend past the end of the
+ * current packet (though they can of course refer back into previous
+ * ones).
  */
-static void lz77_compress(struct LZ77Context *ctx,
-                          const unsigned char *data, int len);
 
-/*
- * Modifiable parameters.
- */
 #define WINSIZE 32768                  /* window size. Must be power of 2! */
-#define HASHMAX 2039                   /* one more than max hash value */
-#define MAXMATCH 32                    /* how many matches we track */
-#define HASHCHARS 3                    /* how many chars make a hash */
+#define WINMASK (WINSIZE - 1)
+#define HASHBITS 15
+#define HASHSIZE (1 << HASHBITS)
+#define MINMATCH 3
+#define MAXMATCH 258
+#define TOO_FAR 4096          /* max distance for a length-3 match */
 
 /*
- * This compressor takes a less slapdash approach than the
- * gzip/zlib one. Rather than allowing our hash chains to fall into
- * disuse near the far end, we keep them doubly linked so we can
- * _find_ the far end, and then every time we add a new byte to the
- * window (thus rolling round by one and removing the previous
- * byte), we can carefully remove the hash chain entry.
+ * Tuning for each compression level, on the usual zlib scale (and
+ * with very much the same numbers). Levels 1-3 take the first
+ * adequate match they find; levels 4 and up defer each match by a
+ * byte to see if a longer one starts there (`lazy matching').
  */
-
-#define INVALID -1                     /* invalid hash _and_ invalid offset */
-struct WindowEntry {
-    short next, prev;                  /* array indices within the window */
-    short hashval;
-};
-
-struct HashEntry {
-    short first;                       /* window index of first in chain */
+typedef struct LZ77Params {
+    int good_length;      /* search less hard once we have a match this long */
+    int max_lazy;         /* lazy: don't try to improve on a match this long;
+                           * greedy: don't index the inside of one */
+    int nice_length;      /* stop searching on finding a match this long */
+    int max_chain;        /* give up after this many hash chain entries */
+    bool lazy;
+} LZ77Params;
+
+static const LZ77Params lz77_params[] = {
+    /* level 0 never searches for matches at all */
+    {0, 0, 0, 0, false},
+    {4, 4, 8, 4, false},
+    {4, 5, 16, 8, false},
+    {4, 6, 32, 32, false},
+    {4, 4, 16, 16, true},
+    {8, 16, 32, 32, true},
+    {8, 16, 128, 128, true},
+    {8, 32, 128, 256, true},
+    {32, 128, 258, 1024, true},
+    {32, 258, 258, 4096, true},
 };
 
-struct Match {
-    int distance, len;
-};
-
-struct LZ77InternalContext {
-    struct WindowEntry win[WINSIZE];
-    unsigned char data[WINSIZE];
-    int winpos;
-    struct HashEntry hashtab[HASHMAX];
-    unsigned char pending[HASHCHARS];
-    int npending;
+/*
+ * The output of the matcher for one packet: a literal byte if dist
+ * is zero, otherwise a match of length len at distance dist.
+ */
+typedef struct LZ77Symbol {
+    unsigned short len, dist;
+} LZ77Symbol;
+
+struct LZ77State {
+    unsigned char window[2 * WINSIZE];
+    uint32_t head[HASHSIZE];
+    uint32_t prev[WINSIZE];
+    uint32_t base;                     /* stream position of window[0] */
+    uint32_t end;                      /* stream position after the data */
+    uint32_t inserted;                 /* next position to hash */
+    const LZ77Params *params;
+
+    LZ77Symbol *syms;
+    size_t nsyms, symsize;
 };
 
-static int lz77_hash(const unsigned char *data)
+static void lz77_init(struct LZ77State *st, int level)
 {
-    return (257 * data[0] + 263 * data[1] + 269 * data[2]) % HASHMAX;
+    memset(st->head, 0, sizeof(st->head));
+    st->base = st->end = st->inserted = 1;
+    st->params = &lz77_params[level];
+    st->syms = NULL;
+    st->nsyms = st->symsize = 0;
 }
 
-static int lz77_init(struct LZ77Context *ctx)
+static inline unsigned lz77_hash(const unsigned char *p)
 {
-    struct LZ77InternalContext *st;
-    int i;
-
-    st = snew(struct LZ77InternalContext);
-    if (!st)
-        return 0;
-
-    ctx->ictx = st;
-
-    for (i = 0; i < WINSIZE; i++)
-        st->win[i].next = st->win[i].prev = st->win[i].hashval = INVALID;
-    for (i = 0; i < HASHMAX; i++)
-        st->hashtab[i].first = INVALID;
-    st->winpos = 0;
-
-    st->npending = 0;
-
-    return 1;
+    uint32_t v = p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+    return (uint32_t)(v * 0x9E3779B1U) >> (32 - HASHBITS);
 }
 
-static void lz77_advance(struct LZ77InternalContext *st,
-                         unsigned char c, int hash)
+/*
+ * Add every position before 'limit' to the hash chains, as far as we
+ * have enough data to hash them.
+ */
+static void lz77_insert_upto(struct LZ77State *st, uint32_t limit)
 {
-    int off;
-
-    /*
-     * Remove the hash entry at winpos from the tail of its chain,
-     * or empty the chain if it's the only thing on the chain.
-     */
-    if (st->win[st->winpos].prev != INVALID) {
-        st->win[st->win[st->winpos].prev].next = INVALID;
-    } else if (st->win[st->winpos].hashval != INVALID) {
-        st->hashtab[st->win[st->winpos].hashval].first = INVALID;
+    while (st->inserted < limit && st->inserted + MINMATCH <= st->end) {
+        uint32_t pos = st->inserted++;
+        unsigned h = lz77_hash(st->window + (pos - st->base));
+        st->prev[pos & WINMASK] = st->head[h];
+        st->head[h] = pos;
     }
-
-    /*
-     * Create a new entry at winpos and add it to the head of its
-     * hash chain.
-     */
-    st->win[st->winpos].hashval = hash;
-    st->win[st->winpos].prev = INVALID;
-    off = st->win[st->winpos].next = st->hashtab[hash].first;
-    st->hashtab[hash].first = st->winpos;
-    if (off != INVALID)
-        st->win[off].prev = st->winpos;
-    st->data[st->winpos] = c;
-
-    /*
-     * Advance the window pointer.
-     */
-    st->winpos = (st->winpos + 1) & (WINSIZE - 1);
 }
 
-#define CHARAT(k) ( (k)<0 ? st->data[(st->winpos+k)&(WINSIZE-1)] : data[k] )
-
-static void lz77_compress(struct LZ77Context *ctx,
-                          const unsigned char *data, int len)
+/*
+ * Find the longest match for the data at 'pos', which must already
+ * be in the hash chains. Only matches longer than 'prev_length' are
+ * of interest; returns 0 if there isn't one.
+ */
+static int lz77_longest_match(struct LZ77State *st, uint32_t pos, int avail,
+                              int prev_length, int *distance)
 {
-    struct LZ77InternalContext *st = ctx->ictx;
-    int i, distance, off, nmatch, matchlen, advance;
-    struct Match defermatch, matches[MAXMATCH];
-    int deferchr;
-
-    assert(st->npending <= HASHCHARS);
+    const LZ77Params *p = st->params;
+    const unsigned char *scan = st->window + (pos - st->base);
+    uint32_t limit = pos > WINSIZE ? pos - WINSIZE : 0;
+    uint32_t cand = st->prev[pos & WINMASK];
+    int maxlen = avail < MAXMATCH ? avail : MAXMATCH;
+    int nice = p->nice_length < maxlen ? p->nice_length : maxlen;
+    int chain = p->max_chain;
+    int best = prev_length, found = 0;
+
+    if (best >= nice)
+        return 0;
+    if (best >= p->good_length)
+        chain >>= 2;
+
+    while (cand > limit && chain-- > 0) {
+        const unsigned char *match = st->window + (cand - st->base);
+        uint32_t next;
+
+        if (match[best] == scan[best] &&
+            match[0] == scan[0] && match[1] == scan[1]) {
+            int len = 2;
+            while (len < maxlen && match[len] == scan[len])
+                len++;
+            if (len > best) {
+                best = found = len;
+                *distance = pos - cand;
+                if (len >= nice)
+                    break;
+            }
+        }
 
-    /*
-     * Add any pending characters from last time to the window. (We
-     * might not be able to.)
-     *
-     * This leaves st->pending empty in the usual case (when len >=
-     * HASHCHARS); otherwise it leaves st->pending empty enough that
-     * adding all the remaining 'len' characters will not push it past
-     * HASHCHARS in size.
-     */
-    for (i = 0; i < st->npending; i++) {
-        unsigned char foo[HASHCHARS];
-        int j;
-        if (len + st->npending - i < HASHCHARS) {
-            /* Update the pending array. */
-            for (j = i; j < st->npending; j++)
-                st->pending[j - i] = st->pending[j];
+        /*
+         * A chain entry that doesn't go backwards has been
+         * overwritten by a position a whole window further on, so
+         * we've run off the end of the usable chain.
+         */
+        next = st->prev[cand & WINMASK];
+        if (next >= cand)
             break;
-        }
-        for (j = 0; j < HASHCHARS; j++)
-            foo[j] = (i + j < st->npending ? st->pending[i + j] :
-                      data[i + j - st->npending]);
-        lz77_advance(st, foo[0], lz77_hash(foo));
+        cand = next;
     }
-    st->npending -= i;
 
-    defermatch.distance = 0; /* appease compiler */
-    defermatch.len = 0;
-    deferchr = '\0';
-    while (len > 0) {
+    return found;
+}
 
-        if (len >= HASHCHARS) {
-            /*
-             * Hash the next few characters.
-             */
-            int hash = lz77_hash(data);
+static void lz77_literal(struct LZ77State *st, uint32_t pos)
+{
+    sgrowarray(st->syms, st->symsize, st->nsyms);
+    st->syms[st->nsyms].len = st->window[pos - st->base];
+    st->syms[st->nsyms].dist = 0;
+    st->nsyms++;
+}
 
-            /*
-             * Look the hash up in the corresponding hash chain and see
-             * what we can find.
-             */
-            nmatch = 0;
-            for (off = st->hashtab[hash].first;
-                 off != INVALID; off = st->win[off].next) {
-                /* distance = 1       if off == st->winpos-1 */
-                /* distance = WINSIZE if off == st->winpos   */
-                distance =
-                    WINSIZE - (off + WINSIZE - st->winpos) % WINSIZE;
-                for (i = 0; i < HASHCHARS; i++)
-                    if (CHARAT(i) != CHARAT(i - distance))
-                        break;
-                if (i == HASHCHARS) {
-                    matches[nmatch].distance = distance;
-                    matches[nmatch].len = 3;
-                    if (++nmatch >= MAXMATCH)
-                        break;
-                }
-            }
-        } else {
-            nmatch = 0;
+static void lz77_match(struct LZ77State *st, int len, int distance)
+{
+    sgrowarray(st->syms, st->symsize, st->nsyms);
+    st->syms[st->nsyms].len = len;
+    st->syms[st->nsyms].dist = distance;
+    st->nsyms++;
+}
+
+/*
+ * Generate symbols for all the data from 'pos' to the end of the
+ * buffer.
+ */
+static void lz77_compress(struct LZ77State *st, uint32_t pos)
+{
+    const LZ77Params *p = st->params;
+    int prev_len = 0, prev_dist = 0;
+    bool pending = false;      /* is there an unsent literal at pos-1? */
+
+    while (pos < st->end) {
+        int avail = st->end - pos, len = 0, dist = 0;
+
+        lz77_insert_upto(st, pos + 1);
+
+        if (avail >= MINMATCH && !(p->lazy && prev_len >= p->max_lazy)) {
+            len = lz77_longest_match(
+                st, pos, avail,
+                p->lazy && prev_len >= MINMATCH ? prev_len : MINMATCH - 1,
+                &dist);
+            if (len == MINMATCH && dist > TOO_FAR)
+                len = 0;
         }
 
-        if (nmatch > 0) {
-            /*
-             * We've now filled up matches[] with nmatch potential
-             * matches. Follow them down to find the longest. (We
-             * assume here that it's always worth favouring a
-             * longer match over a shorter one.)
-             */
-            matchlen = HASHCHARS;
-            while (matchlen < len) {
-                int j;
-                for (i = j = 0; i < nmatch; i++) {
-                    if (CHARAT(matchlen) ==
-                        CHARAT(matchlen - matches[i].distance)) {
-                        matches[j++] = matches[i];
-                    }
-                }
-                if (j == 0)
-                    break;
-                matchlen++;
-                nmatch = j;
+        if (!p->lazy) {
+            if (len) {
+                lz77_match(st, len, dist);
+                if (len > p->max_lazy)
+                    st->inserted = pos + len;
+                pos += len;
+            } else {
+                lz77_literal(st, pos);
+                pos++;
             }
-
+        } else if (prev_len >= MINMATCH && !len) {
             /*
-             * We've now got all the longest matches. We favour the
-             * shorter distances, which means we go with matches[0].
-             * So see if we want to defer it or throw it away.
+             * The match starting at the previous byte was the best
+             * we're going to do.
              */
-            matches[0].len = matchlen;
-            if (defermatch.len > 0) {
-                if (matches[0].len > defermatch.len + 1) {
-                    /* We have a better match. Emit the deferred char,
-                     * and defer this match. */
-                    ctx->literal(ctx, (unsigned char) deferchr);
-                    defermatch = matches[0];
-                    deferchr = data[0];
-                    advance = 1;
-                } else {
-                    /* We don't have a better match. Do the deferred one. */
-                    ctx->match(ctx, defermatch.distance, defermatch.len);
-                    advance = defermatch.len - 1;
-                    defermatch.len = 0;
-                }
-            } else {
-                /* There was no deferred match. Defer this one. */
-                defermatch = matches[0];
-                deferchr = data[0];
-                advance = 1;
-            }
+            lz77_match(st, prev_len, prev_dist);
+            pos += prev_len - 1;
+            prev_len = 0;
+            pending = false;
         } else {
             /*
-             * We found no matches. Emit the deferred match, if
-             * any; otherwise emit a literal.
+             * Either there's no match yet, or we've found a better
+             * one starting here, so the previous byte goes out as a
+             * literal and we wait and see about this one.
              */
-            if (defermatch.len > 0) {
-                ctx->match(ctx, defermatch.distance, defermatch.len);
-                advance = defermatch.len - 1;
-                defermatch.len = 0;
-            } else {
-                ctx->literal(ctx, data[0]);
-                advance = 1;
-            }
+            if (pending)
+                lz77_literal(st, pos - 1);
+            pending = true;
+            prev_len = len;
+            prev_dist = dist;
+            pos++;
         }
+    }
 
-        /*
-         * Now advance the position by `advance' characters,
-         * keeping the window and hash chains consistent.
-         */
-        while (advance > 0) {
-            if (len >= HASHCHARS) {
-                lz77_advance(st, *data, lz77_hash(data));
-            } else {
-                assert(st->npending < HASHCHARS);
-                st->pending[st->npending++] = *data;
+    if (pending) {
+        if (prev_len >= MINMATCH)
+            lz77_match(st, prev_len, prev_dist);
+        else
+            lz77_literal(st, pos - 1);
+    }
+}
+
+/*
+ * Append data to the window, sliding it along as necessary, and
+ * generate symbols for it if 'search' is true. If it's not, we skip
+ * hashing it too, on the grounds that data we didn't think worth
+ * searching isn't worth searching for in future either.
+ */
+static void lz77_add_data(struct LZ77State *st, const unsigned char *data,
+                          size_t len, bool search)
+{
+    while (len > 0) {
+        size_t chunk = len < WINSIZE ? len : WINSIZE;
+        uint32_t start;
+
+        if (st->end - st->base + chunk > 2 * WINSIZE) {
+            uint32_t shift = st->end - st->base - WINSIZE;
+            memmove(st->window, st->window + shift, WINSIZE);
+            st->base += shift;
+
+            if (st->base > 0x80000000U) {
+                /*
+                 * Renumber everything before the positions can wrap
+                 * round. Moving by a multiple of WINSIZE keeps the
+                 * indices into 'prev' the same.
+                 */
+                uint32_t delta = (st->base - 1) & ~(uint32_t)WINMASK;
+                size_t i;
+                for (i = 0; i < HASHSIZE; i++)
+                    st->head[i] = st->head[i] > delta ?
+                        st->head[i] - delta : 0;
+                for (i = 0; i < WINSIZE; i++)
+                    st->prev[i] = st->prev[i] > delta ?
+                        st->prev[i] - delta : 0;
+                st->base -= delta;
+                st->end -= delta;
+                st->inserted -= delta;
             }
-            data++;
-            len--;
-            advance--;
         }
+
+        memcpy(st->window + (st->end - st->base), data, chunk);
+        start = st->end;
+        st->end += chunk;
+
+        if (search)
+            lz77_compress(st, start);
+        else if (st->end - st->inserted > MINMATCH - 1)
+            st->inserted = st->end - (MINMATCH - 1);
+
+        data += chunk;
+        len -= chunk;
     }
 }
 
 /* ----------------------------------------------------------------------
- * Zlib compression. We always use the static Huffman tree option.
- * Mostly this is because it's hard to scan a block in advance to
- * work out better trees; dynamic trees are great when you're
- * compressing a large file under no significant time constraint,
- * but when you're compressing little bits in real time, things get
- * hairier.
+ * Zlib compression.
  *
- * I suppose it's possible that I could compute Huffman trees based
- * on the frequencies in the _previous_ block, as a sort of
- * heuristic, but I'm not confident that the gain would balance out
- * having to transmit the trees.
+ * Each packet is sent as a single Deflate block, using whichever of
+ * the static Huffman trees, a dynamic tree built for that packet, or
+ * no compression at all comes out shortest. Dynamic trees cost a
+ * header of typically 60-80 bytes, so small interactive packets
+ * mostly go as static blocks, while bulk data, which arrives in
+ * packets of tens of kilobytes, can afford the header easily.
  */
 
 struct Outbuf {
@@ -360,41 +368,6 @@ static void outbits(struct Outbuf *out, unsigned long bits, int nbits)
     }
 }
 
-static const unsigned char mirrorbytes[256] = {
-    0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0,
-    0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0,
-    0x08, 0x88, 0x48, 0xc8, 0x28, 0xa8, 0x68, 0xe8,
-    0x18, 0x98, 0x58, 0xd8, 0x38, 0xb8, 0x78, 0xf8,
-    0x04, 0x84, 0x44, 0xc4, 0x24, 0xa4, 0x64, 0xe4,
-    0x14, 0x94, 0x54, 0xd4, 0x34, 0xb4, 0x74, 0xf4,
-    0x0c, 0x8c, 0x4c, 0xcc, 0x2c, 0xac, 0x6c, 0xec,
-    0x1c, 0x9c, 0x5c, 0xdc, 0x3c, 0xbc, 0x7c, 0xfc,
-    0x02, 0x82, 0x42, 0xc2, 0x22, 0xa2, 0x62, 0xe2,
-    0x12, 0x92, 0x52, 0xd2, 0x32, 0xb2, 0x72, 0xf2,
-    0x0a, 0x8a, 0x4a, 0xca, 0x2a, 0xaa, 0x6a, 0xea,
-    0x1a, 0x9a, 0x5a, 0xda, 0x3a, 0xba, 0x7a, 0xfa,
-    0x06, 0x86, 0x46, 0xc6, 0x26, 0xa6, 0x66, 0xe6,
-    0x16, 0x96, 0x56, 0xd6, 0x36, 0xb6, 0x76, 0xf6,
-    0x0e, 0x8e, 0x4e, 0xce, 0x2e, 0xae, 0x6e, 0xee,
-    0x1e, 0x9e, 0x5e, 0xde, 0x3e, 0xbe, 0x7e, 0xfe,
-    0x01, 0x81, 0x41, 0xc1, 0x21, 0xa1, 0x61, 0xe1,
-    0x11, 0x91, 0x51, 0xd1, 0x31, 0xb1, 0x71, 0xf1,
-    0x09, 0x89, 0x49, 0xc9, 0x29, 0xa9, 0x69, 0xe9,
-    0x19, 0x99, 0x59, 0xd9, 0x39, 0xb9, 0x79, 0xf9,
-    0x05, 0x85, 0x45, 0xc5, 0x25, 0xa5, 0x65, 0xe5,
-    0x15, 0x95, 0x55, 0xd5, 0x35, 0xb5, 0x75, 0xf5,
-    0x0d, 0x8d, 0x4d, 0xcd, 0x2d, 0xad, 0x6d, 0xed,
-    0x1d, 0x9d, 0x5d, 0xdd, 0x3d, 0xbd, 0x7d, 0xfd,
-    0x03, 0x83, 0x43, 0xc3, 0x23, 0xa3, 0x63, 0xe3,
-    0x13, 0x93, 0x53, 0xd3, 0x33, 0xb3, 0x73, 0xf3,
-    0x0b, 0x8b, 0x4b, 0xcb, 0x2b, 0xab, 0x6b, 0xeb,
-    0x1b, 0x9b, 0x5b, 0xdb, 0x3b, 0xbb, 0x7b, 0xfb,
-    0x07, 0x87, 0x47, 0xc7, 0x27, 0xa7, 0x67, 0xe7,
-    0x17, 0x97, 0x57, 0xd7, 0x37, 0xb7, 0x77, 0xf7,
-    0x0f, 0x8f, 0x4f, 0xcf, 0x2f, 0xaf, 0x6f, 0xef,
-    0x1f, 0x9f, 0x5f, 0xdf, 0x3f, 0xbf, 0x7f, 0xff,
-};
-
 typedef struct {
     short code, extrabits;
     int min, max;
@@ -465,129 +438,457 @@ static const coderecord distcodes[] = {
     {29, 13, 24577, 32768},
 };
 
-static void zlib_literal(struct LZ77Context *ectx, unsigned char c)
-{
-    struct Outbuf *out = (struct Outbuf *) ectx->userdata;
+#define NLITLEN 288                    /* including the two unused codes */
+#define NDIST 30
+#define NCLEN 19
+#define MAXBITS 15
+#define MAXCLBITS 7
 
-    if (c <= 143) {
-        /* 0 through 143 are 8 bits long starting at 00110000. */
-        outbits(out, mirrorbytes[0x30 + c], 8);
-    } else {
-        /* 144 through 255 are 9 bits long starting at 110010000. */
-        outbits(out, 1 + 2 * mirrorbytes[0x90 - 144 + c], 9);
-    }
+/* The order in which code length code lengths are sent */
+static const unsigned char clen_order[NCLEN] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+typedef struct HuffLeaf {
+    unsigned freq;
+    int sym;
+} HuffLeaf;
+
+static int huffleaf_cmp(const void *av, const void *bv)
+{
+    const HuffLeaf *a = (const HuffLeaf *)av, *b = (const HuffLeaf *)bv;
+    if (a->freq != b->freq)
+        return a->freq < b->freq ? -1 : +1;
+    return a->sym < b->sym ? -1 : a->sym > b->sym ? +1 : 0;
 }
 
-static void zlib_match(struct LZ77Context *ectx, int distance, int len)
+/*
+ * Work out Huffman code lengths for a set of symbol frequencies, no
+ * longer than 'limit' bits. The result is always a complete code
+ * (zlib will reject anything else), so if fewer than two symbols
+ * are used, a dummy is added to make up the numbers.
+ */
+static void huffman_lengths(const unsigned *freqs, int nsyms, int limit,
+                            unsigned char *lens)
 {
-    const coderecord *d, *l;
-    int i, j, k;
-    struct Outbuf *out = (struct Outbuf *) ectx->userdata;
+    HuffLeaf leaves[NLITLEN];
+    unsigned weight[2 * NLITLEN];
+    int parent[2 * NLITLEN], depth[2 * NLITLEN];
+    unsigned kraft, cap = 1U << limit;
+    int n = 0, i, j, k;
 
-    while (len > 0) {
-        int thislen;
+    memset(lens, 0, nsyms);
+    for (i = 0; i < nsyms; i++) {
+        if (freqs[i]) {
+            leaves[n].freq = freqs[i];
+            leaves[n].sym = i;
+            n++;
+        }
+    }
 
-        /*
-         * We can transmit matches of lengths 3 through 258
-         * inclusive. So if len exceeds 258, we must transmit in
-         * several steps, with 258 or less in each step.
-         *
-         * Specifically: if len >= 261, we can transmit 258 and be
-         * sure of having at least 3 left for the next step. And if
-         * len <= 258, we can just transmit len. But if len == 259
-         * or 260, we must transmit len-3.
-         */
-        thislen = (len > 260 ? 258 : len <= 258 ? len : len - 3);
-        len -= thislen;
+    if (n < 2) {
+        int sym = n ? leaves[0].sym : 0;
+        lens[sym] = lens[sym == 0 ? 1 : 0] = 1;
+        return;
+    }
 
-        /*
-         * Binary-search to find which length code we're
-         * transmitting.
-         */
-        i = -1;
-        j = lenof(lencodes);
-        while (1) {
-            assert(j - i >= 2);
-            k = (j + i) / 2;
-            if (thislen < lencodes[k].min)
-                j = k;
-            else if (thislen > lencodes[k].max)
-                i = k;
-            else {
-                l = &lencodes[k];
-                break;                 /* found it! */
-            }
-        }
+    qsort(leaves, n, sizeof(*leaves), huffleaf_cmp);
 
-        /*
-         * Transmit the length code. 256-279 are seven bits
-         * starting at 0000000; 280-287 are eight bits starting at
-         * 11000000.
-         */
-        if (l->code <= 279) {
-            outbits(out, mirrorbytes[(l->code - 256) * 2], 7);
-        } else {
-            outbits(out, mirrorbytes[0xc0 - 280 + l->code], 8);
+    /*
+     * Build the tree by the two-queue method: the leaves are sorted,
+     * and the internal nodes are created in nondecreasing order of
+     * weight, so the two lightest nodes are always at the front of
+     * one queue or the other.
+     */
+    for (i = 0; i < n; i++)
+        weight[i] = leaves[i].freq;
+    for (i = 0, j = k = n; k < 2 * n - 1; k++) {
+        int c;
+        weight[k] = 0;
+        for (c = 0; c < 2; c++) {
+            int node = (i < n && (j >= k || weight[i] <= weight[j])) ?
+                i++ : j++;
+            parent[node] = k;
+            weight[k] += weight[node];
         }
+    }
+    depth[2 * n - 2] = 0;
+    for (k = 2 * n - 3; k >= 0; k--)
+        depth[k] = depth[parent[k]] + 1;
+
+    kraft = 0;
+    for (i = 0; i < n; i++) {
+        lens[leaves[i].sym] = depth[i] < limit ? depth[i] : limit;
+        kraft += 1U << (limit - lens[leaves[i].sym]);
+    }
 
-        /*
-         * Transmit the extra bits.
-         */
-        if (l->extrabits)
-            outbits(out, thislen - l->min, l->extrabits);
+    /*
+     * If we had to truncate any lengths to fit the limit, the code
+     * is now oversubscribed. Lengthen the rarest of the longest
+     * codes that can still be lengthened until it isn't...
+     */
+    while (kraft > cap) {
+        int best = -1;
+        for (i = 0; i < n; i++) {
+            int len = lens[leaves[i].sym];
+            if (len < limit && (best < 0 || len > lens[leaves[best].sym]))
+                best = i;
+        }
+        lens[leaves[best].sym]++;
+        kraft -= 1U << (limit - lens[leaves[best].sym]);
+    }
 
-        /*
-         * Binary-search to find which distance code we're
-         * transmitting.
-         */
-        i = -1;
-        j = lenof(distcodes);
-        while (1) {
-            assert(j - i >= 2);
-            k = (j + i) / 2;
-            if (distance < distcodes[k].min)
-                j = k;
-            else if (distance > distcodes[k].max)
-                i = k;
-            else {
-                d = &distcodes[k];
-                break;                 /* found it! */
+    /*
+     * ... which may have overshot, so then shorten the commonest
+     * codes we can without oversubscribing it again. The slack is
+     * always a multiple of the smallest term in the sum, so there's
+     * always a candidate.
+     */
+    while (kraft < cap) {
+        for (i = n - 1; i >= 0; i--) {
+            int len = lens[leaves[i].sym];
+            if (len > 1 && (1U << (limit - len)) <= cap - kraft) {
+                kraft += 1U << (limit - len);
+                lens[leaves[i].sym]--;
+                break;
             }
         }
+        assert(i >= 0);
+    }
+}
 
-        /*
-         * Transmit the distance code. Five bits starting at 00000.
-         */
-        outbits(out, mirrorbytes[d->code * 8], 5);
+/*
+ * Assign canonical codes to a set of code lengths (RFC1951 section
+ * 3.2.2), bit-reversed ready for outbits().
+ */
+static void huffman_codes(const unsigned char *lens, int nsyms,
+                          unsigned short *codes)
+{
+    unsigned count[MAXBITS + 1], next[MAXBITS + 1], code = 0;
+    int i, b;
+
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < nsyms; i++)
+        count[lens[i]]++;
+    count[0] = 0;
+    for (b = 1; b <= MAXBITS; b++) {
+        code = (code + count[b - 1]) << 1;
+        next[b] = code;
+    }
 
-        /*
-         * Transmit the extra bits.
-         */
-        if (d->extrabits)
-            outbits(out, distance - d->min, d->extrabits);
+    for (i = 0; i < nsyms; i++) {
+        unsigned c, r = 0;
+        if (!lens[i])
+            continue;
+        c = next[lens[i]]++;
+        for (b = 0; b < lens[i]; b++) {
+            r = (r << 1) | (c & 1);
+            c >>= 1;
+        }
+        codes[i] = r;
     }
 }
 
+typedef struct HuffTables {
+    unsigned char litlens[NLITLEN], distlens[NDIST];
+    unsigned short litcodes[NLITLEN], distcodes[NDIST];
+} HuffTables;
+
+/*
+ * Everything needed to send the header of a dynamic-trees block: the
+ * code lengths, run-length encoded, and the code used to send those.
+ */
+typedef struct DynHeader {
+    HuffTables t;
+    int hlit, hdist, hclen;
+    unsigned char cllens[NCLEN];
+    unsigned short clcodes[NCLEN];
+    unsigned char rle[NLITLEN + NDIST], rle_extra[NLITLEN + NDIST];
+    int nrle;
+} DynHeader;
+
 struct ssh_zlib_compressor {
-    struct LZ77Context ectx;
+    struct LZ77State lz;
+    struct Outbuf out;
+    int level;
+    unsigned stored_run;     /* number of consecutive packets sent stored */
+    HuffTables fixed;
+    unsigned char len_code[MAXMATCH + 1];   /* index into lencodes */
+    unsigned char dist_code[512];           /* see zlib_dist_code */
     ssh_compressor sc;
 };
 
-static ssh_compressor *zlib_compress_init(void)
+/*
+ * Distances up to 256 are looked up directly; above that, every
+ * distance code covers a multiple of 128 values, so they can be
+ * looked up by (distance-1)/128.
+ */
+static inline int zlib_dist_code(struct ssh_zlib_compressor *comp, int dist)
+{
+    dist--;
+    return comp->dist_code[dist < 256 ? dist : 256 + (dist >> 7)];
+}
+
+static void zlib_count(struct ssh_zlib_compressor *comp,
+                       unsigned *litfreqs, unsigned *distfreqs)
+{
+    const LZ77Symbol *sym = comp->lz.syms, *end = sym + comp->lz.nsyms;
+
+    memset(litfreqs, 0, NLITLEN * sizeof(*litfreqs));
+    memset(distfreqs, 0, NDIST * sizeof(*distfreqs));
+    litfreqs[256] = 1;                 /* end of block */
+    for (; sym < end; sym++) {
+        if (!sym->dist) {
+            litfreqs[sym->len]++;
+        } else {
+            litfreqs[257 + comp->len_code[sym->len]]++;
+            distfreqs[zlib_dist_code(comp, sym->dist)]++;
+        }
+    }
+}
+
+/* Number of bits it will take to send the packet's symbols. */
+static unsigned long zlib_data_cost(
+    const HuffTables *t, const unsigned *litfreqs, const unsigned *distfreqs)
+{
+    unsigned long bits = 0;
+    int i;
+
+    for (i = 0; i < 257; i++)
+        bits += (unsigned long)litfreqs[i] * t->litlens[i];
+    for (i = 0; i < lenof(lencodes); i++)
+        bits += (unsigned long)litfreqs[257 + i] *
+            (t->litlens[257 + i] + lencodes[i].extrabits);
+    for (i = 0; i < NDIST; i++)
+        bits += (unsigned long)distfreqs[i] *
+            (t->distlens[i] + distcodes[i].extrabits);
+    return bits;
+}
+
+static void zlib_dyn_rle_add(DynHeader *dh, int sym, int extra)
+{
+    dh->rle[dh->nrle] = sym;
+    dh->rle_extra[dh->nrle] = extra;
+    dh->nrle++;
+}
+
+/*
+ * Construct dynamic trees for the packet, and return the number of
+ * bits the block header will take to describe them.
+ */
+static unsigned long zlib_dyn_build(
+    DynHeader *dh, const unsigned *litfreqs, const unsigned *distfreqs)
+{
+    unsigned char lens[NLITLEN + NDIST];
+    unsigned clfreqs[NCLEN];
+    unsigned long bits;
+    int i, n;
+
+    huffman_lengths(litfreqs, NLITLEN - 2, MAXBITS, dh->t.litlens);
+    dh->t.litlens[NLITLEN - 2] = dh->t.litlens[NLITLEN - 1] = 0;
+    huffman_lengths(distfreqs, NDIST, MAXBITS, dh->t.distlens);
+    huffman_codes(dh->t.litlens, NLITLEN, dh->t.litcodes);
+    huffman_codes(dh->t.distlens, NDIST, dh->t.distcodes);
+
+    for (dh->hlit = NLITLEN - 2; dh->hlit > 257; dh->hlit--)
+        if (dh->t.litlens[dh->hlit - 1])
+            break;
+    for (dh->hdist = NDIST; dh->hdist > 1; dh->hdist--)
+        if (dh->t.distlens[dh->hdist - 1])
+            break;
+
+    /*
+     * Run-length encode the two sets of code lengths as one
+     * sequence, using code 16 for repeats of the previous length and
+     * 17 and 18 for runs of zeroes.
+     */
+    n = dh->hlit + dh->hdist;
+    memcpy(lens, dh->t.litlens, dh->hlit);
+    memcpy(lens + dh->hlit, dh->t.distlens, dh->hdist);
+    dh->nrle = 0;
+    for (i = 0; i < n;) {
+        int len = lens[i], run = 1;
+        while (i + run < n && lens[i + run] == len)
+            run++;
+        i += run;
+
+        if (len == 0) {
+            while (run >= 11) {
+                int r = run < 138 ? run : 138;
+                zlib_dyn_rle_add(dh, 18, r - 11);
+                run -= r;
+            }
+            if (run >= 3) {
+                zlib_dyn_rle_add(dh, 17, run - 3);
+                run = 0;
+            }
+        } else {
+            zlib_dyn_rle_add(dh, len, 0);
+            run--;
+            while (run >= 3) {
+                int r = run < 6 ? run : 6;
+                zlib_dyn_rle_add(dh, 16, r - 3);
+                run -= r;
+            }
+        }
+        while (run-- > 0)
+            zlib_dyn_rle_add(dh, len, 0);
+    }
+
+    memset(clfreqs, 0, sizeof(clfreqs));
+    for (i = 0; i < dh->nrle; i++)
+        clfreqs[dh->rle[i]]++;
+    huffman_lengths(clfreqs, NCLEN, MAXCLBITS, dh->cllens);
+    huffman_codes(dh->cllens, NCLEN, dh->clcodes);
+
+    for (dh->hclen = NCLEN; dh->hclen > 4; dh->hclen--)
+        if (dh->cllens[clen_order[dh->hclen - 1]])
+            break;
+
+    bits = 3 + 5 + 5 + 4 + 3 * dh->hclen;
+    for (i = 0; i < NCLEN; i++)
+        bits += (unsigned long)clfreqs[i] * dh->cllens[i];
+    bits += 2 * clfreqs[16] + 3 * clfreqs[17] + 7 * clfreqs[18];
+    return bits;
+}
+
+static void zlib_dyn_send_header(struct Outbuf *out, const DynHeader *dh)
+{
+    static const unsigned char extrabits[3] = { 2, 3, 7 };
+    int i;
+
+    /* BFINAL=0, BTYPE=10, in the wrong order as usual */
+    outbits(out, 4, 3);
+    outbits(out, dh->hlit - 257, 5);
+    outbits(out, dh->hdist - 1, 5);
+    outbits(out, dh->hclen - 4, 4);
+    for (i = 0; i < dh->hclen; i++)
+        outbits(out, dh->cllens[clen_order[i]], 3);
+    for (i = 0; i < dh->nrle; i++) {
+        int sym = dh->rle[i];
+        outbits(out, dh->clcodes[sym], dh->cllens[sym]);
+        if (sym >= 16)
+            outbits(out, dh->rle_extra[i], extrabits[sym - 16]);
+    }
+}
+
+/* Send the packet's symbols, and the end-of-block code. */
+static void zlib_send_symbols(struct ssh_zlib_compressor *comp,
+                              const HuffTables *t)
+{
+    struct Outbuf *out = &comp->out;
+    const LZ77Symbol *sym = comp->lz.syms, *end = sym + comp->lz.nsyms;
+
+    for (; sym < end; sym++) {
+        if (!sym->dist) {
+            outbits(out, t->litcodes[sym->len], t->litlens[sym->len]);
+        } else {
+            int lc = comp->len_code[sym->len];
+            int dc = zlib_dist_code(comp, sym->dist);
+            const coderecord *l = &lencodes[lc], *d = &distcodes[dc];
+
+            /* A length code plus its extra bits fits in one go */
+            outbits(out, t->litcodes[l->code] |
+                    ((unsigned long)(sym->len - l->min) <<
+                     t->litlens[l->code]),
+                    t->litlens[l->code] + l->extrabits);
+            outbits(out, t->distcodes[dc], t->distlens[dc]);
+            if (d->extrabits)
+                outbits(out, sym->dist - d->min, d->extrabits);
+        }
+    }
+
+    outbits(out, t->litcodes[256], t->litlens[256]);
+}
+
+static void zlib_send_stored(struct Outbuf *out,
+                             const unsigned char *data, size_t len)
+{
+    do {
+        size_t chunk = len < 0xFFFF ? len : 0xFFFF;
+
+        /* BFINAL=0, BTYPE=00, then sync to a byte boundary */
+        outbits(out, 0, 3);
+        if (out->noutbits)
+            outbits(out, 0, 8 - out->noutbits);
+        outbits(out, chunk, 16);
+        outbits(out, chunk ^ 0xFFFF, 16);
+        put_data(out->outbuf, data, chunk);
+
+        data += chunk;
+        len -= chunk;
+    } while (len > 0);
+}
+
+/*
+ * Once a packet has come out no smaller for compressing it, the data
+ * going past is probably already compressed or encrypted (someone
+ * copying a .gz file, say), and searching it for matches is largely
+ * wasted effort. So after that, we first make a much cheaper check of
+ * whether the byte frequencies alone promise any saving, and if they
+ * don't, send the packet stored without further ado. Every so often
+ * we do the full job regardless, in case the data has changed
+ * character in a way the cheap check can't see.
+ */
+#define ZLIB_RETRY_INTERVAL 32
+
+static bool zlib_worth_compressing(struct ssh_zlib_compressor *comp,
+                                   const unsigned char *data, int len)
+{
+    unsigned freqs[256];
+    unsigned char lens[256];
+    unsigned long bits = 0;
+    int i;
+
+    if (comp->level == 0)
+        return false;
+    if (comp->stored_run % ZLIB_RETRY_INTERVAL == 0)
+        return true;
+
+    memset(freqs, 0, sizeof(freqs));
+    for (i = 0; i < len; i++)
+        freqs[data[i]]++;
+    huffman_lengths(freqs, 256, MAXBITS, lens);
+    for (i = 0; i < 256; i++)
+        bits += (unsigned long)freqs[i] * lens[i];
+
+    return bits < (unsigned long)len * 8 * 15 / 16;
+}
+
+static ssh_compressor *zlib_compress_init(int level)
 {
-    struct Outbuf *out;
     struct ssh_zlib_compressor *comp = snew(struct ssh_zlib_compressor);
+    int i, j;
 
-    lz77_init(&comp->ectx);
+    if (level < 0)
+        level = 0;
+    if (level > 9)
+        level = 9;
+    comp->level = level;
+    comp->stored_run = 0;
+    lz77_init(&comp->lz, level);
     comp->sc.vt = &ssh_zlib;
-    comp->ectx.literal = zlib_literal;
-    comp->ectx.match = zlib_match;
 
-    out = snew(struct Outbuf);
-    out->outbuf = NULL;
-    out->outbits = out->noutbits = 0;
-    out->firstblock = true;
-    comp->ectx.userdata = out;
+    comp->out.outbuf = NULL;
+    comp->out.outbits = comp->out.noutbits = 0;
+    comp->out.firstblock = true;
+
+    /* The static trees, from RFC1951 section 3.2.6 */
+    for (i = 0; i < NLITLEN; i++)
+        comp->fixed.litlens[i] = (i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8);
+    for (i = 0; i < NDIST; i++)
+        comp->fixed.distlens[i] = 5;
+    huffman_codes(comp->fixed.litlens, NLITLEN, comp->fixed.litcodes);
+    huffman_codes(comp->fixed.distlens, NDIST, comp->fixed.distcodes);
+
+    for (i = 0; i < lenof(lencodes); i++)
+        for (j = lencodes[i].min; j <= lencodes[i].max; j++)
+            comp->len_code[j] = i;
+    /* 258 can be sent either way, but only code 285 does it in one */
+    comp->len_code[MAXMATCH] = lenof(lencodes) - 1;
+    for (i = 0; i < lenof(distcodes); i++)
+        for (j = distcodes[i].min - 1; j < distcodes[i].max; j++)
+            comp->dist_code[j < 256 ? j : 256 + (j >> 7)] = i;
 
     return &comp->sc;
 }
@@ -596,11 +897,9 @@ static void zlib_compress_cleanup(ssh_compressor *sc)
 {
     struct ssh_zlib_compressor *comp =
         container_of(sc, struct ssh_zlib_compressor, sc);
-    struct Outbuf *out = (struct Outbuf *)comp->ectx.userdata;
-    if (out->outbuf)
-        strbuf_free(out->outbuf);
-    sfree(out);
-    sfree(comp->ectx.ictx);
+    if (comp->out.outbuf)
+        strbuf_free(comp->out.outbuf);
+    sfree(comp->lz.syms);
     sfree(comp);
 }
 
@@ -610,8 +909,8 @@ static void zlib_compress_block(
 {
     struct ssh_zlib_compressor *comp =
         container_of(sc, struct ssh_zlib_compressor, sc);
-    struct Outbuf *out = (struct Outbuf *) comp->ectx.userdata;
-    bool in_block;
+    struct Outbuf *out = &comp->out;
+    bool stored;
 
     assert(!out->outbuf);
     out->outbuf = strbuf_new_nm();
@@ -624,62 +923,73 @@ static void zlib_compress_block(
     if (out->firstblock) {
         outbits(out, 0x9C78, 16);
         out->firstblock = false;
+    }
 
-        in_block = false;
-    } else
-        in_block = true;
+    if (!zlib_worth_compressing(comp, block, len)) {
+        lz77_add_data(&comp->lz, block, len, false);
+        stored = true;
+    } else {
+        unsigned litfreqs[NLITLEN], distfreqs[NDIST];
+        unsigned long fixed_bits, dyn_bits, stored_bits;
+        DynHeader dh;
+
+        comp->lz.nsyms = 0;
+        lz77_add_data(&comp->lz, block, len, true);
 
-    if (!in_block) {
         /*
-         * Start a Deflate (RFC1951) fixed-trees block. We
-         * transmit a zero bit (BFINAL=0), followed by a zero
-         * bit and a one bit (BTYPE=01). Of course these are in
-         * the wrong order (01 0).
+         * Cost up the alternatives. Stored blocks carry up to 64K
+         * each and need up to 7 bits of padding, but on the other
+         * hand leave us on a byte boundary, so they don't need the
+         * 10 bits of flush at the end (see below).
          */
-        outbits(out, 2, 3);
-    }
+        zlib_count(comp, litfreqs, distfreqs);
+        fixed_bits = 3 + zlib_data_cost(&comp->fixed, litfreqs, distfreqs) +
+            10;
+        /* A dynamic tree header won't pay for itself on a tiny packet */
+        dyn_bits = comp->lz.nsyms < 64 ? ULONG_MAX :
+            zlib_dyn_build(&dh, litfreqs, distfreqs) +
+            zlib_data_cost(&dh.t, litfreqs, distfreqs) + 10;
+        stored_bits = 8 * (unsigned long)len +
+            (3 + 7 + 32) * ((len + 0xFFFE) / 0xFFFF);
+
+        stored = (stored_bits < fixed_bits && stored_bits < dyn_bits);
+        if (!stored) {
+            if (fixed_bits <= dyn_bits) {
+                /* BFINAL=0, BTYPE=01 */
+                outbits(out, 2, 3);
+                zlib_send_symbols(comp, &comp->fixed);
+            } else {
+                zlib_dyn_send_header(out, &dh);
+                zlib_send_symbols(comp, &dh.t);
+            }
 
-    /*
-     * Do the compression.
-     */
-    lz77_compress(&comp->ectx, block, len);
+            /*
+             * Now we've closed the block, transmit an empty static
+             * block to ensure we have emitted the byte containing
+             * the last piece of genuine data. This is what zlib
+             * calls a partial flush. (The alternatives are to send
+             * nothing and rely on the next block's header to push
+             * it out, which allegedly zlib can't handle, or a sync
+             * flush, which is an empty stored block and costs more.)
+             */
+            outbits(out, 2, 3 + 7);
+        }
+    }
 
-    /*
-     * End the block (by transmitting code 256, which is
-     * 0000000 in fixed-tree mode), and transmit some empty
-     * blocks to ensure we have emitted the byte containing the
-     * last piece of genuine data. There are three ways we can
-     * do this:
-     *
-     *  - Minimal flush. Output end-of-block and then open a
-     *    new static block. This takes 9 bits, which is
-     *    guaranteed to flush out the last genuine code in the
-     *    closed block; but allegedly zlib can't handle it.
-     *
-     *  - Zlib partial flush. Output EOB, open and close an
-     *    empty static block, and _then_ open the new block.
-     *    This is the best zlib can handle.
-     *
-     *  - Zlib sync flush. Output EOB, then an empty
-     *    _uncompressed_ block (000, then sync to byte
-     *    boundary, then send bytes 00 00 FF FF). Then open the
-     *    new block.
-     *
-     * For the moment, we will use Zlib partial flush.
-     */
-    outbits(out, 0, 7);        /* close block */
-    outbits(out, 2, 3 + 7);    /* empty static block */
-    outbits(out, 2, 3);        /* open new block */
+    if (stored) {
+        zlib_send_stored(out, block, len);
+        comp->stored_run++;
+    } else {
+        comp->stored_run = 0;
+    }
 
     /*
      * If we've been asked to pad out the compressed data until it's
      * at least a given length, do so by emitting further empty static
      * blocks.
      */
-    while (out->outbuf->len < minlen) {
-        outbits(out, 0, 7);            /* close block */
-        outbits(out, 2, 3);            /* open new static block */
-    }
+    while (out->outbuf->len < minlen)
+        outbits(out, 2, 3 + 7);
 
     *outlen = out->outbuf->len;
     *outblock = (unsigned char *)strbuf_to_str(out->outbuf);
@@ -687,84 +997,36 @@ static void zlib_compress_block(
 }
 
 /* ----------------------------------------------------------------------
- * Zlib decompression. Of course, even though our compressor always
- * uses static trees, our _decompressor_ has to be capable of
- * handling dynamic trees if it sees them.
+ * Zlib decompression.
  */
 
 /*
  * The way we work the Huffman decode is to have a table lookup on
  * the first N bits of the input stream (in the order they arrive,
  * of course, i.e. the first bit of the Huffman code is in bit 0).
- * Each table entry lists the number of bits to consume, plus
- * either an output code or a pointer to a secondary table.
+ * Each table entry gives the symbol and the number of bits to
+ * consume. Codes longer than N bits (which are rare, because they're
+ * only given to rare symbols) are handled by making the entry for
+ * their first N bits a link to a subtable, indexed by the next few
+ * bits. The subtables live in the same array as the main table, so
+ * building a table costs one allocation, and a lookup costs at most
+ * two array accesses.
  */
-struct zlib_table;
-struct zlib_tableentry;
-
 struct zlib_tableentry {
-    unsigned char nbits;
-    short code;
-    struct zlib_table *nexttable;
+    unsigned short sym;        /* symbol, or subtable index for a link */
+    unsigned char nbits;       /* bits to consume; 0 means invalid code */
+    unsigned char subbits;     /* if nonzero, a link to a subtable */
 };
 
 struct zlib_table {
-    int mask;                          /* mask applied to input bit stream */
+    int rootbits;
+    unsigned rootmask;
     struct zlib_tableentry *table;
 };
 
 #define MAXCODELEN 16
 #define MAXSYMS 288
-
-/*
- * Build a single-level decode table for elements
- * [minlength,maxlength) of the provided code/length tables, and
- * recurse to build subtables.
- */
-static struct zlib_table *zlib_mkonetab(int *codes, unsigned char *lengths,
-                                        int nsyms,
-                                        int pfx, int pfxbits, int bits)
-{
-    struct zlib_table *tab = snew(struct zlib_table);
-    int pfxmask = (1 << pfxbits) - 1;
-    int nbits, i, j, code;
-
-    tab->table = snewn((size_t)1 << bits, struct zlib_tableentry);
-    tab->mask = (1 << bits) - 1;
-
-    for (code = 0; code <= tab->mask; code++) {
-        tab->table[code].code = -1;
-        tab->table[code].nbits = 0;
-        tab->table[code].nexttable = NULL;
-    }
-
-    for (i = 0; i < nsyms; i++) {
-        if (lengths[i] <= pfxbits || (codes[i] & pfxmask) != pfx)
-            continue;
-        code = (codes[i] >> pfxbits) & tab->mask;
-        for (j = code; j <= tab->mask; j += 1 << (lengths[i] - pfxbits)) {
-            tab->table[j].code = i;
-            nbits = lengths[i] - pfxbits;
-            if (tab->table[j].nbits < nbits)
-                tab->table[j].nbits = nbits;
-        }
-    }
-    for (code = 0; code <= tab->mask; code++) {
-        if (tab->table[code].nbits <= bits)
-            continue;
-        /* Generate a subtable. */
-        tab->table[code].code = -1;
-        nbits = tab->table[code].nbits - bits;
-        if (nbits > 7)
-            nbits = 7;
-        tab->table[code].nbits = bits;
-        tab->table[code].nexttable = zlib_mkonetab(codes, lengths, nsyms,
-                                                   pfx | (code << pfxbits),
-                                                   pfxbits + bits, nbits);
-    }
-
-    return tab;
-}
+#define ROOTBITS 10
 
 /*
  * Build a decode table, given a set of Huffman tree lengths.
@@ -773,7 +1035,10 @@ static struct zlib_table *zlib_mktable(unsigned char *lengths,
                                        int nlengths)
 {
     int count[MAXCODELEN], startcode[MAXCODELEN], codes[MAXSYMS];
-    int code, maxlen;
+    unsigned char sublen[1 << ROOTBITS];
+    unsigned short suboff[1 << ROOTBITS];
+    struct zlib_table *tab;
+    int code, maxlen, rootbits, size;
     int i, j;
 
     /* Count the codes of each length. */
@@ -803,17 +1068,75 @@ static struct zlib_table *zlib_mktable(unsigned char *lengths,
     }
 
     /*
-     * Now we have the complete list of Huffman codes. Build a
-     * table.
+     * Now we have the complete list of Huffman codes. Work out how
+     * big a subtable each prefix of the long codes needs, and hence
+     * the size of the whole table.
      */
-    return zlib_mkonetab(codes, lengths, nlengths, 0, 0,
-                         maxlen < 9 ? maxlen : 9);
+    rootbits = maxlen < 1 ? 1 : maxlen < ROOTBITS ? maxlen : ROOTBITS;
+    memset(sublen, 0, sizeof(sublen));
+    for (i = 0; i < nlengths; i++) {
+        if (lengths[i] > rootbits) {
+            int pfx = codes[i] & ((1 << rootbits) - 1);
+            if (sublen[pfx] < lengths[i] - rootbits)
+                sublen[pfx] = lengths[i] - rootbits;
+        }
+    }
+    size = 1 << rootbits;
+    for (i = 0; i < (1 << rootbits); i++) {
+        suboff[i] = size;
+        if (sublen[i])
+            size += 1 << sublen[i];
+    }
+
+    tab = snew(struct zlib_table);
+    tab->rootbits = rootbits;
+    tab->rootmask = (1 << rootbits) - 1;
+    tab->table = snewn(size, struct zlib_tableentry);
+    memset(tab->table, 0, size * sizeof(*tab->table));
+
+    for (i = 0; i < (1 << rootbits); i++) {
+        if (sublen[i]) {
+            tab->table[i].sym = suboff[i];
+            tab->table[i].nbits = rootbits;
+            tab->table[i].subbits = sublen[i];
+        }
+    }
+
+    /*
+     * Fill in every table entry whose index starts with each code.
+     * (If the lengths were nonsense and the code is oversubscribed,
+     * later symbols will just overwrite earlier ones, which is as
+     * good as anything else. Subtable offsets are always taken from
+     * suboff[] rather than the entry in the main table, which might
+     * have been overwritten.)
+     */
+    for (i = 0; i < nlengths; i++) {
+        struct zlib_tableentry ent;
+        int len = lengths[i];
+
+        if (!len)
+            continue;
+        ent.sym = i;
+        ent.subbits = 0;
+        if (len <= rootbits) {
+            ent.nbits = len;
+            for (j = codes[i]; j < (1 << rootbits); j += 1 << len)
+                tab->table[j] = ent;
+        } else {
+            int pfx = codes[i] & tab->rootmask;
+            ent.nbits = len - rootbits;
+            for (j = codes[i] >> rootbits; j < (1 << sublen[pfx]);
+                 j += 1 << ent.nbits)
+                tab->table[suboff[pfx] + j] = ent;
+        }
+    }
+
+    return tab;
 }
 
 static int zlib_freetable(struct zlib_table **ztab)
 {
     struct zlib_table *tab;
-    int code;
 
     if (ztab == NULL)
         return -1;
@@ -822,11 +1145,6 @@ static int zlib_freetable(struct zlib_table **ztab)
         return 0;
 
     tab = *ztab;
-
-    for (code = 0; code <= tab->mask; code++)
-        if (tab->table[code].nexttable != NULL)
-            zlib_freetable(&tab->table[code].nexttable);
-
     sfree(tab->table);
     tab->table = NULL;
 
@@ -894,10 +1212,10 @@ struct zlib_decompress_ctx {
      */
     unsigned char lengths[288 + 32];
 
-    unsigned long bits;
+    uint64_t bits;
     int nbits;
     unsigned char window[WINSIZE];
-    int winpos;
+    size_t winpos, winfill;
     strbuf *outblk;
 
     ssh_decompressor dc;
@@ -919,7 +1237,7 @@ static ssh_decompressor *zlib_decompress_init(void)
     dctx->currlentable = dctx->currdisttable = dctx->lenlentable = NULL;
     dctx->bits = 0;
     dctx->nbits = 0;
-    dctx->winpos = 0;
+    dctx->winpos = dctx->winfill = 0;
     dctx->outblk = NULL;
 
     dctx->dc.vt = &ssh_zlib;
@@ -944,45 +1262,263 @@ static void zlib_decompress_cleanup(ssh_decompressor *dc)
     sfree(dctx);
 }
 
-static int zlib_huflookup(unsigned long *bitsp, int *nbitsp,
+/* End of a compressed block: discard any dynamic trees */
+static void zlib_end_block(struct zlib_decompress_ctx *dctx)
+{
+    dctx->state = OUTSIDEBLK;
+    if (dctx->currlentable != dctx->staticlentable) {
+        zlib_freetable(&dctx->currlentable);
+        dctx->currlentable = NULL;
+    }
+    if (dctx->currdisttable != dctx->staticdisttable) {
+        zlib_freetable(&dctx->currdisttable);
+        dctx->currdisttable = NULL;
+    }
+}
+
+/*
+ * Look up the next Huffman code in the bit stream, without consuming
+ * it. Returns the symbol, and sets *used to the length of its code,
+ * or to 0 if the bits don't match any code. In the latter case
+ * *width is how many bits the lookup depended on.
+ */
+static inline int zlib_lookup(const struct zlib_table *tab, uint64_t bits,
+                              int *used, int *width)
+{
+    const struct zlib_tableentry *ent = &tab->table[bits & tab->rootmask];
+    int n = 0;
+
+    *width = tab->rootbits;
+    if (ent->subbits) {
+        n = tab->rootbits;
+        *width += ent->subbits;
+        ent = &tab->table[ent->sym +
+                          ((bits >> n) & ((1U << ent->subbits) - 1))];
+    }
+    *used = ent->nbits ? n + ent->nbits : 0;
+    return ent->sym;
+}
+
+static int zlib_huflookup(uint64_t *bitsp, int *nbitsp,
                           struct zlib_table *tab)
 {
-    unsigned long bits = *bitsp;
-    int nbits = *nbitsp;
-    while (1) {
-        struct zlib_tableentry *ent;
-        ent = &tab->table[bits & tab->mask];
-        if (ent->nbits > nbits)
-            return -1;                 /* not enough data */
-        bits >>= ent->nbits;
-        nbits -= ent->nbits;
-        if (ent->code == -1)
-            tab = ent->nexttable;
-        else {
-            *bitsp = bits;
-            *nbitsp = nbits;
-            return ent->code;
-        }
+    int used, width, code = zlib_lookup(tab, *bitsp, &used, &width);
 
-        if (!tab) {
-            /*
-             * There was a missing entry in the table, presumably
-             * due to an invalid Huffman table description, and the
-             * subsequent data has attempted to use the missing
-             * entry. Return a decoding failure.
-             */
-            return -2;
-        }
+    if (!used) {
+        /*
+         * There was a missing entry in the table, presumably due to
+         * an invalid Huffman table description, and the subsequent
+         * data has attempted to use the missing entry. Return a
+         * decoding failure - unless we didn't have all the bits the
+         * lookup depended on, in which case the real ones might turn
+         * out to be different.
+         */
+        return *nbitsp < width ? -1 : -2;
     }
+    if (used > *nbitsp)
+        return -1;                     /* not enough data */
+    *bitsp >>= used;
+    *nbitsp -= used;
+    return code;
 }
 
 static void zlib_emit_char(struct zlib_decompress_ctx *dctx, int c)
 {
-    dctx->window[dctx->winpos] = c;
-    dctx->winpos = (dctx->winpos + 1) & (WINSIZE - 1);
     put_byte(dctx->outblk, c);
 }
 
+/*
+ * Copy a match into 'dst', which follows 'done' bytes of output
+ * already produced by this call. Anything further back than that
+ * comes from the window of earlier calls' output.
+ */
+static void zlib_copy_match(struct zlib_decompress_ctx *dctx,
+                            unsigned char *dst, size_t done,
+                            int dist, int len)
+{
+    if ((size_t)dist > done) {
+        size_t back = dist - done;
+        size_t wpos = (dctx->winpos - back) & (WINSIZE - 1);
+        size_t n = back < (size_t)len ? back : len;
+
+        len -= n;
+        while (n > 0) {
+            size_t chunk = n < WINSIZE - wpos ? n : WINSIZE - wpos;
+            memcpy(dst, dctx->window + wpos, chunk);
+            dst += chunk;
+            n -= chunk;
+            wpos = (wpos + chunk) & (WINSIZE - 1);
+        }
+    }
+
+    if (len > 0) {
+        const unsigned char *src = dst - dist;
+        if (dist >= len) {
+            memcpy(dst, src, len);
+        } else {
+            /* Overlapping copy, repeating the last 'dist' bytes */
+            while (len-- > 0)
+                *dst++ = *src++;
+        }
+    }
+}
+
+/*
+ * Append a call's output to the window, for matches in later calls
+ * to refer back to.
+ */
+static void zlib_update_window(struct zlib_decompress_ctx *dctx,
+                               const unsigned char *data, size_t len)
+{
+    size_t first;
+
+    if (len >= WINSIZE) {
+        memcpy(dctx->window, data + len - WINSIZE, WINSIZE);
+        dctx->winpos = 0;
+        dctx->winfill = WINSIZE;
+        return;
+    }
+
+    first = len < WINSIZE - dctx->winpos ? len : WINSIZE - dctx->winpos;
+    memcpy(dctx->window + dctx->winpos, data, first);
+    memcpy(dctx->window, data + first, len - first);
+    dctx->winpos = (dctx->winpos + len) & (WINSIZE - 1);
+    dctx->winfill = (dctx->winfill + len < WINSIZE ?
+                     dctx->winfill + len : WINSIZE);
+}
+
+/*
+ * Claim space in the output strbuf for at least 'n' more bytes after
+ * the 'used' bytes written so far. Anything not written has to be
+ * given back with strbuf_shrink_to.
+ */
+static unsigned char *zlib_out_space(strbuf *out, size_t used, size_t n,
+                                     unsigned char **end)
+{
+    strbuf_shrink_to(out, used);
+    strbuf_append(out, n > used ? n : used);
+    *end = out->u + out->len;
+    return out->u + used;
+}
+
+/*
+ * Bits needed to be sure of decoding a whole length/distance pair:
+ * up to 15 for the length code, 5 extra bits, 15 for the distance
+ * code and 13 extra bits.
+ */
+#define FAST_MATCH_BITS (15 + 5 + 15 + 13)
+
+/*
+ * Fast path for decoding the body of a compressed block, used while
+ * there's at least 8 bytes of input left, so that the bit buffer
+ * can always be refilled with a single 64-bit load. After a refill
+ * there are at least 56 bits in hand, which is always enough for a
+ * whole match, or for several literals in a row.
+ *
+ * Returns false on a decoding error. Otherwise, it stops at the end
+ * of the block, or when the input runs low, and leaves dctx->state
+ * for the ordinary state machine to pick up from.
+ */
+static bool zlib_decode_fast(struct zlib_decompress_ctx *dctx,
+                             const unsigned char **blockp, int *lenp)
+{
+    const unsigned char *in = *blockp, *inend = in + *lenp;
+    const struct zlib_table *lt = dctx->currlentable;
+    const struct zlib_table *dt = dctx->currdisttable;
+    strbuf *out = dctx->outblk;
+    unsigned char *op, *oend;
+    uint64_t bits = dctx->bits;
+    int nbits = dctx->nbits;
+    bool ok = true;
+
+    op = zlib_out_space(out, out->len, 4096, &oend);
+
+    while (inend - in >= 8) {
+        if (oend - op < MAXMATCH)
+            op = zlib_out_space(out, op - out->u, 4096, &oend);
+
+        /*
+         * Refill to between 56 and 63 bits. This ORs in some bits
+         * beyond the ones we count as present, but they're the
+         * genuine next input bits, so the next refill will OR in
+         * exactly the same values again.
+         */
+        bits |= GET_64BIT_LSB_FIRST(in) << nbits;
+        in += (63 - nbits) >> 3;
+        nbits |= 56;
+
+        while (1) {
+            int used, width, sym = zlib_lookup(lt, bits, &used, &width);
+
+            if (!used) {
+                ok = false;
+                goto out;
+            }
+
+            if (sym < 256) {
+                bits >>= used;
+                nbits -= used;
+                *op++ = sym;
+                if (nbits < 15 || op == oend)
+                    break;
+                continue;
+            }
+
+            if (nbits < FAST_MATCH_BITS)
+                break;
+            bits >>= used;
+            nbits -= used;
+
+            if (sym == 256) {
+                zlib_end_block(dctx);
+                goto out;
+            } else if (sym >= 286) {
+                /* literal/length symbols 286 and 287 are invalid */
+                ok = false;
+                goto out;
+            } else {
+                const coderecord *rec = &lencodes[sym - 257];
+                int len, dist;
+
+                len = rec->min + (bits & ((1U << rec->extrabits) - 1));
+                bits >>= rec->extrabits;
+                nbits -= rec->extrabits;
+
+                sym = zlib_lookup(dt, bits, &used, &width);
+                if (!used || sym >= 30) {
+                    /* dist symbols 30 and 31 are invalid */
+                    ok = false;
+                    goto out;
+                }
+                bits >>= used;
+                nbits -= used;
+                rec = &distcodes[sym];
+                dist = rec->min + (bits & ((1U << rec->extrabits) - 1));
+                bits >>= rec->extrabits;
+                nbits -= rec->extrabits;
+
+                if ((size_t)dist > (op - out->u) + dctx->winfill) {
+                    /* refers back before the start of the data */
+                    ok = false;
+                    goto out;
+                }
+                zlib_copy_match(dctx, op, op - out->u, dist, len);
+                op += len;
+                if (oend - op < MAXMATCH)
+                    break;
+            }
+        }
+    }
+
+  out:
+    strbuf_shrink_to(out, op - out->u);
+    dctx->bits = bits & (((uint64_t)1 << nbits) - 1);
+    dctx->nbits = nbits;
+    *lenp = inend - in;
+    *blockp = in;
+    return ok;
+}
+
 #define EATBITS(n) ( dctx->nbits -= (n), dctx->bits >>= (n) )
 
 static bool zlib_decompress_block(
@@ -1002,7 +1538,7 @@ static bool zlib_decompress_block(
 
     while (len > 0 || dctx->nbits > 0) {
         while (dctx->nbits < 24 && len > 0) {
-            dctx->bits |= (*block++) << dctx->nbits;
+            dctx->bits |= (uint64_t)(*block++) << dctx->nbits;
             dctx->nbits += 8;
             len--;
         }
@@ -1130,6 +1666,11 @@ static bool zlib_decompress_block(
             dctx->state = TREES_LEN;
             break;
           case INBLK:
+            if (len >= 8) {
+                if (!zlib_decode_fast(dctx, &block, &len))
+                    goto decode_error;
+                break;
+            }
             code =
                 zlib_huflookup(&dctx->bits, &dctx->nbits, dctx->currlentable);
             if (code == -1)
@@ -1139,15 +1680,7 @@ static bool zlib_decompress_block(
             if (code < 256)
                 zlib_emit_char(dctx, code);
             else if (code == 256) {
-                dctx->state = OUTSIDEBLK;
-                if (dctx->currlentable != dctx->staticlentable) {
-                    zlib_freetable(&dctx->currlentable);
-                    dctx->currlentable = NULL;
-                }
-                if (dctx->currdisttable != dctx->staticdisttable) {
-                    zlib_freetable(&dctx->currdisttable);
-                    dctx->currdisttable = NULL;
-                }
+                zlib_end_block(dctx);
             } else if (code < 286) {
                 dctx->state = GOTLENSYM;
                 dctx->sym = code;
@@ -1185,9 +1718,13 @@ static bool zlib_decompress_block(
             dist = rec->min + (dctx->bits & ((1 << rec->extrabits) - 1));
             EATBITS(rec->extrabits);
             dctx->state = INBLK;
-            while (dctx->len--)
-                zlib_emit_char(dctx, dctx->window[(dctx->winpos - dist) &
-                                                  (WINSIZE - 1)]);
+            if ((size_t)dist > dctx->outblk->len + dctx->winfill)
+                goto decode_error;     /* refers back before the start */
+            {
+                size_t done = dctx->outblk->len;
+                zlib_copy_match(dctx, strbuf_append(dctx->outblk, dctx->len),
+                                done, dist, dctx->len);
+            }
             break;
           case UNCOMP_LEN:
             /*
@@ -1219,15 +1756,27 @@ static bool zlib_decompress_block(
           case UNCOMP_DATA:
             if (dctx->nbits < 8)
                 goto finished;
-            zlib_emit_char(dctx, dctx->bits & 0xFF);
-            EATBITS(8);
-            if (--dctx->uncomplen == 0)
+            while (dctx->nbits >= 8 && dctx->uncomplen > 0) {
+                zlib_emit_char(dctx, dctx->bits & 0xFF);
+                EATBITS(8);
+                dctx->uncomplen--;
+            }
+            if (dctx->nbits == 0 && dctx->uncomplen > 0 && len > 0) {
+                /* The bit buffer is empty, so copy straight from input */
+                int n = len < dctx->uncomplen ? len : dctx->uncomplen;
+                put_data(dctx->outblk, block, n);
+                block += n;
+                len -= n;
+                dctx->uncomplen -= n;
+            }
+            if (dctx->uncomplen == 0)
                 dctx->state = OUTSIDEBLK;       /* end of uncompressed block */
             break;
         }
     }
 
   finished:
+    zlib_update_window(dctx, dctx->outblk->u, dctx->outblk->len);
     *outlen = dctx->outblk->len;
     *outblock = (unsigned char *)strbuf_to_str(dctx->outblk);
     dctx->outblk = NULL;
@@ -106,6 +106,7 @@ struct host_ca {
     char *name;
     strbuf *ca_public_key;
     char *validity_expression;
+    CertExpr *validity;     /* parsed by host_ca_load; NULL if invalid */
     ca_options opts;
 };
 
@@ -118,6 +119,7 @@ char *host_ca_save(host_ca *);   /* NULL on success, or dynamic error msg */
 char *host_ca_delete(const char *name); /* likewise */
 
 host_ca *host_ca_new(void);  /* initialises to default settings */
+host_ca *host_ca_copy(const host_ca *);
 void host_ca_free(host_ca *);
 
 /* ----------------------------------------------------------------------
@@ -26,6 +26,17 @@ SockAddr *sk_nonamelookup(const char *host)
 {
     return snew(SockAddr);
 }
+NameLookup *sk_namelookup_async(const char *host, int address_family,
+                                namelookup_callback_fn_t callback, void *ctx)
+{
+    return NULL;
+}
+void sk_namelookup_cancel(NameLookup *nl)
+{
+}
+void sk_set_namelookup_cache(bool enabled)
+{
+}
 
 void sk_getaddr(SockAddr *addr, char *buf, int buflen)
 {
@@ -78,6 +89,14 @@ Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
         plug, "no actual networking in this application");
 }
 
+Socket *sk_new_tuned(SockAddr *addr, int port, bool privport, bool oobinline,
+                     bool nodelay, bool keepalive,
+                     const SockBufferSizes *bufsizes, Plug *plug)
+{
+    return new_error_socket_fmt(
+        plug, "no actual networking in this application");
+}
+
 Socket *sk_newlistener(const char *srcaddr, int port, Plug *plug,
                        bool local_host_only, int orig_address_family)
 {
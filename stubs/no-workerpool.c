@@ -0,0 +1,20 @@
+/*
+ * Stub version of the worker thread pool, for builds without thread
+ * support, and for test programs that want everything to happen in
+ * one thread. worker_pool_submit() always fails, so that
+ * run_in_background() falls back to doing its work on the spot, and
+ * run_in_parallel() just does its items one after another.
+ */
+
+#include "putty.h"
+
+bool worker_pool_submit(toplevel_callback_fn_t work, void *ctx)
+{
+    return false;
+}
+
+void run_in_parallel(toplevel_callback_fn_t work, void **ctxs, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        work(ctxs[i]);
+}
@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+
+# Stress test for concurrent signing in an SSH agent: open a lot of
+# simultaneous connections to the agent in $SSH_AUTH_SOCK, have each
+# one send sign requests for the agent's keys as fast as it gets
+# answers back, and report the latency percentiles for each key.
+#
+# The interesting case is an agent holding a mixture of slow keys
+# (e.g. RSA-4096) and fast ones (e.g. Ed25519): if the agent signs
+# everything in one thread, requests for the fast keys get stuck
+# behind the slow ones.
+
+import argparse
+import os
+import socket
+import sys
+import threading
+import time
+
+from ssh import *
+
+def recv_exactly(s, length):
+    data = b""
+    while len(data) < length:
+        got = s.recv(length - len(data))
+        if not got:
+            raise EOFError("agent closed connection")
+        data += got
+    return data
+
+def agent_query(s, msg):
+    s.sendall(ssh_string(msg))
+    length = ssh_decode_uint32(recv_exactly(s, 4))
+    assert length < AGENT_MAX_MSGLEN
+    return recv_exactly(s, length)
+
+def connect():
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect(os.environ["SSH_AUTH_SOCK"])
+    return s
+
+def list_keys():
+    s = connect()
+    reply = agent_query(s, ssh_byte(SSH2_AGENTC_REQUEST_IDENTITIES))
+    s.close()
+    assert reply[0] == SSH2_AGENT_IDENTITIES_ANSWER
+    nkeys, rest = ssh_decode_uint32(reply[1:], True)
+    keys = []
+    for _ in range(nkeys):
+        blob, rest = ssh_decode_string(rest, True)
+        comment, rest = ssh_decode_string(rest, True)
+        keys.append((blob, comment.decode("UTF-8", "replace")))
+    return keys
+
+def worker(blob, flags, deadline, latencies, failures):
+    s = connect()
+    request = (ssh_byte(SSH2_AGENTC_SIGN_REQUEST) + ssh_string(blob) +
+               ssh_string(os.urandom(64)) + ssh_uint32(flags))
+    while time.monotonic() < deadline:
+        start = time.monotonic()
+        reply = agent_query(s, request)
+        if reply[0] == SSH2_AGENT_SIGN_RESPONSE:
+            latencies.append(time.monotonic() - start)
+        else:
+            failures.append(reply[0])
+    s.close()
+
+def percentile(sorted_values, percent):
+    return sorted_values[(len(sorted_values) - 1) * percent // 100]
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Send concurrent sign requests to an SSH agent.')
+    parser.add_argument("--conns", type=int, default=16,
+                        help="Number of connections per key.")
+    parser.add_argument("--seconds", type=float, default=5,
+                        help="How long to keep sending requests.")
+    parser.add_argument("--flags", type=int, default=0,
+                        help="Signature flags to send (e.g. 4 for "
+                        "rsa-sha2-512).")
+    args = parser.parse_args()
+
+    keys = list_keys()
+    if not keys:
+        sys.exit("agent has no SSH-2 keys")
+
+    deadline = time.monotonic() + args.seconds
+    results = []
+    threads = []
+    for blob, comment in keys:
+        latencies, failures = [], []
+        results.append((comment, latencies, failures))
+        for _ in range(args.conns):
+            t = threading.Thread(target=worker, args=(
+                blob, args.flags, deadline, latencies, failures))
+            t.start()
+            threads.append(t)
+    for t in threads:
+        t.join()
+
+    for comment, latencies, failures in results:
+        latencies.sort()
+        if latencies:
+            print("{}: {:d} signatures, {:.1f}/s, latency p50 {:.1f}ms, "
+                  "p90 {:.1f}ms, p99 {:.1f}ms, max {:.1f}ms".format(
+                      comment, len(latencies), len(latencies) / args.seconds,
+                      *(1000 * percentile(latencies, p)
+                        for p in (50, 90, 99, 100))))
+        if failures:
+            print("{}: {:d} failures".format(comment, len(failures)))
+
+if __name__ == '__main__':
+    main()
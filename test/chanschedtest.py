@@ -0,0 +1,302 @@
+#!/usr/bin/env python3
+
+# Test of SSH-2 channel output scheduling: data on a session channel
+# has to go out ahead of a backlog of data on a bulk (port-forwarding)
+# channel, at both ends of the connection.
+#
+# This talks the bare ssh-connection protocol, so that there's no
+# encryption to get in the way of seeing the packets. On the server
+# side, it runs psusan on stdio as the client, and opens a session
+# channel running a command along with a direct-tcpip channel to a
+# local socket that sends a lot of data. On the client side, it runs
+# plink against itself as the server, with a local port forwarding
+# fed the same way. In both cases, the peer gives both channels a
+# zero window to start with, so that their outgoing data piles up,
+# and then opens the bulk channel's window and the session channel's
+# window in a single write. None of the bulk data must be sent before
+# the session data.
+#
+# Typical usage, from the top of the source tree:
+#
+#   test/chanschedtest.py --build build
+
+import argparse
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+SSH2_MSG_CHANNEL_OPEN = 90
+SSH2_MSG_CHANNEL_OPEN_CONFIRMATION = 91
+SSH2_MSG_CHANNEL_OPEN_FAILURE = 92
+SSH2_MSG_CHANNEL_WINDOW_ADJUST = 93
+SSH2_MSG_CHANNEL_DATA = 94
+SSH2_MSG_CHANNEL_EXTENDED_DATA = 95
+SSH2_MSG_CHANNEL_REQUEST = 98
+SSH2_MSG_CHANNEL_SUCCESS = 99
+SSH2_MSG_CHANNEL_FAILURE = 100
+
+VERSION = b"SSHCONNECTION@putty.projects.tartarus.org-2.0-chanschedtest\r\n"
+MARKER = b"interactive data"
+BULK_SIZE = 1 << 20
+MAXPKT = 0x4000
+
+def ssh_uint32(n):
+    return struct.pack(">I", n)
+
+def ssh_string(s):
+    if isinstance(s, str):
+        s = s.encode("ASCII")
+    return ssh_uint32(len(s)) + s
+
+class Packet:
+    def __init__(self, data):
+        self.type = data[0]
+        self.data = data[1:]
+        self.pos = 0
+
+    def uint32(self):
+        n, = struct.unpack(">I", self.data[self.pos:self.pos+4])
+        self.pos += 4
+        return n
+
+    def string(self):
+        n = self.uint32()
+        s = self.data[self.pos:self.pos+n]
+        self.pos += n
+        return s
+
+class BareConnection:
+    def __init__(self, rfile, wfile):
+        self.rfile = rfile
+        self.wfile = wfile
+        self.wfile.write(VERSION)
+        self.wfile.flush()
+        line = self.rfile.readline()
+        if not line.startswith(b"SSHCONNECTION@"):
+            raise ValueError("bad version string {!r}".format(line))
+
+    @staticmethod
+    def packet(pkttype, *fields):
+        payload = bytes([pkttype]) + b"".join(fields)
+        return ssh_uint32(len(payload)) + payload
+
+    def send(self, *packets):
+        self.wfile.write(b"".join(packets))
+        self.wfile.flush()
+
+    def recv(self):
+        lendata = self.rfile.read(4)
+        if len(lendata) < 4:
+            raise EOFError("connection closed")
+        n, = struct.unpack(">I", lendata)
+        return Packet(self.rfile.read(n))
+
+def bulk_source(listener):
+    # Accept one connection and send it a lot of data
+    conn, _ = listener.accept()
+    try:
+        conn.sendall(b"B" * BULK_SIZE)
+        conn.shutdown(socket.SHUT_WR)
+        while conn.recv(65536):
+            pass
+    except OSError:
+        pass
+    conn.close()
+
+def bulk_sink(port):
+    # Connect to a port and send it a lot of data
+    conn = socket.create_connection(("127.0.0.1", port))
+    try:
+        conn.sendall(b"B" * BULK_SIZE)
+        while conn.recv(65536):
+            pass
+    except OSError:
+        pass
+    conn.close()
+
+def start_thread(fn, *args):
+    thread = threading.Thread(target=fn, args=args, daemon=True)
+    thread.start()
+    return thread
+
+class Tester:
+    def __init__(self, build, tmp):
+        self.build = build
+        self.tmp = tmp
+        self.procs = []
+        self.failures = 0
+
+        self.env = dict(os.environ)
+        self.env["HOME"] = tmp
+        self.env["PUTTYRANDOMSEED"] = os.path.join(tmp, "seed")
+
+    def spawn(self, *args, **kwargs):
+        proc = subprocess.Popen(args, cwd=self.tmp, env=self.env,
+                                stderr=subprocess.DEVNULL, **kwargs)
+        self.procs.append(proc)
+        return proc
+
+    def stop_procs(self):
+        for proc in self.procs:
+            if proc.poll() is None:
+                proc.terminate()
+            proc.wait()
+
+    def check(self, name, ok):
+        if not ok:
+            print("FAIL: {}".format(name))
+            self.failures += 1
+
+    def check_order(self, name, conn, session_id, bulk_id):
+        # Our ids for the session and bulk channels are 0 and 1, and
+        # session_id and bulk_id are the peer's. Let both channels'
+        # outgoing data pile up, and then open both windows at once,
+        # the bulk channel's first.
+        time.sleep(1)
+        conn.send(
+            conn.packet(SSH2_MSG_CHANNEL_WINDOW_ADJUST,
+                        ssh_uint32(bulk_id), ssh_uint32(BULK_SIZE)),
+            conn.packet(SSH2_MSG_CHANNEL_WINDOW_ADJUST,
+                        ssh_uint32(session_id), ssh_uint32(BULK_SIZE)))
+
+        session_data, bulk_before, bulk_total = b"", None, 0
+        while bulk_total < BULK_SIZE or bulk_before is None:
+            pkt = conn.recv()
+            if pkt.type not in {SSH2_MSG_CHANNEL_DATA,
+                                SSH2_MSG_CHANNEL_EXTENDED_DATA}:
+                continue
+            recipient = pkt.uint32()
+            if pkt.type == SSH2_MSG_CHANNEL_EXTENDED_DATA:
+                pkt.uint32()
+            data = pkt.string()
+            if recipient == 0:
+                session_data += data
+                if MARKER in session_data and bulk_before is None:
+                    bulk_before = bulk_total
+            elif recipient == 1:
+                bulk_total += len(data)
+
+        self.check(name + ": bulk data all arrived", bulk_total == BULK_SIZE)
+        self.check(name + ": session data sent first ({:d} bulk bytes "
+                   "before it)".format(bulk_before), bulk_before == 0)
+
+    def test_server(self):
+        # psusan is the server, and we're the client.
+        listener = socket.socket()
+        listener.bind(("127.0.0.1", 0))
+        listener.listen(1)
+        start_thread(bulk_source, listener)
+
+        proc = self.spawn(os.path.join(self.build, "psusan"),
+                          stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        conn = BareConnection(proc.stdout, proc.stdin)
+        conn.send(
+            conn.packet(SSH2_MSG_CHANNEL_OPEN, ssh_string("session"),
+                        ssh_uint32(0), ssh_uint32(0), ssh_uint32(MAXPKT)),
+            conn.packet(SSH2_MSG_CHANNEL_OPEN, ssh_string("direct-tcpip"),
+                        ssh_uint32(1), ssh_uint32(0), ssh_uint32(MAXPKT),
+                        ssh_string("127.0.0.1"),
+                        ssh_uint32(listener.getsockname()[1]),
+                        ssh_string("127.0.0.1"), ssh_uint32(0)))
+
+        remote_ids = {}
+        while len(remote_ids) < 2:
+            pkt = conn.recv()
+            if pkt.type == SSH2_MSG_CHANNEL_OPEN_FAILURE:
+                sys.exit("psusan refused to open a channel")
+            if pkt.type == SSH2_MSG_CHANNEL_OPEN_CONFIRMATION:
+                local_id = pkt.uint32()
+                remote_ids[local_id] = pkt.uint32()
+
+        conn.send(conn.packet(
+            SSH2_MSG_CHANNEL_REQUEST, ssh_uint32(remote_ids[0]),
+            ssh_string("exec"), b"\0",
+            ssh_string("echo " + MARKER.decode("ASCII") + "; exec cat")))
+
+        self.check_order("server", conn, remote_ids[0], remote_ids[1])
+        listener.close()
+
+    def test_client(self):
+        # plink is the client, and we're the server.
+        listener = socket.socket()
+        listener.bind(("127.0.0.1", 0))
+        listener.listen(1)
+        fwd = socket.socket()
+        fwd.bind(("127.0.0.1", 0))
+        fwdport = fwd.getsockname()[1]
+        fwd.close()
+
+        proc = self.spawn(
+            os.path.join(self.build, "plink"), "-batch", "-ssh-connection",
+            "-P", str(listener.getsockname()[1]), "-T",
+            "-L", "{:d}:127.0.0.1:1".format(fwdport), "127.0.0.1",
+            stdin=subprocess.PIPE, stdout=subprocess.DEVNULL)
+        sock, _ = listener.accept()
+        listener.close()
+        conn = BareConnection(sock.makefile("rb"), sock.makefile("wb"))
+
+        # Accept the session channel, and anything it asks for
+        session_id = bulk_id = None
+        while session_id is None:
+            pkt = conn.recv()
+            if pkt.type == SSH2_MSG_CHANNEL_OPEN:
+                if pkt.string() != b"session":
+                    sys.exit("plink opened an unexpected channel")
+                session_id = pkt.uint32()
+                conn.send(conn.packet(
+                    SSH2_MSG_CHANNEL_OPEN_CONFIRMATION, ssh_uint32(session_id),
+                    ssh_uint32(0), ssh_uint32(0), ssh_uint32(MAXPKT)))
+
+        # Make the forwarded connection and accept its channel
+        start_thread(bulk_sink, fwdport)
+        while bulk_id is None:
+            pkt = conn.recv()
+            if pkt.type == SSH2_MSG_CHANNEL_REQUEST:
+                pkt.uint32()
+                pkt.string()
+                if pkt.data[pkt.pos]:
+                    conn.send(conn.packet(SSH2_MSG_CHANNEL_SUCCESS,
+                                          ssh_uint32(session_id)))
+            elif pkt.type == SSH2_MSG_CHANNEL_OPEN:
+                pkt.string()
+                bulk_id = pkt.uint32()
+                conn.send(conn.packet(
+                    SSH2_MSG_CHANNEL_OPEN_CONFIRMATION, ssh_uint32(bulk_id),
+                    ssh_uint32(1), ssh_uint32(0), ssh_uint32(MAXPKT)))
+
+        proc.stdin.write(MARKER)
+        proc.stdin.flush()
+
+        self.check_order("client", conn, session_id, bulk_id)
+        sock.close()
+
+    def run(self):
+        self.test_server()
+        self.test_client()
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Test that session channel data overtakes bulk data.')
+    parser.add_argument("--build", default=".",
+                        help="Directory containing plink and psusan.")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        tester = Tester(os.path.abspath(args.build), tmp)
+        try:
+            tester.run()
+        finally:
+            tester.stop_procs()
+
+    if tester.failures:
+        print("{:d} checks failed".format(tester.failures))
+        sys.exit(1)
+    print("All checks passed")
+
+if __name__ == '__main__':
+    main()
@@ -549,7 +549,10 @@ class mpint(MyTestBase):
     def testMonty(self):
         moduli = [5, 19, 2**16+1, 2**31-1, 2**128-159, 2**255-19,
                   293828847201107461142630006802421204703,
-                  113064788724832491560079164581712332614996441637880086878209969852674997069759]
+                  113064788724832491560079164581712332614996441637880086878209969852674997069759,
+                  2**256 - 2**224 + 2**192 + 2**96 - 1,
+                  2**384 - 2**128 - 2**96 + 2**32 - 1,
+                  2**521 - 1]
 
         for m in moduli:
             mc = monty_new(m)
@@ -618,6 +621,36 @@ class mpint(MyTestBase):
         # modulus, by pre-reducing it
         assert(int(mp_modpow(1<<877, 907, 999979)) == pow(2, 877*907, 999979))
 
+    def testMontySpecialReduction(self):
+        # Moduli for which MontyContext uses a special-purpose
+        # reduction instead of Montgomery's. Check that reducing
+        # inputs anywhere in the full double-width range gives the
+        # right answer, including the extremes where the carries and
+        # folds are most likely to go wrong.
+        moduli = [2**255 - 19,
+                  2**521 - 1,
+                  2**448 - 2**224 - 1, # c too big: control case
+                  2**256 - 2**224 + 2**192 + 2**96 - 1] # likewise
+
+        for m in moduli:
+            mc = monty_new(m)
+            # monty_import(1) is r mod m, whatever r is
+            rinv = pow(int(monty_import(mc, 1)), -1, m)
+            # Stay within the double-width input range whatever
+            # BIGNUM_INT_BITS is
+            xbits = 2 * ((m.bit_length() + 15) // 16 * 16)
+
+            values = [0, 1, m-1, m, m+1, 2*m-1, 2*m, m*m - 1,
+                      2**m.bit_length(), 2**(2*m.bit_length()) - 1,
+                      2**xbits - 1, 2**(xbits - 1), (2**xbits - 1) // 3]
+            for i in range(16):
+                h = hashlib.sha512(b"%d %d" % (m, i)).digest() * 3
+                values.append(int.from_bytes(h, "big") % 2**xbits)
+
+            for x in values:
+                self.assertEqual(int(monty_export(mc, x)), x * rinv % m,
+                                 "m={:#x} x={:#x}".format(m, x))
+
     def testModsqrt(self):
         moduli = [
             5, 19, 2**16+1, 2**31-1, 2**128-159, 2**255-19,
@@ -782,6 +815,26 @@ class ecc(MyTestBase):
         check_point(ecc_weierstrass_add_general(wmP, wP), rI)
         check_point(ecc_weierstrass_add_general(wP, wmP), rI)
 
+        # Doubling via add_general, with inputs that aren't in affine
+        # form (Z != 1), compared against ecc_weierstrass_double. Do
+        # it both with the same point object twice, and with two
+        # different projective representations of the same point.
+        # (Fresh points are made each time, because check_point
+        # normalises its input to Z = 1 as a side effect.)
+        rR = rP + rP + rQ
+        def make_R(how):
+            if how == 1:
+                return ecc_weierstrass_add(ecc_weierstrass_double(wP), wQ)
+            else:
+                return ecc_weierstrass_add(ecc_weierstrass_add(wP, wQ), wP)
+        for hA, hB in [(1, 1), (2, 2), (1, 2), (2, 1)]:
+            wA = make_R(hA)
+            wB = wA if hA == hB else make_R(hB)
+            wS = ecc_weierstrass_add_general(wA, wB)
+            wD = ecc_weierstrass_double(wA)
+            check_point(wS, rR + rR)
+            check_point(wD, rR + rR)
+
         # Verify that point_valid fails if we pass it nonsense.
         bogus = ecc_weierstrass_point_new(wc, int(rP.x), int(rP.y * 3))
         self.assertFalse(ecc_weierstrass_point_valid(bogus))
@@ -931,6 +984,48 @@ class ecc(MyTestBase):
             self.assertEqual(int(x), int(rGi.x))
             self.assertEqual(int(y), int(rGi.y))
 
+    def testWeierstrassBaseMultiply(self):
+        for curve in [p256, p384, p521]:
+            wc = ecc_weierstrass_curve(curve.p, int(curve.a), int(curve.b),
+                                       None)
+            wG = ecc_weierstrass_point_new(wc, int(curve.G.x), int(curve.G.y))
+            bits = curve.p.bit_length()
+            table = ecc_weierstrass_base_table_new(wG, bits)
+
+            ints = set(i % curve.G_order for i in fibonacci_scattered(10))
+            ints.update([1, 2, 15, 16, 17, curve.G_order - 1])
+            for i in sorted(ints):
+                wGi = ecc_weierstrass_base_multiply(table, i)
+                if i == 0:
+                    self.assertTrue(ecc_weierstrass_is_identity(wGi))
+                    continue
+                x, y = ecc_weierstrass_get_affine(wGi)
+                rGi = curve.G * i
+                self.assertEqual(int(x), int(rGi.x))
+                self.assertEqual(int(y), int(rGi.y))
+
+            # Unlike the general multiply routine, this one should cope
+            # with multiples of the group order
+            self.assertTrue(ecc_weierstrass_is_identity(
+                ecc_weierstrass_base_multiply(table, curve.G_order)))
+
+    def testEdwardsBaseMultiply(self):
+        ec = ecc_edwards_curve(ed25519.p, int(ed25519.d), int(ed25519.a), None)
+        eG = ecc_edwards_point_new(ec, int(ed25519.G.x), int(ed25519.G.y))
+        table = ecc_edwards_base_table_new(eG, 256)
+
+        ints = set(i % ed25519.G_order for i in fibonacci_scattered(10))
+        ints.update([0, 1, 2, 15, 16, 17, 2**256 - 1, ed25519.G_order])
+        for i in sorted(ints):
+            eGi = ecc_edwards_base_multiply(table, i)
+            x, y = ecc_edwards_get_affine(eGi)
+            rGi = ed25519.G * (i % ed25519.G_order)
+            if i % ed25519.G_order == 0:
+                self.assertEqual((int(x), int(y)), (0, 1))
+                continue
+            self.assertEqual(int(x), int(rGi.x))
+            self.assertEqual(int(y), int(rGi.y))
+
 class keygen(MyTestBase):
     def testPrimeCandidateSource(self):
         def inspect(pcs):
@@ -2552,6 +2647,27 @@ culpa qui officia deserunt mollit anim id est laborum.
             unhex('d78ba86e7273de0e007ab0ba256646823d5c902bc44293ae'
                   '78547e9a7f629be928cc78ff78a75a4feb7aa6f125079c7d'))
 
+    def testOpenSSHBcryptBlockLayout(self):
+        # Each 32-byte block of bcrypt output depends only on its
+        # index, and is scattered across the output at intervals of
+        # the total number of blocks. Blocks are computed two at a
+        # time where possible, and the pairs in separate threads, so
+        # check that outputs with odd and even numbers of blocks
+        # agree with each other.
+        def blocks(outbytes):
+            out = openssh_bcrypt('test passphrase',
+                                 unhex('d0c3b40ace4afeaf8c0f81202ae36718'),
+                                 3, outbytes)
+            n = (outbytes + 31) // 32
+            return [out[i::n] for i in range(n)]
+
+        b32, b48, b96, b128 = blocks(32), blocks(48), blocks(96), blocks(128)
+        self.assertEqualBin(b32[0], b96[0])
+        self.assertEqualBin(b48[0], b96[0][:24])
+        self.assertEqualBin(b48[1], b96[1][:24])
+        for i in range(3):
+            self.assertEqualBin(b96[i], b128[i])
+
     def testRSAVerify(self):
         def blobs(n, e, d, p, q, iqmp):
             pubblob = ssh_string(b"ssh-rsa") + ssh2_mpint(e) + ssh2_mpint(n)
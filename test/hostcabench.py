@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+
+# Benchmark for host certificate verification in a long-running
+# client. Configures a lot of host CAs, starts uppity with a host key
+# certified by one of them, and has a single psftp process open and
+# close connections to it at a fixed rate, so that every connection
+# has to check the host certificate against the CA configuration.
+# Reports the connection latency percentiles, and the CPU time psftp
+# used per connection.
+#
+# Typical usage, from the top of the source tree:
+#
+#   test/hostcabench.py --build build --ncas 200 --conns 100 --rate 10
+#
+# Needs ssh-keygen, to make the CA and sign the host certificate.
+
+import argparse
+import os
+import queue
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.parse
+
+def cpu_seconds(pid):
+    try:
+        with open("/proc/{:d}/stat".format(pid)) as f:
+            fields = f.read().rsplit(")", 1)[1].split()
+        return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+    except OSError:
+        return None
+
+def make_keys(tmp, puttygen):
+    def keygen(*args):
+        subprocess.check_call(["ssh-keygen", "-q"] + list(args), cwd=tmp)
+    keygen("-t", "ed25519", "-N", "", "-f", "ca")
+    keygen("-t", "ed25519", "-N", "", "-f", "host")
+    keygen("-s", "ca", "-h", "-I", "hostcabench", "-n", "127.0.0.1",
+           "host.pub")
+    subprocess.check_call([puttygen, "host", "-o", "host.ppk",
+                           "--certificate", "host-cert.pub"], cwd=tmp)
+    with open(os.path.join(tmp, "ca.pub")) as f:
+        return f.read().split()[1]
+
+def make_cas(cadir, ncas, ca_blob):
+    # All but one of the CAs have expressions that don't match the
+    # target host, so that the client has to check every one of them
+    # but only trusts the last.
+    os.mkdir(cadir)
+    for i in range(ncas):
+        if i == ncas - 1:
+            expr = "127.0.0.1 && port:0-65535"
+        else:
+            expr = ("*.corp{0:d}.example.com || "
+                    "(*.lab{0:d}.example.net && port:2200-2299)".format(i))
+        with open(os.path.join(cadir, "ca{:04d}".format(i)), "w") as f:
+            f.write("PublicKey={}\n".format(ca_blob))
+            f.write("Validity={}\n".format(urllib.parse.quote(expr, safe="")))
+            f.write("PermitRSASHA1=0\nPermitRSASHA256=1\n"
+                    "PermitRSASHA512=1\n")
+
+def percentile(sorted_values, percent):
+    return sorted_values[(len(sorted_values) - 1) * percent // 100]
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Time host certificate checks against many CAs.')
+    parser.add_argument("--build", default=".",
+                        help="Directory containing psftp, uppity and "
+                        "puttygen.")
+    parser.add_argument("--ncas", type=int, default=100,
+                        help="Number of host CAs to configure.")
+    parser.add_argument("--conns", type=int, default=50,
+                        help="Number of connections to make.")
+    parser.add_argument("--rate", type=float, default=5,
+                        help="Connections to start per second.")
+    parser.add_argument("--port", type=int, default=2226,
+                        help="Port for uppity to listen on.")
+    args = parser.parse_args()
+
+    if shutil.which("ssh-keygen") is None:
+        sys.exit("ssh-keygen is needed to make the host certificate")
+    build = os.path.abspath(args.build)
+
+    with tempfile.TemporaryDirectory() as tmp:
+        ca_blob = make_keys(tmp, os.path.join(build, "puttygen"))
+        make_cas(os.path.join(tmp, "cas"), args.ncas, ca_blob)
+        open(os.path.join(tmp, "hostkeys"), "w").close()
+
+        env = dict(os.environ)
+        env["PUTTYSSHHOSTCAS"] = os.path.join(tmp, "cas")
+        env["PUTTYSSHHOSTKEYS"] = os.path.join(tmp, "hostkeys")
+        env["PUTTYRANDOMSEED"] = os.path.join(tmp, "seed")
+
+        server = subprocess.Popen(
+            [os.path.join(build, "uppity"), "--listen", str(args.port),
+             "--hostkey", os.path.join(tmp, "host.ppk"),
+             "--allow-auth", "none"],
+            cwd=tmp, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        time.sleep(0.5)
+
+        # psftp is run in batch mode, so that it refuses to connect if
+        # it can't verify the certificate, and given its commands on
+        # standard input, so we can pace them. It won't read commands
+        # until it has made its first connection, so that one is made
+        # from the command line, and not counted.
+        client = subprocess.Popen(
+            [os.path.join(build, "psftp"), "-batch", "-P", str(args.port),
+             "test@127.0.0.1"], env=env, cwd=tmp,
+            stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+            stderr=subprocess.STDOUT, universal_newlines=True, bufsize=1)
+        lines = queue.Queue()
+        def reader():
+            for line in client.stdout:
+                lines.put(line)
+            lines.put(None)
+        threading.Thread(target=reader, daemon=True).start()
+
+        def wait_for_connection():
+            while True:
+                line = lines.get(timeout=60)
+                if line is None:
+                    sys.exit("psftp exited unexpectedly")
+                if line.startswith("Remote working directory"):
+                    return True
+                if "FATAL ERROR" in line:
+                    return False
+
+        latencies = []
+        failures = 0
+        try:
+            if not wait_for_connection():
+                sys.exit("psftp failed to make its first connection")
+
+            start_cpu = cpu_seconds(client.pid)
+            start = time.monotonic()
+            for i in range(args.conns):
+                due = start + i / args.rate
+                now = time.monotonic()
+                if now < due:
+                    time.sleep(due - now)
+
+                conn_start = time.monotonic()
+                client.stdin.write("close\nopen test@127.0.0.1 {:d}\n".format(
+                    args.port))
+                if wait_for_connection():
+                    latencies.append(time.monotonic() - conn_start)
+                else:
+                    failures += 1
+            cpu = cpu_seconds(client.pid) - start_cpu
+            elapsed = time.monotonic() - start
+        finally:
+            client.stdin.close()
+            client.wait()
+            server.terminate()
+            server.wait()
+
+    latencies.sort()
+    print("{:d} CAs, {:d} connections in {:.2f}s ({:.1f}/s), "
+          "{:d} failed".format(args.ncas, len(latencies), elapsed,
+                               len(latencies) / elapsed, failures))
+    if latencies:
+        print("latency p50 {:.1f}ms, p90 {:.1f}ms, p99 {:.1f}ms, "
+              "max {:.1f}ms".format(*(1000 * percentile(latencies, p)
+                                      for p in (50, 90, 99, 100))))
+        print("psftp CPU: {:.2f}s, {:.1f}ms per connection".format(
+            cpu, 1000 * cpu / args.conns))
+    sys.exit(0 if failures == 0 else 1)
+
+if __name__ == '__main__':
+    main()
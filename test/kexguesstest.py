@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+
+# Test of the client's guessed key exchange packet and pipelined
+# userauth start. Runs plink against uppity, and checks from plink's
+# event log that the guess is sent and accepted when both sides prefer
+# the same kex, sent and discarded when they don't, and not sent at
+# all when the "Chokes on pipelined connection setup" bug is forced
+# on. In every case the connection has to complete and run a command.
+#
+# Typical usage, from the top of the source tree:
+#
+#   test/kexguesstest.py --build build
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+SENT = "Sending guessed key exchange packet"
+DISCARDED = "Server did not accept our guessed key exchange packet"
+BUGGY = "may not handle pipelined SSH-2 connection setup"
+
+class Tester:
+    def __init__(self, build, tmp, port):
+        self.build = build
+        self.tmp = tmp
+        self.port = port
+        self.servers = []
+        self.failures = 0
+
+        self.env = dict(os.environ)
+        self.env["HOME"] = tmp
+        self.env["PUTTYSSHHOSTKEYS"] = os.path.join(tmp, "hostkeys")
+        self.env["PUTTYRANDOMSEED"] = os.path.join(tmp, "seed")
+
+    def start_server(self, port, *args):
+        self.servers.append(subprocess.Popen(
+            [os.path.join(self.build, "uppity"), "--listen", str(port),
+             "--hostkey", os.path.join(self.tmp, "host.ppk"),
+             "--allow-auth", "none"] + list(args),
+            cwd=self.tmp, stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL))
+
+    def stop_servers(self):
+        for server in self.servers:
+            server.terminate()
+            server.wait()
+
+    def plink(self, port, *args, stdin=""):
+        proc = subprocess.run(
+            [os.path.join(self.build, "plink"), "-v", "-P", str(port),
+             "-l", "test"] + list(args) + ["127.0.0.1", "echo", "hello"],
+            env=self.env, cwd=self.tmp, input=stdin, timeout=60,
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+            universal_newlines=True)
+        return proc.stdout, proc.stderr
+
+    def check(self, name, ok):
+        if not ok:
+            print("FAIL: {}".format(name))
+            self.failures += 1
+
+    def run_case(self, name, port, args, sent, discarded, buggy):
+        output, log = self.plink(port, "-batch", *args)
+        self.check(name + ": connection completed", output == "hello\n")
+        self.check(name + ": guess " + ("sent" if sent else "not sent"),
+                   (SENT in log) == sent)
+        self.check(name + ": guess " +
+                   ("discarded" if discarded else "not discarded"),
+                   (DISCARDED in log) == discarded)
+        self.check(name + ": bug " + ("detected" if buggy else "not detected"),
+                   (BUGGY in log) == buggy)
+
+    def run(self):
+        subprocess.check_call(
+            [os.path.join(self.build, "puttygen"), "-t", "ed25519",
+             "-o", "host.ppk", "--random-device", "/dev/urandom",
+             "--new-passphrase", os.devnull], cwd=self.tmp)
+
+        # One server with its default kex list, and one that only
+        # offers a kex method the client doesn't put first.
+        matching, mismatching = self.port, self.port + 1
+        self.start_server(matching)
+        self.start_server(mismatching, "--kexinit-kex", "ecdh-sha2-nistp256")
+        time.sleep(0.5)
+
+        # The guess is only right if the host key algorithm matches
+        # too, and the client only puts the server's one first if it
+        # already has that host key cached. So accept the key
+        # interactively once, and copy the entry for the other port.
+        open(self.env["PUTTYSSHHOSTKEYS"], "w").close()
+        self.plink(matching, stdin="y\n")
+        with open(self.env["PUTTYSSHHOSTKEYS"]) as f:
+            entries = f.read()
+        if "@{:d}:".format(matching) not in entries:
+            sys.exit("failed to store uppity's host key")
+        with open(self.env["PUTTYSSHHOSTKEYS"], "a") as f:
+            f.write(entries.replace("@{:d}:".format(matching),
+                                    "@{:d}:".format(mismatching)))
+
+        sessions = os.path.join(self.tmp, ".putty", "sessions")
+        os.makedirs(sessions)
+        with open(os.path.join(sessions, "pipelinebug"), "w") as f:
+            f.write("BugPipelinedSetup=2\n")
+
+        self.run_case("matching kex", matching, [],
+                      sent=True, discarded=False, buggy=False)
+        self.run_case("mismatching kex", mismatching, [],
+                      sent=True, discarded=True, buggy=False)
+        self.run_case("bug forced on", matching, ["-load", "pipelinebug"],
+                      sent=False, discarded=False, buggy=True)
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Test the guessed first kex packet against uppity.')
+    parser.add_argument("--build", default=".",
+                        help="Directory containing plink, uppity and "
+                        "puttygen.")
+    parser.add_argument("--port", type=int, default=2227,
+                        help="First of two ports for uppity to listen on.")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        tester = Tester(os.path.abspath(args.build), tmp, args.port)
+        try:
+            tester.run()
+        finally:
+            tester.stop_servers()
+
+    if tester.failures:
+        print("{:d} checks failed".format(tester.failures))
+        sys.exit(1)
+    print("All checks passed")
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,223 @@
+#!/usr/bin/env python3
+
+# Stress test for psocks: run a lot of simultaneous connections
+# through it to a local target server, and report the throughput and
+# how much memory psocks used along the way.
+#
+# Typical usage, letting this script start psocks itself:
+#
+#   test/psocksstress.py --psocks build/psocks --nconns 4000 --slow
+#
+# Each connection does a SOCKS5 CONNECT to the target, sends a block
+# of data, and (in echo mode) reads it all back. With --slow, the
+# target reads its data in small pieces with pauses in between, so
+# that psocks has to cope with a lot of slow consumers at once.
+
+import argparse
+import asyncio
+import os
+import resource
+import socket
+import struct
+import subprocess
+import sys
+import time
+
+def rss_kb(pid):
+    try:
+        with open("/proc/{:d}/status".format(pid)) as f:
+            for line in f:
+                if line.startswith("VmRSS:"):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return None
+
+def cpu_seconds(pid):
+    try:
+        with open("/proc/{:d}/stat".format(pid)) as f:
+            fields = f.read().rsplit(")", 1)[1].split()
+        return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+    except OSError:
+        return None
+
+class Target:
+    def __init__(self, args):
+        self.args = args
+        self.received = 0
+
+    async def handle(self, reader, writer):
+        try:
+            while True:
+                if self.args.slow:
+                    await asyncio.sleep(self.args.slow_delay)
+                    data = await reader.read(self.args.slow_chunk)
+                else:
+                    data = await reader.read(65536)
+                if not data:
+                    break
+                self.received += len(data)
+                if self.args.mode == "echo":
+                    writer.write(data)
+                    await writer.drain()
+        except ConnectionError:
+            pass
+        writer.close()
+
+async def socks5_connect(proxy_port, target_port):
+    reader, writer = await asyncio.open_connection("127.0.0.1", proxy_port)
+    writer.write(b"\x05\x01\x00")
+    reply = await reader.readexactly(2)
+    assert reply == b"\x05\x00", reply
+    writer.write(b"\x05\x01\x00\x01" + socket.inet_aton("127.0.0.1") +
+                 struct.pack(">H", target_port))
+    reply = await reader.readexactly(10)
+    assert reply[:2] == b"\x05\x00", reply
+    return reader, writer
+
+async def client(args, target_port, stats):
+    try:
+        reader, writer = await socks5_connect(args.port, target_port)
+    except (ConnectionError, AssertionError, asyncio.IncompleteReadError):
+        stats["failed"] += 1
+        return
+    block = os.urandom(min(args.bytes, 65536))
+    remaining = args.bytes
+
+    async def send():
+        nonlocal remaining
+        while remaining > 0:
+            chunk = block[:remaining]
+            writer.write(chunk)
+            remaining -= len(chunk)
+            await writer.drain()
+        writer.write_eof()
+
+    async def receive():
+        # In echo mode, check we get back the same data we sent
+        expected = block * 2
+        total = 0
+        ok = True
+        while True:
+            data = await reader.read(len(block))
+            if not data:
+                break
+            offset = total % len(block)
+            if data != expected[offset:offset+len(data)]:
+                ok = False
+            total += len(data)
+        return total if ok else -1
+
+    try:
+        if args.mode == "echo":
+            _, got = await asyncio.gather(send(), receive())
+            if got != args.bytes:
+                stats["short"] += 1
+        else:
+            await send()
+            await receive()
+        stats["done"] += 1
+    except ConnectionError:
+        stats["failed"] += 1
+    writer.close()
+
+async def sample_memory(pid, stats, interval):
+    while True:
+        kb = rss_kb(pid)
+        if kb is not None:
+            stats["peak_rss"] = max(stats["peak_rss"], kb)
+        await asyncio.sleep(interval)
+
+async def run(args, psocks_pid):
+    target = Target(args)
+    server = await asyncio.start_server(target.handle, "127.0.0.1", 0,
+                                        backlog=4096)
+    target_port = server.sockets[0].getsockname()[1]
+
+    stats = {"done": 0, "failed": 0, "short": 0, "peak_rss": 0}
+    sampler = None
+    if psocks_pid is not None:
+        stats["start_rss"] = rss_kb(psocks_pid)
+        stats["start_cpu"] = cpu_seconds(psocks_pid)
+        sampler = asyncio.ensure_future(
+            sample_memory(psocks_pid, stats, 0.05))
+
+    start = time.monotonic()
+    clients = []
+    for _ in range(args.nconns):
+        clients.append(asyncio.ensure_future(
+            client(args, target_port, stats)))
+        if args.ramp:
+            await asyncio.sleep(args.ramp / args.nconns)
+    await asyncio.gather(*clients)
+    elapsed = time.monotonic() - start
+
+    if sampler is not None:
+        sampler.cancel()
+        stats["cpu"] = cpu_seconds(psocks_pid) - stats["start_cpu"]
+    server.close()
+
+    total = stats["done"] * args.bytes
+    print("{:d} connections ok, {:d} failed, {:d} short".format(
+        stats["done"], stats["failed"], stats["short"]))
+    print("{:d} bytes each way in {:.2f}s: {:.1f} MB/s, {:.0f} conns/s".format(
+        total, elapsed, total / elapsed / 1e6, args.nconns / elapsed))
+    if psocks_pid is not None:
+        print("psocks RSS: {:d} kB at start, {:d} kB peak".format(
+            stats["start_rss"] or 0, stats["peak_rss"]))
+        moved = total * (2 if args.mode == "echo" else 1)
+        print("psocks CPU: {:.2f}s, {:.2f}s per GB relayed".format(
+            stats["cpu"], stats["cpu"] / (moved / 1e9)))
+    return stats["failed"] == 0 and stats["short"] == 0
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Run many simultaneous connections through psocks.')
+    parser.add_argument("--psocks", help="psocks binary to run; otherwise "
+                        "connect to an already running one")
+    parser.add_argument("--psocks-arg", action="append", default=[],
+                        help="Extra argument to pass to psocks.")
+    parser.add_argument("--pid", type=int,
+                        help="Process id of an existing psocks to monitor.")
+    parser.add_argument("--port", type=int, default=11080,
+                        help="Port psocks listens on.")
+    parser.add_argument("--nconns", type=int, default=1000,
+                        help="Number of simultaneous connections to make.")
+    parser.add_argument("--bytes", type=int, default=1 << 20,
+                        help="Amount of data to send on each connection.")
+    parser.add_argument("--mode", choices=["echo", "sink"], default="echo",
+                        help="Whether the target echoes data back.")
+    parser.add_argument("--slow", action="store_true",
+                        help="Make the target a slow consumer.")
+    parser.add_argument("--slow-chunk", type=int, default=4096,
+                        help="Bytes read at a time by a slow target.")
+    parser.add_argument("--slow-delay", type=float, default=0.01,
+                        help="Pause between reads by a slow target.")
+    parser.add_argument("--ramp", type=float, default=0,
+                        help="Seconds over which to start the connections.")
+    args = parser.parse_args()
+
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    want = min(hard, max(soft, 4 * args.nconns + 64))
+    resource.setrlimit(resource.RLIMIT_NOFILE, (want, hard))
+
+    proc = None
+    pid = args.pid
+    if args.psocks is not None:
+        proc = subprocess.Popen(
+            [args.psocks] + args.psocks_arg + [str(args.port)],
+            stderr=subprocess.DEVNULL)
+        pid = proc.pid
+        time.sleep(0.5)
+
+    try:
+        ok = asyncio.get_event_loop().run_until_complete(run(args, pid))
+    finally:
+        if proc is not None:
+            proc.terminate()
+            proc.wait()
+
+    sys.exit(0 if ok else 1)
+
+if __name__ == '__main__':
+    main()
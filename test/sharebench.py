@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+
+# Benchmark for bulk data through a shared SSH connection. Starts
+# uppity, and times plink uploading and downloading a lot of data
+# through it, first over a direct connection of its own, and then as
+# a downstream of another plink acting as the connection-sharing
+# upstream. Reports the throughput of each, and the CPU time used by
+# the upstream when there is one.
+#
+# Typical usage, from the top of the source tree:
+#
+#   test/sharebench.py --build build --megabytes 200
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+def cpu_seconds(pid):
+    try:
+        with open("/proc/{:d}/stat".format(pid)) as f:
+            fields = f.read().rsplit(")", 1)[1].split()
+        return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+    except OSError:
+        return None
+
+class Bench:
+    def __init__(self, build, server_build, tmp, port, size):
+        self.build = build
+        self.server_build = server_build
+        self.tmp = tmp
+        self.port = port
+        self.size = size
+
+        self.env = dict(os.environ)
+        self.env["HOME"] = tmp
+        self.env["PUTTYSSHHOSTKEYS"] = os.path.join(tmp, "hostkeys")
+        self.env["PUTTYRANDOMSEED"] = os.path.join(tmp, "seed")
+
+    def plink_args(self, *args, batch=True):
+        return ([os.path.join(self.build, "plink"), "-v",
+                 "-P", str(self.port), "-l", "test"] +
+                (["-batch"] if batch else []) + list(args) + ["127.0.0.1"])
+
+    def transfer(self, name, upstream=None):
+        # Upload by feeding our data to 'cat' on the server, and
+        # download by having 'head' send it to us.
+        extra = ["-share"] if upstream else []
+        chunk = b"\0" * 65536
+        results = []
+        for direction, command in [
+                ("upload", "cat > /dev/null"),
+                ("download", "head -c {:d} /dev/zero".format(self.size))]:
+            with open(os.path.join(self.tmp, "log"), "w+") as log:
+                start_cpu = upstream and cpu_seconds(upstream.pid)
+                start = time.monotonic()
+                proc = subprocess.Popen(
+                    self.plink_args(*extra) + [command], env=self.env,
+                    cwd=self.tmp, stdin=subprocess.PIPE,
+                    stdout=subprocess.PIPE, stderr=log)
+                received = 0
+                if direction == "upload":
+                    for _ in range(self.size // len(chunk)):
+                        proc.stdin.write(chunk)
+                    proc.stdin.close()
+                    proc.stdout.read()
+                else:
+                    proc.stdin.close()
+                    while True:
+                        data = proc.stdout.read1(65536)
+                        if not data:
+                            break
+                        received += len(data)
+                proc.wait()
+                elapsed = time.monotonic() - start
+                cpu = upstream and cpu_seconds(upstream.pid) - start_cpu
+                log.seek(0)
+                shared = "Using existing shared connection" in log.read()
+            if upstream and not shared:
+                sys.exit("downstream plink did not use the shared connection")
+            if direction == "download" and received != self.size:
+                sys.exit("{} {}: received {:d} bytes, expected {:d}".format(
+                    name, direction, received, self.size))
+            results.append((direction, elapsed, cpu))
+        return results
+
+    def run(self):
+        subprocess.check_call(
+            [os.path.join(self.server_build, "puttygen"), "-t", "ed25519",
+             "-o", "host.ppk", "--random-device", "/dev/urandom",
+             "--new-passphrase", os.devnull], cwd=self.tmp)
+        server = subprocess.Popen(
+            [os.path.join(self.server_build, "uppity"),
+             "--listen", str(self.port),
+             "--hostkey", os.path.join(self.tmp, "host.ppk"),
+             "--allow-auth", "none"],
+            cwd=self.tmp, stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL)
+        upstream = None
+        try:
+            time.sleep(0.5)
+
+            # Accept the host key once, so that later runs don't ask
+            open(self.env["PUTTYSSHHOSTKEYS"], "w").close()
+            subprocess.run(self.plink_args(batch=False) + ["true"],
+                           env=self.env,
+                           cwd=self.tmp, input=b"y\n",
+                           stdout=subprocess.DEVNULL,
+                           stderr=subprocess.DEVNULL, timeout=60)
+
+            direct = self.transfer("direct")
+
+            upstream = subprocess.Popen(
+                self.plink_args("-share", "-N"), env=self.env,
+                cwd=self.tmp, stdin=subprocess.DEVNULL,
+                stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+            for _ in range(100):
+                if subprocess.run(self.plink_args("-shareexists"),
+                                  env=self.env, cwd=self.tmp,
+                                  stdout=subprocess.DEVNULL,
+                                  stderr=subprocess.DEVNULL).returncode == 0:
+                    break
+                time.sleep(0.1)
+            else:
+                sys.exit("sharing upstream never started")
+            shared = self.transfer("shared", upstream)
+        finally:
+            if upstream:
+                upstream.terminate()
+                upstream.wait()
+            server.terminate()
+            server.wait()
+
+        mb = self.size / 1048576
+        for (direction, t_direct, _), (_, t_shared, cpu) in zip(direct, shared):
+            print("{}: direct {:.1f}MB/s, shared {:.1f}MB/s ({:.0f}%), "
+                  "upstream CPU {:.2f}s".format(
+                      direction, mb / t_direct, mb / t_shared,
+                      100 * t_direct / t_shared, cpu))
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Compare bulk throughput of a shared SSH connection '
+        'with a direct one.')
+    parser.add_argument("--build", default=".",
+                        help="Directory containing plink, uppity and "
+                        "puttygen.")
+    parser.add_argument("--server-build",
+                        help="Directory to take uppity and puttygen "
+                        "from instead, to compare clients against the "
+                        "same server.")
+    parser.add_argument("--megabytes", type=int, default=100,
+                        help="Amount of data to send each way.")
+    parser.add_argument("--port", type=int, default=2228,
+                        help="Port for uppity to listen on.")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        build = os.path.abspath(args.build)
+        server_build = (os.path.abspath(args.server_build)
+                        if args.server_build else build)
+        bench = Bench(build, server_build, tmp, args.port,
+                      args.megabytes << 20)
+        bench.run()
+
+if __name__ == '__main__':
+    main()
@@ -686,6 +686,9 @@ void test_simple(void)
     test_bool_simple(CONF_warn_on_close, "WarnOnClose", true);
     test_bool_simple(CONF_tcp_nodelay, "TCPNoDelay", true);
     test_bool_simple(CONF_tcp_keepalives, "TCPKeepalives", false);
+    test_int_simple(CONF_tcp_notsent_lowat, "TCPNotSentLowat", 0);
+    test_int_simple(CONF_tcp_sndbuf, "TCPSendBuffer", 0);
+    test_int_simple(CONF_tcp_rcvbuf, "TCPRecvBuffer", 0);
     test_str_simple(CONF_loghost, "LogHost", "");
     test_str_simple(CONF_proxy_exclude_list, "ProxyExcludeList", "");
     test_bool_simple(CONF_even_proxy_localhost, "ProxyLocalhost", false);
@@ -699,6 +702,7 @@ void test_simple(void)
     test_str_ambi_simple(CONF_remote_cmd, "RemoteCommand", "", false);
     test_bool_simple(CONF_nopty, "NoPTY", false);
     test_bool_simple(CONF_compression, "Compression", false);
+    test_int_simple(CONF_compression_level, "CompressionLevel", 6);
     test_bool_simple(CONF_ssh_prefer_known_hostkeys, "PreferKnownHostKeys", true);
     test_int_simple(CONF_ssh_rekey_time, "RekeyTime", 60);
     test_str_simple(CONF_ssh_rekey_data, "RekeyBytes", "1G");
@@ -863,6 +867,7 @@ void test_simple(void)
     test_bool_simple(CONF_ssh_connection_sharing, "ConnectionSharing", false);
     test_bool_simple(CONF_ssh_connection_sharing_upstream, "ConnectionSharingUpstream", true);
     test_bool_simple(CONF_ssh_connection_sharing_downstream, "ConnectionSharingDownstream", true);
+    test_int_simple(CONF_ssh_connection_sharing_persist, "ConnectionSharingPersist", 0);
     test_bool_simple(CONF_stamp_utmp, "StampUtmp", true);
     test_bool_simple(CONF_login_shell, "LoginShell", true);
     test_bool_simple(CONF_scrollbar_on_left, "ScrollbarOnLeft", false);
@@ -909,6 +914,8 @@ void test_simple(void)
                         FORCE_OFF, 1, FORCE_ON, 2, -1);
     test_int_translated(CONF_sshbug_rsa_sha2_cert_userauth, "BugRSASHA2CertUserauth", AUTO,
                         AUTO, 0, FORCE_OFF, 1, FORCE_ON, 2, -1);
+    test_int_translated(CONF_sshbug_pipelined_setup, "BugPipelinedSetup", AUTO,
+                        AUTO, 0, FORCE_OFF, 1, FORCE_ON, 2, -1);
     test_int_translated(CONF_proxy_type, "ProxyMethod", PROXY_NONE,
                         PROXY_NONE, 0, PROXY_SOCKS4, 1, PROXY_SOCKS5, 2,
                         PROXY_HTTP, 3, PROXY_TELNET, 4, PROXY_CMD, 5,
@@ -0,0 +1,217 @@
+/*
+ * Tests of the Unix name lookup cache, and of asynchronous name
+ * lookups.
+ *
+ * Only address literals and 'localhost' are looked up, so that the
+ * test doesn't depend on having a working DNS server. Cache hits are
+ * detected by the cache returning another reference to the very same
+ * SockAddr it stored.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include "putty.h"
+#include "network.h"
+
+void modalfatalbox(const char *p, ...)
+{
+    va_list ap;
+    fprintf(stderr, "FATAL ERROR: ");
+    va_start(ap, p);
+    vfprintf(stderr, p, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+const char *const appname = "test_namelookup";
+
+void timer_change_notify(unsigned long next)
+{
+}
+
+static int fails;
+
+static void check(bool ok, const char *what)
+{
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        fails++;
+    }
+}
+
+static SockAddr *lookup(const char *host, int af)
+{
+    char *canonicalname;
+    SockAddr *addr = sk_namelookup(host, &canonicalname, af);
+    check(!sk_addr_error(addr), "lookup succeeded");
+    sfree(canonicalname);
+    return addr;
+}
+
+typedef struct AsyncResult {
+    bool done;
+    SockAddr *addr;
+    char *canonicalname;
+} AsyncResult;
+
+static unsigned outstanding;
+
+static void async_callback(void *ctx, SockAddr *addr, char *canonicalname)
+{
+    AsyncResult *res = (AsyncResult *)ctx;
+    check(!res->done, "callback only called once");
+    res->done = true;
+    res->addr = addr;
+    res->canonicalname = canonicalname;
+    outstanding--;
+}
+
+static bool continue_until_done(void *ctx, bool found_any_fd,
+                                bool ran_any_callback)
+{
+    return outstanding > 0;
+}
+
+static void wait_for_lookups(void)
+{
+    if (outstanding)
+        cli_main_loop(cliloop_no_pw_setup, cliloop_no_pw_check,
+                      continue_until_done, NULL);
+}
+
+static NameLookup *start_async(const char *host, AsyncResult *res)
+{
+    memset(res, 0, sizeof(*res));
+    outstanding++;
+    return sk_namelookup_async(host, ADDRTYPE_UNSPEC, async_callback, res);
+}
+
+static void free_async(AsyncResult *res)
+{
+    sk_addr_free(res->addr);
+    sfree(res->canonicalname);
+}
+
+static void test_sync_cache(void)
+{
+    SockAddr *a = lookup("127.0.0.1", ADDRTYPE_UNSPEC);
+    SockAddr *b = lookup("127.0.0.1", ADDRTYPE_UNSPEC);
+    check(a == b, "second lookup hits the cache");
+
+    SockAddr *c = lookup("127.0.0.1", ADDRTYPE_IPV4);
+    check(c != a, "different address family is a different entry");
+    SockAddr *d = lookup("127.0.0.1", ADDRTYPE_IPV4);
+    check(c == d, "and is cached separately");
+
+    SockAddr *e = lookup("localhost", ADDRTYPE_UNSPEC);
+    SockAddr *f = lookup("localhost", ADDRTYPE_UNSPEC);
+    check(e == f, "host names are cached too");
+
+    sk_addr_free(a);
+    sk_addr_free(b);
+    sk_addr_free(c);
+    sk_addr_free(d);
+    sk_addr_free(e);
+    sk_addr_free(f);
+}
+
+static void test_cache_disabled(void)
+{
+    SockAddr *a = lookup("127.0.0.1", ADDRTYPE_UNSPEC);
+
+    sk_set_namelookup_cache(false);
+    SockAddr *b = lookup("127.0.0.1", ADDRTYPE_UNSPEC);
+    SockAddr *c = lookup("127.0.0.1", ADDRTYPE_UNSPEC);
+    check(b != a, "turning the cache off stops it being used");
+    check(b != c, "and stops anything new being stored");
+
+    sk_set_namelookup_cache(true);
+    SockAddr *d = lookup("127.0.0.1", ADDRTYPE_UNSPEC);
+    SockAddr *e = lookup("127.0.0.1", ADDRTYPE_UNSPEC);
+    check(d != a, "turning the cache off emptied it");
+    check(d == e, "turning the cache back on works");
+
+    sk_addr_free(a);
+    sk_addr_free(b);
+    sk_addr_free(c);
+    sk_addr_free(d);
+    sk_addr_free(e);
+}
+
+static void test_async(void)
+{
+    AsyncResult res[1];
+
+    /* A lookup the cache doesn't know yet, so it goes to the resolver */
+    start_async("127.0.0.2", res);
+    check(!res->done, "async lookup doesn't call back immediately");
+    wait_for_lookups();
+    check(res->done, "async lookup calls back");
+    check(res->addr && !sk_addr_error(res->addr), "async lookup succeeded");
+
+    /* Its result should now be in the cache */
+    SockAddr *a = lookup("127.0.0.2", ADDRTYPE_UNSPEC);
+    check(a == res->addr, "async lookup fills the cache");
+    sk_addr_free(a);
+    free_async(res);
+
+    /* And a second async lookup should be answered from the cache,
+     * but still via a callback */
+    start_async("127.0.0.2", res);
+    check(!res->done, "cached async lookup doesn't call back immediately");
+    wait_for_lookups();
+    check(res->done, "cached async lookup calls back");
+    free_async(res);
+}
+
+static void test_async_cancel(void)
+{
+    AsyncResult cancelled[1], res[1];
+
+    /* Both of these are cache hits, so their callbacks are queued in
+     * order, and by the time the second has been called, the first
+     * has been dealt with. */
+    NameLookup *nl = start_async("127.0.0.2", cancelled);
+    start_async("127.0.0.2", res);
+    sk_namelookup_cancel(nl);
+    outstanding--;                     /* not expecting this one now */
+    wait_for_lookups();
+    check(res->done, "uncancelled lookup calls back");
+    check(!cancelled->done, "cancelled lookup doesn't call back");
+    free_async(res);
+
+    /* Cancelling a lookup that went to the resolver */
+    sk_set_namelookup_cache(false);
+    nl = start_async("127.0.0.3", cancelled);
+    sk_namelookup_cancel(nl);
+    outstanding--;
+    start_async("127.0.0.4", res);
+    wait_for_lookups();
+    check(res->done, "uncancelled lookup calls back");
+    sk_set_namelookup_cache(true);
+    free_async(res);
+}
+
+int main(void)
+{
+    uxsel_init();
+    sk_init();
+
+    test_sync_cache();
+    test_cache_disabled();
+    test_async();
+    test_async_cancel();
+
+    sk_cleanup();
+
+    if (fails) {
+        printf("Test suite FAILED! (%d failures)\n", fails);
+        return 1;
+    } else {
+        printf("Test suite passed\n");
+        return 0;
+    }
+}
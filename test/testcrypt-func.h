@@ -220,6 +220,10 @@ FUNC(val_wpoint, ecc_weierstrass_add, ARG(val_wpoint, P), ARG(val_wpoint, Q))
 FUNC(val_wpoint, ecc_weierstrass_double, ARG(val_wpoint, P))
 FUNC(val_wpoint, ecc_weierstrass_multiply, ARG(val_wpoint, B),
      ARG(val_mpint, n))
+FUNC(val_wtable, ecc_weierstrass_base_table_new, ARG(val_wpoint, B),
+     ARG(uint, bits))
+FUNC(val_wpoint, ecc_weierstrass_base_multiply, ARG(val_wtable, table),
+     ARG(val_mpint, n))
 FUNC(uint, ecc_weierstrass_is_identity, ARG(val_wpoint, P))
 /* The output pointers in get_affine all become extra output values */
 FUNC(void, ecc_weierstrass_get_affine, ARG(val_wpoint, P),
@@ -244,6 +248,10 @@ FUNC(val_epoint, ecc_edwards_point_new_from_y, ARG(val_ecurve, curve),
 FUNC(val_epoint, ecc_edwards_point_copy, ARG(val_epoint, orig))
 FUNC(val_epoint, ecc_edwards_add, ARG(val_epoint, P), ARG(val_epoint, Q))
 FUNC(val_epoint, ecc_edwards_multiply, ARG(val_epoint, B), ARG(val_mpint, n))
+FUNC(val_etable, ecc_edwards_base_table_new, ARG(val_epoint, B),
+     ARG(uint, bits))
+FUNC(val_epoint, ecc_edwards_base_multiply, ARG(val_etable, table),
+     ARG(val_mpint, n))
 FUNC(uint, ecc_edwards_eq, ARG(val_epoint, P), ARG(val_epoint, Q))
 FUNC(void, ecc_edwards_get_affine, ARG(val_epoint, P), ARG(out_val_mpint, x),
      ARG(out_val_mpint, y))
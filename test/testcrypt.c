@@ -80,10 +80,12 @@ uint64_t prng_reseed_time_ms(void)
     X(monty, MontyContext *, monty_free(v))                             \
     X(wcurve, WeierstrassCurve *, ecc_weierstrass_curve_free(v))        \
     X(wpoint, WeierstrassPoint *, ecc_weierstrass_point_free(v))        \
+    X(wtable, WeierstrassBaseTable *, ecc_weierstrass_base_table_free(v)) \
     X(mcurve, MontgomeryCurve *, ecc_montgomery_curve_free(v))          \
     X(mpoint, MontgomeryPoint *, ecc_montgomery_point_free(v))          \
     X(ecurve, EdwardsCurve *, ecc_edwards_curve_free(v))                \
     X(epoint, EdwardsPoint *, ecc_edwards_point_free(v))                \
+    X(etable, EdwardsBaseTable *, ecc_edwards_base_table_free(v))       \
     X(hash, ssh_hash *, ssh_hash_free(v))                               \
     X(key, ssh_key *, ssh_key_free(v))                                  \
     X(cipher, ssh_cipher *, ssh_cipher_free(v))                         \
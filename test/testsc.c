@@ -414,6 +414,7 @@ VOLATILE_WRAPPED_DEFN(static, size_t, looplimit, (size_t x))
     X(ecc_weierstrass_double)                   \
     X(ecc_weierstrass_add_general)              \
     X(ecc_weierstrass_multiply)                 \
+    X(ecc_weierstrass_base_multiply)            \
     X(ecc_weierstrass_is_identity)              \
     X(ecc_weierstrass_get_affine)               \
     X(ecc_weierstrass_decompress)               \
@@ -423,6 +424,7 @@ VOLATILE_WRAPPED_DEFN(static, size_t, looplimit, (size_t x))
     X(ecc_montgomery_get_affine)                \
     X(ecc_edwards_add)                          \
     X(ecc_edwards_multiply)                     \
+    X(ecc_edwards_base_multiply)                \
     X(ecc_edwards_eq)                           \
     X(ecc_edwards_get_affine)                   \
     X(ecc_edwards_decompress)                   \
@@ -953,6 +955,30 @@ static void test_ecc_weierstrass_multiply(void)
     mp_free(exponent);
 }
 
+static void test_ecc_weierstrass_base_multiply(void)
+{
+    WeierstrassCurve *wc = wcurve();
+    WeierstrassPoint *B = wpoint(wc, 1);
+    mp_int *exponent = mp_new(56);
+    /* mp_random_fill fills every bit of the mp_int, which is rounded up
+     * to a whole number of words, so the table must cover all of them */
+    WeierstrassBaseTable *table = ecc_weierstrass_base_table_new(
+        B, mp_max_bits(exponent));
+    for (size_t i = 0; i < looplimit(5); i++) {
+        mp_random_fill(exponent);
+
+        log_start();
+        WeierstrassPoint *r = ecc_weierstrass_base_multiply(table, exponent);
+        log_end();
+
+        ecc_weierstrass_point_free(r);
+    }
+    ecc_weierstrass_base_table_free(table);
+    ecc_weierstrass_point_free(B);
+    ecc_weierstrass_curve_free(wc);
+    mp_free(exponent);
+}
+
 static void test_ecc_weierstrass_is_identity(void)
 {
     WeierstrassCurve *wc = wcurve();
@@ -1285,6 +1311,30 @@ static void test_ecc_edwards_multiply(void)
     mp_free(exponent);
 }
 
+static void test_ecc_edwards_base_multiply(void)
+{
+    EdwardsCurve *ec = ecurve();
+    EdwardsPoint *B = epoint(ec, 1);
+    mp_int *exponent = mp_new(56);
+    /* mp_random_fill fills every bit of the mp_int, which is rounded up
+     * to a whole number of words, so the table must cover all of them */
+    EdwardsBaseTable *table = ecc_edwards_base_table_new(
+        B, mp_max_bits(exponent));
+    for (size_t i = 0; i < looplimit(5); i++) {
+        mp_random_fill(exponent);
+
+        log_start();
+        EdwardsPoint *r = ecc_edwards_base_multiply(table, exponent);
+        log_end();
+
+        ecc_edwards_point_free(r);
+    }
+    ecc_edwards_base_table_free(table);
+    ecc_edwards_point_free(B);
+    ecc_edwards_curve_free(ec);
+    mp_free(exponent);
+}
+
 static void test_ecc_edwards_eq(void)
 {
     EdwardsCurve *ec = ecurve();
@@ -0,0 +1,106 @@
+/*
+ * Unix implementation of run_in_background(), on the worker thread
+ * pool in unix/utils/workerpool.c.
+ *
+ * Finished jobs are passed back to the main thread on a queue, and a
+ * byte written down a pipe wakes up the event loop via uxsel to call
+ * their completion functions.
+ */
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "putty.h"
+#include "ssh.h"
+
+typedef struct BackgroundJob BackgroundJob;
+struct BackgroundJob {
+    toplevel_callback_fn_t work, done;
+    void *ctx;
+    BackgroundJob *next;
+};
+
+static pthread_mutex_t bg_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Protected by bg_mutex */
+static BackgroundJob *bg_finished_head, *bg_finished_tail;
+
+/* Only accessed from the main thread */
+static int bg_pipe[2] = { -1, -1 };
+
+static void bg_do_job(void *vctx)
+{
+    BackgroundJob *job = (BackgroundJob *)vctx;
+
+    /* Data-independent timing is a per-thread setting, where it exists */
+    enable_dit();
+
+    job->work(job->ctx);
+
+    pthread_mutex_lock(&bg_mutex);
+    bool need_wakeup = !bg_finished_head;
+    job->next = NULL;
+    if (bg_finished_tail)
+        bg_finished_tail->next = job;
+    else
+        bg_finished_head = job;
+    bg_finished_tail = job;
+    if (need_wakeup) {
+        /* The pipe only ever has a byte or two in it, so this can't
+         * block */
+        if (write(bg_pipe[1], "x", 1) <= 0)
+            /* not much we can do about it */;
+    }
+    pthread_mutex_unlock(&bg_mutex);
+}
+
+static void bg_select_result(int fd, int event)
+{
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0);
+
+    pthread_mutex_lock(&bg_mutex);
+    BackgroundJob *job = bg_finished_head;
+    bg_finished_head = bg_finished_tail = NULL;
+    pthread_mutex_unlock(&bg_mutex);
+
+    while (job) {
+        BackgroundJob *next = job->next;
+        job->done(job->ctx);
+        sfree(job);
+        job = next;
+    }
+}
+
+static bool bg_setup(void)
+{
+    if (bg_pipe[0] >= 0)
+        return true;
+
+    if (pipe(bg_pipe) < 0)
+        return false;
+    cloexec(bg_pipe[0]);
+    cloexec(bg_pipe[1]);
+    nonblock(bg_pipe[0]);
+    nonblock(bg_pipe[1]);
+    uxsel_set(bg_pipe[0], SELECT_R, bg_select_result);
+    return true;
+}
+
+void run_in_background(toplevel_callback_fn_t work,
+                       toplevel_callback_fn_t done, void *ctx)
+{
+    if (bg_setup()) {
+        BackgroundJob *job = snew(BackgroundJob);
+        job->work = work;
+        job->done = done;
+        job->ctx = ctx;
+        if (worker_pool_submit(bg_do_job, job))
+            return;
+        sfree(job);
+    }
+
+    /* No threads, so do the job ourselves */
+    work(ctx);
+    queue_toplevel_callback(done, ctx);
+}
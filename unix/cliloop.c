@@ -24,6 +24,16 @@ void cli_main_loop(cliloop_pw_setup_t pw_setup,
         if (!pw_setup(ctx, pw))
             break; /* our client signalled emergency exit */
 
+        /*
+         * Run any timers that are due before we collect the fds, so
+         * that if a timer callback opens a new one (such as a
+         * network connection attempt), we wait for it this time
+         * round.
+         */
+        bool timers_pending = false;
+        if (!toplevel_callback_pending())
+            timers_pending = run_timers(now, &next);
+
         /* Count the currently active fds. */
         size_t nfds = 0;
         for (int fd = first_fd(&fdstate, &rwx); fd >= 0;
@@ -46,7 +56,7 @@ void cli_main_loop(cliloop_pw_setup_t pw_setup,
 
         if (toplevel_callback_pending()) {
             ret = pollwrap_poll_instant(pw);
-        } else if (run_timers(now, &next)) {
+        } else if (timers_pending) {
             do {
                 unsigned long then;
                 long ticks;
@@ -2,6 +2,15 @@
  * Unix networking abstraction.
  */
 
+#if HAVE_CMAKE_H
+#include "cmake.h"
+#endif
+
+#if HAVE_SPLICE
+#define _GNU_SOURCE
+#include <features.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -59,6 +68,27 @@ struct SockAddrStep_tag {
 };
 
 typedef struct NetSocket NetSocket;
+
+/*
+ * An outgoing connection attempt which has been overtaken by a later
+ * one, but is still allowed to win the race (see sk_net_stagger).
+ */
+typedef struct ConnectAttempt ConnectAttempt;
+struct ConnectAttempt {
+    int fd;
+    SockAddrStep step;
+    unsigned long start;               /* GETTICKCOUNT() at connect() */
+    NetSocket *owner;
+    ConnectAttempt *next;
+};
+
+/*
+ * How long to wait for a connection attempt before starting another
+ * one to the next candidate address in parallel. RFC 8305 recommends
+ * 250ms.
+ */
+#define CONNECT_ATTEMPT_DELAY (TICKSPERSEC / 4)
+
 struct NetSocket {
     const char *error;
     int s;
@@ -77,10 +107,22 @@ struct NetSocket {
     int pending_error;                 /* in case send() returns error */
     bool listener;
     bool nodelay, keepalive;           /* for connect()-type sockets */
+    SockBufferSizes bufsizes;          /* likewise */
     bool privport;
     int port;                          /* and again */
     SockAddr *addr;
     SockAddrStep step;
+    unsigned long attempt_start;       /* GETTICKCOUNT() at connect() */
+    /*
+     * Earlier connection attempts still in progress in parallel with
+     * the one in 's' and 'step', and the timer for starting another.
+     * 'latest_step' is the last address we started an attempt on,
+     * which isn't always the same as 'step'.
+     */
+    SockAddrStep latest_step;
+    ConnectAttempt *attempts;
+    bool stagger_pending;
+    unsigned long stagger_time;
     /*
      * We sometimes need pairs of Socket structures to be linked:
      * if we are listening on the same IPv6 and v4 port, for
@@ -88,10 +130,22 @@ struct NetSocket {
      * track this link.
      */
     NetSocket *parent, *child;
+    /*
+     * A socket spliced to another by sk_net_splice passes the data it
+     * receives straight to 'splice_peer' through a pipe, instead of
+     * to its plug. 'splice_queued' is the amount of data waiting in
+     * that pipe to be written to the peer.
+     */
+    NetSocket *splice_peer;
+    int splice_pipe[2];
+    size_t splice_queued;
 
     Socket sock;
 };
 
+/* Maximum amount to splice from a socket into its pipe in one go */
+#define SPLICE_CHUNK 65536
+
 struct SockAddr {
     int refcount;
     const char *error;
@@ -138,8 +192,34 @@ struct SockAddr {
 #endif
 
 static tree234 *sktree;
+static tree234 *attempttree;
+
+/*
+ * Cache of recent results from sk_namelookup and sk_namelookup_async,
+ * so that a busy dynamic port forwarding or psocks setup doesn't wait
+ * for the system resolver once per connection to the same host.
+ * Failed lookups are cached too, but for less time, and only if the
+ * resolver said the name definitely doesn't exist.
+ */
+typedef struct NameCacheEntry NameCacheEntry;
+struct NameCacheEntry {
+    char *host;
+    int address_family;
+    SockAddr *addr;                    /* we hold one reference to this */
+    char *canonicalname;
+    unsigned long expiry;              /* GETTICKCOUNT() value */
+};
+
+#define NAME_CACHE_TTL (60 * TICKSPERSEC)
+#define NAME_CACHE_NEGATIVE_TTL (5 * TICKSPERSEC)
+#define NAME_CACHE_MAX_ENTRIES 64
+
+static tree234 *namecache;
+static bool namecache_enabled = true;
+static void name_cache_entry_free(NameCacheEntry *e);
 
 static void uxsel_tell(NetSocket *s);
+void try_send(NetSocket *s);
 
 static int cmpfortree(void *av, void *bv)
 {
@@ -167,14 +247,50 @@ static int cmpforsearch(void *av, void *bv)
     return 0;
 }
 
+static int cmpfornamecache(void *av, void *bv)
+{
+    NameCacheEntry *a = (NameCacheEntry *) av, *b = (NameCacheEntry *) bv;
+    int c = strcmp(a->host, b->host);
+    if (c)
+        return c;
+    if (a->address_family < b->address_family)
+        return -1;
+    if (a->address_family > b->address_family)
+        return +1;
+    return 0;
+}
+
+static int cmpforattempt(void *av, void *bv)
+{
+    ConnectAttempt *a = (ConnectAttempt *) av, *b = (ConnectAttempt *) bv;
+    if (a->fd < b->fd)
+        return -1;
+    if (a->fd > b->fd)
+        return +1;
+    return 0;
+}
+
+static int cmpforattemptsearch(void *av, void *bv)
+{
+    ConnectAttempt *b = (ConnectAttempt *) bv;
+    int as = *(int *)av, bs = b->fd;
+    if (as < bs)
+        return -1;
+    if (as > bs)
+        return +1;
+    return 0;
+}
+
 void sk_init(void)
 {
     sktree = newtree234(cmpfortree);
+    attempttree = newtree234(cmpforattempt);
 }
 
 void sk_cleanup(void)
 {
     NetSocket *s;
+    ConnectAttempt *a;
     int i;
 
     if (sktree) {
@@ -182,17 +298,29 @@ void sk_cleanup(void)
             close(s->s);
         }
     }
+    if (attempttree) {
+        for (i = 0; (a = index234(attempttree, i)) != NULL; i++) {
+            close(a->fd);
+        }
+    }
+    if (namecache) {
+        NameCacheEntry *e;
+        while ((e = delpos234(namecache, 0)) != NULL)
+            name_cache_entry_free(e);
+        freetree234(namecache);
+        namecache = NULL;
+    }
 }
 
-SockAddr *sk_namelookup(const char *host, char **canonicalname,
-                        int address_family)
+/*
+ * Do a name lookup with no caching. *cacheable is set to false if the
+ * result is a transient failure which shouldn't be remembered.
+ */
+static SockAddr *sk_namelookup_uncached(const char *host, char **canonicalname,
+                                        int address_family, bool *cacheable)
 {
     *canonicalname = NULL;
-
-    if (host[0] == '/') {
-        *canonicalname = dupstr(host);
-        return unix_sock_addr(host);
-    }
+    *cacheable = true;
 
     SockAddr *addr = snew(SockAddr);
     memset(addr, 0, sizeof(SockAddr));
@@ -227,6 +355,8 @@ SockAddr *sk_namelookup(const char *host, char **canonicalname,
                 *canonicalname = dupstr(host);
         } else {
             addr->error = gai_strerror(err);
+            if (err != EAI_NONAME)
+                *cacheable = false;
         }
         return addr;
     }
@@ -264,9 +394,219 @@ SockAddr *sk_namelookup(const char *host, char **canonicalname,
         *canonicalname = dupstr(h->h_name);
     } else {
         addr->error = hstrerror(h_errno);
+        if (h_errno != HOST_NOT_FOUND)
+            *cacheable = false;
+    }
+    return addr;
+#endif
+}
+
+static void name_cache_entry_free(NameCacheEntry *e)
+{
+    sfree(e->host);
+    sfree(e->canonicalname);
+    sk_addr_free(e->addr);
+    sfree(e);
+}
+
+static bool name_cache_entry_expired(NameCacheEntry *e, unsigned long now)
+{
+    return (long)(now - e->expiry) >= 0;
+}
+
+/*
+ * Make room in the cache for one more entry, by throwing out
+ * everything that has expired, and then if that wasn't enough, the
+ * entry closest to expiring.
+ */
+static void name_cache_make_room(unsigned long now)
+{
+    NameCacheEntry *e, *oldest;
+    int i;
+
+    for (i = 0; (e = index234(namecache, i)) != NULL;) {
+        if (name_cache_entry_expired(e, now)) {
+            delpos234(namecache, i);
+            name_cache_entry_free(e);
+        } else {
+            i++;
+        }
+    }
+
+    while (count234(namecache) >= NAME_CACHE_MAX_ENTRIES) {
+        oldest = NULL;
+        for (i = 0; (e = index234(namecache, i)) != NULL; i++)
+            if (!oldest || (long)(e->expiry - oldest->expiry) < 0)
+                oldest = e;
+        del234(namecache, oldest);
+        name_cache_entry_free(oldest);
+    }
+}
+
+void sk_set_namelookup_cache(bool enabled)
+{
+    namecache_enabled = enabled;
+    if (!enabled && namecache) {
+        NameCacheEntry *e;
+        while ((e = delpos234(namecache, 0)) != NULL)
+            name_cache_entry_free(e);
     }
+}
+
+/*
+ * Look a name up in the cache. Returns NULL if it isn't there (or
+ * has expired, or the cache is turned off).
+ */
+static SockAddr *name_cache_find(const char *host, char **canonicalname,
+                                 int address_family, unsigned long now)
+{
+    NameCacheEntry key, *e;
+
+    if (!namecache_enabled)
+        return NULL;
+    if (!namecache)
+        namecache = newtree234(cmpfornamecache);
+
+    key.host = (char *)host;
+    key.address_family = address_family;
+    e = find234(namecache, &key, NULL);
+    if (!e)
+        return NULL;
+    if (name_cache_entry_expired(e, now)) {
+        del234(namecache, e);
+        name_cache_entry_free(e);
+        return NULL;
+    }
+
+    *canonicalname = e->canonicalname ? dupstr(e->canonicalname) : NULL;
+    return sk_addr_dup(e->addr);
+}
+
+static void name_cache_add(const char *host, const char *canonicalname,
+                           int address_family, SockAddr *addr,
+                           unsigned long now)
+{
+    NameCacheEntry *e;
+
+    if (!namecache_enabled)
+        return;
+    if (!namecache)
+        namecache = newtree234(cmpfornamecache);
+
+    name_cache_make_room(now);
+    e = snew(NameCacheEntry);
+    e->host = dupstr(host);
+    e->address_family = address_family;
+    e->addr = sk_addr_dup(addr);
+    e->canonicalname = canonicalname ? dupstr(canonicalname) : NULL;
+    e->expiry = now + (addr->error ? NAME_CACHE_NEGATIVE_TTL :
+                       NAME_CACHE_TTL);
+    if (add234(namecache, e) != e)
+        name_cache_entry_free(e);    /* an async lookup got there first */
+}
+
+SockAddr *sk_namelookup(const char *host, char **canonicalname,
+                        int address_family)
+{
+    unsigned long now;
+    bool cacheable;
+    SockAddr *addr;
+
+    if (host[0] == '/') {
+        *canonicalname = dupstr(host);
+        return unix_sock_addr(host);
+    }
+
+    now = GETTICKCOUNT();
+    addr = name_cache_find(host, canonicalname, address_family, now);
+    if (addr)
+        return addr;
+
+    addr = sk_namelookup_uncached(host, canonicalname, address_family,
+                                  &cacheable);
+    if (cacheable)
+        name_cache_add(host, *canonicalname, address_family, addr, now);
     return addr;
+}
+
+/*
+ * Asynchronous lookups. The resolver call itself runs via
+ * run_in_background, and touches nothing but the NameLookup; the
+ * cache is only consulted and updated from the main thread.
+ */
+struct NameLookup {
+    char *host;
+    int address_family;
+    namelookup_callback_fn_t callback;
+    void *ctx;
+    bool cancelled, cacheable;
+    SockAddr *addr;
+    char *canonicalname;
+};
+
+static void namelookup_work(void *vctx)
+{
+    NameLookup *nl = (NameLookup *)vctx;
+    nl->addr = sk_namelookup_uncached(nl->host, &nl->canonicalname,
+                                      nl->address_family, &nl->cacheable);
+}
+
+static void namelookup_done(void *vctx)
+{
+    NameLookup *nl = (NameLookup *)vctx;
+
+    if (nl->cancelled) {
+        sk_addr_free(nl->addr);
+        sfree(nl->canonicalname);
+    } else {
+        if (nl->cacheable)
+            name_cache_add(nl->host, nl->canonicalname, nl->address_family,
+                           nl->addr, GETTICKCOUNT());
+        /* Ownership of addr and canonicalname passes to the callback */
+        nl->callback(nl->ctx, nl->addr, nl->canonicalname);
+    }
+    sfree(nl->host);
+    sfree(nl);
+}
+
+NameLookup *sk_namelookup_async(const char *host, int address_family,
+                                namelookup_callback_fn_t callback, void *ctx)
+{
+    NameLookup *nl = snew(NameLookup);
+    nl->host = dupstr(host);
+    nl->address_family = address_family;
+    nl->callback = callback;
+    nl->ctx = ctx;
+    nl->cancelled = false;
+    nl->cacheable = false;
+    nl->canonicalname = NULL;
+
+    if (host[0] == '/') {
+        nl->canonicalname = dupstr(host);
+        nl->addr = unix_sock_addr(host);
+    } else {
+        nl->addr = name_cache_find(host, &nl->canonicalname, address_family,
+                                   GETTICKCOUNT());
+    }
+
+    if (nl->addr) {
+        queue_toplevel_callback(namelookup_done, nl);
+    } else {
+#ifndef NO_IPV6
+        run_in_background(namelookup_work, namelookup_done, nl);
+#else
+        /* gethostbyname isn't thread-safe, so do it here and now */
+        namelookup_work(nl);
+        queue_toplevel_callback(namelookup_done, nl);
 #endif
+    }
+    return nl;
+}
+
+void sk_namelookup_cancel(NameLookup *nl)
+{
+    /* namelookup_done will still be called, and will free it */
+    nl->cancelled = true;
 }
 
 SockAddr *sk_nonamelookup(const char *host)
@@ -511,6 +851,8 @@ static Socket *sk_net_accept(accept_ctx_t ctx, Plug *plug)
      * Create NetSocket structure.
      */
     s = snew(NetSocket);
+    s->attempts = NULL;
+    s->stagger_pending = false;
     s->sock.vt = &NetSocket_sockvt;
     s->error = NULL;
     s->plug = plug;
@@ -525,6 +867,7 @@ static Socket *sk_net_accept(accept_ctx_t ctx, Plug *plug)
     s->incomingeof = false;
     s->listener = false;
     s->parent = s->child = NULL;
+    s->splice_peer = NULL;
     s->addr = NULL;
     s->connected = true;
 
@@ -543,6 +886,26 @@ static Socket *sk_net_accept(accept_ctx_t ctx, Plug *plug)
     return &s->sock;
 }
 
+/*
+ * Log the outcome of one connection attempt, including how long it
+ * took.
+ */
+static void sk_net_log_attempt(NetSocket *s, PlugLogType type,
+                               const SockAddrStep *step, unsigned long start,
+                               const char *error_msg, int error_code)
+{
+    SockAddr thisaddr = sk_extractaddr_tmp(s->addr, step);
+    unsigned long ms = (GETTICKCOUNT() - start) * 1000 / TICKSPERSEC;
+    char *msg;
+
+    if (type == PLUGLOG_CONNECT_SUCCESS)
+        msg = dupprintf("after %lu ms", ms);
+    else
+        msg = dupprintf("%s (after %lu ms)", error_msg, ms);
+    plug_log(s->plug, &s->sock, type, &thisaddr, s->port, msg, error_code);
+    sfree(msg);
+}
+
 static int try_connect(NetSocket *sock)
 {
     int s;
@@ -560,8 +923,10 @@ static int try_connect(NetSocket *sock)
      */
     del234(sktree, sock);
 
-    if (sock->s >= 0)
+    if (sock->s >= 0) {
+        uxsel_del(sock->s);
         close(sock->s);
+    }
 
     {
         SockAddr thisaddr = sk_extractaddr_tmp(
@@ -569,6 +934,7 @@ static int try_connect(NetSocket *sock)
         plug_log(sock->plug, &sock->sock, PLUGLOG_CONNECT_TRYING,
                  &thisaddr, sock->port, NULL, 0);
     }
+    sock->latest_step = sock->step;
 
     /*
      * Open socket.
@@ -590,7 +956,6 @@ static int try_connect(NetSocket *sock)
         if (setsockopt(s, SOL_SOCKET, SO_OOBINLINE,
                        (void *) &b, sizeof(b)) < 0) {
             err = errno;
-            close(s);
             goto ret;
         }
     }
@@ -600,7 +965,6 @@ static int try_connect(NetSocket *sock)
         if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY,
                        (void *) &b, sizeof(b)) < 0) {
             err = errno;
-            close(s);
             goto ret;
         }
     }
@@ -610,11 +974,40 @@ static int try_connect(NetSocket *sock)
         if (setsockopt(s, SOL_SOCKET, SO_KEEPALIVE,
                        (void *) &b, sizeof(b)) < 0) {
             err = errno;
-            close(s);
             goto ret;
         }
     }
 
+    /*
+     * Buffer sizes have to be set before connect(), so that the TCP
+     * window scale we negotiate takes account of them.
+     */
+    if (sock->bufsizes.sndbuf > 0) {
+        int b = sock->bufsizes.sndbuf;
+        if (setsockopt(s, SOL_SOCKET, SO_SNDBUF,
+                       (void *) &b, sizeof(b)) < 0) {
+            err = errno;
+            goto ret;
+        }
+    }
+
+    if (sock->bufsizes.rcvbuf > 0) {
+        int b = sock->bufsizes.rcvbuf;
+        if (setsockopt(s, SOL_SOCKET, SO_RCVBUF,
+                       (void *) &b, sizeof(b)) < 0) {
+            err = errno;
+            goto ret;
+        }
+    }
+
+#ifdef TCP_NOTSENT_LOWAT
+    if (sock->bufsizes.notsent_lowat > 0 && family != AF_UNIX) {
+        /* Not fatal if this fails: an older kernel may not know it */
+        int b = sock->bufsizes.notsent_lowat;
+        setsockopt(s, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (void *) &b, sizeof(b));
+    }
+#endif
+
     /*
      * Bind to local address.
      */
@@ -711,6 +1104,7 @@ static int try_connect(NetSocket *sock)
 
     nonblock(s);
 
+    sock->attempt_start = GETTICKCOUNT();
     if ((connect(s, &(sa->sa), salen)) < 0) {
         if ( errno != EINPROGRESS ) {
             err = errno;
@@ -724,9 +1118,8 @@ static int try_connect(NetSocket *sock)
         sock->connected = true;
         sock->writable = true;
 
-        SockAddr thisaddr = sk_extractaddr_tmp(sock->addr, &sock->step);
-        plug_log(sock->plug, &sock->sock, PLUGLOG_CONNECT_SUCCESS,
-                 &thisaddr, sock->port, NULL, 0);
+        sk_net_log_attempt(sock, PLUGLOG_CONNECT_SUCCESS, &sock->step,
+                           sock->attempt_start, NULL, 0);
     }
 
     uxsel_tell(sock);
@@ -739,16 +1132,200 @@ static int try_connect(NetSocket *sock)
     add234(sktree, sock);
 
     if (err) {
-        SockAddr thisaddr = sk_extractaddr_tmp(
-            sock->addr, &sock->step);
-        plug_log(sock->plug, &sock->sock, PLUGLOG_CONNECT_FAILED,
-                 &thisaddr, sock->port, strerror(err), err);
+        sk_net_log_attempt(sock, PLUGLOG_CONNECT_FAILED, &sock->step,
+                           sock->attempt_start, strerror(err), err);
     }
     return err;
 }
 
+/* ----------------------------------------------------------------------
+ * Staggered parallel connection attempts ('Happy Eyeballs', RFC 8305).
+ *
+ * If a connection attempt to one candidate address hasn't succeeded
+ * or failed after CONNECT_ATTEMPT_DELAY, we don't abandon it, but we
+ * start an attempt to the next address alongside it. The older
+ * attempt is 'parked' in a ConnectAttempt, and the NetSocket's own fd
+ * and SockAddrStep always describe the most recent attempt. Whichever
+ * attempt completes first wins, and the rest are closed.
+ */
+
+static void net_attempt_select_result(int fd, int event);
+
+static void sk_net_stagger_timer(void *ctx, unsigned long now);
+
+static void sk_net_schedule_stagger(NetSocket *s)
+{
+    SockAddrStep next = s->latest_step;
+
+    if (!s->addr || !sk_nextaddr(s->addr, &next))
+        return;                        /* nothing to stagger on to */
+
+    s->stagger_time = schedule_timer(CONNECT_ATTEMPT_DELAY,
+                                     sk_net_stagger_timer, s);
+    s->stagger_pending = true;
+}
+
+/*
+ * Move the socket's current connection attempt into its list of
+ * parked ones, leaving it free to start another.
+ */
+static void sk_net_park_attempt(NetSocket *s)
+{
+    ConnectAttempt *a = snew(ConnectAttempt);
+
+    del234(sktree, s);
+    a->fd = s->s;
+    a->step = s->step;
+    a->start = s->attempt_start;
+    a->owner = s;
+    a->next = s->attempts;
+    s->attempts = a;
+    s->s = -1;
+    add234(sktree, s);
+
+    add234(attempttree, a);
+    uxsel_set(a->fd, SELECT_W, net_attempt_select_result);
+}
+
+static void sk_net_unlink_attempt(ConnectAttempt *a)
+{
+    ConnectAttempt **pp;
+
+    for (pp = &a->owner->attempts; *pp != a; pp = &(*pp)->next)
+        assert(*pp);
+    *pp = a->next;
+    del234(attempttree, a);
+}
+
+/*
+ * Make a parked attempt into the socket's current one, closing
+ * whatever was current before.
+ */
+static void sk_net_adopt_attempt(NetSocket *s, ConnectAttempt *a)
+{
+    sk_net_unlink_attempt(a);
+
+    del234(sktree, s);
+    if (s->s >= 0) {
+        uxsel_del(s->s);
+        close(s->s);
+    }
+    s->s = a->fd;
+    s->step = a->step;
+    s->attempt_start = a->start;
+    add234(sktree, s);
+
+    sfree(a);
+}
+
+static void sk_net_close_attempts(NetSocket *s)
+{
+    while (s->attempts) {
+        ConnectAttempt *a = s->attempts;
+        sk_net_unlink_attempt(a);
+        uxsel_del(a->fd);
+        close(a->fd);
+        sfree(a);
+    }
+}
+
+/*
+ * Called when one of our connection attempts has succeeded (and been
+ * made current), to clean up all the others.
+ */
+static void sk_net_finish_connect(NetSocket *s)
+{
+    sk_net_close_attempts(s);
+    s->stagger_pending = false;
+
+    if (s->addr) {
+        sk_addr_free(s->addr);
+        s->addr = NULL;
+    }
+    s->connected = true;
+    s->writable = true;
+    uxsel_tell(s);
+}
+
+static void sk_net_stagger_timer(void *ctx, unsigned long now)
+{
+    NetSocket *s = (NetSocket *)ctx;
+    int err;
+
+    if (!s->stagger_pending || now != s->stagger_time)
+        return;
+    s->stagger_pending = false;
+
+    if (s->connected || !s->addr || s->s < 0)
+        return;
+
+    SockAddrStep next = s->latest_step;
+    if (!sk_nextaddr(s->addr, &next))
+        return;
+
+    sk_net_park_attempt(s);
+    s->step = next;
+
+    do {
+        err = try_connect(s);
+    } while (err && sk_nextaddr(s->addr, &s->step));
+
+    if (err) {
+        /*
+         * Every remaining address failed straight away, so go back to
+         * waiting for the attempt we just parked.
+         */
+        sk_net_adopt_attempt(s, s->attempts);
+        uxsel_tell(s);
+    } else if (s->connected) {
+        sk_net_close_attempts(s);
+    } else {
+        sk_net_schedule_stagger(s);
+    }
+}
+
+static void net_attempt_select_result(int fd, int event)
+{
+    ConnectAttempt *a;
+    NetSocket *s;
+    int err;
+    socklen_t errlen = sizeof(err);
+
+    a = find234(attempttree, &fd, cmpforattemptsearch);
+    if (!a)
+        return;
+    s = a->owner;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+        err = errno;
+
+    if (err) {
+        sk_net_log_attempt(s, PLUGLOG_CONNECT_FAILED, &a->step, a->start,
+                           strerror(err), err);
+        sk_net_unlink_attempt(a);
+        uxsel_del(a->fd);
+        close(a->fd);
+        sfree(a);
+        return;
+    }
+
+    /* This attempt has won the race. */
+    sk_net_adopt_attempt(s, a);
+    sk_net_log_attempt(s, PLUGLOG_CONNECT_SUCCESS, &s->step,
+                       s->attempt_start, NULL, 0);
+    sk_net_finish_connect(s);
+}
+
 Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
                bool nodelay, bool keepalive, Plug *plug)
+{
+    return sk_new_tuned(addr, port, privport, oobinline, nodelay, keepalive,
+                        NULL, plug);
+}
+
+Socket *sk_new_tuned(SockAddr *addr, int port, bool privport, bool oobinline,
+                     bool nodelay, bool keepalive,
+                     const SockBufferSizes *bufsizes, Plug *plug)
 {
     NetSocket *s;
     int err;
@@ -757,6 +1334,8 @@ Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
      * Create NetSocket structure.
      */
     s = snew(NetSocket);
+    s->attempts = NULL;
+    s->stagger_pending = false;
     s->sock.vt = &NetSocket_sockvt;
     s->error = NULL;
     s->plug = plug;
@@ -768,6 +1347,7 @@ Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
     s->localhost_only = false;    /* unused, but best init anyway */
     s->pending_error = 0;
     s->parent = s->child = NULL;
+    s->splice_peer = NULL;
     s->oobpending = false;
     s->outgoingeof = EOF_NO;
     s->incomingeof = false;
@@ -778,6 +1358,10 @@ Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
     s->oobinline = oobinline;
     s->nodelay = nodelay;
     s->keepalive = keepalive;
+    if (bufsizes)
+        s->bufsizes = *bufsizes;
+    else
+        memset(&s->bufsizes, 0, sizeof(s->bufsizes));
     s->privport = privport;
     s->port = port;
 
@@ -787,6 +1371,8 @@ Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
 
     if (err)
         s->error = strerror(err);
+    else if (!s->connected)
+        sk_net_schedule_stagger(s);
 
     return &s->sock;
 }
@@ -811,6 +1397,8 @@ Socket *sk_newlistener(const char *srcaddr, int port, Plug *plug,
      * Create NetSocket structure.
      */
     s = snew(NetSocket);
+    s->attempts = NULL;
+    s->stagger_pending = false;
     s->sock.vt = &NetSocket_sockvt;
     s->error = NULL;
     s->plug = plug;
@@ -821,6 +1409,7 @@ Socket *sk_newlistener(const char *srcaddr, int port, Plug *plug,
     s->localhost_only = local_host_only;
     s->pending_error = 0;
     s->parent = s->child = NULL;
+    s->splice_peer = NULL;
     s->oobpending = false;
     s->outgoingeof = EOF_NO;
     s->incomingeof = false;
@@ -1005,6 +1594,36 @@ static void sk_net_close(Socket *sock)
 
     bufchain_clear(&s->output_data);
 
+    if (s->splice_peer) {
+        NetSocket *peer = s->splice_peer;
+        peer->splice_peer = NULL;
+
+        /*
+         * Data we've received but not yet passed on still belongs to
+         * the peer, so move it into the peer's ordinary output
+         * buffer. Data on its way to us can be thrown away, just as
+         * our own output_data is.
+         */
+        while (s->splice_queued > 0) {
+            char buf[4096];
+            ssize_t ret = read(s->splice_pipe[0], buf, sizeof(buf));
+            if (ret <= 0)
+                break;
+            bufchain_add(&peer->output_data, buf, ret);
+            s->splice_queued -= ret;
+        }
+        close(s->splice_pipe[0]);
+        close(s->splice_pipe[1]);
+        close(peer->splice_pipe[0]);
+        close(peer->splice_pipe[1]);
+        if (peer->writable)
+            try_send(peer);
+        uxsel_tell(peer);
+    }
+
+    sk_net_close_attempts(s);
+    expire_timer_context(s);
+
     del234(sktree, s);
     if (s->s >= 0) {
         uxsel_del(s->s);
@@ -1165,9 +1784,49 @@ void try_send(NetSocket *s)
                 }
             } else {
                 bufchain_consume(&s->output_data, nsent);
+                if (nsent < len) {
+                    /*
+                     * A short write means the kernel has taken all
+                     * it's going to for now (in particular, we've
+                     * reached TCP_NOTSENT_LOWAT if that's set), so
+                     * don't spend another system call finding that
+                     * out. Leave the rest in output_data until
+                     * select says we can write again.
+                     */
+                    s->writable = false;
+                    return;
+                }
+            }
+        }
+    }
+
+#if HAVE_SPLICE
+    /*
+     * After our own output buffer, send anything our splice peer has
+     * queued up for us.
+     */
+    if (s->splice_peer && s->splice_peer->splice_queued > 0) {
+        NetSocket *peer = s->splice_peer;
+        while (peer->splice_queued > 0) {
+            ssize_t nsent = splice(peer->splice_pipe[0], NULL, s->s, NULL,
+                                   peer->splice_queued,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (nsent < 0 && errno == EAGAIN) {
+                s->writable = false;
+                return;
+            } else if (nsent <= 0) {
+                /* As above, report the error later */
+                s->pending_error = (nsent < 0 ? errno : EPIPE);
+                uxsel_tell(s);
+                queue_toplevel_callback(socket_error_callback, s);
+                return;
             }
+            peer->splice_queued -= nsent;
         }
+        /* The pipe is empty, so the peer can read more into it */
+        uxsel_tell(peer);
     }
+#endif
 
     /*
      * If we reach here, we've finished sending everything we might
@@ -1264,6 +1923,95 @@ static void sk_net_write_eof(Socket *sock)
     uxsel_tell(s);
 }
 
+#if HAVE_SPLICE
+/*
+ * Receive data on a spliced socket, by moving it from the socket into
+ * the pipe and then on to the peer without it coming into user space.
+ */
+static void net_splice_receive(NetSocket *s)
+{
+    NetSocket *peer = s->splice_peer;
+    ssize_t ret;
+
+    if (s->splice_queued > 0)
+        return;               /* wait for the pipe to drain to the peer */
+
+    ret = splice(s->s, NULL, s->splice_pipe[1], NULL, SPLICE_CHUNK,
+                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    noise_ultralight(NOISE_SOURCE_IOLEN, ret);
+    if (ret < 0) {
+        if (errno != EAGAIN)
+            plug_closing_errno(s->plug, errno);
+    } else if (ret == 0) {
+        s->incomingeof = true;         /* stop trying to read now */
+        uxsel_tell(s);
+        plug_closing_normal(s->plug);
+    } else {
+        if (s->addr) {
+            sk_addr_free(s->addr);
+            s->addr = NULL;
+        }
+        s->splice_queued += ret;
+        if (peer->writable)
+            try_send(peer);
+        uxsel_tell(peer);
+        uxsel_tell(s);
+    }
+}
+#endif
+
+/*
+ * Connect two sockets so that from now on, whatever either one
+ * receives is sent straight out of the other by splice(2), never
+ * passing through user space or either socket's plug. EOF and errors
+ * are still reported to the plugs in the usual way, and anything
+ * already buffered for output on either socket is sent first.
+ * Returns false if this isn't possible, in which case nothing has
+ * changed.
+ */
+bool sk_net_splice(Socket *sock1, Socket *sock2)
+{
+#if HAVE_SPLICE
+    if (sock1->vt != &NetSocket_sockvt || sock2->vt != &NetSocket_sockvt)
+        return false;
+    NetSocket *s1 = container_of(sock1, NetSocket, sock);
+    NetSocket *s2 = container_of(sock2, NetSocket, sock);
+    if (s1->listener || s2->listener || s1->splice_peer || s2->splice_peer ||
+        s1->oobinline || s2->oobinline)
+        return false;
+
+    int pipe1[2], pipe2[2];
+    if (pipe(pipe1) < 0)
+        return false;
+    if (pipe(pipe2) < 0) {
+        close(pipe1[0]);
+        close(pipe1[1]);
+        return false;
+    }
+    for (size_t i = 0; i < 2; i++) {
+        nonblock(pipe1[i]);
+        cloexec(pipe1[i]);
+        nonblock(pipe2[i]);
+        cloexec(pipe2[i]);
+    }
+
+    s1->splice_peer = s2;
+    s1->splice_pipe[0] = pipe1[0];
+    s1->splice_pipe[1] = pipe1[1];
+    s1->splice_queued = 0;
+    s2->splice_peer = s1;
+    s2->splice_pipe[0] = pipe2[0];
+    s2->splice_pipe[1] = pipe2[1];
+    s2->splice_queued = 0;
+
+    uxsel_tell(s1);
+    uxsel_tell(s2);
+    return true;
+#else
+    return false;
+#endif
+}
+
 static void net_select_result(int fd, int event)
 {
     int ret;
@@ -1370,6 +2118,13 @@ static void net_select_result(int fd, int event)
         } else
             atmark = true;
 
+#if HAVE_SPLICE
+        if (s->splice_peer && !s->oobpending) {
+            net_splice_receive(s);
+            break;
+        }
+#endif
+
         ret = recv(s->s, buf, s->oobpending ? 1 : sizeof(buf), 0);
         noise_ultralight(NOISE_SOURCE_IOLEN, ret);
         if (ret < 0) {
@@ -1421,42 +2176,51 @@ static void net_select_result(int fd, int event)
                      * with the next candidate address, if we have
                      * more than one.
                      */
-                    SockAddr thisaddr;
                     assert(s->addr);
 
-                    thisaddr = sk_extractaddr_tmp(s->addr, &s->step);
-                    plug_log(s->plug, &s->sock, PLUGLOG_CONNECT_FAILED,
-                             &thisaddr, s->port, errmsg, err);
+                    sk_net_log_attempt(s, PLUGLOG_CONNECT_FAILED, &s->step,
+                                       s->attempt_start, errmsg, err);
+                    sfree(errmsg);
 
+                    /* Carry on from the last address we tried, which
+                     * might be past this one if it was a parked
+                     * attempt that we adopted. */
+                    s->step = s->latest_step;
                     while (err && s->addr && sk_nextaddr(s->addr, &s->step)) {
                         err = try_connect(s);
                     }
+                    if (err && s->attempts) {
+                        /*
+                         * We've run out of addresses, but an earlier
+                         * attempt is still in progress, so wait for
+                         * that one instead.
+                         */
+                        sk_net_adopt_attempt(s, s->attempts);
+                        uxsel_tell(s);
+                        return;
+                    }
                     if (err) {
                         plug_closing_errno(s->plug, err);
                         return;      /* socket is now presumably defunct */
                     }
-                    if (!s->connected)
-                        return;      /* another async attempt in progress */
+                    if (!s->connected) {
+                        /* another async attempt in progress */
+                        sk_net_schedule_stagger(s);
+                        return;
+                    }
                 } else {
                     /*
                      * The connection attempt succeeded.
                      */
-                    SockAddr thisaddr = sk_extractaddr_tmp(s->addr, &s->step);
-                    plug_log(s->plug, &s->sock, PLUGLOG_CONNECT_SUCCESS,
-                             &thisaddr, s->port, NULL, 0);
+                    sk_net_log_attempt(s, PLUGLOG_CONNECT_SUCCESS, &s->step,
+                                       s->attempt_start, NULL, 0);
                 }
             }
 
             /*
              * If we get here, we've managed to make a connection.
              */
-            if (s->addr) {
-                sk_addr_free(s->addr);
-                s->addr = NULL;
-            }
-            s->connected = true;
-            s->writable = true;
-            uxsel_tell(s);
+            sk_net_finish_connect(s);
         } else {
             size_t bufsize_before, bufsize_after;
             s->writable = true;
@@ -1580,9 +2344,11 @@ static void uxsel_tell(NetSocket *s)
         } else {
             if (!s->connected)
                 rwx |= SELECT_W;       /* write == connect */
-            if (s->connected && !s->frozen && !s->incomingeof)
+            if (s->connected && !s->frozen && !s->incomingeof &&
+                !(s->splice_peer && s->splice_queued > 0))
                 rwx |= SELECT_R | SELECT_X;
-            if (bufchain_size(&s->output_data))
+            if (bufchain_size(&s->output_data) ||
+                (s->splice_peer && s->splice_peer->splice_queued > 0))
                 rwx |= SELECT_W;
         }
     }
@@ -1686,6 +2452,8 @@ Socket *new_unix_listener(SockAddr *listenaddr, Plug *plug)
      * Create NetSocket structure.
      */
     s = snew(NetSocket);
+    s->attempts = NULL;
+    s->stagger_pending = false;
     s->sock.vt = &NetSocket_sockvt;
     s->error = NULL;
     s->plug = plug;
@@ -1696,6 +2464,7 @@ Socket *new_unix_listener(SockAddr *listenaddr, Plug *plug)
     s->localhost_only = true;
     s->pending_error = 0;
     s->parent = s->child = NULL;
+    s->splice_peer = NULL;
     s->oobpending = false;
     s->outgoingeof = EOF_NO;
     s->incomingeof = false;
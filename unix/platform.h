@@ -361,6 +361,7 @@ bool init_ucs(struct unicode_data *ucsdata, char *line_codepage,
  */
 void *sk_getxdmdata(Socket *sock, int *lenp);
 int sk_net_get_fd(Socket *sock);
+bool sk_net_splice(Socket *sock1, Socket *sock2);
 SockAddr *unix_sock_addr(const char *path);
 Socket *new_unix_listener(SockAddr *listenaddr, Plug *plug);
 
@@ -478,6 +479,14 @@ bool cliloop_no_pw_setup(void *ctx, pollwrapper *pw);
 void cliloop_no_pw_check(void *ctx, pollwrapper *pw);
 bool cliloop_always_continue(void *ctx, bool, bool);
 
+/*
+ * share-persist.c: start a detached background upstream for a
+ * persistent shared connection, if the configuration wants one.
+ * Returns false if the connection should not go ahead (in which case
+ * the reason has already been reported on standard error).
+ */
+bool share_persist_start(const BackendVtable *vt, Conf *conf, LogPolicy *lp);
+
 /* network.c: network error reporting helper taking an OS error code */
 void plug_closing_errno(Plug *plug, int error);
 
@@ -552,6 +552,8 @@ static void usage(void)
     printf("            disconnect if SSH authentication succeeds trivially\n");
     printf("  -noshare  disable use of connection sharing\n");
     printf("  -share    enable use of connection sharing\n");
+    printf("  -sharepersist seconds\n");
+    printf("            share a connection kept open in the background\n");
     printf("  -hostkey keyid\n");
     printf("            manually specify a host key (may be repeated)\n");
     printf("  -sanitise-stderr, -sanitise-stdout, "
@@ -573,6 +575,7 @@ static void usage(void)
     printf("            control what happens when a log file already exists\n");
     printf("  -shareexists\n");
     printf("            test whether a connection-sharing upstream exists\n");
+    printf("  -timing   report connection setup times on standard error\n");
 }
 
 static void version(void)
@@ -680,6 +683,7 @@ int main(int argc, char **argv)
     enum TriState sanitise_stdout = AUTO, sanitise_stderr = AUTO;
     bool use_subsystem = false;
     bool just_test_share_exists = false;
+    bool report_timing = false;
     struct winsize size;
     const struct BackendVtable *backvt;
 
@@ -765,6 +769,8 @@ int main(int argc, char **argv)
             }
         } else if (!strcmp(p, "-shareexists")) {
             just_test_share_exists = true;
+        } else if (!strcmp(p, "-timing")) {
+            report_timing = true;
         } else if (!strcmp(p, "-fuzznet")) {
             conf_set_int(conf, CONF_proxy_type, PROXY_FUZZ);
             conf_set_str(conf, CONF_proxy_telnet_command, "%host");
@@ -929,6 +935,9 @@ int main(int argc, char **argv)
         !conf_get_str_nthstrkey(conf, CONF_portfwd, 0))
         conf_set_bool(conf, CONF_ssh_simple, true);
 
+    if (report_timing)
+        conf_set_bool(conf, CONF_ssh_report_timing, true);
+
     if (just_test_share_exists) {
         if (!backvt->test_for_upstream) {
             fprintf(stderr, "Connection sharing not supported for this "
@@ -942,6 +951,13 @@ int main(int argc, char **argv)
             return 1;
     }
 
+    /*
+     * If we're configured to share a persistent connection, make
+     * sure there's a background upstream for us to connect to.
+     */
+    if (!share_persist_start(backvt, conf, console_cli_logpolicy))
+        return 1;
+
     /*
      * Start up the connection.
      */
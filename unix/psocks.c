@@ -119,6 +119,7 @@ static const PsocksPlatform platform = {
     open_pipes,
     found_subcommand,
     start_subcommand,
+    sk_net_splice,
 };
 
 static bool psocks_pw_setup(void *ctx, pollwrapper *pw)
@@ -566,7 +566,11 @@ char *ssh_sftp_get_cmdline(const char *prompt, bool no_fds_ok)
 
 void frontend_net_error_pending(void) {}
 
-void platform_psftp_pre_conn_setup(LogPolicy *lp) {}
+bool platform_psftp_pre_conn_setup(LogPolicy *lp, Conf *conf)
+{
+    return share_persist_start(
+        backend_vt_from_proto(conf_get_int(conf, CONF_protocol)), conf, lp);
+}
 
 const bool buildinfo_gtk_relevant = false;
 
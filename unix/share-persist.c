@@ -0,0 +1,221 @@
+/*
+ * Start a persistent connection-sharing upstream in a detached
+ * background process, for the Unix command-line tools.
+ *
+ * If the configuration asks for sharing to persist, and no upstream
+ * exists yet for the destination, we fork. The child makes the real
+ * SSH connection, with no session channel of its own, so that it
+ * exists only to be a sharing upstream. It still has the terminal
+ * until authentication is complete, so it can ask about host keys
+ * and passwords in the usual way; then it tells the parent it's
+ * ready, detaches from the terminal, and carries on in the
+ * background until the connection layer closes it after the
+ * configured idle time.
+ *
+ * Meanwhile the parent waits for the child to become ready, and then
+ * goes on to make its own connection in the ordinary way, which will
+ * find the new upstream and become a downstream of it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "putty.h"
+
+static int persist_ready_fd = -1;
+
+static SeatPromptResult persist_get_userpass_input(Seat *seat, prompts_t *p)
+{
+    /* We never restart the session, so a single static
+     * cmdline_get_passwd_input_state that's never reset will do */
+    static cmdline_get_passwd_input_state cmdline_state =
+        CMDLINE_GET_PASSWD_INPUT_STATE_INIT;
+
+    SeatPromptResult spr;
+    spr = cmdline_get_passwd_input(p, &cmdline_state, false);
+    if (spr.kind == SPRK_INCOMPLETE)
+        spr = console_get_userpass_input(p);
+    return spr;
+}
+
+static void persist_notify_session_started(Seat *seat)
+{
+    int fd;
+
+    if (persist_ready_fd < 0)
+        return;
+
+    /*
+     * Tell the parent process we're ready for it to connect to us.
+     * Whether or not that works, the parent will stop waiting once
+     * we close our end of the pipe.
+     */
+    if (write(persist_ready_fd, "", 1) < 0) {
+        /* nothing useful we can do about this */
+    }
+    close(persist_ready_fd);
+    persist_ready_fd = -1;
+
+    /*
+     * Detach from the terminal, and from the calling process's
+     * standard I/O, so that whatever started it isn't kept waiting
+     * for us to close them.
+     */
+    setsid();
+    if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+        dup2(fd, STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        if (fd > STDERR_FILENO)
+            close(fd);
+    }
+    if (chdir("/") < 0) {
+        /* not important */
+    }
+    console_set_batch_mode(true);
+}
+
+static const SeatVtable persist_seat_vt = {
+    .output = nullseat_output,
+    .eof = nullseat_eof,
+    .sent = nullseat_sent,
+    .banner = nullseat_banner_to_stderr,
+    .get_userpass_input = persist_get_userpass_input,
+    .notify_session_started = persist_notify_session_started,
+    .notify_remote_exit = nullseat_notify_remote_exit,
+    .notify_remote_disconnect = nullseat_notify_remote_disconnect,
+    .connection_fatal = console_connection_fatal,
+    .nonfatal = console_nonfatal,
+    .update_specials_menu = nullseat_update_specials_menu,
+    .get_ttymode = nullseat_get_ttymode,
+    .set_busy_status = nullseat_set_busy_status,
+    .confirm_ssh_host_key = console_confirm_ssh_host_key,
+    .confirm_weak_crypto_primitive = console_confirm_weak_crypto_primitive,
+    .confirm_weak_cached_hostkey = console_confirm_weak_cached_hostkey,
+    .prompt_descriptions = console_prompt_descriptions,
+    .is_utf8 = nullseat_is_never_utf8,
+    .echoedit_update = nullseat_echoedit_update,
+    .get_display = nullseat_get_display,
+    .get_windowid = nullseat_get_windowid,
+    .get_window_pixel_size = nullseat_get_window_pixel_size,
+    .stripctrl_new = console_stripctrl_new,
+    .set_trust_status = nullseat_set_trust_status,
+    .can_set_trust_status = nullseat_can_set_trust_status_yes,
+    .has_mixed_input_stream = nullseat_has_mixed_input_stream_no,
+    .verbose = cmdline_seat_verbose,
+    .interactive = nullseat_interactive_no,
+    .get_cursor_position = nullseat_get_cursor_position,
+};
+static Seat persist_seat[1] = {{ &persist_seat_vt }};
+
+static bool persist_continue(void *vctx, bool found_any_fd,
+                             bool ran_any_callback)
+{
+    Backend *backend = (Backend *)vctx;
+    return backend_connected(backend);
+}
+
+static NORETURN void persist_upstream_main(
+    const BackendVtable *vt, Conf *conf, LogPolicy *lp)
+{
+    Backend *backend;
+    LogContext *logctx;
+    char *error, *realhost;
+
+    /*
+     * Make the connection with no main channel and no port
+     * forwardings, and only as an upstream: anything else is the
+     * business of the downstreams.
+     */
+    conf = conf_copy(conf);
+    conf_set_bool(conf, CONF_ssh_no_shell, true);
+    conf_set_bool(conf, CONF_ssh_connection_sharing_downstream, false);
+    conf_set_bool(conf, CONF_ssh_simple, false);
+    {
+        char *key;
+        while ((key = conf_get_str_nthstrkey(conf, CONF_portfwd, 0)) != NULL)
+            conf_del_str_str(conf, CONF_portfwd, key);
+    }
+
+    logctx = log_init(lp, conf);
+    error = backend_init(vt, persist_seat, &backend, logctx, conf,
+                         conf_get_str(conf, CONF_host),
+                         conf_get_int(conf, CONF_port),
+                         &realhost, false,
+                         conf_get_bool(conf, CONF_tcp_keepalives));
+    if (error) {
+        fprintf(stderr, "Unable to open connection:\n%s\n", error);
+        sfree(error);
+        cleanup_exit(1);
+    }
+    sfree(realhost);
+
+    cli_main_loop(cliloop_no_pw_setup, cliloop_no_pw_check,
+                  persist_continue, backend);
+
+    cleanup_exit(persist_ready_fd < 0 ? 0 : 1);
+}
+
+bool share_persist_start(const BackendVtable *vt, Conf *conf, LogPolicy *lp)
+{
+    int fds[2];
+    pid_t pid;
+    char c;
+    ssize_t ret;
+
+    if (!vt->test_for_upstream ||
+        conf_get_int(conf, CONF_ssh_connection_sharing_persist) <= 0 ||
+        !conf_get_bool(conf, CONF_ssh_connection_sharing) ||
+        !conf_get_bool(conf, CONF_ssh_connection_sharing_upstream) ||
+        !conf_get_bool(conf, CONF_ssh_connection_sharing_downstream))
+        return true;                   /* not wanted */
+
+    if (conf_get_bool(conf, CONF_ssh_no_shell))
+        return true;          /* we'll be a suitable upstream ourselves */
+
+    if (vt->test_for_upstream(conf_get_str(conf, CONF_host),
+                              conf_get_int(conf, CONF_port), conf))
+        return true;                   /* there's one already */
+
+    /*
+     * If we can't start the background process, just carry on and
+     * make an ordinary connection.
+     */
+    if (pipe(fds) < 0)
+        return true;
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return true;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        persist_ready_fd = fds[1];
+        persist_upstream_main(vt, conf, lp);
+    }
+
+    close(fds[1]);
+    do {
+        ret = read(fds[0], &c, 1);
+    } while (ret < 0 && errno == EINTR);
+    close(fds[0]);
+
+    if (ret == 1)
+        return true;
+
+    /*
+     * The child gave up before it was ready, and will have said why
+     * on our shared standard error.
+     */
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+    return false;
+}
@@ -633,14 +633,91 @@ void enum_host_ca_finish(host_ca_enum *handle)
     sfree(handle);
 }
 
+static bool stat_same(const struct stat *a, const struct stat *b)
+{
+    return (a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+            a->st_size == b->st_size && a->st_mtime == b->st_mtime &&
+            a->st_ctime == b->st_ctime);
+}
+
+/*
+ * Loaded CA records are cached by name, so that checking all the
+ * configured CAs for every new connection doesn't mean reading all
+ * their files again each time. As with the host key cache below, an
+ * entry is reloaded whenever a stat() shows its file has changed.
+ * host_ca_save and host_ca_delete also drop the entry for the CA they
+ * change, in case they did it too quickly for the timestamps to show.
+ *
+ * host_ca_load still returns a fresh copy, which the caller owns. The
+ * copy shares the cached record's parsed validity expression, so that
+ * isn't parsed again for each connection either, and it's thrown away
+ * along with the cache entry.
+ */
+typedef struct host_ca_cache_entry {
+    host_ca *hca;
+    struct stat st;
+} host_ca_cache_entry;
+
+static tree234 *host_ca_cache;
+
+static int host_ca_cache_cmp(void *av, void *bv)
+{
+    host_ca_cache_entry *a = (host_ca_cache_entry *)av;
+    host_ca_cache_entry *b = (host_ca_cache_entry *)bv;
+    return strcmp(a->hca->name, b->hca->name);
+}
+
+static int host_ca_cache_find(void *av, void *bv)
+{
+    const char *a = (const char *)av;
+    host_ca_cache_entry *b = (host_ca_cache_entry *)bv;
+    return strcmp(a, b->hca->name);
+}
+
+static void host_ca_cache_drop(const char *name)
+{
+    host_ca_cache_entry *ent;
+
+    if (!host_ca_cache)
+        return;
+    ent = find234(host_ca_cache, (void *)name, host_ca_cache_find);
+    if (ent) {
+        del234(host_ca_cache, ent);
+        host_ca_free(ent->hca);
+        sfree(ent);
+    }
+}
+
 host_ca *host_ca_load(const char *name)
 {
     char *filename = make_filename(INDEX_HOSTCA, name);
+    host_ca_cache_entry *ent = NULL;
+    struct stat st;
+
+    if (!host_ca_cache)
+        host_ca_cache = newtree234(host_ca_cache_cmp);
+    if (stat(filename, &st) == 0) {
+        ent = find234(host_ca_cache, (void *)name, host_ca_cache_find);
+        if (ent && stat_same(&st, &ent->st)) {
+            sfree(filename);
+            return host_ca_copy(ent->hca);
+        }
+    }
+    host_ca_cache_drop(name);
+
     FILE *fp = fopen(filename, "r");
     sfree(filename);
     if (!fp)
         return NULL;
 
+    /*
+     * Only cache what we read if the file didn't change while we were
+     * reading it. Otherwise we might have half of the old version,
+     * and a stat() of the new one to say it's up to date.
+     */
+    struct stat st_after;
+    bool cacheable = (fstat(fileno(fp), &st) == 0);
+
     host_ca *hca = host_ca_new();
     hca->name = dupstr(name);
 
@@ -677,6 +754,9 @@ host_ca *host_ca_load(const char *name)
         sfree(line);
     }
 
+    if (cacheable)
+        cacheable = (fstat(fileno(fp), &st_after) == 0 &&
+                     stat_same(&st, &st_after));
     fclose(fp);
 
     if (eb) {
@@ -686,6 +766,16 @@ host_ca *host_ca_load(const char *name)
         cert_expr_builder_free(eb);
     }
 
+    if (hca->validity_expression)
+        hca->validity = cert_expr_parse(hca->validity_expression);
+
+    if (cacheable) {
+        ent = snew(host_ca_cache_entry);
+        ent->hca = host_ca_copy(hca);
+        ent->st = st;
+        add234(host_ca_cache, ent);
+    }
+
     return hca;
 }
 
@@ -694,6 +784,8 @@ char *host_ca_save(host_ca *hca)
     if (!*hca->name)
         return dupstr("CA record must have a name");
 
+    host_ca_cache_drop(hca->name);
+
     char *filename = make_filename(INDEX_HOSTCA, hca->name);
     FILE *fp = fopen(filename, "w");
     if (!fp)
@@ -727,6 +819,8 @@ char *host_ca_delete(const char *name)
 {
     if (!*name)
         return dupstr("CA record must have a name");
+
+    host_ca_cache_drop(name);
     char *filename = make_filename(INDEX_HOSTCA, name);
     bool bad = remove(filename) < 0;
 
@@ -746,74 +840,145 @@ char *host_ca_delete(const char *name)
  * e.g.
  *
  *   rsa@22:foovax.example.org 0x23,0x293487364395345345....2343
+ *
+ * The file can get large (people import whole known_hosts files into
+ * it), so rather than scanning it line by line on every lookup, we
+ * read it into memory in one go and index it by the part before the
+ * space. The index is kept for the life of the process, and rebuilt
+ * whenever a stat() shows the file has changed underneath us.
+ *
+ * If the same host key identifier appears on more than one line,
+ * the last one wins. PuTTY itself never writes duplicates, but this
+ * means the output of contrib/kh2reg.py can simply be appended to
+ * the file to import keys in bulk, overriding any old ones.
  */
-int check_stored_host_key(const char *hostname, int port,
-                          const char *keytype, const char *key)
-{
-    FILE *fp;
-    char *filename;
-    char *line;
-    int ret;
+typedef struct hostkey_entry {
+    ptrlen id, key;
+} hostkey_entry;
 
-    filename = make_filename(INDEX_HOSTKEYS, NULL);
-    fp = fopen(filename, "r");
-    sfree(filename);
-    if (!fp)
-        return 1;                      /* key does not exist */
+static struct hostkey_cache {
+    bool valid;
+    struct stat st;
+    char *data;
+    size_t len;
+    hostkey_entry *entries;
+    tree234 *index;
+} hostkey_cache;
 
-    ret = 1;
-    while ( (line = fgetline(fp)) ) {
-        int i;
-        char *p = line;
-        char porttext[20];
+static int hostkey_cmp(void *av, void *bv)
+{
+    hostkey_entry *a = (hostkey_entry *)av, *b = (hostkey_entry *)bv;
+    return ptrlen_strcmp(a->id, b->id);
+}
 
-        line[strcspn(line, "\n")] = '\0';   /* strip trailing newline */
+static int hostkey_cmp_find(void *av, void *bv)
+{
+    ptrlen *a = (ptrlen *)av;
+    hostkey_entry *b = (hostkey_entry *)bv;
+    return ptrlen_strcmp(*a, b->id);
+}
 
-        i = strlen(keytype);
-        if (strncmp(p, keytype, i))
-            goto done;
-        p += i;
+static void hostkey_cache_clear(void)
+{
+    struct hostkey_cache *hc = &hostkey_cache;
+    if (hc->index)
+        freetree234(hc->index);
+    sfree(hc->entries);
+    sfree(hc->data);
+    memset(hc, 0, sizeof(*hc));
+}
 
-        if (*p != '@')
-            goto done;
-        p++;
+/*
+ * Make sure the cache reflects the current contents of the host key
+ * file. Returns false if there isn't one.
+ */
+static bool hostkey_cache_update(void)
+{
+    struct hostkey_cache *hc = &hostkey_cache;
+    char *filename = make_filename(INDEX_HOSTKEYS, NULL);
+    struct stat st;
+    strbuf *sb;
+    char buf[4096];
+    const char *p, *end;
+    size_t nlines;
+    ssize_t ret;
+    int fd;
 
-        sprintf(porttext, "%d", port);
-        i = strlen(porttext);
-        if (strncmp(p, porttext, i))
-            goto done;
-        p += i;
+    if (stat(filename, &st) < 0) {
+        sfree(filename);
+        hostkey_cache_clear();
+        return false;
+    }
+    if (hc->valid && stat_same(&st, &hc->st)) {
+        sfree(filename);
+        return true;
+    }
 
-        if (*p != ':')
-            goto done;
-        p++;
+    hostkey_cache_clear();
+    fd = open(filename, O_RDONLY);
+    sfree(filename);
+    if (fd < 0 || fstat(fd, &hc->st) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    sb = strbuf_new();
+    while ((ret = read(fd, buf, sizeof(buf))) > 0)
+        put_data(sb, buf, ret);
+    close(fd);
+    hc->len = sb->len;
+    hc->data = strbuf_to_str(sb);
+
+    end = hc->data + hc->len;
+    nlines = 0;
+    for (p = hc->data; p < end; p++)
+        if (*p == '\n')
+            nlines++;
+    hc->entries = snewn(nlines + 1, hostkey_entry);
+    hc->index = newtree234(hostkey_cmp);
+
+    for (p = hc->data, nlines = 0; p < end; ) {
+        const char *eol = memchr(p, '\n', end - p);
+        const char *space;
+        hostkey_entry *ent, *old;
+
+        if (!eol)
+            eol = end;
+        space = memchr(p, ' ', eol - p);
+        if (space) {
+            ent = &hc->entries[nlines++];
+            ent->id = make_ptrlen_startend(p, space);
+            ent->key = make_ptrlen_startend(space + 1, eol);
+            if ((old = add234(hc->index, ent)) != ent)
+                old->key = ent->key;
+        }
+        p = eol + 1;
+    }
 
-        i = strlen(hostname);
-        if (strncmp(p, hostname, i))
-            goto done;
-        p += i;
+    hc->valid = true;
+    return true;
+}
 
-        if (*p != ' ')
-            goto done;
-        p++;
+int check_stored_host_key(const char *hostname, int port,
+                          const char *keytype, const char *key)
+{
+    hostkey_entry *ent;
+    char *id;
+    ptrlen idpl;
 
-        /*
-         * Found the key. Now just work out whether it's the right
-         * one or not.
-         */
-        if (!strcmp(p, key))
-            ret = 0;                   /* key matched OK */
-        else
-            ret = 2;                   /* key mismatch */
+    if (!hostkey_cache_update())
+        return 1;                      /* key does not exist */
 
-      done:
-        sfree(line);
-        if (ret != 1)
-            break;
-    }
+    id = dupprintf("%s@%d:%s", keytype, port, hostname);
+    idpl = ptrlen_from_asciz(id);
+    ent = find234(hostkey_cache.index, &idpl, hostkey_cmp_find);
+    sfree(id);
 
-    fclose(fp);
-    return ret;
+    if (!ent)
+        return 1;                      /* key does not exist */
+    if (ptrlen_eq_string(ent->key, key))
+        return 0;                      /* key matched OK */
+    return 2;                          /* key mismatch */
 }
 
 bool have_ssh_host_key(const char *hostname, int port,
@@ -826,20 +991,15 @@ bool have_ssh_host_key(const char *hostname, int port,
     return check_stored_host_key(hostname, port, keytype, "") != 1;
 }
 
-void store_host_key(Seat *seat, const char *hostname, int port,
-                    const char *keytype, const char *key)
+/*
+ * Open a file for writing in the PuTTY directory, creating the
+ * directory if necessary. Reports failure to the Seat and returns -1.
+ */
+static int open_hostkeys_file(Seat *seat, const char *filename, int flags)
 {
-    FILE *rfp, *wfp;
-    char *newtext, *line;
-    int headerlen;
-    char *filename, *tmpfilename;
+    int fd = open(filename, O_WRONLY | O_CREAT | flags, 0666);
 
-    /*
-     * Open both the old file and a new file.
-     */
-    tmpfilename = make_filename(INDEX_HOSTKEYS_TMP, NULL);
-    wfp = fopen(tmpfilename, "w");
-    if (!wfp && errno == ENOENT) {
+    if (fd < 0 && errno == ENOENT) {
         char *dir, *errmsg;
 
         dir = make_filename(INDEX_DIR, NULL);
@@ -847,24 +1007,75 @@ void store_host_key(Seat *seat, const char *hostname, int port,
             seat_nonfatal(seat, "Unable to store host key: %s", errmsg);
             sfree(errmsg);
             sfree(dir);
-            sfree(tmpfilename);
-            return;
+            return -1;
         }
         sfree(dir);
 
-        wfp = fopen(tmpfilename, "w");
+        fd = open(filename, O_WRONLY | O_CREAT | flags, 0666);
     }
-    if (!wfp) {
+    if (fd < 0)
         seat_nonfatal(seat, "Unable to store host key: open(\"%s\") "
-                      "returned '%s'", tmpfilename, strerror(errno));
-        sfree(tmpfilename);
-        return;
-    }
-    filename = make_filename(INDEX_HOSTKEYS, NULL);
-    rfp = fopen(filename, "r");
+                      "returned '%s'", filename, strerror(errno));
+    return fd;
+}
+
+void store_host_key(Seat *seat, const char *hostname, int port,
+                    const char *keytype, const char *key)
+{
+    FILE *rfp, *wfp;
+    char *newtext, *line;
+    int headerlen, fd;
+    char *filename, *tmpfilename;
+    ptrlen id;
 
     newtext = dupprintf("%s@%d:%s %s\n", keytype, port, hostname, key);
     headerlen = 1 + strcspn(newtext, " ");   /* count the space too */
+    id = make_ptrlen(newtext, headerlen - 1);
+    filename = make_filename(INDEX_HOSTKEYS, NULL);
+
+    /*
+     * If there's no existing entry for this host key identifier,
+     * which is the usual case, we need only append the new line to
+     * the file.
+     */
+    if (!hostkey_cache_update() ||
+        !find234(hostkey_cache.index, &id, hostkey_cmp_find)) {
+        strbuf *sb = strbuf_new();
+        size_t done = 0;
+        ssize_t ret = 0;
+
+        if (hostkey_cache.len > 0 &&
+            hostkey_cache.data[hostkey_cache.len - 1] != '\n')
+            put_byte(sb, '\n');        /* finish an unterminated last line */
+        put_dataz(sb, newtext);
+
+        if ((fd = open_hostkeys_file(seat, filename, O_APPEND)) >= 0) {
+            while (done < sb->len &&
+                   (ret = write(fd, sb->u + done, sb->len - done)) > 0)
+                done += ret;
+            if (ret < 0)
+                seat_nonfatal(seat, "Unable to store host key: write(\"%s\")"
+                              " returned '%s'", filename, strerror(errno));
+            close(fd);
+        }
+
+        strbuf_free(sb);
+        goto out;
+    }
+
+    /*
+     * Otherwise, rewrite the file without the old entry. Open both
+     * the old file and a new file.
+     */
+    tmpfilename = make_filename(INDEX_HOSTKEYS_TMP, NULL);
+    fd = open_hostkeys_file(seat, tmpfilename, O_TRUNC);
+    if (fd < 0 || !(wfp = fdopen(fd, "w"))) {
+        if (fd >= 0)
+            close(fd);
+        sfree(tmpfilename);
+        goto out;
+    }
+    rfp = fopen(filename, "r");
 
     /*
      * Copy all lines from the old file to the new one that _don't_
@@ -893,6 +1104,10 @@ void store_host_key(Seat *seat, const char *hostname, int port,
     }
 
     sfree(tmpfilename);
+
+  out:
+    /* The next lookup will have to re-read the file in any case */
+    hostkey_cache_clear();
     sfree(filename);
     sfree(newtext);
 }
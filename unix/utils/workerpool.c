@@ -0,0 +1,233 @@
+/*
+ * Unix pool of worker threads, shared by run_in_background() (in
+ * unix/background.c) and run_in_parallel().
+ *
+ * Worker threads are started lazily, the first time there's a job
+ * for them and no idle thread to take it, up to a limit of twice the
+ * number of online CPUs (and at least MIN_WORKER_THREADS). Having a
+ * few more threads than CPUs lets the OS scheduler slip quick jobs in
+ * between slow ones, instead of making them queue behind. Starting
+ * them lazily also means that programs which fork to detach
+ * themselves, like Pageant, don't start any threads until after they
+ * have finished forking. Once started, a worker thread hangs around
+ * for the rest of the process lifetime, waiting for more jobs.
+ *
+ * If a process with a thread pool forks anyway, the child has none of
+ * the threads, so a pthread_atfork handler resets the pool in the
+ * child to the state of never having started any.
+ */
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "putty.h"
+
+#define MIN_WORKER_THREADS 4
+#define MAX_WORKER_THREADS 64
+
+typedef struct PoolJob PoolJob;
+struct PoolJob {
+    toplevel_callback_fn_t work;
+    void *ctx;
+    PoolJob *next;
+};
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+/* All of these are protected by pool_mutex */
+static PoolJob *pool_head, *pool_tail;
+static unsigned pool_npending, pool_nthreads, pool_nidle, pool_max_threads;
+
+static void *pool_thread(void *arg)
+{
+    pthread_mutex_lock(&pool_mutex);
+    while (true) {
+        while (!pool_head) {
+            pool_nidle++;
+            pthread_cond_wait(&pool_cond, &pool_mutex);
+            pool_nidle--;
+        }
+
+        PoolJob *job = pool_head;
+        pool_head = job->next;
+        if (!pool_head)
+            pool_tail = NULL;
+        pool_npending--;
+        pthread_mutex_unlock(&pool_mutex);
+
+        job->work(job->ctx);
+        sfree(job);
+
+        pthread_mutex_lock(&pool_mutex);
+    }
+
+    return NULL;                       /* not reached */
+}
+
+static void pool_atfork_prepare(void)
+{
+    pthread_mutex_lock(&pool_mutex);
+}
+
+static void pool_atfork_parent(void)
+{
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+static void pool_atfork_child(void)
+{
+    /* The jobs in the queue belonged to threads of the parent
+     * process, so we just forget them, along with the threads. */
+    pool_head = pool_tail = NULL;
+    pool_npending = pool_nthreads = pool_nidle = 0;
+    pthread_mutex_init(&pool_mutex, NULL);
+    pthread_cond_init(&pool_cond, NULL);
+}
+
+static void pool_init(void)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pool_max_threads = (ncpus < 1 ? MIN_WORKER_THREADS :
+                        ncpus * 2 < MIN_WORKER_THREADS ? MIN_WORKER_THREADS :
+                        ncpus * 2 > MAX_WORKER_THREADS ? MAX_WORKER_THREADS :
+                        ncpus * 2);
+    pthread_atfork(pool_atfork_prepare, pool_atfork_parent,
+                   pool_atfork_child);
+}
+
+/* Must be called with pool_mutex held */
+static bool pool_submit_locked(toplevel_callback_fn_t work, void *ctx)
+{
+    PoolJob *job = snew(PoolJob);
+    job->work = work;
+    job->ctx = ctx;
+    job->next = NULL;
+    if (pool_tail)
+        pool_tail->next = job;
+    else
+        pool_head = job;
+    pool_tail = job;
+    pool_npending++;
+
+    if (pool_npending > pool_nidle && pool_nthreads < pool_max_threads) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, pool_thread, NULL) == 0)
+            pool_nthreads++;
+        pthread_attr_destroy(&attr);
+
+        if (!pool_nthreads) {
+            /* Couldn't start even one thread, so nothing will ever
+             * take this job: take it back and let the caller do it */
+            pool_head = pool_tail = NULL;
+            pool_npending = 0;
+            sfree(job);
+            return false;
+        }
+    }
+
+    pthread_cond_signal(&pool_cond);
+    return true;
+}
+
+bool worker_pool_submit(toplevel_callback_fn_t work, void *ctx)
+{
+    pthread_once(&pool_once, pool_init);
+    pthread_mutex_lock(&pool_mutex);
+    bool ok = pool_submit_locked(work, ctx);
+    pthread_mutex_unlock(&pool_mutex);
+    return ok;
+}
+
+/*
+ * run_in_parallel() submits helper jobs to the pool, each of which
+ * claims items from the batch until there are none left. The calling
+ * thread claims items too, so the batch always finishes even if every
+ * worker thread is busy with something else; when it runs out, it
+ * withdraws any helpers that haven't started, and waits for the ones
+ * that have.
+ */
+typedef struct ParallelBatch {
+    toplevel_callback_fn_t work;
+    void **ctxs;
+    size_t n, next;
+    unsigned outstanding;              /* helper jobs not yet finished */
+    pthread_cond_t done_cond;
+} ParallelBatch;
+
+/* Claims and runs items until there are none left. Called, and
+ * returns, with pool_mutex held. */
+static void parallel_run_items(ParallelBatch *batch)
+{
+    while (batch->next < batch->n) {
+        size_t i = batch->next++;
+        pthread_mutex_unlock(&pool_mutex);
+        batch->work(batch->ctxs[i]);
+        pthread_mutex_lock(&pool_mutex);
+    }
+}
+
+static void parallel_helper(void *vctx)
+{
+    ParallelBatch *batch = (ParallelBatch *)vctx;
+
+    pthread_mutex_lock(&pool_mutex);
+    parallel_run_items(batch);
+    if (--batch->outstanding == 0)
+        pthread_cond_signal(&batch->done_cond);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void run_in_parallel(toplevel_callback_fn_t work, void **ctxs, size_t n)
+{
+    if (n == 0)
+        return;
+    if (n == 1) {
+        work(ctxs[0]);
+        return;
+    }
+
+    ParallelBatch batch[1];
+    batch->work = work;
+    batch->ctxs = ctxs;
+    batch->n = n;
+    batch->next = 0;
+    batch->outstanding = 0;
+    pthread_cond_init(&batch->done_cond, NULL);
+
+    pthread_once(&pool_once, pool_init);
+    pthread_mutex_lock(&pool_mutex);
+
+    for (size_t i = 1; i < n && i <= pool_max_threads; i++) {
+        if (!pool_submit_locked(parallel_helper, batch))
+            break;
+        batch->outstanding++;
+    }
+
+    parallel_run_items(batch);
+
+    /* Withdraw the helpers that never got started */
+    for (PoolJob **prev = &pool_head, *job; (job = *prev) != NULL ;) {
+        if (job->work == parallel_helper && job->ctx == batch) {
+            *prev = job->next;
+            if (pool_tail == job)
+                pool_tail = (prev == &pool_head ? NULL :
+                             container_of(prev, PoolJob, next));
+            pool_npending--;
+            batch->outstanding--;
+            sfree(job);
+        } else {
+            prev = &job->next;
+        }
+    }
+
+    while (batch->outstanding)
+        pthread_cond_wait(&batch->done_cond, &pool_mutex);
+
+    pthread_mutex_unlock(&pool_mutex);
+    pthread_cond_destroy(&batch->done_cond);
+}
@@ -29,7 +29,10 @@ void backend_socket_log(Seat *seat, LogContext *logctx, Socket *sock,
             sk_getaddr(addr, addrbuf, lenof(addrbuf));
         else /* fallback if address unavailable */
             sprintf(addrbuf, "remote host");
-        msg = dupprintf("Connected to %s", addrbuf);
+        if (error_msg)
+            msg = dupprintf("Connected to %s %s", addrbuf, error_msg);
+        else
+            msg = dupprintf("Connected to %s", addrbuf);
         if (sock) {
             SocketEndpointInfo *local_end = sk_endpoint_info(sock, false);
             if (local_end) {
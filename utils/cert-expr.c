@@ -596,6 +596,54 @@ static bool eval(ExprNode *en, const char *hostname, unsigned port)
     }
 }
 
+/*
+ * A parsed expression that can be kept and matched repeatedly, so
+ * that checking a CA's expression against every new connection
+ * doesn't mean parsing it again each time. Unix storage keeps one
+ * with each CA record in its cache, so it lasts exactly as long as
+ * the record does. It's reference-counted so that the copies of the
+ * record handed out by host_ca_load can share it.
+ */
+struct CertExpr {
+    char *text;                        /* the parse tree points into this */
+    ExprNode *en;
+    unsigned refcount;
+};
+
+CertExpr *cert_expr_parse(const char *expression)
+{
+    CertExpr *ce = snew(CertExpr);
+    ce->text = dupstr(expression);
+    ce->en = parse(ptrlen_from_asciz(ce->text), NULL, NULL);
+    if (!ce->en) {
+        sfree(ce->text);
+        sfree(ce);
+        return NULL;
+    }
+    ce->refcount = 1;
+    return ce;
+}
+
+CertExpr *cert_expr_dup(CertExpr *ce)
+{
+    ce->refcount++;
+    return ce;
+}
+
+void cert_expr_free(CertExpr *ce)
+{
+    if (--ce->refcount > 0)
+        return;
+    exprnode_free(ce->en);
+    sfree(ce->text);
+    sfree(ce);
+}
+
+bool cert_expr_match(CertExpr *ce, const char *hostname, unsigned port)
+{
+    return eval(ce->en, hostname, port);
+}
+
 bool cert_expr_match_str(const char *expression,
                          const char *hostname, unsigned port)
 {
@@ -959,6 +1007,52 @@ int main(int argc, char **argv)
             }
         }
 
+        /*
+         * Run the evaluation tests again through the public interface
+         * for reusable parsed expressions. The second pass goes
+         * through a reference from cert_expr_dup, after the original
+         * one has been freed.
+         */
+        for (size_t i = 0; i < lenof(evaltests); i++) {
+            const struct EvalTest *test = &evaltests[i];
+            CertExpr *ce = cert_expr_parse(test->expr);
+            if (!ce) {
+                fprintf(stderr, "FAIL: evaltests[%zu] @ %s:%d: "
+                        "cert_expr_parse failed\n",
+                        i, test->file, test->line);
+                fail++;
+                continue;
+            }
+
+            for (size_t pass_no = 0; pass_no < 2; pass_no++) {
+                if (pass_no == 1) {
+                    CertExpr *dup = cert_expr_dup(ce);
+                    cert_expr_free(ce);
+                    ce = dup;
+                }
+
+                bool output = cert_expr_match(ce, test->host, test->port);
+                if (output == test->output) {
+                    pass++;
+                } else {
+                    fprintf(stderr, "FAIL: evaltests[%zu] @ %s:%d "
+                            "(CertExpr, pass %zu):\n"
+                            "  expression: %s\n"
+                            "  host:       %s\n"
+                            "  port:       %u\n"
+                            "  expected:   %s\n"
+                            "  actual:     %s\n",
+                            i, test->file, test->line, pass_no,
+                            test->expr, test->host, test->port,
+                            test->output ? "accept" : "reject",
+                            output ? "accept" : "reject");
+                    fail++;
+                }
+            }
+
+            cert_expr_free(ce);
+        }
+
         fprintf(stderr, "pass %zu fail %zu total %zu\n",
                 pass, fail, pass+fail);
         return fail != 0;
@@ -16,7 +16,26 @@ void host_ca_free(host_ca *hca)
 {
     sfree(hca->name);
     sfree(hca->validity_expression);
+    if (hca->validity)
+        cert_expr_free(hca->validity);
     if (hca->ca_public_key)
         strbuf_free(hca->ca_public_key);
     sfree(hca);
 }
+
+host_ca *host_ca_copy(const host_ca *orig)
+{
+    host_ca *hca = snew(host_ca);
+    *hca = *orig;
+    hca->name = orig->name ? dupstr(orig->name) : NULL;
+    hca->validity_expression = (orig->validity_expression ?
+                                dupstr(orig->validity_expression) : NULL);
+    if (orig->validity)
+        hca->validity = cert_expr_dup(orig->validity);
+    if (orig->ca_public_key) {
+        hca->ca_public_key = strbuf_new_nm();
+        put_datapl(hca->ca_public_key,
+                   ptrlen_from_strbuf(orig->ca_public_key));
+    }
+    return hca;
+}
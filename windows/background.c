@@ -0,0 +1,93 @@
+/*
+ * Windows implementation of run_in_background(), on the worker thread
+ * pool in windows/utils/workerpool.c.
+ *
+ * Finished jobs are passed back to the main thread on a queue, and an
+ * event object registered with handle-wait.c wakes up the event loop
+ * to call their completion functions.
+ */
+
+#include "putty.h"
+#include "ssh.h"
+
+typedef struct BackgroundJob BackgroundJob;
+struct BackgroundJob {
+    toplevel_callback_fn_t work, done;
+    void *ctx;
+    BackgroundJob *next;
+};
+
+static CRITICAL_SECTION bg_critsec;
+static HANDLE bg_finished_event;
+static bool bg_initialised;
+
+/* Protected by bg_critsec */
+static BackgroundJob *bg_finished_head, *bg_finished_tail;
+
+static void bg_do_job(void *vctx)
+{
+    BackgroundJob *job = (BackgroundJob *)vctx;
+
+    /* Data-independent timing is a per-thread setting, where it exists */
+    enable_dit();
+
+    job->work(job->ctx);
+
+    EnterCriticalSection(&bg_critsec);
+    job->next = NULL;
+    if (bg_finished_tail)
+        bg_finished_tail->next = job;
+    else
+        bg_finished_head = job;
+    bg_finished_tail = job;
+    LeaveCriticalSection(&bg_critsec);
+    SetEvent(bg_finished_event);
+}
+
+static void bg_finished_callback(void *vctx)
+{
+    EnterCriticalSection(&bg_critsec);
+    BackgroundJob *job = bg_finished_head;
+    bg_finished_head = bg_finished_tail = NULL;
+    LeaveCriticalSection(&bg_critsec);
+
+    while (job) {
+        BackgroundJob *next = job->next;
+        job->done(job->ctx);
+        sfree(job);
+        job = next;
+    }
+}
+
+static bool bg_setup(void)
+{
+    if (bg_initialised)
+        return true;
+
+    bg_finished_event = CreateEvent(NULL, false, false, NULL);
+    if (!bg_finished_event)
+        return false;
+    InitializeCriticalSection(&bg_critsec);
+    add_handle_wait(bg_finished_event, bg_finished_callback, NULL);
+
+    bg_initialised = true;
+    return true;
+}
+
+void run_in_background(toplevel_callback_fn_t work,
+                       toplevel_callback_fn_t done, void *ctx)
+{
+    if (bg_setup()) {
+        BackgroundJob *job = snew(BackgroundJob);
+        job->work = work;
+        job->done = done;
+        job->ctx = ctx;
+        if (worker_pool_submit(bg_do_job, job))
+            return;
+        sfree(job);
+    }
+
+    /* No threads, so do the job ourselves */
+    work(ctx);
+    queue_toplevel_callback(done, ctx);
+}
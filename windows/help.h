@@ -86,6 +86,7 @@ typedef const char *HelpCtx;
 #define WINHELP_CTX_connection_nodelay "config-nodelay"
 #define WINHELP_CTX_connection_ipversion "config-address-family"
 #define WINHELP_CTX_connection_tcpkeepalive "config-tcp-keepalives"
+#define WINHELP_CTX_connection_tcpbuffers "config-tcp-buffers"
 #define WINHELP_CTX_connection_loghost "config-loghost"
 #define WINHELP_CTX_proxy_type "config-proxy-type"
 #define WINHELP_CTX_proxy_main "config-proxy"
@@ -174,6 +175,7 @@ typedef const char *HelpCtx;
 #define WINHELP_CTX_ssh_bugs_oldgex2 "config-ssh-bug-oldgex2"
 #define WINHELP_CTX_ssh_bugs_dropstart "config-ssh-bug-dropstart"
 #define WINHELP_CTX_ssh_bugs_filter_kexinit "config-ssh-bug-filter-kexinit"
+#define WINHELP_CTX_ssh_bugs_pipelined_setup "config-ssh-bug-pipelined-setup"
 #define WINHELP_CTX_serial_line "config-serial-line"
 #define WINHELP_CTX_serial_speed "config-serial-speed"
 #define WINHELP_CTX_serial_databits "config-serial-databits"
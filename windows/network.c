@@ -67,6 +67,7 @@ struct NetSocket {
     char oobdata[1];
     size_t sending_oob;
     bool oobinline, nodelay, keepalive, privport;
+    SockBufferSizes bufsizes;          /* for connect()-type sockets */
     enum { EOF_NO, EOF_PENDING, EOF_SENT } outgoingeof;
     SockAddr *addr;
     SockAddrStep step;
@@ -554,6 +555,53 @@ SockAddr *sk_namelookup(const char *host, char **canonicalname,
     return addr;
 }
 
+/*
+ * Windows has no lookup cache or resolver thread, so an asynchronous
+ * lookup is done on the spot, and only its result is delivered
+ * later.
+ */
+struct NameLookup {
+    namelookup_callback_fn_t callback;
+    void *ctx;
+    bool cancelled;
+    SockAddr *addr;
+    char *canonicalname;
+};
+
+static void namelookup_done(void *vctx)
+{
+    NameLookup *nl = (NameLookup *)vctx;
+
+    if (nl->cancelled) {
+        sk_addr_free(nl->addr);
+        sfree(nl->canonicalname);
+    } else {
+        nl->callback(nl->ctx, nl->addr, nl->canonicalname);
+    }
+    sfree(nl);
+}
+
+NameLookup *sk_namelookup_async(const char *host, int address_family,
+                                namelookup_callback_fn_t callback, void *ctx)
+{
+    NameLookup *nl = snew(NameLookup);
+    nl->callback = callback;
+    nl->ctx = ctx;
+    nl->cancelled = false;
+    nl->addr = sk_namelookup(host, &nl->canonicalname, address_family);
+    queue_toplevel_callback(namelookup_done, nl);
+    return nl;
+}
+
+void sk_namelookup_cancel(NameLookup *nl)
+{
+    nl->cancelled = true;
+}
+
+void sk_set_namelookup_cache(bool enabled)
+{
+}
+
 static SockAddr *sk_special_addr(SuperFamily superfamily, const char *name)
 {
     SockAddr *addr = snew(SockAddr);
@@ -953,6 +1001,18 @@ static DWORD try_connect(NetSocket *sock)
         p_setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, (void *) &b, sizeof(b));
     }
 
+    /* Windows has no equivalent of TCP_NOTSENT_LOWAT, so we only
+     * honour the buffer sizes here. */
+    if (sock->bufsizes.sndbuf > 0) {
+        int b = sock->bufsizes.sndbuf;
+        p_setsockopt(s, SOL_SOCKET, SO_SNDBUF, (void *) &b, sizeof(b));
+    }
+
+    if (sock->bufsizes.rcvbuf > 0) {
+        int b = sock->bufsizes.rcvbuf;
+        p_setsockopt(s, SOL_SOCKET, SO_RCVBUF, (void *) &b, sizeof(b));
+    }
+
     /*
      * Bind to local address.
      */
@@ -1095,6 +1155,14 @@ static DWORD try_connect(NetSocket *sock)
 
 Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
                bool nodelay, bool keepalive, Plug *plug)
+{
+    return sk_new_tuned(addr, port, privport, oobinline, nodelay, keepalive,
+                        NULL, plug);
+}
+
+Socket *sk_new_tuned(SockAddr *addr, int port, bool privport, bool oobinline,
+                     bool nodelay, bool keepalive,
+                     const SockBufferSizes *bufsizes, Plug *plug)
 {
     NetSocket *s;
     DWORD err;
@@ -1119,6 +1187,10 @@ Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
     s->oobinline = oobinline;
     s->nodelay = nodelay;
     s->keepalive = keepalive;
+    if (bufsizes)
+        s->bufsizes = *bufsizes;
+    else
+        memset(&s->bufsizes, 0, sizeof(s->bufsizes));
     s->privport = privport;
     s->port = port;
     s->addr = addr;
@@ -189,6 +189,7 @@ static void usage(void)
     printf("            control what happens when a log file already exists\n");
     printf("  -shareexists\n");
     printf("            test whether a connection-sharing upstream exists\n");
+    printf("  -timing   report connection setup times on standard error\n");
 }
 
 static void version(void)
@@ -292,6 +293,7 @@ int main(int argc, char **argv)
     bool errors;
     bool use_subsystem = false;
     bool just_test_share_exists = false;
+    bool report_timing = false;
     enum TriState sanitise_stdout = AUTO, sanitise_stderr = AUTO;
     const struct BackendVtable *vt;
 
@@ -356,6 +358,8 @@ int main(int argc, char **argv)
             exit(0);
         } else if (!strcmp(p, "-shareexists")) {
             just_test_share_exists = true;
+        } else if (!strcmp(p, "-timing")) {
+            report_timing = true;
         } else if (!strcmp(p, "-sanitise-stdout") ||
                    !strcmp(p, "-sanitize-stdout")) {
             sanitise_stdout = FORCE_ON;
@@ -450,6 +454,9 @@ int main(int argc, char **argv)
         !conf_get_str_nthstrkey(conf, CONF_portfwd, 0))
         conf_set_bool(conf, CONF_ssh_simple, true);
 
+    if (report_timing)
+        conf_set_bool(conf, CONF_ssh_report_timing, true);
+
     logctx = log_init(console_cli_logpolicy, conf);
 
     if (just_test_share_exists) {
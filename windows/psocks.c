@@ -10,6 +10,7 @@ static const PsocksPlatform platform = {
     NULL /* open_pipes */,
     NULL /* found_subcommand */,
     NULL /* start_subcommand */,
+    NULL /* splice */,
 };
 
 int main(int argc, char **argv)
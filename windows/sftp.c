@@ -634,11 +634,12 @@ char *ssh_sftp_get_cmdline(const char *prompt, bool no_fds_ok)
     return ctx->line;
 }
 
-void platform_psftp_pre_conn_setup(LogPolicy *lp)
+bool platform_psftp_pre_conn_setup(LogPolicy *lp, Conf *conf)
 {
     if (restricted_acl()) {
         lp_eventlog(lp, "Running with restricted process ACL");
     }
+    return true;
 }
 
 /* ----------------------------------------------------------------------
@@ -464,6 +464,9 @@ host_ca *host_ca_load(const char *name)
         cert_expr_builder_free(eb);
     }
 
+    if (hca->validity_expression)
+        hca->validity = cert_expr_parse(hca->validity_expression);
+
     if (get_reg_dword(rkey, "PermitRSASHA1", &val))
         hca->opts.permit_rsa_sha1 = val;
     if (get_reg_dword(rkey, "PermitRSASHA256", &val))
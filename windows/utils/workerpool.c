@@ -0,0 +1,231 @@
+/*
+ * Windows pool of worker threads, shared by run_in_background() (in
+ * windows/background.c) and run_in_parallel().
+ *
+ * Worker threads are started lazily, the first time there's a job for
+ * them and no idle thread to take it, up to a limit of twice the
+ * number of processors (see the Unix version for why), and then wait
+ * on a semaphore for further jobs for the rest of the process
+ * lifetime.
+ */
+
+#include "putty.h"
+
+#define MIN_WORKER_THREADS 4
+#define MAX_WORKER_THREADS 64
+
+typedef struct PoolJob PoolJob;
+struct PoolJob {
+    toplevel_callback_fn_t work;
+    void *ctx;
+    PoolJob *next;
+};
+
+enum { POOL_UNINIT, POOL_INITIALISING, POOL_READY, POOL_BROKEN };
+static volatile LONG pool_state = POOL_UNINIT;
+
+static CRITICAL_SECTION pool_critsec;
+static HANDLE pool_job_semaphore;
+
+/* All of these are protected by pool_critsec */
+static PoolJob *pool_head, *pool_tail;
+static unsigned pool_npending, pool_nthreads, pool_nidle, pool_max_threads;
+
+static DWORD WINAPI pool_threadfunc(void *param)
+{
+    while (true) {
+        EnterCriticalSection(&pool_critsec);
+        pool_nidle++;
+        LeaveCriticalSection(&pool_critsec);
+
+        WaitForSingleObject(pool_job_semaphore, INFINITE);
+
+        EnterCriticalSection(&pool_critsec);
+        pool_nidle--;
+        PoolJob *job = pool_head;
+        if (job) {
+            pool_head = job->next;
+            if (!pool_head)
+                pool_tail = NULL;
+            pool_npending--;
+        }
+        LeaveCriticalSection(&pool_critsec);
+
+        /* The queue can be empty if run_in_parallel withdrew the job
+         * we were woken up for */
+        if (job) {
+            job->work(job->ctx);
+            sfree(job);
+        }
+    }
+
+    return 0;                          /* not reached */
+}
+
+static bool pool_setup(void)
+{
+    /* This can be called from more than one thread at once, so
+     * exactly one of them must do the setup while the others wait */
+    if (pool_state == POOL_READY)
+        return true;
+    if (InterlockedCompareExchange(&pool_state, POOL_INITIALISING,
+                                   POOL_UNINIT) != POOL_UNINIT) {
+        while (pool_state == POOL_INITIALISING)
+            Sleep(0);
+        return pool_state == POOL_READY;
+    }
+
+    pool_job_semaphore = CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+    if (!pool_job_semaphore) {
+        InterlockedExchange(&pool_state, POOL_BROKEN);
+        return false;
+    }
+    InitializeCriticalSection(&pool_critsec);
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    pool_max_threads = si.dwNumberOfProcessors * 2;
+    if (pool_max_threads < MIN_WORKER_THREADS)
+        pool_max_threads = MIN_WORKER_THREADS;
+    if (pool_max_threads > MAX_WORKER_THREADS)
+        pool_max_threads = MAX_WORKER_THREADS;
+
+    InterlockedExchange(&pool_state, POOL_READY);
+    return true;
+}
+
+/* Must be called with pool_critsec held */
+static bool pool_submit_locked(toplevel_callback_fn_t work, void *ctx)
+{
+    PoolJob *job = snew(PoolJob);
+    job->work = work;
+    job->ctx = ctx;
+    job->next = NULL;
+    if (pool_tail)
+        pool_tail->next = job;
+    else
+        pool_head = job;
+    pool_tail = job;
+    pool_npending++;
+
+    if (pool_npending > pool_nidle && pool_nthreads < pool_max_threads) {
+        DWORD threadid; /* required for Win9x */
+        HANDLE hThread = CreateThread(NULL, 0, pool_threadfunc, NULL,
+                                      0, &threadid);
+        if (hThread) {
+            CloseHandle(hThread);      /* we don't need the thread handle */
+            pool_nthreads++;
+        } else if (!pool_nthreads) {
+            /* Couldn't start even one thread, so nothing will ever
+             * take this job: take it back and let the caller do it */
+            pool_head = pool_tail = NULL;
+            pool_npending = 0;
+            sfree(job);
+            return false;
+        }
+    }
+
+    ReleaseSemaphore(pool_job_semaphore, 1, NULL);
+    return true;
+}
+
+bool worker_pool_submit(toplevel_callback_fn_t work, void *ctx)
+{
+    if (!pool_setup())
+        return false;
+    EnterCriticalSection(&pool_critsec);
+    bool ok = pool_submit_locked(work, ctx);
+    LeaveCriticalSection(&pool_critsec);
+    return ok;
+}
+
+/*
+ * run_in_parallel() works the same way as on Unix: helper jobs and
+ * the calling thread all claim items from the batch until there are
+ * none left, and then the caller withdraws the helpers that never
+ * started and waits for the rest.
+ */
+typedef struct ParallelBatch {
+    toplevel_callback_fn_t work;
+    void **ctxs;
+    size_t n, next;
+    unsigned outstanding;              /* helper jobs not yet finished */
+    HANDLE done_event;
+} ParallelBatch;
+
+/* Claims and runs items until there are none left. Called, and
+ * returns, with pool_critsec held. */
+static void parallel_run_items(ParallelBatch *batch)
+{
+    while (batch->next < batch->n) {
+        size_t i = batch->next++;
+        LeaveCriticalSection(&pool_critsec);
+        batch->work(batch->ctxs[i]);
+        EnterCriticalSection(&pool_critsec);
+    }
+}
+
+static void parallel_helper(void *vctx)
+{
+    ParallelBatch *batch = (ParallelBatch *)vctx;
+
+    EnterCriticalSection(&pool_critsec);
+    parallel_run_items(batch);
+    if (--batch->outstanding == 0)
+        SetEvent(batch->done_event);
+    LeaveCriticalSection(&pool_critsec);
+}
+
+void run_in_parallel(toplevel_callback_fn_t work, void **ctxs, size_t n)
+{
+    HANDLE done_event;
+
+    if (n < 2 || !pool_setup() ||
+        !(done_event = CreateEvent(NULL, false, false, NULL))) {
+        for (size_t i = 0; i < n; i++)
+            work(ctxs[i]);
+        return;
+    }
+
+    ParallelBatch batch[1];
+    batch->work = work;
+    batch->ctxs = ctxs;
+    batch->n = n;
+    batch->next = 0;
+    batch->outstanding = 0;
+    batch->done_event = done_event;
+
+    EnterCriticalSection(&pool_critsec);
+
+    for (size_t i = 1; i < n && i <= pool_max_threads; i++) {
+        if (!pool_submit_locked(parallel_helper, batch))
+            break;
+        batch->outstanding++;
+    }
+
+    parallel_run_items(batch);
+
+    /* Withdraw the helpers that never got started. Their semaphore
+     * counts stay behind, but a worker woken by one of those just
+     * finds nothing to do. */
+    for (PoolJob **prev = &pool_head, *job; (job = *prev) != NULL ;) {
+        if (job->work == parallel_helper && job->ctx == batch) {
+            *prev = job->next;
+            if (pool_tail == job)
+                pool_tail = (prev == &pool_head ? NULL :
+                             container_of(prev, PoolJob, next));
+            pool_npending--;
+            batch->outstanding--;
+            sfree(job);
+        } else {
+            prev = &job->next;
+        }
+    }
+
+    bool wait = batch->outstanding > 0;
+    LeaveCriticalSection(&pool_critsec);
+
+    if (wait)
+        WaitForSingleObject(done_event, INFINITE);
+    CloseHandle(done_event);
+}